@@ -0,0 +1,39 @@
+//
+// Created by blgnksy on 18/10/2026.
+//
+
+#ifndef EXTREMEC_ASYNC_H
+#define EXTREMEC_ASYNC_H
+
+#include <stddef.h>
+
+typedef struct async_pool_t async_pool_t;
+typedef struct future_t future_t;
+
+typedef void *(*async_fn_t)(void *arg);
+
+typedef enum {
+    FUTURE_PENDING,
+    FUTURE_RUNNING,
+    FUTURE_DONE,
+    FUTURE_CANCELLED
+} future_status_t;
+
+/**
+ * Called once when the future is done or cancelled. The pool releases the future after the callback returns, so the
+ * callback must not call future_release; it may read the result with future_wait, which does not block then.
+ */
+typedef void (*future_callback_t)(future_t *future, future_status_t status, void *ctx);
+
+async_pool_t *async_pool_create(int threads, size_t capacity);
+void async_pool_destroy(async_pool_t *pool);
+
+future_t *async_submit(async_pool_t *pool, async_fn_t fn, void *arg);
+
+future_status_t future_wait(future_t *future, void **result);
+int future_then(future_t *future, future_callback_t callback, void *ctx);
+int future_cancel(future_t *future);
+future_status_t future_status(future_t *future);
+void future_release(future_t *future);
+
+#endif //EXTREMEC_ASYNC_H
@@ -0,0 +1,25 @@
+//
+// Created by blgnksy on 18/10/2026.
+//
+
+#ifndef EXTREMEC_BENCH_H
+#define EXTREMEC_BENCH_H
+
+#include <stdint.h>
+
+/**
+ * Hardware events that can be counted around a benchmarked region. They map to `perf_event_open` hardware counters.
+ */
+typedef enum {
+    BENCH_BRANCH_MISSES,
+    BENCH_CACHE_MISSES,
+    BENCH_INSTRUCTIONS
+} bench_event_t;
+
+uint64_t bench_now_ns(void);
+int bench_counter_open(bench_event_t event);
+void bench_counter_start(int fd);
+uint64_t bench_counter_stop(int fd);
+void bench_counter_close(int fd);
+
+#endif //EXTREMEC_BENCH_H
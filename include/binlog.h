@@ -0,0 +1,95 @@
+//
+// Created by blgnksy on 18/10/2026.
+//
+
+#ifndef EXTREMEC_BINLOG_H
+#define EXTREMEC_BINLOG_H
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define BINLOG_MAX_ARGS 16
+/** Longer %s arguments are cut. */
+#define BINLOG_MAX_STRING 512
+/** First bytes of a binary log. */
+#define BINLOG_MAGIC "BINLOG1\n"
+/** thread of the record that defines a site in a binary log. */
+#define BINLOG_DEFINITION 0xffff
+
+typedef enum { BINLOG_TEXT, BINLOG_BINARY } binlog_mode_t;
+
+/** A call site: one per BINLOG expansion, filled in on its first call. */
+typedef struct {
+    const char *format;
+    const char *file;
+    int line;
+    _Atomic int id;
+    uint8_t arg_count;
+    uint8_t strings;
+    uint8_t types[BINLOG_MAX_ARGS];
+} binlog_site_t;
+
+/**
+ * Header of every record, in the rings and in binary logs. A definition (thread BINLOG_DEFINITION) is followed by
+ * binlog_definition_t, the format and the file name; an entry by its arguments, 8 bytes each (16 for long double),
+ * strings as a uint32_t length and the bytes. Records are padded to 8 bytes.
+ */
+typedef struct {
+    uint32_t size;
+    uint16_t site;
+    /** Threads are numbered from 1 in the order they first log; after 65534 threads the numbers repeat. */
+    uint16_t thread;
+    uint64_t time_ns;
+} binlog_record_t;
+
+typedef struct {
+    uint32_t line;
+    uint32_t format_length;
+    uint32_t file_length;
+    uint32_t reserved;
+} binlog_definition_t;
+
+typedef struct {
+    /** Where the background thread writes: formatted text, or records for binlog_decode. */
+    int fd;
+    binlog_mode_t mode;
+    /** Bytes per thread, a power of two. */
+    size_t ring_size;
+    /** How long the background thread sleeps when every ring is empty. */
+    int flush_interval_ms;
+} binlog_options_t;
+
+typedef struct {
+    uint64_t records;
+    uint64_t bytes_written;
+    uint64_t writes;
+    /** Calls that waited for room in a full ring. */
+    uint64_t stalls;
+    /** Writes of the background thread that failed; their records are lost. */
+    uint64_t dropped;
+    uint64_t threads;
+} binlog_stats_t;
+
+/**
+ * Logs like fprintf(stderr, format, ...), but only copies the arguments on the calling thread. format must be a
+ * string literal: it is kept, not copied.
+ */
+#define BINLOG(format, ...)                                                                                            \
+    do {                                                                                                               \
+        static binlog_site_t binlog_site_ = {format, __FILE__, __LINE__, 0, 0, 0, {0}};                                \
+        binlog_write(&binlog_site_ __VA_OPT__(, ) __VA_ARGS__);                                                        \
+    } while (0)
+
+int binlog_start(const binlog_options_t *options);
+void binlog_flush(void);
+void binlog_stop(void);
+void binlog_stats(binlog_stats_t *stats);
+
+void binlog_write(binlog_site_t *site, ...);
+void binlog_vprintf(const char *format, va_list ap);
+
+int binlog_parse(const char *format, uint8_t *types);
+size_t binlog_format(const char *format, const unsigned char *args, size_t length, char *out, size_t size);
+
+#endif //EXTREMEC_BINLOG_H
@@ -0,0 +1,22 @@
+//
+// Created by blgnksy on 18/10/2026.
+//
+
+#ifndef EXTREMEC_CONCURRENT_MAP_H
+#define EXTREMEC_CONCURRENT_MAP_H
+
+#include <stddef.h>
+
+typedef struct cmap_t cmap_t;
+
+cmap_t *cmap_new(size_t capacity);
+void cmap_free(cmap_t *map);
+size_t cmap_capacity(const cmap_t *map);
+
+int cmap_put_int(cmap_t *map, int key, int value);
+int cmap_get_int(const cmap_t *map, int key, int *value);
+int cmap_put_ptr(cmap_t *map, int key, void *value);
+int cmap_get_ptr(const cmap_t *map, int key, void **value);
+int cmap_remove(cmap_t *map, int key);
+
+#endif //EXTREMEC_CONCURRENT_MAP_H
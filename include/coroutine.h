@@ -0,0 +1,28 @@
+//
+// Created by blgnksy on 18/10/2026.
+//
+
+#ifndef EXTREMEC_COROUTINE_H
+#define EXTREMEC_COROUTINE_H
+
+#include <stddef.h>
+
+typedef struct coro_t coro_t;
+typedef struct coro_sched_t coro_sched_t;
+
+typedef void (*coro_fn_t)(void *arg);
+
+/**
+ * Saves the callee-saved registers on the current stack, stores the stack pointer in *from_sp and resumes the
+ * context whose stack pointer is to_sp. Implemented in assembly in coroutine.c (x86-64 System V only).
+ */
+void coro_switch(void **from_sp, void *to_sp);
+
+coro_sched_t *coro_sched_new(size_t stack_size);
+void coro_sched_free(coro_sched_t *sched);
+coro_t *coro_spawn(coro_sched_t *sched, coro_fn_t fn, void *arg);
+void coro_sched_run(coro_sched_t *sched);
+void coro_yield(void);
+size_t coro_sched_stacks(const coro_sched_t *sched);
+
+#endif //EXTREMEC_COROUTINE_H
@@ -0,0 +1,39 @@
+//
+// Created by blgnksy on 18/10/2026.
+//
+
+#ifndef EXTREMEC_COUNTERS_H
+#define EXTREMEC_COUNTERS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/** How a thread picks its shard. */
+typedef enum {
+    /** The CPU it runs on, read from rseq or sched_getcpu. */
+    SHARD_PER_CPU,
+    /** A slot assigned to the thread on its first update. */
+    SHARD_PER_THREAD,
+} shard_mode_t;
+
+/** Slots of a per-thread counter or histogram if there are fewer CPUs. Threads beyond that share slots. */
+#define SHARD_THREAD_SLOTS 256
+
+typedef struct counter_t counter_t;
+typedef struct histogram_t histogram_t;
+
+int shard_current_cpu(void);
+
+counter_t *counter_new(shard_mode_t mode);
+void counter_free(counter_t *counter);
+void counter_add(counter_t *counter, int64_t delta);
+int64_t counter_read(const counter_t *counter);
+void counter_reset(counter_t *counter);
+
+histogram_t *histogram_new(shard_mode_t mode);
+void histogram_free(histogram_t *histogram);
+void histogram_record(histogram_t *histogram, uint64_t value);
+uint64_t histogram_count(const histogram_t *histogram);
+uint64_t histogram_percentile(const histogram_t *histogram, double percentile);
+
+#endif //EXTREMEC_COUNTERS_H
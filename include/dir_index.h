@@ -0,0 +1,47 @@
+//
+// Created by blgnksy on 18/10/2026.
+//
+
+#ifndef EXTREMEC_DIR_INDEX_H
+#define EXTREMEC_DIR_INDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct dir_index_t dir_index_t;
+
+/** Sums over a subtree, the directory itself not included. */
+typedef struct {
+    uint64_t files;
+    uint64_t dirs;
+    uint64_t bytes;
+} dir_totals_t;
+
+typedef struct {
+    size_t entries;
+    size_t watches;
+    /** Bytes held by the index: nodes, names, directory statistics and hash tables. */
+    size_t memory;
+    uint64_t events;
+    /** Rescans after the event queue overflowed; calls of dir_index_rescan are not counted. */
+    uint64_t resyncs;
+    uint64_t watch_failures;
+} dir_index_stats_t;
+
+/** Called with a path relative to the root. Returning non-zero stops the query. */
+typedef int (*dir_entry_fn_t)(const char *path, uint64_t size, int is_dir, void *ctx);
+
+dir_index_t *dir_index_open(const char *root);
+void dir_index_close(dir_index_t *index);
+int dir_index_fd(const dir_index_t *index);
+int dir_index_update(dir_index_t *index, int timeout_ms);
+int dir_index_rescan(dir_index_t *index);
+
+int dir_index_totals(const dir_index_t *index, const char *prefix, dir_totals_t *totals);
+long dir_index_count_size(const dir_index_t *index, const char *prefix, uint64_t min_size, uint64_t max_size);
+int dir_index_query(const dir_index_t *index, const char *prefix, uint64_t min_size, uint64_t max_size,
+                    dir_entry_fn_t fn, void *ctx);
+int dir_index_lookup(const dir_index_t *index, const char *path, uint64_t *size, int *is_dir);
+void dir_index_stats(const dir_index_t *index, dir_index_stats_t *stats);
+
+#endif //EXTREMEC_DIR_INDEX_H
@@ -0,0 +1,28 @@
+//
+// Created by blgnksy on 18/10/2026.
+//
+
+#ifndef EXTREMEC_EBR_H
+#define EXTREMEC_EBR_H
+
+#include <stddef.h>
+
+typedef struct ebr_t ebr_t;
+typedef struct ebr_thread_t ebr_thread_t;
+
+typedef void (*ebr_free_fn_t)(void *ptr);
+
+ebr_t *ebr_new(void);
+void ebr_free(ebr_t *ebr);
+
+ebr_thread_t *ebr_register(ebr_t *ebr);
+void ebr_unregister(ebr_thread_t *thread);
+
+void ebr_enter(ebr_thread_t *thread);
+void ebr_exit(ebr_thread_t *thread);
+
+void ebr_retire(ebr_thread_t *thread, void *ptr, ebr_free_fn_t free_fn);
+void ebr_reclaim(ebr_thread_t *thread);
+size_t ebr_pending(const ebr_thread_t *thread);
+
+#endif //EXTREMEC_EBR_H
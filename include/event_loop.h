@@ -0,0 +1,62 @@
+//
+// Created by blgnksy on 18/10/2026.
+//
+
+#ifndef EXTREMEC_EVENT_LOOP_H
+#define EXTREMEC_EVENT_LOOP_H
+
+#include <stdint.h>
+
+typedef struct loop_t loop_t;
+typedef struct io_watcher_t io_watcher_t;
+typedef struct loop_timer_t loop_timer_t;
+typedef struct loop_task_t loop_task_t;
+
+typedef void (*io_cb_t)(loop_t *loop, io_watcher_t *watcher, uint32_t events);
+typedef void (*timer_cb_t)(loop_t *loop, loop_timer_t *timer);
+typedef void (*task_cb_t)(loop_t *loop, loop_task_t *task);
+
+/**
+ * The loop does not allocate watchers, timers or tasks. The caller owns them (usually embedded in its own
+ * structures) and must keep them alive while they are registered.
+ */
+struct io_watcher_t {
+    int fd;
+    uint32_t events;
+    io_cb_t cb;
+    void *ctx;
+};
+
+struct loop_timer_t {
+    loop_timer_t *prev;
+    loop_timer_t *next;
+    uint64_t expires;
+    uint64_t repeat;
+    timer_cb_t cb;
+    void *ctx;
+};
+
+struct loop_task_t {
+    loop_task_t *next;
+    task_cb_t cb;
+    void *ctx;
+};
+
+loop_t *loop_new(void);
+void loop_free(loop_t *loop);
+int loop_run(loop_t *loop);
+void loop_stop(loop_t *loop);
+uint64_t loop_now(const loop_t *loop);
+
+int loop_io_start(loop_t *loop, io_watcher_t *watcher, int fd, uint32_t events, io_cb_t cb, void *ctx);
+int loop_io_stop(loop_t *loop, io_watcher_t *watcher);
+
+void loop_timer_init(loop_timer_t *timer);
+int loop_timer_start(loop_t *loop, loop_timer_t *timer, uint64_t timeout_ms, uint64_t repeat_ms, timer_cb_t cb,
+                     void *ctx);
+void loop_timer_stop(loop_t *loop, loop_timer_t *timer);
+int loop_timer_active(const loop_timer_t *timer);
+
+int loop_post(loop_t *loop, loop_task_t *task, task_cb_t cb, void *ctx);
+
+#endif //EXTREMEC_EVENT_LOOP_H
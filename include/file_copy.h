@@ -0,0 +1,36 @@
+//
+// Created by blgnksy on 18/10/2026.
+//
+
+#ifndef EXTREMEC_FILE_COPY_H
+#define EXTREMEC_FILE_COPY_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/** In the order they are tried: each one falls back to the next where the kernel or the files do not support it. */
+typedef enum {
+    COPY_FILE_RANGE,
+    COPY_SENDFILE,
+    COPY_SPLICE,
+    COPY_READ_WRITE
+} copy_method_t;
+
+typedef struct {
+    /** First method to try. */
+    copy_method_t method;
+    /** Buffer of read/write and pipe size of splice, 0 for 1 MiB. */
+    size_t buffer_size;
+    /** Threads for one large file; each copies a contiguous part. */
+    int threads;
+    /** Files smaller than this are copied by one thread, 0 for 64 MiB. */
+    size_t parallel_min;
+    /** Drops the pages of both files from the page cache after copying. */
+    int drop_cache;
+} copy_options_t;
+
+const char *copy_method_name(copy_method_t method);
+int copy_range(int in, int out, off_t offset, off_t length, const copy_options_t *options, copy_method_t *method);
+int copy_file(const char *from, const char *to, const copy_options_t *options, copy_method_t *method);
+
+#endif //EXTREMEC_FILE_COPY_H
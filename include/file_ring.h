@@ -0,0 +1,88 @@
+//
+// Created by blgnksy on 18/10/2026.
+//
+
+#ifndef EXTREMEC_FILE_RING_H
+#define EXTREMEC_FILE_RING_H
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+typedef struct file_ring_t file_ring_t;
+typedef struct file_req_t file_req_t;
+struct statx;
+
+typedef enum {
+    FILE_OP_STATX,
+    FILE_OP_OPENAT,
+    FILE_OP_READ,
+    FILE_OP_CLOSE
+} file_op_t;
+
+typedef enum {
+    FILE_RING_AUTO,
+    FILE_RING_URING,
+    FILE_RING_THREADS
+} file_backend_t;
+
+/** Called on the thread running file_ring_run when the request completed. It may submit further requests. */
+typedef void (*file_req_cb_t)(file_ring_t *ring, file_req_t *req);
+
+/**
+ * A request is owned by the caller, usually embedded in its own structure, and must stay alive until its callback
+ * ran. `result` is what the system call returned, or -errno.
+ */
+struct file_req_t {
+    file_op_t op;
+    /** Directory for statx and openat, the file for read and close. */
+    int fd;
+    int flags;
+    /** statx mask or openat mode. */
+    unsigned mask;
+    unsigned length;
+    const char *path;
+    struct statx *statx;
+    void *buffer;
+    uint64_t offset;
+    long result;
+    file_req_cb_t cb;
+    void *ctx;
+    /** Used by the ring. */
+    file_req_t *next;
+    file_ring_t *ring;
+};
+
+file_ring_t *file_ring_create(unsigned depth, file_backend_t backend);
+void file_ring_destroy(file_ring_t *ring);
+file_backend_t file_ring_backend(const file_ring_t *ring);
+void file_ring_submit(file_ring_t *ring, file_req_t *req);
+int file_ring_run(file_ring_t *ring);
+
+static inline void file_prep_statx(file_req_t *req, int dirfd, const char *path, int flags, unsigned mask,
+                                   struct statx *statx, file_req_cb_t cb, void *ctx)
+{
+    *req = (file_req_t) {.op = FILE_OP_STATX, .fd = dirfd, .flags = flags, .mask = mask, .path = path,
+                         .statx = statx, .cb = cb, .ctx = ctx};
+}
+
+static inline void file_prep_openat(file_req_t *req, int dirfd, const char *path, int flags, unsigned mode,
+                                    file_req_cb_t cb, void *ctx)
+{
+    *req = (file_req_t) {.op = FILE_OP_OPENAT, .fd = dirfd, .flags = flags, .mask = mode, .path = path, .cb = cb,
+                         .ctx = ctx};
+}
+
+static inline void file_prep_read(file_req_t *req, int fd, void *buffer, unsigned length, uint64_t offset,
+                                  file_req_cb_t cb, void *ctx)
+{
+    *req = (file_req_t) {.op = FILE_OP_READ, .fd = fd, .length = length, .buffer = buffer, .offset = offset,
+                         .cb = cb, .ctx = ctx};
+}
+
+static inline void file_prep_close(file_req_t *req, int fd, file_req_cb_t cb, void *ctx)
+{
+    *req = (file_req_t) {.op = FILE_OP_CLOSE, .fd = fd, .cb = cb, .ctx = ctx};
+}
+
+#endif //EXTREMEC_FILE_RING_H
@@ -0,0 +1,27 @@
+//
+// Created by blgnksy on 18/10/2026.
+//
+
+#ifndef EXTREMEC_GROWBUF_H
+#define EXTREMEC_GROWBUF_H
+
+#include <stddef.h>
+
+/**
+ * \struct growbuf_t
+ * \brief Byte buffer in its own mapping, grown with mremap. `data` may move when the buffer grows.
+ */
+typedef struct {
+    char *data;
+    size_t size;
+    size_t capacity;
+} growbuf_t;
+
+int growbuf_init(growbuf_t *buffer, size_t capacity);
+void growbuf_free(growbuf_t *buffer);
+int growbuf_reserve(growbuf_t *buffer, size_t capacity);
+int growbuf_resize(growbuf_t *buffer, size_t size);
+int growbuf_append(growbuf_t *buffer, const void *bytes, size_t length);
+int growbuf_release_tail(growbuf_t *buffer);
+
+#endif //EXTREMEC_GROWBUF_H
@@ -5,6 +5,12 @@
 #ifndef EXTREMEC_HELPERS_H
 #define EXTREMEC_HELPERS_H
 
+#include <stdarg.h>
+
+/** Takes over the message of exit_sys, e.g. to put it in a log; the process exits when it returns. */
+typedef void (*exit_sys_handler_t)(int error, const char *format, va_list ap);
+
 void exit_sys(const char *format, ...);
+void exit_sys_handler(exit_sys_handler_t handler);
 
 #endif //EXTREMEC_HELPERS_H
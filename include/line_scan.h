@@ -0,0 +1,17 @@
+//
+// Created by blgnksy on 18/10/2026.
+//
+
+#ifndef EXTREMEC_LINE_SCAN_H
+#define EXTREMEC_LINE_SCAN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+size_t scan_count(const char *data, size_t length, char byte);
+const char *scan_find2(const char *data, size_t length, char a, char b);
+size_t scan_positions(const char *data, size_t length, char a, char b, uint32_t *positions);
+int scan_use_kernel(const char *name);
+const char *scan_kernel_name(void);
+
+#endif //EXTREMEC_LINE_SCAN_H
@@ -0,0 +1,61 @@
+//
+// Created by blgnksy on 18/10/2026.
+//
+
+#ifndef EXTREMEC_LOCKS_H
+#define EXTREMEC_LOCKS_H
+
+#include <stdatomic.h>
+
+/** Test-and-set: every waiter keeps writing the lock word. */
+typedef struct {
+    atomic_int locked;
+} tas_lock_t;
+
+/** Test-and-test-and-set: waiters spin on a read and back off exponentially after a lost exchange. */
+typedef struct {
+    atomic_int locked;
+} ttas_lock_t;
+
+/** Ticket lock: FIFO, waiters spin on the number being served. */
+typedef struct {
+    atomic_uint next;
+    atomic_uint serving;
+} ticket_lock_t;
+
+/**
+ * \struct mcs_node_t
+ * \brief Queue node of an MCS lock. Each thread brings its own and spins on its own `locked`, on its own cache line.
+ */
+typedef struct mcs_node_t {
+    _Alignas(64) _Atomic(struct mcs_node_t *) next;
+    atomic_int locked;
+} mcs_node_t;
+
+typedef struct {
+    _Atomic(mcs_node_t *) tail;
+} mcs_lock_t;
+
+/** Futex mutex: 0 unlocked, 1 locked, 2 locked and somebody may sleep in the kernel. */
+typedef struct {
+    atomic_uint state;
+} futex_mutex_t;
+
+#define TAS_LOCK_INIT {0}
+#define TTAS_LOCK_INIT {0}
+#define TICKET_LOCK_INIT {0, 0}
+#define MCS_LOCK_INIT {NULL}
+#define FUTEX_MUTEX_INIT {0}
+
+void tas_lock(tas_lock_t *lock);
+void tas_unlock(tas_lock_t *lock);
+void ttas_lock(ttas_lock_t *lock);
+void ttas_unlock(ttas_lock_t *lock);
+void ticket_lock(ticket_lock_t *lock);
+void ticket_unlock(ticket_lock_t *lock);
+void mcs_lock(mcs_lock_t *lock, mcs_node_t *node);
+void mcs_unlock(mcs_lock_t *lock, mcs_node_t *node);
+void futex_mutex_lock(futex_mutex_t *mutex);
+void futex_mutex_unlock(futex_mutex_t *mutex);
+
+#endif //EXTREMEC_LOCKS_H
@@ -0,0 +1,27 @@
+//
+// Created by blgnksy on 18/10/2026.
+//
+
+#ifndef EXTREMEC_PARALLEL_H
+#define EXTREMEC_PARALLEL_H
+
+#include <stddef.h>
+
+/** Body of a parallel_for: handles the indices [begin, end). */
+typedef void (*parallel_for_fn_t)(size_t begin, size_t end, void *ctx);
+
+/** Body of a parallel_reduce: folds the indices [begin, end) into *partial. */
+typedef void (*parallel_reduce_fn_t)(size_t begin, size_t end, void *partial, void *ctx);
+
+/** Merges the partial result *from into *into. Must be associative and commutative. */
+typedef void (*parallel_combine_fn_t)(void *into, const void *from, void *ctx);
+
+int parallel_init(int workers);
+void parallel_shutdown(void);
+int parallel_workers(void);
+
+void parallel_for(size_t begin, size_t end, size_t grain, parallel_for_fn_t fn, void *ctx);
+void parallel_reduce(size_t begin, size_t end, size_t grain, void *result, size_t size, parallel_reduce_fn_t fn,
+                     parallel_combine_fn_t combine, void *ctx);
+
+#endif //EXTREMEC_PARALLEL_H
@@ -0,0 +1,55 @@
+//
+// Created by blgnksy on 18/10/2026.
+//
+
+#ifndef EXTREMEC_PROC_MAPS_H
+#define EXTREMEC_PROC_MAPS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define MEM_PATH_MAX 256
+
+/** One line of /proc/self/maps. */
+typedef struct {
+    uintptr_t start;
+    uintptr_t end;
+    /** "rwxp" or "rw-s" and so on, NUL-terminated. */
+    char perms[5];
+    uint64_t offset;
+    uint64_t inode;
+    /** File path, or a pseudo path like "[heap]" and "[stack]", empty for anonymous memory. Truncated if longer. */
+    char path[MEM_PATH_MAX];
+} mem_region_t;
+
+/** Totals of /proc/self/smaps_rollup, in KiB. */
+typedef struct {
+    uint64_t rss_kb;
+    uint64_t pss_kb;
+    uint64_t anonymous_kb;
+    uint64_t anon_huge_kb;
+    uint64_t swap_kb;
+} mem_rollup_t;
+
+typedef struct {
+    uint64_t time_ns;
+    mem_rollup_t rollup;
+    /** Sizes of the [heap] and [stack] mappings. */
+    uint64_t heap_bytes;
+    uint64_t stack_bytes;
+} mem_sample_t;
+
+typedef struct mem_sampler_t mem_sampler_t;
+
+typedef int (*mem_region_fn_t)(const mem_region_t *region, void *ctx);
+
+int mem_maps_foreach(mem_region_fn_t fn, void *ctx);
+long mem_maps_read(mem_region_t *regions, size_t capacity);
+int mem_rollup_read(mem_rollup_t *rollup);
+int mem_sample_take(mem_sample_t *sample);
+
+mem_sampler_t *mem_sampler_start(unsigned interval_ms, size_t capacity);
+size_t mem_sampler_read(mem_sampler_t *sampler, mem_sample_t *samples, size_t capacity);
+void mem_sampler_stop(mem_sampler_t *sampler);
+
+#endif //EXTREMEC_PROC_MAPS_H
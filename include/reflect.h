@@ -0,0 +1,64 @@
+//
+// Created by blgnksy on 18/10/2026.
+//
+
+#ifndef EXTREMEC_REFLECT_H
+#define EXTREMEC_REFLECT_H
+
+#include <stddef.h>
+
+/**
+ * Compile-time reflection for structures with X-macros.
+ *
+ * A structure is described once, as a list of fields:
+ * \code{.c}
+ * #define CAR_FIELDS(F, S)      \
+ *     F(S, char, name, [32])    \
+ *     F(S, double, speed, )     \
+ *     F(S, double, fuel, )
+ * REFLECT_STRUCT(car_t, CAR_FIELDS)
+ * \endcode
+ * and the macros expand the list twice: once into the structure definition and once into a table with the name,
+ * `offsetof`, `sizeof` and `_Alignof` of every field, so the layout the compiler chose can be inspected at run time.
+ * The fourth argument is the array suffix of the field and is left empty for scalars.
+ */
+typedef struct {
+    const char *name;
+    const char *type;
+    size_t offset;
+    size_t size;
+    size_t align;
+} field_info_t;
+
+typedef struct {
+    const char *name;
+    size_t size;
+    size_t align;
+    size_t field_count;
+    const field_info_t *fields;
+} struct_info_t;
+
+#define REFLECT_DECLARE_FIELD(S, type, name, dims) type name dims;
+#define REFLECT_FIELD_INFO(S, type, name, dims)                                                                        \
+    {#name, #type #dims, offsetof(S, name), sizeof(((S *) 0)->name), _Alignof(type)},
+
+#define REFLECT_TABLE(S, FIELDS)                                                                                       \
+    static const field_info_t S##_fields[] = {FIELDS(REFLECT_FIELD_INFO, S)};                                          \
+    static const struct_info_t S##_info = {#S, sizeof(S), _Alignof(S), sizeof(S##_fields) / sizeof(field_info_t),     \
+                                           S##_fields};
+
+/** Defines `S` and its `S##_info` table. */
+#define REFLECT_STRUCT(S, FIELDS)                                                                                      \
+    typedef struct {                                                                                                   \
+        FIELDS(REFLECT_DECLARE_FIELD, S)                                                                               \
+    } S;                                                                                                               \
+    REFLECT_TABLE(S, FIELDS)
+
+/** Same as REFLECT_STRUCT but without alignment, like sample1_t in structs.c. */
+#define REFLECT_PACKED_STRUCT(S, FIELDS)                                                                               \
+    typedef struct __attribute__((__packed__)) {                                                                       \
+        FIELDS(REFLECT_DECLARE_FIELD, S)                                                                               \
+    } S;                                                                                                               \
+    REFLECT_TABLE(S, FIELDS)
+
+#endif //EXTREMEC_REFLECT_H
@@ -0,0 +1,33 @@
+//
+// Created by blgnksy on 18/10/2026.
+//
+
+#ifndef EXTREMEC_SCHEDULER_H
+#define EXTREMEC_SCHEDULER_H
+
+#include <stdatomic.h>
+
+typedef struct ws_pool_t ws_pool_t;
+
+typedef void (*ws_fn_t)(void *arg);
+
+/**
+ * \struct ws_task_t
+ * \brief A spawned task. The spawner owns it, usually on its own stack, and must ws_sync it before it goes away.
+ */
+typedef struct {
+    ws_fn_t fn;
+    void *arg;
+    atomic_int done;
+} ws_task_t;
+
+ws_pool_t *ws_pool_create(int workers);
+void ws_pool_destroy(ws_pool_t *pool);
+int ws_pool_workers(const ws_pool_t *pool);
+
+void ws_run(ws_pool_t *pool, ws_fn_t fn, void *arg);
+void ws_spawn(ws_task_t *task, ws_fn_t fn, void *arg);
+void ws_sync(ws_task_t *task);
+int ws_worker_index(void);
+
+#endif //EXTREMEC_SCHEDULER_H
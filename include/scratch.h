@@ -0,0 +1,54 @@
+//
+// Created by blgnksy on 18/10/2026.
+//
+
+#ifndef EXTREMEC_SCRATCH_H
+#define EXTREMEC_SCRATCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/** Position in the calling thread's scratch arena, to roll back to. */
+typedef struct {
+    char *top;
+} scratch_mark_t;
+
+/** Per-thread bump pointer and end of the arena; use the functions below. */
+typedef struct {
+    char *top;
+    char *end;
+    char *base;
+} scratch_arena_t;
+
+extern _Thread_local scratch_arena_t scratch_arena;
+
+void *scratch_alloc_slow(size_t size);
+void scratch_release(scratch_mark_t mark);
+size_t scratch_used(void);
+
+/**
+ * Allocates size bytes, 16-byte aligned, that stay valid until the thread releases a mark taken before. Never freed
+ * one by one.
+ * @return the memory, or NULL with errno set
+ */
+static inline void *scratch_alloc(size_t size)
+{
+    scratch_arena_t *arena = &scratch_arena;
+    size_t rounded = (size + 15) & ~(size_t) 15;
+
+    // rounded - 1 wraps for size 0 and for sizes that overflowed the rounding, which sends both to the slow path.
+    if (__builtin_expect(rounded - 1 < (size_t) (arena->end - arena->top), 1)) {
+        void *ptr = arena->top;
+        arena->top += rounded;
+        return ptr;
+    }
+    return scratch_alloc_slow(size);
+}
+
+static inline scratch_mark_t scratch_mark(void)
+{
+    scratch_mark_t mark = {scratch_arena.top};
+    return mark;
+}
+
+#endif //EXTREMEC_SCRATCH_H
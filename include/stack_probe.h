@@ -0,0 +1,14 @@
+//
+// Created by blgnksy on 18/10/2026.
+//
+
+#ifndef EXTREMEC_STACK_PROBE_H
+#define EXTREMEC_STACK_PROBE_H
+
+#include <stddef.h>
+
+size_t stack_size(void);
+size_t stack_paint(size_t max_depth);
+size_t stack_high_water(void);
+
+#endif //EXTREMEC_STACK_PROBE_H
@@ -0,0 +1,23 @@
+//
+// Created by blgnksy on 18/10/2026.
+//
+
+#ifndef EXTREMEC_SWISS_MAP_H
+#define EXTREMEC_SWISS_MAP_H
+
+#include <stddef.h>
+
+typedef struct swiss_map_t swiss_map_t;
+
+swiss_map_t *swiss_new(size_t capacity);
+void swiss_free(swiss_map_t *map);
+int swiss_reserve(swiss_map_t *map, size_t count);
+size_t swiss_size(const swiss_map_t *map);
+size_t swiss_capacity(const swiss_map_t *map);
+
+int swiss_insert(swiss_map_t *map, int key, int value);
+int swiss_find(const swiss_map_t *map, int key, int *value);
+int swiss_erase(swiss_map_t *map, int key);
+int swiss_next(const swiss_map_t *map, size_t *cursor, int *key, int *value);
+
+#endif //EXTREMEC_SWISS_MAP_H
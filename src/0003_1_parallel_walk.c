@@ -0,0 +1,374 @@
+/**
+ * \file 0003_1_parallel_walk.c
+ *
+ * @brief Parallel directory tree walker with getdents64, openat and work stealing, like a fast `du`
+ *
+ * 0003_0_file_directory.c lists one directory with opendir and readdir. Walking a big tree that way, by path, costs:
+ *
+ * - one system call per 32 KiB of entries in glibc's readdir buffer;
+ * - a path lookup from the root for every opendir and lstat, i.e. every component again, and a path string to build;
+ * - an lstat per entry just to learn whether it is a directory;
+ * - a single thread waiting on the disk or the page cache, one directory at a time.
+ *
+ * This walker reads entries with raw getdents64 into a 256 KiB buffer, opens every directory with openat relative to
+ * its parent's descriptor, and takes the type from d_type, calling fstatat only for sizes and for file systems that
+ * report DT_UNKNOWN. Every subdirectory is a task of the work-stealing pool of scheduler.c, so idle workers steal
+ * whole subtrees. A directory's descriptor is closed as soon as all of its subdirectories have opened theirs, which
+ * bounds the open descriptors by the directories being listed rather than by those waiting in the deques.
+ *
+ * Counted are directories, other entries, their apparent size and their disk usage (st_blocks), per worker, summed at
+ * the end. Hard links are counted once per link. With -n no sizes are taken, so fstatat is only made for entries of
+ * type DT_UNKNOWN, whose type it is the only way to learn; on file systems that fill in d_type that is none at all.
+ *
+ * \code{.sh}
+ * ./0003_1_parallel_walk [-w max-workers] [-n] [-m files] directory
+ * \endcode
+ *
+ * -m first creates a test tree of that many (sparse) files under the directory. Each walk runs twice and the second,
+ * warm-cache run is reported: first the readdir loop, then the getdents64 walker with 1, 2, 4, ... workers.
+ */
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "helpers.h"
+#include "scheduler.h"
+
+#define DENTS_BUFFER (256 * 1024)
+#define MAX_WORKERS 256
+#define TREE_FANOUT 32
+#define FILES_PER_DIR 100
+
+struct linux_dirent64 {
+    ino64_t d_ino;
+    off64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+typedef struct {
+    uint64_t dirs;
+    uint64_t files;
+    uint64_t bytes;
+    uint64_t blocks;
+    uint64_t errors;
+} totals_t;
+
+typedef struct {
+    _Alignas(64) totals_t totals;
+} worker_totals_t;
+
+/** An open directory, closed when the last child has opened itself. */
+typedef struct {
+    int fd;
+    atomic_int refs;
+} dir_ref_t;
+
+typedef struct {
+    ws_task_t task;
+    dir_ref_t *parent;
+    const char *name;
+} walk_t;
+
+static worker_totals_t worker_totals[MAX_WORKERS + 1];
+static int with_sizes = 1;
+/** One listing buffer per worker, kept from pool to pool; a worker lists one directory at a time. */
+static char *dents_buffers[MAX_WORKERS + 1];
+
+static void dir_release(dir_ref_t *dir)
+{
+    if (atomic_fetch_sub_explicit(&dir->refs, 1, memory_order_acq_rel) == 1)
+        close(dir->fd);
+}
+
+static void add_sizes(totals_t *totals, const struct stat *st)
+{
+    totals->bytes += (uint64_t) st->st_size;
+    totals->blocks += (uint64_t) st->st_blocks;
+}
+
+static void walk_dir(void *arg)
+{
+    walk_t *walk = (walk_t *) arg;
+    int worker = ws_worker_index() + 1;
+    totals_t *totals = &worker_totals[worker].totals;
+    int fd = openat(walk->parent->fd, walk->name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+
+    dir_release(walk->parent);
+    if (fd == -1) {
+        totals->errors++;
+        return;
+    }
+    totals->dirs++;
+    if (!dents_buffers[worker] && !(dents_buffers[worker] = (char *) malloc(DENTS_BUFFER)))
+        exit_sys("malloc");
+    char *dents_buffer = dents_buffers[worker];
+
+    // Subdirectory names are collected first and spawned after the listing, when the buffer is free again.
+    char *names = NULL;
+    size_t names_used = 0, names_size = 0, subdirs = 0;
+    long n;
+    while ((n = syscall(SYS_getdents64, fd, dents_buffer, DENTS_BUFFER)) > 0) {
+        for (long offset = 0; offset < n;) {
+            struct linux_dirent64 *entry = (struct linux_dirent64 *) (dents_buffer + offset);
+            const char *name = entry->d_name;
+            offset += entry->d_reclen;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+                continue;
+
+            struct stat st;
+            int have_stat = 0;
+            unsigned char type = entry->d_type;
+            if (type == DT_UNKNOWN || (with_sizes && type != DT_DIR)) {
+                if (fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+                    totals->errors++;
+                    continue;
+                }
+                have_stat = 1;
+                type = S_ISDIR(st.st_mode) ? DT_DIR : DT_REG;
+            }
+            if (type != DT_DIR) {
+                totals->files++;
+                if (have_stat)
+                    add_sizes(totals, &st);
+                continue;
+            }
+
+            size_t length = strlen(name) + 1;
+            if (names_used + length > names_size) {
+                names_size = names_size ? names_size * 2 : 4096;
+                if (names_size < names_used + length)
+                    names_size = names_used + length;
+                if (!(names = (char *) realloc(names, names_size)))
+                    exit_sys("realloc");
+            }
+            memcpy(names + names_used, name, length);
+            names_used += length;
+            subdirs++;
+        }
+    }
+    if (n == -1)
+        totals->errors++;
+    if (subdirs == 0) {
+        close(fd);
+        free(names);
+        return;
+    }
+
+    walk_t *children = (walk_t *) malloc(subdirs * sizeof(walk_t));
+    if (!children)
+        exit_sys("malloc");
+    dir_ref_t self = {.fd = fd};
+    atomic_init(&self.refs, (int) subdirs + 1);
+    const char *name = names;
+    for (size_t i = 0; i < subdirs; i++) {
+        children[i].parent = &self;
+        children[i].name = name;
+        name += strlen(name) + 1;
+        ws_spawn(&children[i].task, walk_dir, &children[i]);
+    }
+    dir_release(&self);
+    for (size_t i = 0; i < subdirs; i++)
+        ws_sync(&children[i].task);
+    free(children);
+    free(names);
+}
+
+static totals_t sum_totals(void)
+{
+    totals_t sum = {0};
+
+    for (int i = 0; i <= MAX_WORKERS; i++) {
+        totals_t *t = &worker_totals[i].totals;
+        sum.dirs += t->dirs;
+        sum.files += t->files;
+        sum.bytes += t->bytes;
+        sum.blocks += t->blocks;
+        sum.errors += t->errors;
+    }
+    return sum;
+}
+
+static totals_t walk_parallel(ws_pool_t *pool, const char *root)
+{
+    dir_ref_t cwd = {.fd = AT_FDCWD};
+    walk_t walk = {.parent = &cwd, .name = root};
+
+    // AT_FDCWD is never closed: the extra reference keeps dir_release away from it.
+    atomic_init(&cwd.refs, 2);
+    memset(worker_totals, 0, sizeof(worker_totals));
+    ws_run(pool, walk_dir, &walk);
+    return sum_totals();
+}
+
+/** The loop of 0003_0_file_directory.c, made recursive: paths, readdir and an lstat per entry. */
+static void walk_readdir(char *path, size_t length, totals_t *totals)
+{
+    DIR *dp = opendir(path);
+    struct dirent *dirp;
+
+    if (!dp) {
+        totals->errors++;
+        return;
+    }
+    totals->dirs++;
+    while ((dirp = readdir(dp)) != NULL) {
+        const char *name = dirp->d_name;
+        if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+            continue;
+        size_t name_length = strlen(name);
+        if (length + 1 + name_length >= PATH_MAX) {
+            totals->errors++;
+            continue;
+        }
+        path[length] = '/';
+        memcpy(path + length + 1, name, name_length + 1);
+
+        struct stat st;
+        if (lstat(path, &st) == -1) {
+            totals->errors++;
+        } else if (S_ISDIR(st.st_mode)) {
+            walk_readdir(path, length + 1 + name_length, totals);
+        } else {
+            totals->files++;
+            if (with_sizes)
+                add_sizes(totals, &st);
+        }
+        path[length] = '\0';
+    }
+    closedir(dp);
+}
+
+static void report(const char *walker, int workers, totals_t totals, uint64_t elapsed_ns)
+{
+    printf("  %-9s %7d %10lu %10lu %12.1f %12.1f %9.1f %8.2f\n", walker, workers, (unsigned long) totals.dirs,
+           (unsigned long) totals.files, (double) totals.bytes / 1048576.0, (double) totals.blocks * 512.0 / 1048576.0,
+           (double) elapsed_ns / 1e6, (double) (totals.dirs + totals.files) / (double) elapsed_ns * 1e3);
+    if (totals.errors)
+        printf("  (%lu entries could not be read)\n", (unsigned long) totals.errors);
+}
+
+/**
+ * Creates a tree of `files` files, up to FILES_PER_DIR per leaf directory and up to TREE_FANOUT directories per level.
+ * Files are sparse, with sizes from 0 to 64 KiB.
+ */
+static void make_tree(int parent, long files, long *made)
+{
+    if (files <= FILES_PER_DIR) {
+        for (long i = 0; i < files; i++) {
+            char name[32];
+            snprintf(name, sizeof(name), "file_%ld", i);
+            int fd = openat(parent, name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if (fd == -1 || ftruncate(fd, (*made * 4099) % 65536) == -1)
+                exit_sys("create %s", name);
+            close(fd);
+            (*made)++;
+        }
+        return;
+    }
+    long leaves = (files + FILES_PER_DIR - 1) / FILES_PER_DIR;
+    long fanout = leaves < TREE_FANOUT ? leaves : TREE_FANOUT;
+    long per_child = (files + fanout - 1) / fanout;
+    for (long i = 0; files > 0; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "dir_%ld", i);
+        if (mkdirat(parent, name, 0755) == -1 && errno != EEXIST)
+            exit_sys("mkdir %s", name);
+        int fd = openat(parent, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd == -1)
+            exit_sys("open %s", name);
+        make_tree(fd, files < per_child ? files : per_child, made);
+        close(fd);
+        files -= per_child;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    long max_workers = sysconf(_SC_NPROCESSORS_ONLN);
+    long make_files = 0;
+    int result;
+
+    while ((result = getopt(argc, argv, "w:nm:")) != -1) {
+        switch (result) {
+        case 'w':
+            max_workers = strtol(optarg, NULL, 10);
+            break;
+        case 'n':
+            with_sizes = 0;
+            break;
+        case 'm':
+            make_files = strtol(optarg, NULL, 10);
+            break;
+        default:
+            optind = argc;
+            break;
+        }
+    }
+    if (optind != argc - 1 || max_workers < 1 || max_workers > MAX_WORKERS || make_files < 0) {
+        fprintf(stderr, "Usage: %s [-w max-workers (1-%d)] [-n] [-m files] directory\n", argv[0], MAX_WORKERS);
+        exit(1);
+    }
+    const char *root = argv[optind];
+
+    // Every directory being listed holds a descriptor.
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    if (make_files) {
+        long made = 0;
+        if (mkdir(root, 0755) == -1 && errno != EEXIST)
+            exit_sys("mkdir %s", root);
+        int fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd == -1)
+            exit_sys("open %s", root);
+        uint64_t begin = bench_now_ns();
+        make_tree(fd, make_files, &made);
+        close(fd);
+        printf("created %ld files under %s in %.0f ms\n", made, root, (double) (bench_now_ns() - begin) / 1e6);
+    }
+
+    printf("  %-9s %7s %10s %10s %12s %12s %9s %8s\n", "walker", "workers", "dirs", "files", "size MiB", "disk MiB",
+           "ms", "Mentries/s");
+    char path[PATH_MAX];
+    totals_t totals;
+    uint64_t begin = 0;
+    for (int run = 0; run < 2; run++) {
+        memset(&totals, 0, sizeof(totals));
+        snprintf(path, sizeof(path), "%s", root);
+        begin = bench_now_ns();
+        walk_readdir(path, strlen(path), &totals);
+    }
+    report("readdir", 1, totals, bench_now_ns() - begin);
+
+    for (int workers = 1; workers <= max_workers; workers *= 2) {
+        ws_pool_t *pool = ws_pool_create(workers);
+        if (!pool)
+            exit_sys("ws_pool_create");
+        for (int run = 0; run < 2; run++) {
+            begin = bench_now_ns();
+            totals = walk_parallel(pool, root);
+        }
+        report("getdents", workers, totals, bench_now_ns() - begin);
+        ws_pool_destroy(pool);
+    }
+    return 0;
+}
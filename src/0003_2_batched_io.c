@@ -0,0 +1,323 @@
+/**
+ * \file 0003_2_batched_io.c
+ *
+ * @brief Metadata scans and small-file reads: one blocking system call at a time, against file_ring.c
+ *
+ * The files under a directory are listed first (nftw), then scanned twice:
+ *
+ * - `statx`: the size of every file, as `du` or a build tool checking timestamps would;
+ * - `read`: open, read and close every file, as a grep or an indexer would.
+ *
+ * `sync` is the plain loop of blocking calls. `uring` and `threads` keep `depth` files in flight on a file_ring_t,
+ * through io_uring and through its thread-pool fallback. Each in-flight file is a chain of requests: the callback of
+ * the open submits the read, the read the close, and the close the open of the next file.
+ *
+ * With a warm page cache nothing blocks and the gain is only fewer kernel entries; with a cold one (-c, needs root
+ * to write /proc/sys/vm/drop_caches) the requests in flight overlap their waits for the disk. io_uring always hands
+ * statx and openat to its kernel workers rather than trying them inline, so for metadata alone on a single CPU the
+ * plain loop can stay ahead; the reads are where the depth pays off.
+ *
+ * \code{.sh}
+ * ./0003_2_batched_io [-d depth] [-c] [-m files] directory
+ * \endcode
+ *
+ * -m first creates that many files of 1 to 8 KiB under the directory, 1000 per subdirectory.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "file_ring.h"
+#include "helpers.h"
+
+#define READ_SIZE (64 * 1024)
+#define FILES_PER_DIR 1000
+
+typedef struct {
+    char **paths;
+    size_t count;
+    size_t capacity;
+} path_list_t;
+
+typedef struct {
+    const path_list_t *list;
+    size_t next;
+    uint64_t bytes;
+    uint64_t errors;
+} scan_t;
+
+typedef struct {
+    file_req_t req;
+    scan_t *scan;
+    struct statx statx;
+    int fd;
+    uint64_t offset;
+    char buffer[READ_SIZE];
+} slot_t;
+
+static path_list_t files;
+static int drop_caches;
+
+static int collect(const char *path, const struct stat *st, int type, struct FTW *ftw)
+{
+    (void) st;
+    (void) ftw;
+    if (type != FTW_F)
+        return 0;
+    if (files.count == files.capacity) {
+        files.capacity = files.capacity ? files.capacity * 2 : 1024;
+        if (!(files.paths = (char **) realloc(files.paths, files.capacity * sizeof(char *))))
+            exit_sys("realloc");
+    }
+    if (!(files.paths[files.count++] = strdup(path)))
+        exit_sys("strdup");
+    return 0;
+}
+
+static void make_files(const char *root, long count)
+{
+    char path[4096], data[8192];
+
+    memset(data, 'x', sizeof(data));
+    if (mkdir(root, 0755) == -1 && errno != EEXIST)
+        exit_sys("mkdir %s", root);
+    for (long i = 0; i < count; i++) {
+        if (i % FILES_PER_DIR == 0) {
+            snprintf(path, sizeof(path), "%s/d%05ld", root, i / FILES_PER_DIR);
+            if (mkdir(path, 0755) == -1 && errno != EEXIST)
+                exit_sys("mkdir %s", path);
+        }
+        snprintf(path, sizeof(path), "%s/d%05ld/f%04ld", root, i / FILES_PER_DIR, i % FILES_PER_DIR);
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        size_t size = (size_t) (i * 7919) % sizeof(data) + 1;
+        if (fd == -1 || write(fd, data, size) != (ssize_t) size)
+            exit_sys("create %s", path);
+        close(fd);
+    }
+}
+
+static void cache_drop(void)
+{
+    if (!drop_caches)
+        return;
+    sync();
+    int fd = open("/proc/sys/vm/drop_caches", O_WRONLY | O_CLOEXEC);
+    if (fd == -1 || write(fd, "3", 1) != 1)
+        exit_sys("drop_caches");
+    close(fd);
+}
+
+static void scan_sync_statx(scan_t *scan)
+{
+    struct statx stx;
+
+    for (size_t i = 0; i < scan->list->count; i++) {
+        if (statx(AT_FDCWD, scan->list->paths[i], AT_SYMLINK_NOFOLLOW, STATX_SIZE, &stx) == -1)
+            scan->errors++;
+        else
+            scan->bytes += stx.stx_size;
+    }
+}
+
+static void scan_sync_read(scan_t *scan)
+{
+    static char buffer[READ_SIZE];
+
+    for (size_t i = 0; i < scan->list->count; i++) {
+        int fd = open(scan->list->paths[i], O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            scan->errors++;
+            continue;
+        }
+        ssize_t n;
+        // A short read ends the file, as in on_read, without one more read to see 0.
+        do {
+            if ((n = read(fd, buffer, sizeof(buffer))) > 0)
+                scan->bytes += (uint64_t) n;
+        } while (n == (ssize_t) sizeof(buffer));
+        if (n == -1)
+            scan->errors++;
+        close(fd);
+    }
+}
+
+static void on_statx(file_ring_t *ring, file_req_t *req);
+static void on_open(file_ring_t *ring, file_req_t *req);
+
+static void next_statx(file_ring_t *ring, slot_t *slot)
+{
+    scan_t *scan = slot->scan;
+
+    if (scan->next == scan->list->count)
+        return;
+    file_prep_statx(&slot->req, AT_FDCWD, scan->list->paths[scan->next++], AT_SYMLINK_NOFOLLOW, STATX_SIZE,
+                    &slot->statx, on_statx, slot);
+    file_ring_submit(ring, &slot->req);
+}
+
+static void on_statx(file_ring_t *ring, file_req_t *req)
+{
+    slot_t *slot = (slot_t *) req->ctx;
+
+    if (req->result < 0)
+        slot->scan->errors++;
+    else
+        slot->scan->bytes += slot->statx.stx_size;
+    next_statx(ring, slot);
+}
+
+static void next_open(file_ring_t *ring, slot_t *slot)
+{
+    scan_t *scan = slot->scan;
+
+    if (scan->next == scan->list->count)
+        return;
+    file_prep_openat(&slot->req, AT_FDCWD, scan->list->paths[scan->next++], O_RDONLY | O_CLOEXEC, 0, on_open, slot);
+    file_ring_submit(ring, &slot->req);
+}
+
+static void on_close(file_ring_t *ring, file_req_t *req)
+{
+    next_open(ring, (slot_t *) req->ctx);
+}
+
+static void on_read(file_ring_t *ring, file_req_t *req)
+{
+    slot_t *slot = (slot_t *) req->ctx;
+
+    if (req->result < 0)
+        slot->scan->errors++;
+    else
+        slot->scan->bytes += (uint64_t) req->result;
+    if (req->result == READ_SIZE) {
+        slot->offset += READ_SIZE;
+        file_prep_read(&slot->req, slot->fd, slot->buffer, READ_SIZE, slot->offset, on_read, slot);
+    } else {
+        file_prep_close(&slot->req, slot->fd, on_close, slot);
+    }
+    file_ring_submit(ring, &slot->req);
+}
+
+static void on_open(file_ring_t *ring, file_req_t *req)
+{
+    slot_t *slot = (slot_t *) req->ctx;
+
+    if (req->result < 0) {
+        slot->scan->errors++;
+        next_open(ring, slot);
+        return;
+    }
+    slot->fd = (int) req->result;
+    slot->offset = 0;
+    file_prep_read(&slot->req, slot->fd, slot->buffer, READ_SIZE, 0, on_read, slot);
+    file_ring_submit(ring, &slot->req);
+}
+
+static void scan_ring(file_ring_t *ring, slot_t *slots, unsigned depth, int read_files, scan_t *scan)
+{
+    for (unsigned i = 0; i < depth; i++) {
+        slots[i].scan = scan;
+        if (read_files)
+            next_open(ring, &slots[i]);
+        else
+            next_statx(ring, &slots[i]);
+    }
+    if (file_ring_run(ring) == -1)
+        exit_sys("file_ring_run");
+}
+
+static void report(const char *phase, const char *backend, unsigned depth, const scan_t *scan, uint64_t elapsed_ns)
+{
+    printf("  %-6s %-8s %6u %9zu %10.1f %9.1f %10.1f\n", phase, backend, depth, scan->list->count,
+           (double) scan->bytes / 1048576.0, (double) elapsed_ns / 1e6,
+           (double) scan->list->count / (double) elapsed_ns * 1e6);
+    if (scan->errors)
+        printf("  (%lu requests failed)\n", (unsigned long) scan->errors);
+}
+
+int main(int argc, char **argv)
+{
+    static const char *backend_names[] = {"auto", "uring", "threads"};
+    long depth = 64, make_count = 0;
+    int result;
+
+    while ((result = getopt(argc, argv, "d:cm:")) != -1) {
+        switch (result) {
+        case 'd':
+            depth = strtol(optarg, NULL, 10);
+            break;
+        case 'c':
+            drop_caches = 1;
+            break;
+        case 'm':
+            make_count = strtol(optarg, NULL, 10);
+            break;
+        default:
+            optind = argc;
+            break;
+        }
+    }
+    if (optind != argc - 1 || depth < 1 || depth > 4096 || make_count < 0) {
+        fprintf(stderr, "Usage: %s [-d depth (1-4096)] [-c] [-m files] directory\n", argv[0]);
+        exit(1);
+    }
+    const char *root = argv[optind];
+
+    if (make_count) {
+        uint64_t begin = bench_now_ns();
+        make_files(root, make_count);
+        printf("created %ld files under %s in %.0f ms\n", make_count, root, (double) (bench_now_ns() - begin) / 1e6);
+    }
+    if (nftw(root, collect, 64, FTW_PHYS) == -1)
+        exit_sys("nftw %s", root);
+    if (files.count == 0) {
+        fprintf(stderr, "FATAL: no files under %s\n", root);
+        exit(1);
+    }
+
+    slot_t *slots = (slot_t *) malloc((size_t) depth * sizeof(slot_t));
+    if (!slots)
+        exit_sys("malloc");
+    printf("page cache: %s\n", drop_caches ? "dropped before every run" : "warm");
+    printf("  %-6s %-8s %6s %9s %10s %9s %10s\n", "phase", "backend", "depth", "files", "MiB", "ms", "kfiles/s");
+    for (int read_files = 0; read_files < 2; read_files++) {
+        const char *phase = read_files ? "read" : "statx";
+        scan_t scan = {.list = &files};
+        cache_drop();
+        uint64_t begin = bench_now_ns();
+        if (read_files)
+            scan_sync_read(&scan);
+        else
+            scan_sync_statx(&scan);
+        report(phase, "sync", 1, &scan, bench_now_ns() - begin);
+
+        for (file_backend_t backend = FILE_RING_URING; backend <= FILE_RING_THREADS; backend++) {
+            file_ring_t *ring = file_ring_create((unsigned) depth, backend);
+            if (!ring) {
+                printf("  %-6s %-8s unavailable: %s\n", phase, backend_names[backend], strerror(errno));
+                continue;
+            }
+            scan = (scan_t) {.list = &files};
+            cache_drop();
+            begin = bench_now_ns();
+            scan_ring(ring, slots, (unsigned) depth, read_files, &scan);
+            report(phase, backend_names[backend], (unsigned) depth, &scan, bench_now_ns() - begin);
+            file_ring_destroy(ring);
+        }
+    }
+    free(slots);
+    for (size_t i = 0; i < files.count; i++)
+        free(files.paths[i]);
+    free(files.paths);
+    return 0;
+}
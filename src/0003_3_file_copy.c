@@ -0,0 +1,214 @@
+/**
+ * \file 0003_3_file_copy.c
+ *
+ * @brief File copy with copy_file_range, sendfile, splice or read/write, and a benchmark of them
+ *
+ * Copies one file with copy_file of file_copy.c, which starts with the given method and falls back to the next ones
+ * as needed, and prints the one that did the work:
+ *
+ * \code{.sh}
+ * ./0003_3_file_copy [-M method] [-b buffer-KiB] [-t threads] [-d] from to
+ * \endcode
+ *
+ * Methods are 0 copy_file_range, 1 sendfile, 2 splice and 3 read/write; -d drops both files from the page cache
+ * after the copy. With -B, it copies files of 4 KiB up to max-MiB (default 256) in the directory with every method
+ * and reports MB/s; -c drops the page cache before each copy (needs root), so that the source is read from disk.
+ *
+ * \code{.sh}
+ * ./0003_3_file_copy -B directory [-c] [-t threads] [max-MiB]
+ * \endcode
+ *
+ * On a file system with reflinks (btrfs, XFS) copy_file_range does not copy at all and is in a class of its own.
+ * Elsewhere it and sendfile save the copy to and from user space; read/write with a small buffer pays a system call
+ * pair per buffer. Parallel parts only pay off on devices that need more than one request in flight.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "file_copy.h"
+#include "helpers.h"
+
+#define MIN_SIZE (4 * 1024)
+/** Small files are copied repeatedly until this many bytes went through. */
+#define MIN_BYTES_PER_RUN (256L * 1024 * 1024)
+
+static int drop_caches;
+
+static void cache_drop(void)
+{
+    if (!drop_caches)
+        return;
+    sync();
+    int fd = open("/proc/sys/vm/drop_caches", O_WRONLY | O_CLOEXEC);
+    if (fd == -1 || write(fd, "3", 1) != 1)
+        exit_sys("drop_caches");
+    close(fd);
+}
+
+static void make_source(const char *path, size_t size)
+{
+    static uint64_t block[8192];
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+    if (fd == -1)
+        exit_sys("open %s", path);
+    for (size_t done = 0; done < size;) {
+        for (size_t i = 0; i < sizeof(block) / sizeof(block[0]); i++)
+            block[i] = (done + i * 8) * UINT64_C(0x9e3779b97f4a7c15);
+        size_t length = size - done < sizeof(block) ? size - done : sizeof(block);
+        if (write(fd, block, length) != (ssize_t) length)
+            exit_sys("write %s", path);
+        done += length;
+    }
+    if (close(fd) == -1)
+        exit_sys("close %s", path);
+}
+
+static int same_contents(const char *a, const char *b)
+{
+    static char buffer_a[1 << 16], buffer_b[1 << 16];
+    int fd_a = open(a, O_RDONLY | O_CLOEXEC), fd_b = open(b, O_RDONLY | O_CLOEXEC);
+    int same = fd_a != -1 && fd_b != -1;
+
+    while (same) {
+        ssize_t n_a = read(fd_a, buffer_a, sizeof(buffer_a)), n_b = read(fd_b, buffer_b, sizeof(buffer_b));
+        if (n_a != n_b || n_a == -1 || memcmp(buffer_a, buffer_b, (size_t) n_a) != 0)
+            same = 0;
+        if (n_a <= 0)
+            break;
+    }
+    close(fd_a);
+    close(fd_b);
+    return same;
+}
+
+/**
+ * @return MB/s of copying from into to with the options, repeated for small files
+ */
+static double measure(const char *from, const char *to, size_t size, const copy_options_t *options,
+                      copy_method_t *used)
+{
+    long repeats = MIN_BYTES_PER_RUN / (long) size;
+    uint64_t elapsed = 0;
+
+    if (repeats < 1 || drop_caches)
+        repeats = 1;
+    for (long i = 0; i < repeats; i++) {
+        cache_drop();
+        uint64_t begin = bench_now_ns();
+        if (copy_file(from, to, options, used) == -1)
+            exit_sys("copy_file %s", from);
+        elapsed += bench_now_ns() - begin;
+    }
+    if (!same_contents(from, to)) {
+        fprintf(stderr, "FATAL: %s differs from %s after %s\n", to, from, copy_method_name(*used));
+        exit(1);
+    }
+    return (double) size * (double) repeats / (double) elapsed * 1e3;
+}
+
+static void benchmark(const char *directory, size_t max_size, int threads)
+{
+    char from[4096], to[4096];
+
+    snprintf(from, sizeof(from), "%s/copy_source", directory);
+    snprintf(to, sizeof(to), "%s/copy_target", directory);
+    printf("page cache: %s, MB/s\n", drop_caches ? "dropped before every copy" : "warm");
+    printf("  %10s", "size");
+    for (copy_method_t method = COPY_FILE_RANGE; method <= COPY_READ_WRITE; method++)
+        printf(" %16s", copy_method_name(method));
+    printf(" %16s %16s\n", "read/write 64K", "parallel");
+
+    for (size_t size = MIN_SIZE; size <= max_size; size *= 4) {
+        make_source(from, size);
+        if (size >= 1024 * 1024)
+            printf("  %6zu MiB", size >> 20);
+        else
+            printf("  %6zu KiB", size >> 10);
+        fflush(stdout);
+        copy_options_t options = {0};
+        copy_method_t used;
+        for (copy_method_t method = COPY_FILE_RANGE; method <= COPY_READ_WRITE; method++) {
+            options.method = method;
+            double rate = measure(from, to, size, &options, &used);
+            // A method that fell back measured another one.
+            if (used != method)
+                printf(" %16s", "n/a");
+            else
+                printf(" %16.0f", rate);
+            fflush(stdout);
+        }
+        options.method = COPY_READ_WRITE;
+        options.buffer_size = 64 * 1024;
+        printf(" %16.0f", measure(from, to, size, &options, &used));
+        options = (copy_options_t) {.threads = threads, .parallel_min = 1};
+        printf(" %16.0f\n", measure(from, to, size, &options, &used));
+    }
+    unlink(from);
+    unlink(to);
+}
+
+int main(int argc, char **argv)
+{
+    copy_options_t options = {0};
+    const char *bench_directory = NULL;
+    int result, usage = 0;
+
+    options.threads = 1;
+    while ((result = getopt(argc, argv, "M:b:t:dB:c")) != -1) {
+        switch (result) {
+        case 'M':
+            options.method = (copy_method_t) strtol(optarg, NULL, 10);
+            break;
+        case 'b':
+            options.buffer_size = (size_t) strtol(optarg, NULL, 10) * 1024;
+            break;
+        case 't':
+            options.threads = (int) strtol(optarg, NULL, 10);
+            break;
+        case 'd':
+            options.drop_cache = 1;
+            break;
+        case 'B':
+            bench_directory = optarg;
+            break;
+        case 'c':
+            drop_caches = 1;
+            break;
+        default:
+            usage = 1;
+            break;
+        }
+    }
+
+    if (!usage && bench_directory && optind >= argc - 1 && options.threads >= 1) {
+        long max_mib = optind == argc - 1 ? strtol(argv[optind], NULL, 10) : 256;
+        if (max_mib < 1) {
+            fprintf(stderr, "max-MiB must be at least 1\n");
+            exit(1);
+        }
+        benchmark(bench_directory, (size_t) max_mib << 20, options.threads > 1 ? options.threads : 4);
+        return 0;
+    }
+    if (usage || bench_directory || optind != argc - 2 || options.method > COPY_READ_WRITE || options.threads < 1) {
+        fprintf(stderr, "Usage: %s [-M method (0-3)] [-b buffer-KiB] [-t threads] [-d] from to\n", argv[0]);
+        fprintf(stderr, "       %s -B directory [-c] [-t threads] [max-MiB]\n", argv[0]);
+        exit(1);
+    }
+
+    copy_method_t used;
+    uint64_t begin = bench_now_ns();
+    if (copy_file(argv[optind], argv[optind + 1], &options, &used) == -1)
+        exit_sys("copy %s to %s", argv[optind], argv[optind + 1]);
+    printf("copied with %s in %.1f ms\n", copy_method_name(used), (double) (bench_now_ns() - begin) / 1e6);
+    return 0;
+}
@@ -0,0 +1,446 @@
+/**
+ * \file 0003_4_dir_index.c
+ *
+ * @brief A directory index kept current with inotify (dir_index.c), against rescanning the tree
+ *
+ * 0003_1_parallel_walk.c makes one walk fast; a tool that must answer "how big is src/" or "which files are between
+ * 1 and 4 MiB" again and again would still walk the tree for every answer, or keep the result of the last walk and
+ * rescan it periodically. This program measures what dir_index.c does instead:
+ *
+ * - the initial scan, and a full rescan of an unchanged tree: the cost of every poll of a rescanning index;
+ * - the memory of the index per entry, as counted by the index and as the growth of the resident set;
+ * - the latency of single changes: from the system call that creates, appends to, renames, creates a directory or
+ *   deletes, to the index answering with the change;
+ * - an overflow of the event queue, forced by creating more files than fs.inotify.max_queued_events without reading
+ *   events, after which the index must resync and agree with a fresh scan;
+ * - prefix totals and size range queries, against a walk that answers the same question.
+ *
+ * \code{.sh}
+ * ./0003_4_dir_index [-m files] [-c changes] directory
+ * \endcode
+ *
+ * -m first creates a test tree of that many files with sizes from 0 to a few MiB (sparse). inotify needs a watch per
+ * directory, at most fs.inotify.max_user_watches of them.
+ */
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "dir_index.h"
+#include "helpers.h"
+#include "proc_maps.h"
+
+#define TREE_FANOUT 32
+#define FILES_PER_DIR 100
+#define CHURN_DIR "dir_index.churn"
+#define BURST_DIR "dir_index.burst"
+
+typedef enum { CHANGE_CREATE, CHANGE_APPEND, CHANGE_RENAME, CHANGE_MKDIR, CHANGE_DELETE, CHANGE_KINDS } change_t;
+
+typedef struct {
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t count;
+} latency_t;
+
+typedef struct {
+    uint64_t min_size;
+    uint64_t max_size;
+    long files;
+} range_count_t;
+
+static const char *change_names[] = {"create", "append", "rename", "mkdir", "delete"};
+
+static long read_proc_long(const char *path)
+{
+    long value = -1;
+    FILE *f = fopen(path, "r");
+
+    if (f) {
+        if (fscanf(f, "%ld", &value) != 1)
+            value = -1;
+        fclose(f);
+    }
+    return value;
+}
+
+/**
+ * Creates a tree of `files` files, up to FILES_PER_DIR per leaf directory and up to TREE_FANOUT directories per level.
+ * Sizes spread over the power-of-two buckets from empty to 4 MiB.
+ */
+static void make_tree(int parent, long files, long *made)
+{
+    if (files <= FILES_PER_DIR) {
+        for (long i = 0; i < files; i++) {
+            char name[32];
+            snprintf(name, sizeof(name), "file_%ld", i);
+            uint64_t mix = (uint64_t) *made * 0x9e3779b97f4a7c15u;
+            off_t size = (off_t) ((mix >> 40) & ((UINT64_C(1) << (mix >> 59)) - 1) & 0x3fffff);
+            int fd = openat(parent, name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if (fd == -1 || ftruncate(fd, size) == -1)
+                exit_sys("create %s", name);
+            close(fd);
+            (*made)++;
+        }
+        return;
+    }
+    long leaves = (files + FILES_PER_DIR - 1) / FILES_PER_DIR;
+    long fanout = leaves < TREE_FANOUT ? leaves : TREE_FANOUT;
+    long per_child = (files + fanout - 1) / fanout;
+    for (long i = 0; files > 0; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "dir_%ld", i);
+        if (mkdirat(parent, name, 0755) == -1 && errno != EEXIST)
+            exit_sys("mkdir %s", name);
+        int fd = openat(parent, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd == -1)
+            exit_sys("open %s", name);
+        make_tree(fd, files < per_child ? files : per_child, made);
+        close(fd);
+        files -= per_child;
+    }
+}
+
+/** What a walk that does not keep an index pays for one size query. */
+static long walk_count(int dir_fd, uint64_t min_size, uint64_t max_size)
+{
+    DIR *dp = fdopendir(dir_fd);
+    struct dirent *entry;
+    struct stat st;
+    long count = 0;
+
+    if (!dp)
+        exit_sys("fdopendir");
+    while ((entry = readdir(dp)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+        if (entry->d_type == DT_DIR) {
+            int fd = openat(dirfd(dp), entry->d_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (fd != -1)
+                count += walk_count(fd, min_size, max_size);
+        } else if (fstatat(dirfd(dp), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISREG(st.st_mode)) {
+            count += (uint64_t) st.st_size >= min_size && (uint64_t) st.st_size <= max_size;
+        }
+    }
+    closedir(dp);
+    return count;
+}
+
+static int count_entry(const char *path, uint64_t size, int is_dir, void *ctx)
+{
+    (void) path;
+    (void) size;
+    *(long *) ctx += !is_dir;
+    return 0;
+}
+
+static int present(const dir_index_t *index, const char *path, uint64_t size, int is_dir)
+{
+    uint64_t found_size;
+    int found_dir;
+
+    if (dir_index_lookup(index, path, &found_size, &found_dir) == -1)
+        return 0;
+    return found_dir == is_dir && (is_dir || found_size == size);
+}
+
+/**
+ * Reads events until the index agrees with the change just made.
+ * @return nanoseconds from the call to the index being current
+ */
+static uint64_t wait_for(dir_index_t *index, const char *path, int exists, uint64_t size, int is_dir)
+{
+    uint64_t begin = bench_now_ns();
+
+    for (int rounds = 0; exists ? !present(index, path, size, is_dir) : present(index, path, size, is_dir); rounds++) {
+        if (rounds == 100) {
+            fprintf(stderr, "FATAL: the index did not see %s %s\n", exists ? "the creation of" : "the removal of",
+                    path);
+            exit(1);
+        }
+        if (dir_index_update(index, 10) == -1)
+            exit_sys("dir_index_update");
+    }
+    return bench_now_ns() - begin;
+}
+
+static void record(latency_t *latency, uint64_t elapsed)
+{
+    latency->total_ns += elapsed;
+    latency->count++;
+    if (elapsed > latency->max_ns)
+        latency->max_ns = elapsed;
+}
+
+static void measure_changes(dir_index_t *index, const char *root, long changes)
+{
+    latency_t latencies[CHANGE_KINDS];
+    char path[2 * PATH_MAX], target[2 * PATH_MAX], relative[PATH_MAX / 2], relative_target[PATH_MAX / 2];
+    static const char payload[100] = {0};
+
+    memset(latencies, 0, sizeof(latencies));
+    snprintf(path, sizeof(path), "%s/" CHURN_DIR, root);
+    if (mkdir(path, 0755) == -1 && errno != EEXIST)
+        exit_sys("mkdir %s", path);
+    wait_for(index, CHURN_DIR, 1, 0, 1);
+
+    for (long i = 0; i < changes; i++) {
+        snprintf(relative, sizeof(relative), CHURN_DIR "/file_%ld", i);
+        snprintf(relative_target, sizeof(relative_target), CHURN_DIR "/renamed_%ld", i);
+        snprintf(path, sizeof(path), "%s/%s", root, relative);
+        snprintf(target, sizeof(target), "%s/%s", root, relative_target);
+
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd == -1)
+            exit_sys("open %s", path);
+        record(&latencies[CHANGE_CREATE], wait_for(index, relative, 1, 0, 0));
+        if (write(fd, payload, sizeof(payload)) != (ssize_t) sizeof(payload))
+            exit_sys("write %s", path);
+        record(&latencies[CHANGE_APPEND], wait_for(index, relative, 1, sizeof(payload), 0));
+        close(fd);
+
+        if (rename(path, target) == -1)
+            exit_sys("rename %s", path);
+        record(&latencies[CHANGE_RENAME], wait_for(index, relative_target, 1, sizeof(payload), 0));
+        if (present(index, relative, sizeof(payload), 0)) {
+            fprintf(stderr, "FATAL: %s is still in the index after the rename\n", relative);
+            exit(1);
+        }
+
+        snprintf(relative, sizeof(relative), CHURN_DIR "/dir_%ld", i);
+        snprintf(path, sizeof(path), "%s/%s", root, relative);
+        if (mkdir(path, 0755) == -1)
+            exit_sys("mkdir %s", path);
+        record(&latencies[CHANGE_MKDIR], wait_for(index, relative, 1, 0, 1));
+
+        if (unlink(target) == -1)
+            exit_sys("unlink %s", target);
+        record(&latencies[CHANGE_DELETE], wait_for(index, relative_target, 0, sizeof(payload), 0));
+        if (rmdir(path) == -1)
+            exit_sys("rmdir %s", path);
+        record(&latencies[CHANGE_DELETE], wait_for(index, relative, 0, 0, 1));
+    }
+
+    printf("  %-8s %8s %10s %10s\n", "change", "count", "mean us", "max us");
+    for (int kind = 0; kind < CHANGE_KINDS; kind++)
+        printf("  %-8s %8lu %10.1f %10.1f\n", change_names[kind], (unsigned long) latencies[kind].count,
+               (double) latencies[kind].total_ns / (double) latencies[kind].count / 1e3,
+               (double) latencies[kind].max_ns / 1e3);
+}
+
+/** Compares the index with a fresh scan of the same tree. */
+static void check_against_scan(const dir_index_t *index, const char *root, const char *when)
+{
+    dir_index_t *fresh = dir_index_open(root);
+    dir_index_stats_t stats, fresh_stats;
+    dir_totals_t totals, fresh_totals;
+
+    if (!fresh)
+        exit_sys("dir_index_open %s", root);
+    dir_index_stats(index, &stats);
+    dir_index_stats(fresh, &fresh_stats);
+    dir_index_totals(index, "", &totals);
+    dir_index_totals(fresh, "", &fresh_totals);
+    if (stats.entries != fresh_stats.entries || totals.files != fresh_totals.files ||
+        totals.dirs != fresh_totals.dirs || totals.bytes != fresh_totals.bytes) {
+        fprintf(stderr, "FATAL: %s the index has %zu entries and %lu bytes, a fresh scan %zu and %lu\n", when,
+                stats.entries, (unsigned long) totals.bytes, fresh_stats.entries, (unsigned long) fresh_totals.bytes);
+        exit(1);
+    }
+    printf("  %s: %zu entries, %lu bytes, same as a fresh scan\n", when, stats.entries, (unsigned long) totals.bytes);
+    dir_index_close(fresh);
+}
+
+static void measure_overflow(dir_index_t *index, const char *root)
+{
+    long max_queued = read_proc_long("/proc/sys/fs/inotify/max_queued_events");
+    long files = (max_queued > 0 ? max_queued : 16384) + 1000;
+    dir_index_stats_t before, after;
+    char path[PATH_MAX];
+
+    snprintf(path, sizeof(path), "%s/" BURST_DIR, root);
+    if (mkdir(path, 0755) == -1 && errno != EEXIST)
+        exit_sys("mkdir %s", path);
+    wait_for(index, BURST_DIR, 1, 0, 1);
+    dir_index_stats(index, &before);
+
+    int dir_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd == -1)
+        exit_sys("open %s", path);
+    for (long i = 0; i < files; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "burst_%ld", i);
+        int fd = openat(dir_fd, name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd == -1 || ftruncate(fd, i) == -1)
+            exit_sys("create %s", name);
+        close(fd);
+    }
+    uint64_t begin = bench_now_ns();
+    if (dir_index_update(index, 0) == -1)
+        exit_sys("dir_index_update");
+    uint64_t elapsed = bench_now_ns() - begin;
+    dir_index_stats(index, &after);
+    printf("  %ld files created with events unread (queue %ld): %lu resyncs, update took %.1f ms\n", files,
+           max_queued, (unsigned long) (after.resyncs - before.resyncs), (double) elapsed / 1e6);
+    check_against_scan(index, root, "after the burst");
+
+    for (long i = 0; i < files; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "burst_%ld", i);
+        if (unlinkat(dir_fd, name, 0) == -1)
+            exit_sys("unlink %s", name);
+    }
+    close(dir_fd);
+    if (rmdir(path) == -1)
+        exit_sys("rmdir %s", path);
+    if (dir_index_update(index, 0) == -1)
+        exit_sys("dir_index_update");
+    check_against_scan(index, root, "after the cleanup");
+}
+
+static void measure_queries(const dir_index_t *index, const char *root)
+{
+    static const range_count_t ranges[] = {
+        {0, 0, 0}, {1, 4095, 0}, {4096, 65535, 0}, {100000, 1000000, 0}, {1 << 20, 4 << 20, 0}};
+    dir_totals_t totals;
+    uint64_t begin;
+
+    begin = bench_now_ns();
+    if (dir_index_totals(index, "", &totals) == -1)
+        exit_sys("dir_index_totals");
+    printf("  totals of the tree: %lu files, %lu dirs, %.1f MiB in %.1f us\n", (unsigned long) totals.files,
+           (unsigned long) totals.dirs, (double) totals.bytes / 1048576.0, (double) (bench_now_ns() - begin) / 1e3);
+    begin = bench_now_ns();
+    if (dir_index_totals(index, "dir_1", &totals) == 0)
+        printf("  totals of dir_1*: %lu files, %.1f MiB in %.1f us\n", (unsigned long) totals.files,
+               (double) totals.bytes / 1048576.0, (double) (bench_now_ns() - begin) / 1e3);
+
+    printf("  %-20s %10s %12s %12s %12s\n", "size range", "files", "count us", "query us", "walk ms");
+    for (size_t i = 0; i < sizeof(ranges) / sizeof(ranges[0]); i++) {
+        uint64_t min_size = ranges[i].min_size, max_size = ranges[i].max_size;
+        begin = bench_now_ns();
+        long count = dir_index_count_size(index, "", min_size, max_size);
+        uint64_t count_ns = bench_now_ns() - begin;
+
+        long listed = 0;
+        begin = bench_now_ns();
+        if (dir_index_query(index, "", min_size ? min_size : 1, max_size, count_entry, &listed) == -1)
+            exit_sys("dir_index_query");
+        uint64_t query_ns = bench_now_ns() - begin;
+        // Listing from 0 would also report every directory; empty files are listed by counting.
+        if (min_size == 0)
+            listed = count;
+
+        int fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd == -1)
+            exit_sys("open %s", root);
+        begin = bench_now_ns();
+        long walked = walk_count(fd, min_size, max_size);
+        uint64_t walk_ns = bench_now_ns() - begin;
+
+        if (count != walked || listed != walked) {
+            fprintf(stderr, "FATAL: [%lu, %lu] counted %ld, listed %ld, walked %ld\n", (unsigned long) min_size,
+                    (unsigned long) max_size, count, listed, walked);
+            exit(1);
+        }
+        char label[48];
+        snprintf(label, sizeof(label), "[%lu, %lu]", (unsigned long) min_size, (unsigned long) max_size);
+        printf("  %-20s %10ld %12.1f %12.1f %12.1f\n", label, count, (double) count_ns / 1e3,
+               (double) query_ns / 1e3, (double) walk_ns / 1e6);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    long make_files = 0, changes = 1000;
+    int result;
+
+    while ((result = getopt(argc, argv, "m:c:")) != -1) {
+        switch (result) {
+        case 'm':
+            make_files = strtol(optarg, NULL, 10);
+            break;
+        case 'c':
+            changes = strtol(optarg, NULL, 10);
+            break;
+        default:
+            optind = argc;
+            break;
+        }
+    }
+    if (optind != argc - 1 || make_files < 0 || changes < 1) {
+        fprintf(stderr, "Usage: %s [-m files] [-c changes] directory\n", argv[0]);
+        exit(1);
+    }
+    const char *root = argv[optind];
+
+    if (make_files) {
+        long made = 0;
+        if (mkdir(root, 0755) == -1 && errno != EEXIST)
+            exit_sys("mkdir %s", root);
+        int fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd == -1)
+            exit_sys("open %s", root);
+        uint64_t begin = bench_now_ns();
+        make_tree(fd, make_files, &made);
+        close(fd);
+        printf("created %ld files under %s in %.0f ms\n", made, root, (double) (bench_now_ns() - begin) / 1e6);
+    }
+
+    mem_rollup_t rss_before, rss_after;
+    if (mem_rollup_read(&rss_before) == -1)
+        exit_sys("mem_rollup_read");
+    uint64_t begin = bench_now_ns();
+    dir_index_t *index = dir_index_open(root);
+    if (!index)
+        exit_sys("dir_index_open %s", root);
+    uint64_t open_ns = bench_now_ns() - begin;
+    if (mem_rollup_read(&rss_after) == -1)
+        exit_sys("mem_rollup_read");
+
+    dir_index_stats_t stats;
+    dir_index_stats(index, &stats);
+    long max_watches = read_proc_long("/proc/sys/fs/inotify/max_user_watches");
+    printf("index of %s: %zu entries, %zu watches (limit %ld), %lu could not be watched\n", root, stats.entries,
+           stats.watches, max_watches, (unsigned long) stats.watch_failures);
+    printf("  scan and watch      %10.1f ms\n", (double) open_ns / 1e6);
+    begin = bench_now_ns();
+    if (dir_index_rescan(index) == -1)
+        exit_sys("dir_index_rescan");
+    printf("  rescan, no changes  %10.1f ms  (what every poll of a rescanning index costs)\n",
+           (double) (bench_now_ns() - begin) / 1e6);
+    printf("  memory              %10.1f MiB counted, %.1f MiB resident, %.0f and %.0f bytes per entry\n",
+           (double) stats.memory / 1048576.0, (double) (rss_after.rss_kb - rss_before.rss_kb) / 1024.0,
+           (double) stats.memory / (double) stats.entries,
+           (double) (rss_after.rss_kb - rss_before.rss_kb) * 1024.0 / (double) stats.entries);
+
+    printf("latency of %ld changes of each kind:\n", changes);
+    measure_changes(index, root, changes);
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/" CHURN_DIR, root);
+    if (rmdir(path) == -1)
+        exit_sys("rmdir %s", path);
+    wait_for(index, CHURN_DIR, 0, 0, 1);
+
+    printf("event queue overflow:\n");
+    measure_overflow(index, root);
+
+    printf("queries:\n");
+    measure_queries(index, root);
+
+    dir_index_stats(index, &stats);
+    printf("%lu events applied, %lu resyncs\n", (unsigned long) stats.events, (unsigned long) stats.resyncs);
+    dir_index_close(index);
+    return 0;
+}
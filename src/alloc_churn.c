@@ -0,0 +1,265 @@
+/** \file alloc_churn.c
+ *
+ * @brief Multi-threaded small-allocation churn: glibc malloc against the slab allocator of slab_alloc.c
+ *
+ * 1, 2, 4, ... threads allocate and free small blocks as fast as they can, in two patterns:
+ *
+ * - `local`: every thread keeps SLOTS live blocks and replaces a random one per operation, so blocks are freed by the
+ *   thread that allocated them.
+ * - `remote`: every thread allocates a batch of BATCH blocks and hands it to the next thread, which frees it. Every free
+ *   is of a block allocated elsewhere, which is where thread caches have to give memory back.
+ *
+ * Sizes are mostly 16 to 256 bytes, one in 16 up to 4 KiB. Every block carries a tag that is checked when it is freed,
+ * so an allocator handing out a block twice would be caught.
+ *
+ * The allocator is whatever malloc the process has. Given the path of a preloadable library as the third argument,
+ * the program runs itself a second time with that library in LD_PRELOAD:
+ *
+ * \code{.sh}
+ * ./alloc_churn [milliseconds-per-run] [max-threads] [./libslab.so]
+ * \endcode
+ */
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "helpers.h"
+
+#define MAX_THREADS 64
+#define SLOTS 1024
+#define BATCH 256
+
+typedef enum { PATTERN_LOCAL, PATTERN_REMOTE } pattern_t;
+
+static const char *pattern_names[] = {"local", "remote"};
+
+typedef struct {
+    size_t count;
+    void *blocks[BATCH];
+    uint64_t tags[BATCH];
+} batch_t;
+
+typedef struct shared_t shared_t;
+
+typedef struct {
+    _Alignas(64) _Atomic(batch_t *) inbox;
+    shared_t *shared;
+    pthread_t thread;
+    int index;
+    uint64_t ops;
+    uint64_t seed;
+    int spares;
+    batch_t *spare[MAX_THREADS + 1];
+} worker_t;
+
+struct shared_t {
+    pattern_t pattern;
+    int threads;
+    _Alignas(64) atomic_int stop;
+    pthread_barrier_t start;
+    worker_t *workers;
+};
+
+static uint64_t next_random(uint64_t *seed)
+{
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 7;
+    *seed ^= *seed << 17;
+    return *seed;
+}
+
+static void *alloc_tagged(uint64_t *seed, uint64_t tag)
+{
+    uint64_t r = next_random(seed);
+    size_t size = (r & 15) ? 16 + (r >> 8) % 241 : 256 + (r >> 8) % 3841;
+    uint64_t *block = (uint64_t *) malloc(size);
+
+    if (!block)
+        exit_sys("malloc");
+    *block = tag;
+    return block;
+}
+
+static void free_tagged(void *block, uint64_t tag)
+{
+    if (*(uint64_t *) block != tag) {
+        fprintf(stderr, "FATAL: block %p holds tag %lu, expected %lu\n", block, (unsigned long) *(uint64_t *) block,
+                (unsigned long) tag);
+        exit(1);
+    }
+    free(block);
+}
+
+static void free_batch(batch_t *batch)
+{
+    for (size_t i = 0; i < batch->count; i++)
+        free_tagged(batch->blocks[i], batch->tags[i]);
+    batch->count = 0;
+}
+
+static void run_local(worker_t *worker)
+{
+    void *slots[SLOTS];
+    uint64_t tags[SLOTS];
+    uint64_t tag = (uint64_t) worker->index << 48;
+
+    for (size_t i = 0; i < SLOTS; i++)
+        slots[i] = alloc_tagged(&worker->seed, tags[i] = tag++);
+    pthread_barrier_wait(&worker->shared->start);
+    while (!atomic_load_explicit(&worker->shared->stop, memory_order_relaxed)) {
+        for (int n = 0; n < 64; n++) {
+            size_t i = next_random(&worker->seed) % SLOTS;
+            free_tagged(slots[i], tags[i]);
+            slots[i] = alloc_tagged(&worker->seed, tags[i] = tag++);
+        }
+        worker->ops += 64;
+    }
+    for (size_t i = 0; i < SLOTS; i++)
+        free_tagged(slots[i], tags[i]);
+}
+
+static void run_remote(worker_t *worker)
+{
+    shared_t *shared = worker->shared;
+    worker_t *next = &shared->workers[(worker->index + 1) % shared->threads];
+    uint64_t tag = (uint64_t) worker->index << 48;
+
+    pthread_barrier_wait(&shared->start);
+    while (!atomic_load_explicit(&shared->stop, memory_order_relaxed)) {
+        batch_t *batch = worker->spares ? worker->spare[--worker->spares]
+                                        : atomic_exchange_explicit(&worker->inbox, NULL, memory_order_acquire);
+        if (!batch) {
+            sched_yield();
+            continue;
+        }
+        // Blocks of the previous thread, or our own if the next thread had not picked them up yet.
+        free_batch(batch);
+        for (size_t i = 0; i < BATCH; i++)
+            batch->blocks[i] = alloc_tagged(&worker->seed, batch->tags[i] = tag++);
+        batch->count = BATCH;
+        worker->ops += BATCH;
+
+        batch_t *unread = atomic_exchange_explicit(&next->inbox, batch, memory_order_acq_rel);
+        if (unread)
+            worker->spare[worker->spares++] = unread;
+        batch_t *received = atomic_exchange_explicit(&worker->inbox, NULL, memory_order_acquire);
+        if (received)
+            worker->spare[worker->spares++] = received;
+    }
+}
+
+static void *run_worker(void *arg)
+{
+    worker_t *worker = (worker_t *) arg;
+
+    if (worker->shared->pattern == PATTERN_LOCAL)
+        run_local(worker);
+    else
+        run_remote(worker);
+    return NULL;
+}
+
+static void run(pattern_t pattern, int threads, long ms)
+{
+    shared_t shared = {.pattern = pattern, .threads = threads};
+    worker_t *workers = (worker_t *) aligned_alloc(64, (size_t) threads * sizeof(worker_t));
+
+    if (!workers)
+        exit_sys("aligned_alloc");
+    shared.workers = workers;
+    atomic_init(&shared.stop, 0);
+    if (pthread_barrier_init(&shared.start, NULL, (unsigned) threads + 1) != 0)
+        exit_sys("pthread_barrier_init");
+    for (int i = 0; i < threads; i++) {
+        worker_t *worker = &workers[i];
+        memset(worker, 0, sizeof(*worker));
+        atomic_init(&worker->inbox, NULL);
+        worker->shared = &shared;
+        worker->index = i;
+        worker->seed = 0x9e3779b97f4a7c15u * (uint64_t) (i + 1);
+        worker->spare[worker->spares] = (batch_t *) calloc(1, sizeof(batch_t));
+        if (!worker->spare[worker->spares++])
+            exit_sys("calloc");
+    }
+    for (int i = 0; i < threads; i++)
+        if (pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]) != 0)
+            exit_sys("pthread_create");
+
+    pthread_barrier_wait(&shared.start);
+    uint64_t begin = bench_now_ns();
+    struct timespec duration = {ms / 1000, (ms % 1000) * 1000000};
+    nanosleep(&duration, NULL);
+    atomic_store(&shared.stop, 1);
+    uint64_t ops = 0;
+    for (int i = 0; i < threads; i++) {
+        pthread_join(workers[i].thread, NULL);
+        ops += workers[i].ops;
+    }
+    uint64_t elapsed = bench_now_ns() - begin;
+    printf("  %-7s %7d %10.2f %10.1f\n", pattern_names[pattern], threads, (double) ops / (double) elapsed * 1e3,
+           (double) elapsed * threads / (double) ops);
+
+    for (int i = 0; i < threads; i++) {
+        batch_t *batch = atomic_load(&workers[i].inbox);
+        if (batch) {
+            free_batch(batch);
+            free(batch);
+        }
+        for (int s = 0; s < workers[i].spares; s++) {
+            free_batch(workers[i].spare[s]);
+            free(workers[i].spare[s]);
+        }
+    }
+    pthread_barrier_destroy(&shared.start);
+    free(workers);
+}
+
+int main(int argc, char **argv)
+{
+    long ms = argc > 1 ? strtol(argv[1], NULL, 10) : 500;
+    long max_threads = argc > 2 ? strtol(argv[2], NULL, 10) : sysconf(_SC_NPROCESSORS_ONLN);
+    const char *preload = getenv("LD_PRELOAD");
+    struct rusage usage;
+
+    if (ms <= 0 || max_threads < 1 || max_threads > MAX_THREADS) {
+        fprintf(stderr, "Usage: %s [milliseconds-per-run] [max-threads (1-%d)] [preload-library]\n", argv[0],
+                MAX_THREADS);
+        exit(1);
+    }
+    printf("malloc: %s\n", preload && *preload ? preload : "glibc");
+    printf("  %-7s %7s %10s %10s\n", "pattern", "threads", "Mops/s", "ns/op");
+    for (pattern_t pattern = PATTERN_LOCAL; pattern <= PATTERN_REMOTE; pattern++)
+        for (int threads = 1; threads <= max_threads; threads *= 2)
+            run(pattern, threads, ms);
+    getrusage(RUSAGE_SELF, &usage);
+    printf("  peak RSS %ld KiB\n", usage.ru_maxrss);
+    fflush(stdout);
+
+    if (argc > 3) {
+        pid_t pid = fork();
+        if (pid == -1)
+            exit_sys("fork");
+        if (pid == 0) {
+            char *args[] = {argv[0], argv[1], argv[2], NULL};
+            setenv("LD_PRELOAD", argv[3], 1);
+            execv("/proc/self/exe", args);
+            exit_sys("execv");
+        }
+        int status;
+        if (waitpid(pid, &status, 0) == -1)
+            exit_sys("waitpid");
+        return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+    }
+    return 0;
+}
@@ -0,0 +1,344 @@
+/** \file async.c
+ *
+ * @brief Async functions on a fixed thread pool
+ *
+ * function.c notes that C functions are always blocking and that async functions have to be built with threads. This
+ * is such a building block: `async_submit` hands a function to a pool of worker threads and returns immediately with a
+ * future. The caller can later block on the future with `future_wait`, or attach a callback with `future_then` that a
+ * worker calls when the function returns.
+ *
+ * Futures are not allocated per task. The pool allocates `capacity` of them up front and keeps the unused ones in a free
+ * list; `async_submit` fails with EAGAIN when all of them are in flight. Completion is signaled through the future's
+ * state word with a futex, so there is no mutex or condition variable per future either, and a future whose caller
+ * is not waiting completes without any syscall.
+ *
+ * A future is created PENDING, becomes RUNNING when a worker takes it, and ends DONE or CANCELLED. Only a PENDING
+ * future can be cancelled: once the function runs it is not interrupted.
+ */
+
+#include <errno.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "async.h"
+
+#define STATUS_MASK 3u
+#define FLAG_WAITERS 4u
+#define FLAG_CALLBACK 8u
+
+/**
+ * \struct future_t
+ * \brief A task slot. Aligned to a cache line so that workers completing neighbouring futures do not share a line.
+ */
+struct future_t {
+    _Alignas(64) _Atomic uint32_t state;
+    async_fn_t fn;
+    void *arg;
+    void *result;
+    future_callback_t callback;
+    void *ctx;
+    future_t *prev;
+    future_t *next;
+    async_pool_t *pool;
+};
+
+struct async_pool_t {
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    future_t *head;
+    future_t *tail;
+    future_t *free_list;
+    future_t *futures;
+    size_t capacity;
+    int shutdown;
+    int thread_count;
+    pthread_t *threads;
+};
+
+static void futex_wait(_Atomic uint32_t *addr, uint32_t expected)
+{
+    syscall(SYS_futex, (uint32_t *) addr, FUTEX_WAIT_PRIVATE, expected, NULL, NULL, 0);
+}
+
+static void futex_wake_all(_Atomic uint32_t *addr)
+{
+    syscall(SYS_futex, (uint32_t *) addr, FUTEX_WAKE_PRIVATE, INT32_MAX, NULL, NULL, 0);
+}
+
+/**
+ * Publishes the final status. A waiter is woken only if it announced itself with FLAG_WAITERS. The futex call may
+ * happen after the waiter already released the future, which is harmless because the slot belongs to the pool and
+ * a wake-up on a reused slot only causes a spurious wake-up.
+ */
+static void future_complete(future_t *future, future_status_t status)
+{
+    uint32_t old = atomic_load_explicit(&future->state, memory_order_relaxed);
+
+    while (!atomic_compare_exchange_weak_explicit(&future->state, &old, (old & ~STATUS_MASK) | (uint32_t) status,
+                                                  memory_order_acq_rel, memory_order_relaxed))
+        ;
+    if (old & FLAG_CALLBACK) {
+        future->callback(future, status, future->ctx);
+        future_release(future);
+    } else if (old & FLAG_WAITERS) {
+        futex_wake_all(&future->state);
+    }
+}
+
+/* Doubly linked run queue so that cancellation can unlink in O(1). Called with the pool lock held. */
+static void queue_push(async_pool_t *pool, future_t *future)
+{
+    future->next = NULL;
+    future->prev = pool->tail;
+    if (pool->tail)
+        pool->tail->next = future;
+    else
+        pool->head = future;
+    pool->tail = future;
+}
+
+static void queue_unlink(async_pool_t *pool, future_t *future)
+{
+    if (future->prev)
+        future->prev->next = future->next;
+    else
+        pool->head = future->next;
+    if (future->next)
+        future->next->prev = future->prev;
+    else
+        pool->tail = future->prev;
+}
+
+static void *worker(void *arg)
+{
+    async_pool_t *pool = (async_pool_t *) arg;
+
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        while (!pool->head && !pool->shutdown)
+            pthread_cond_wait(&pool->not_empty, &pool->lock);
+        future_t *future = pool->head;
+        if (!future) {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        queue_unlink(pool, future);
+        // Under the lock, so future_cancel sees either PENDING and a queued future or RUNNING.
+        atomic_fetch_or_explicit(&future->state, FUTURE_RUNNING, memory_order_relaxed);
+        pthread_mutex_unlock(&pool->lock);
+
+        future->result = future->fn(future->arg);
+        future_complete(future, FUTURE_DONE);
+    }
+    return NULL;
+}
+
+/**
+ * @param threads number of worker threads
+ * @param capacity maximum number of futures in flight
+ * @return the pool or NULL with errno set
+ */
+async_pool_t *async_pool_create(int threads, size_t capacity)
+{
+    if (threads <= 0 || capacity == 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    async_pool_t *pool = (async_pool_t *) calloc(1, sizeof(async_pool_t));
+    if (!pool)
+        return NULL;
+    pool->futures = (future_t *) aligned_alloc(_Alignof(future_t), capacity * sizeof(future_t));
+    pool->threads = (pthread_t *) calloc((size_t) threads, sizeof(pthread_t));
+    if (!pool->futures || !pool->threads) {
+        free(pool->futures);
+        free(pool->threads);
+        free(pool);
+        errno = ENOMEM;
+        return NULL;
+    }
+    memset(pool->futures, 0, capacity * sizeof(future_t));
+    pool->capacity = capacity;
+    for (size_t i = 0; i < capacity; i++) {
+        pool->futures[i].pool = pool;
+        pool->futures[i].next = i + 1 < capacity ? &pool->futures[i + 1] : NULL;
+    }
+    pool->free_list = pool->futures;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->not_empty, NULL);
+
+    for (int i = 0; i < threads; i++) {
+        int err = pthread_create(&pool->threads[i], NULL, worker, pool);
+        if (err) {
+            pool->thread_count = i;
+            async_pool_destroy(pool);
+            errno = err;
+            return NULL;
+        }
+    }
+    pool->thread_count = threads;
+    return pool;
+}
+
+/**
+ * Cancels the futures that did not start yet, lets the running ones finish and joins the workers. Futures that are
+ * still held by the caller become invalid.
+ * @param pool
+ */
+void async_pool_destroy(async_pool_t *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = 1;
+    future_t *pending = pool->head;
+    pool->head = pool->tail = NULL;
+    pthread_cond_broadcast(&pool->not_empty);
+    pthread_mutex_unlock(&pool->lock);
+
+    while (pending) {
+        future_t *next = pending->next;
+        future_complete(pending, FUTURE_CANCELLED);
+        pending = next;
+    }
+    for (int i = 0; i < pool->thread_count; i++)
+        pthread_join(pool->threads[i], NULL);
+
+    pthread_cond_destroy(&pool->not_empty);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->threads);
+    free(pool->futures);
+    free(pool);
+}
+
+/**
+ * Queues fn(arg) on the pool.
+ * @param pool
+ * @param fn
+ * @param arg
+ * @return a future that must be released with future_release (or handed to future_then), or NULL with errno set to
+ * EAGAIN when all futures are in flight
+ */
+future_t *async_submit(async_pool_t *pool, async_fn_t fn, void *arg)
+{
+    pthread_mutex_lock(&pool->lock);
+    future_t *future = pool->free_list;
+    if (!future || pool->shutdown) {
+        pthread_mutex_unlock(&pool->lock);
+        errno = future ? ECANCELED : EAGAIN;
+        return NULL;
+    }
+    pool->free_list = future->next;
+    atomic_store_explicit(&future->state, FUTURE_PENDING, memory_order_relaxed);
+    future->fn = fn;
+    future->arg = arg;
+    future->result = NULL;
+    future->callback = NULL;
+    queue_push(pool, future);
+    pthread_cond_signal(&pool->not_empty);
+    pthread_mutex_unlock(&pool->lock);
+    return future;
+}
+
+/**
+ * Blocks until the future is done or cancelled. It spins briefly first: tiny tasks often finish in less time than a
+ * futex round trip.
+ * @param future
+ * @param result receives the return value of the function, may be NULL
+ * @return FUTURE_DONE or FUTURE_CANCELLED
+ */
+future_status_t future_wait(future_t *future, void **result)
+{
+    uint32_t state;
+    int spins = 0;
+
+    for (;;) {
+        state = atomic_load_explicit(&future->state, memory_order_acquire);
+        if ((state & STATUS_MASK) >= FUTURE_DONE)
+            break;
+        if (spins < 128) {
+            spins++;
+            __builtin_ia32_pause();
+            continue;
+        }
+        if (!(state & FLAG_WAITERS) &&
+            !atomic_compare_exchange_weak_explicit(&future->state, &state, state | FLAG_WAITERS,
+                                                   memory_order_relaxed, memory_order_relaxed))
+            continue;
+        futex_wait(&future->state, state | FLAG_WAITERS);
+    }
+    if (result)
+        *result = future->result;
+    return (future_status_t) (state & STATUS_MASK);
+}
+
+/**
+ * Attaches a callback that is called on the worker thread when the function returns, or on the cancelling thread.
+ * If the future is already finished the callback is called right away on the calling thread. The pool releases the
+ * future after the callback returns, so the caller must not touch it after this call.
+ * @param future
+ * @param callback
+ * @param ctx
+ * @return 0, or -1 with errno EBUSY if a callback was already attached
+ */
+int future_then(future_t *future, future_callback_t callback, void *ctx)
+{
+    uint32_t state = atomic_load_explicit(&future->state, memory_order_acquire);
+
+    if (state & FLAG_CALLBACK) {
+        errno = EBUSY;
+        return -1;
+    }
+    future->callback = callback;
+    future->ctx = ctx;
+    while ((state & STATUS_MASK) < FUTURE_DONE) {
+        if (atomic_compare_exchange_weak_explicit(&future->state, &state, state | FLAG_CALLBACK, memory_order_acq_rel,
+                                                  memory_order_acquire))
+            return 0;
+    }
+    callback(future, (future_status_t) (state & STATUS_MASK), ctx);
+    future_release(future);
+    return 0;
+}
+
+/**
+ * @param future
+ * @return 0 if the future was still pending and is now cancelled, -1 with errno EBUSY if it already started
+ */
+int future_cancel(future_t *future)
+{
+    async_pool_t *pool = future->pool;
+
+    pthread_mutex_lock(&pool->lock);
+    if ((atomic_load_explicit(&future->state, memory_order_relaxed) & STATUS_MASK) != FUTURE_PENDING) {
+        pthread_mutex_unlock(&pool->lock);
+        errno = EBUSY;
+        return -1;
+    }
+    queue_unlink(pool, future);
+    pthread_mutex_unlock(&pool->lock);
+    future_complete(future, FUTURE_CANCELLED);
+    return 0;
+}
+
+future_status_t future_status(future_t *future)
+{
+    return (future_status_t) (atomic_load_explicit(&future->state, memory_order_acquire) & STATUS_MASK);
+}
+
+/**
+ * Returns the future to the pool. Call it once, after future_wait returned; a pending future must be cancelled first.
+ * @param future
+ */
+void future_release(future_t *future)
+{
+    async_pool_t *pool = future->pool;
+
+    pthread_mutex_lock(&pool->lock);
+    future->next = pool->free_list;
+    pool->free_list = future;
+    pthread_mutex_unlock(&pool->lock);
+}
@@ -0,0 +1,165 @@
+/** \file async_function.c
+ *
+ * @brief Async functions with futures and callbacks
+ *
+ * Uses the thread pool of async.c in the three ways an async call is usually consumed:
+ *
+ * - submit and block on the future (`future_wait`), which measures the submit-to-complete latency,
+ * - submit a batch and wait for all of them, which measures throughput,
+ * - submit with a `future_then` callback and never block on a single task.
+ *
+ * The tasks are tiny on purpose, so the numbers are the overhead of the async machinery itself.
+ *
+ * \code{.sh}
+ * ./async_function [number-of-tasks] [number-of-threads]
+ * \endcode
+ */
+
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "async.h"
+#include "bench.h"
+#include "helpers.h"
+
+#define CAPACITY 1024
+
+static void *increment(void *arg)
+{
+    return (void *) ((uintptr_t) arg + 1);
+}
+
+static void *nap(void *arg)
+{
+    usleep((useconds_t) (uintptr_t) arg);
+    return NULL;
+}
+
+static void count_done(future_t *future, future_status_t status, void *ctx)
+{
+    (void) future;
+    if (status == FUTURE_DONE)
+        atomic_fetch_add_explicit((_Atomic size_t *) ctx, 1, memory_order_relaxed);
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+/** Retries while every future is in flight, which is how a producer applies back pressure. */
+static future_t *submit(async_pool_t *pool, async_fn_t fn, void *arg)
+{
+    future_t *future;
+
+    while ((future = async_submit(pool, fn, arg)) == NULL)
+        sched_yield();
+    return future;
+}
+
+static void measure_latency(async_pool_t *pool, size_t tasks)
+{
+    uint64_t *latencies = (uint64_t *) malloc(tasks * sizeof(uint64_t));
+    uint64_t total = 0;
+
+    if (!latencies)
+        exit_sys("malloc");
+    for (size_t i = 0; i < tasks; i++) {
+        uint64_t begin = bench_now_ns();
+        future_t *future = submit(pool, increment, (void *) (uintptr_t) i);
+        void *result;
+        future_wait(future, &result);
+        latencies[i] = bench_now_ns() - begin;
+        total += latencies[i];
+        future_release(future);
+        if ((uintptr_t) result != i + 1) {
+            fprintf(stderr, "FATAL: wrong result %zu for task %zu\n", (size_t) (uintptr_t) result, i);
+            exit(1);
+        }
+    }
+    qsort(latencies, tasks, sizeof(uint64_t), compare_u64);
+    printf("latency:    mean %8.0f ns  p50 %8llu ns  p99 %8llu ns\n", (double) total / (double) tasks,
+           (unsigned long long) latencies[tasks / 2], (unsigned long long) latencies[tasks * 99 / 100]);
+    free(latencies);
+}
+
+static void measure_batches(async_pool_t *pool, size_t tasks)
+{
+    future_t *batch[CAPACITY];
+    uint64_t begin = bench_now_ns();
+
+    for (size_t done = 0; done < tasks;) {
+        size_t n = tasks - done < CAPACITY ? tasks - done : CAPACITY;
+        for (size_t i = 0; i < n; i++)
+            batch[i] = submit(pool, increment, (void *) (uintptr_t) i);
+        for (size_t i = 0; i < n; i++) {
+            future_wait(batch[i], NULL);
+            future_release(batch[i]);
+        }
+        done += n;
+    }
+    double seconds = (double) (bench_now_ns() - begin) / 1e9;
+    printf("wait batch: %10.0f tasks/s\n", (double) tasks / seconds);
+}
+
+static void measure_callbacks(async_pool_t *pool, size_t tasks)
+{
+    _Atomic size_t completed = 0;
+    uint64_t begin = bench_now_ns();
+
+    for (size_t i = 0; i < tasks; i++)
+        future_then(submit(pool, increment, (void *) (uintptr_t) i), count_done, &completed);
+    while (atomic_load_explicit(&completed, memory_order_relaxed) < tasks)
+        sched_yield();
+    double seconds = (double) (bench_now_ns() - begin) / 1e9;
+    printf("callbacks:  %10.0f tasks/s\n", (double) tasks / seconds);
+}
+
+static void show_cancellation(async_pool_t *pool, int threads)
+{
+    future_t *busy[64];
+    int n = threads < 64 ? threads : 64;
+
+    // Keep every worker busy so the next future stays pending long enough to be cancelled.
+    for (int i = 0; i < n; i++)
+        busy[i] = submit(pool, nap, (void *) (uintptr_t) 20000);
+    future_t *victim = submit(pool, increment, NULL);
+    int cancelled = future_cancel(victim) == 0;
+    future_status_t status = future_wait(victim, NULL);
+    printf("cancel:     %s, status %s\n", cancelled ? "accepted" : "too late",
+           status == FUTURE_CANCELLED ? "CANCELLED" : "DONE");
+    future_release(victim);
+    for (int i = 0; i < n; i++) {
+        future_wait(busy[i], NULL);
+        future_release(busy[i]);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    size_t tasks = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+    long threads = argc > 2 ? atol(argv[2]) : sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (tasks == 0 || threads <= 0) {
+        fprintf(stderr, "Usage: %s [number-of-tasks] [number-of-threads]\n", argv[0]);
+        exit(1);
+    }
+    async_pool_t *pool = async_pool_create((int) threads, CAPACITY);
+    if (!pool)
+        exit_sys("%s - async_pool_create", argv[0]);
+
+    printf("%zu tiny tasks on %ld threads\n", tasks, threads);
+    measure_latency(pool, tasks);
+    measure_batches(pool, tasks);
+    measure_callbacks(pool, tasks);
+    show_cancellation(pool, (int) threads);
+
+    async_pool_destroy(pool);
+    return 0;
+}
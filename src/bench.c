@@ -0,0 +1,89 @@
+/** \file bench.c
+ *
+ * @brief Small timing and hardware counter helpers shared by the benchmark programs.
+ *
+ * Hardware counters are read through `perf_event_open`. They are not available everywhere (virtual machines without a
+ * PMU, `perf_event_paranoid` set to 3, containers with seccomp filters), so every function accepts the -1 descriptor
+ * returned on failure and the caller only has to print "n/a".
+ */
+
+#include <linux/perf_event.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bench.h"
+
+/**
+ * CLOCK_MONOTONIC is served from the vDSO, so reading it costs a few nanoseconds and no syscall.
+ * @return nanoseconds since an arbitrary point
+ */
+uint64_t bench_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+/**
+ * Opens a disabled user-space-only counter for the calling thread.
+ * @param event
+ * @return counter descriptor or -1 if the event cannot be counted here
+ */
+int bench_counter_open(bench_event_t event)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    switch (event) {
+        case BENCH_BRANCH_MISSES:
+            attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+            break;
+        case BENCH_CACHE_MISSES:
+            attr.config = PERF_COUNT_HW_CACHE_MISSES;
+            break;
+        case BENCH_INSTRUCTIONS:
+            attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+            break;
+    }
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    return (int) syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+void bench_counter_start(int fd)
+{
+    if (fd == -1)
+        return;
+    ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+    ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+}
+
+/**
+ * @param fd
+ * @return events counted since bench_counter_start, 0 for an invalid descriptor
+ */
+uint64_t bench_counter_stop(int fd)
+{
+    uint64_t value = 0;
+
+    if (fd == -1)
+        return 0;
+    ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    if (read(fd, &value, sizeof(value)) != (ssize_t) sizeof(value))
+        return 0;
+    return value;
+}
+
+void bench_counter_close(int fd)
+{
+    if (fd != -1)
+        close(fd);
+}
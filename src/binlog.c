@@ -0,0 +1,958 @@
+/** \file binlog.c
+ *
+ * @brief Asynchronous logger: the calling thread copies raw arguments into its own ring, a background thread formats
+ *
+ * fprintf(stderr, ...) formats on the calling thread, takes the lock of the stream, and, stderr being unbuffered,
+ * makes a write system call per call: microseconds on the path that logs, and more when threads queue on the lock
+ * or the terminal is slow. That is what LOG_ERROR of preprocessors.c and exit_sys of helpers.c used to do.
+ *
+ * BINLOG(format, ...) does the least that can be done on the calling thread instead:
+ *
+ * - Every expansion has a static binlog_site_t. On its first call the format is parsed once into the types of its
+ *   arguments and the site gets an id; afterwards the id is one load.
+ * - The record, a timestamp, the site id and the arguments as raw 8-byte values (strings copied, up to
+ *   BINLOG_MAX_STRING bytes), goes into a ring of the calling thread. The thread is its only producer and the
+ *   background thread its only consumer, so publishing a record is a release store of the head: no lock, no atomic
+ *   read-modify-write, no system call. When the ring is full the caller waits for room; nothing is dropped.
+ * - While it writes a record the thread raises a flag in its ring. binlog_stop first stops accepting records, then
+ *   waits for the flags to drop before the last drain, so no record is published after it. The flag is set with a
+ *   sequentially consistent store, the one fence of the path.
+ * - The background thread drains the rings, formats the records with snprintf, a conversion at a time, into a 64 KiB
+ *   buffer, and writes the buffer when it is full or when the rings are empty. In binary mode it does not even
+ *   format: it copies the records, preceded by the format of each site on its first use, and binlog_decode.c turns
+ *   the file into text later.
+ *
+ * The entries of one thread stay in order; across threads they are ordered by drain batch, and the timestamps of
+ * the binary log give the exact order.
+ *
+ * Formats with conversions that need the caller's state (%n, %m, wide strings) are formatted on the calling thread,
+ * into the text log, or to stderr next to a binary one. Before binlog_start and after binlog_stop BINLOG is
+ * fprintf(stderr, ...).
+ *
+ * Pending entries are flushed on the fatal paths: binlog_stop runs at exit, and exit_sys, which now hands its message
+ * to the logger, stops the logger before the process exits. A crash by a signal still loses the rings.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "binlog.h"
+#include "helpers.h"
+
+#define MAX_SITES 4096
+#define OUTPUT_BUFFER (64 * 1024)
+#define MIN_RING (64 * 1024)
+
+enum {
+    ARG_INT = 1,
+    ARG_LONG,
+    ARG_LLONG,
+    ARG_INTMAX,
+    ARG_SIZE,
+    ARG_PTRDIFF,
+    ARG_DOUBLE,
+    ARG_LDOUBLE,
+    ARG_POINTER,
+    ARG_STRING
+};
+
+typedef struct {
+    char flags[8];
+    int width;
+    int precision;
+    /** One of the ARG_ types, what va_arg must read. */
+    int type;
+    int star_width;
+    int star_precision;
+    char length[3];
+    char conversion;
+} spec_t;
+
+typedef struct ring_t {
+    /** Written by the producer. */
+    _Alignas(64) _Atomic uint64_t head;
+    uint64_t cached_tail;
+    _Atomic uint64_t stalls;
+    /** Written by the consumer. */
+    _Alignas(64) _Atomic uint64_t tail;
+    _Alignas(64) unsigned char *data;
+    size_t mask;
+    uint16_t thread;
+    /** Set by the producer while it writes a record, for binlog_stop. */
+    _Atomic int writing;
+    _Atomic int closed;
+    struct ring_t *next;
+} ring_t;
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t flushed;
+    pthread_t thread;
+    binlog_options_t options;
+    _Atomic int running;
+    /** Cleared by binlog_stop before running: records started after that are written directly. */
+    _Atomic int accepting;
+    int stopping;
+    uint64_t flush_requested;
+    uint64_t flush_completed;
+
+    /** Site ids are indexes + 1; 0 marks the padding at the end of a ring. */
+    pthread_mutex_t sites_lock;
+    binlog_site_t *sites[MAX_SITES];
+    int site_count;
+    /** Sites of binlog_vprintf, by format pointer. */
+    struct dynamic_site_t *dynamic;
+    unsigned char defined[MAX_SITES];
+
+    pthread_mutex_t rings_lock;
+    ring_t *rings;
+    uint16_t next_thread;
+
+    unsigned char *output;
+    size_t output_used;
+
+    _Atomic uint64_t records;
+    _Atomic uint64_t bytes_written;
+    _Atomic uint64_t writes;
+    _Atomic uint64_t dropped;
+    _Atomic uint64_t retired_stalls;
+    _Atomic uint64_t threads;
+} logger = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .wake = PTHREAD_COND_INITIALIZER,
+    .flushed = PTHREAD_COND_INITIALIZER,
+    .sites_lock = PTHREAD_MUTEX_INITIALIZER,
+    .rings_lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+struct dynamic_site_t {
+    binlog_site_t site;
+    struct dynamic_site_t *next;
+};
+
+static _Thread_local ring_t *thread_ring;
+static pthread_key_t ring_key;
+static pthread_once_t ring_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Parses a conversion after its '%'.
+ * @return the character after it, or NULL if the logger cannot take it
+ */
+static const char *parse_spec(const char *p, spec_t *spec)
+{
+    size_t flags = 0;
+
+    memset(spec, 0, sizeof(*spec));
+    spec->width = spec->precision = -1;
+    while (*p && strchr("-+ #0'", *p) && flags < sizeof(spec->flags) - 1)
+        spec->flags[flags++] = *p++;
+    if (*p == '*') {
+        spec->star_width = 1;
+        p++;
+    } else if (*p >= '0' && *p <= '9') {
+        for (spec->width = 0; *p >= '0' && *p <= '9'; p++)
+            spec->width = spec->width * 10 + (*p - '0');
+    }
+    if (*p == '.') {
+        p++;
+        if (*p == '*') {
+            spec->star_precision = 1;
+            p++;
+        } else {
+            for (spec->precision = 0; *p >= '0' && *p <= '9'; p++)
+                spec->precision = spec->precision * 10 + (*p - '0');
+        }
+    }
+    for (size_t n = 0; *p && strchr("hljztL", *p) && n < sizeof(spec->length) - 1; n++)
+        spec->length[n] = *p++;
+    spec->conversion = *p;
+
+    const char *length = spec->length;
+    switch (spec->conversion) {
+    case 'd':
+    case 'i':
+    case 'u':
+    case 'o':
+    case 'x':
+    case 'X':
+        spec->type = strcmp(length, "l") == 0    ? ARG_LONG
+                     : strcmp(length, "ll") == 0 ? ARG_LLONG
+                     : strcmp(length, "j") == 0  ? ARG_INTMAX
+                     : strcmp(length, "z") == 0  ? ARG_SIZE
+                     : strcmp(length, "t") == 0  ? ARG_PTRDIFF
+                     : strcmp(length, "L") == 0  ? 0
+                                                 : ARG_INT;
+        break;
+    case 'c':
+        spec->type = length[0] ? 0 : ARG_INT;
+        break;
+    case 's':
+        spec->type = length[0] ? 0 : ARG_STRING;
+        break;
+    case 'p':
+        spec->type = ARG_POINTER;
+        break;
+    case 'f':
+    case 'F':
+    case 'e':
+    case 'E':
+    case 'g':
+    case 'G':
+    case 'a':
+    case 'A':
+        spec->type = strcmp(length, "L") == 0 ? ARG_LDOUBLE : !length[0] || strcmp(length, "l") == 0 ? ARG_DOUBLE : 0;
+        break;
+    case '%':
+        return p + 1;
+    default:
+        return NULL;
+    }
+    return spec->type ? p + 1 : NULL;
+}
+
+/**
+ * Lists the argument types of a format, ARG_INT for the '*' of widths and precisions.
+ * @return number of arguments, or -1 if the format has a conversion the logger cannot take
+ */
+int binlog_parse(const char *format, uint8_t *types)
+{
+    int count = 0;
+    spec_t spec;
+
+    for (const char *p = format; (p = strchr(p, '%')) != NULL;) {
+        if (!(p = parse_spec(p + 1, &spec)))
+            return -1;
+        if (spec.conversion == '%')
+            continue;
+        if (count + spec.star_width + spec.star_precision + 1 > BINLOG_MAX_ARGS)
+            return -1;
+        if (spec.star_width)
+            types[count++] = ARG_INT;
+        if (spec.star_precision)
+            types[count++] = ARG_INT;
+        types[count++] = (uint8_t) spec.type;
+    }
+    return count;
+}
+
+static int read_slot(const unsigned char *args, size_t length, size_t *offset, void *value, size_t size)
+{
+    if (*offset + size > length)
+        return -1;
+    memcpy(value, args + *offset, size);
+    *offset += size;
+    return 0;
+}
+
+/** Writes the conversion back as text, with the widths and precisions of '*' as digits. */
+static void spec_text(const spec_t *spec, char *text, size_t size)
+{
+    int n = snprintf(text, size, "%%%s", spec->flags);
+
+    if (spec->width >= 0)
+        n += snprintf(text + n, size - (size_t) n, "%d", spec->width);
+    if (spec->precision >= 0)
+        n += snprintf(text + n, size - (size_t) n, ".%d", spec->precision);
+    snprintf(text + n, size - (size_t) n, "%s%c", spec->length, spec->conversion);
+}
+
+static int format_value(char *out, size_t size, const spec_t *spec, const unsigned char *args, size_t length,
+                        size_t *offset)
+{
+    uint64_t value;
+    long double ldouble;
+    double dvalue;
+    char text[64];
+    int is_signed = spec->conversion == 'd' || spec->conversion == 'i';
+
+    if (spec->type == ARG_STRING) {
+        uint32_t string_length;
+        spec_t bounded = *spec;
+        if (read_slot(args, length, offset, &string_length, sizeof(string_length)) == -1)
+            return -1;
+        if (string_length == UINT32_MAX) {
+            spec_text(spec, text, sizeof(text));
+            return snprintf(out, size, text, "(null)");
+        }
+        if (*offset + string_length > length)
+            return -1;
+        const char *string = (const char *) args + *offset;
+        *offset += (string_length + sizeof(uint32_t) + 7) / 8 * 8 - sizeof(uint32_t);
+        // The string in the record is not terminated; the precision keeps snprintf inside it.
+        if (bounded.precision < 0 || (uint32_t) bounded.precision > string_length)
+            bounded.precision = (int) string_length;
+        spec_text(&bounded, text, sizeof(text));
+        return snprintf(out, size, text, string);
+    }
+    spec_text(spec, text, sizeof(text));
+    if (spec->type == ARG_LDOUBLE) {
+        if (read_slot(args, length, offset, &ldouble, sizeof(ldouble)) == -1)
+            return -1;
+        *offset += 16 - sizeof(ldouble);
+        return snprintf(out, size, text, ldouble);
+    }
+    if (spec->type == ARG_DOUBLE) {
+        if (read_slot(args, length, offset, &dvalue, sizeof(dvalue)) == -1)
+            return -1;
+        return snprintf(out, size, text, dvalue);
+    }
+    if (read_slot(args, length, offset, &value, sizeof(value)) == -1)
+        return -1;
+    switch (spec->type) {
+    case ARG_POINTER:
+        return snprintf(out, size, text, (void *) (uintptr_t) value);
+    case ARG_LONG:
+        return is_signed ? snprintf(out, size, text, (long) value) : snprintf(out, size, text, (unsigned long) value);
+    case ARG_LLONG:
+        return is_signed ? snprintf(out, size, text, (long long) value)
+                         : snprintf(out, size, text, (unsigned long long) value);
+    case ARG_INTMAX:
+        return is_signed ? snprintf(out, size, text, (intmax_t) value) : snprintf(out, size, text, (uintmax_t) value);
+    case ARG_SIZE:
+        return is_signed ? snprintf(out, size, text, (ssize_t) value) : snprintf(out, size, text, (size_t) value);
+    case ARG_PTRDIFF:
+        return snprintf(out, size, text, (ptrdiff_t) value);
+    default:
+        return is_signed || spec->conversion == 'c' ? snprintf(out, size, text, (int) value)
+                                                    : snprintf(out, size, text, (unsigned) value);
+    }
+}
+
+/**
+ * Formats the arguments of a record as snprintf would. Stops at arguments missing from a damaged record.
+ * @return length of the whole text; like snprintf, at most size - 1 bytes and a NUL are written
+ */
+size_t binlog_format(const char *format, const unsigned char *args, size_t length, char *out, size_t size)
+{
+    size_t used = 0, offset = 0;
+    spec_t spec;
+
+    for (const char *p = format; *p;) {
+        const char *percent = strchr(p, '%');
+        size_t literal = percent ? (size_t) (percent - p) : strlen(p);
+        if (used < size)
+            memcpy(out + used, p, used + literal < size ? literal : size - used);
+        used += literal;
+        if (!percent)
+            break;
+        const char *next = parse_spec(percent + 1, &spec);
+        if (!next)
+            break;
+        p = next;
+        if (spec.conversion == '%') {
+            if (used < size)
+                out[used] = '%';
+            used++;
+            continue;
+        }
+
+        // Widths and precisions of '*' become digits, so that each conversion is one snprintf with one value.
+        int32_t star;
+        uint64_t slot;
+        if (spec.star_width) {
+            if (read_slot(args, length, &offset, &slot, sizeof(slot)) == -1)
+                break;
+            star = (int32_t) slot;
+            if (star < 0 && strlen(spec.flags) < sizeof(spec.flags) - 1)
+                strcat(spec.flags, "-");
+            spec.width = star < 0 ? -star : star;
+        }
+        if (spec.star_precision) {
+            if (read_slot(args, length, &offset, &slot, sizeof(slot)) == -1)
+                break;
+            star = (int32_t) slot;
+            spec.precision = star < 0 ? -1 : star;
+        }
+        int n = format_value(out + (used < size ? used : size), used < size ? size - used : 0, &spec, args, length,
+                             &offset);
+        if (n < 0)
+            break;
+        used += (size_t) n;
+    }
+    if (size)
+        out[used < size ? used : size - 1] = '\0';
+    return used;
+}
+
+/**
+ * Gives a site its id and argument types.
+ * @return the id, or -1 if the format cannot be logged asynchronously
+ */
+static int site_register(binlog_site_t *site)
+{
+    pthread_mutex_lock(&logger.sites_lock);
+    int id = atomic_load_explicit(&site->id, memory_order_relaxed);
+    if (id == 0) {
+        int count = binlog_parse(site->format, site->types);
+        if (count < 0 || logger.site_count == MAX_SITES) {
+            id = -1;
+        } else {
+            site->arg_count = (uint8_t) count;
+            site->strings = 0;
+            for (int i = 0; i < count; i++)
+                site->strings = (uint8_t) (site->strings + (site->types[i] == ARG_STRING));
+            logger.sites[logger.site_count++] = site;
+            id = logger.site_count;
+        }
+        atomic_store_explicit(&site->id, id, memory_order_release);
+    }
+    pthread_mutex_unlock(&logger.sites_lock);
+    return id;
+}
+
+static void ring_exit(void *arg)
+{
+    ring_t *ring = (ring_t *) arg;
+
+    // The background thread frees the ring once it has drained it.
+    atomic_store_explicit(&ring->closed, 1, memory_order_release);
+    thread_ring = NULL;
+}
+
+static void create_key(void)
+{
+    pthread_key_create(&ring_key, ring_exit);
+}
+
+static ring_t *ring_attach(void)
+{
+    size_t size = logger.options.ring_size;
+    ring_t *ring;
+
+    if (posix_memalign((void **) &ring, 64, sizeof(ring_t)) != 0)
+        return NULL;
+    memset(ring, 0, sizeof(*ring));
+    if (!(ring->data = (unsigned char *) aligned_alloc(64, size))) {
+        free(ring);
+        return NULL;
+    }
+    ring->mask = size - 1;
+    pthread_once(&ring_once, create_key);
+    pthread_setspecific(ring_key, ring);
+
+    pthread_mutex_lock(&logger.rings_lock);
+    // 16 bits in a record: after 65534 threads the numbers are handed out again.
+    if (++logger.next_thread == BINLOG_DEFINITION)
+        logger.next_thread = 1;
+    ring->thread = logger.next_thread;
+    ring->next = logger.rings;
+    logger.rings = ring;
+    pthread_mutex_unlock(&logger.rings_lock);
+    atomic_fetch_add_explicit(&logger.threads, 1, memory_order_relaxed);
+    return thread_ring = ring;
+}
+
+/**
+ * Reserves size contiguous bytes, after a padding record if they would wrap. Waits while the ring is full; the
+ * background thread keeps draining until every writer has finished, so room comes.
+ * @return the position of the record
+ */
+static unsigned char *ring_reserve(ring_t *ring, size_t size, uint64_t *end)
+{
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t offset = head & ring->mask, capacity = ring->mask + 1;
+    size_t padding = offset + size > capacity ? capacity - offset : 0;
+    int stalled = 0;
+
+    while (head + padding + size - ring->cached_tail > capacity) {
+        ring->cached_tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        if (head + padding + size - ring->cached_tail <= capacity)
+            break;
+        stalled = 1;
+        sched_yield();
+    }
+    if (stalled)
+        atomic_store_explicit(&ring->stalls, atomic_load_explicit(&ring->stalls, memory_order_relaxed) + 1,
+                              memory_order_relaxed);
+    if (padding) {
+        binlog_record_t *pad = (binlog_record_t *) (ring->data + offset);
+        pad->size = (uint32_t) padding;
+        pad->site = 0;
+        head += padding;
+    }
+    *end = head + size;
+    return ring->data + (head & ring->mask);
+}
+
+/** Takes an argument off the list. @return its size in a record */
+static size_t arg_size(int type, va_list *ap)
+{
+    switch (type) {
+    case ARG_STRING: {
+        const char *string = va_arg(*ap, const char *);
+        return (sizeof(uint32_t) + (string ? strnlen(string, BINLOG_MAX_STRING) : 0) + 7) / 8 * 8;
+    }
+    case ARG_LDOUBLE:
+        (void) va_arg(*ap, long double);
+        return 16;
+    case ARG_DOUBLE:
+        (void) va_arg(*ap, double);
+        return 8;
+    case ARG_LONG:
+        (void) va_arg(*ap, long);
+        return 8;
+    case ARG_LLONG:
+        (void) va_arg(*ap, long long);
+        return 8;
+    case ARG_INTMAX:
+        (void) va_arg(*ap, intmax_t);
+        return 8;
+    case ARG_SIZE:
+        (void) va_arg(*ap, size_t);
+        return 8;
+    case ARG_PTRDIFF:
+        (void) va_arg(*ap, ptrdiff_t);
+        return 8;
+    case ARG_POINTER:
+        (void) va_arg(*ap, void *);
+        return 8;
+    default:
+        (void) va_arg(*ap, int);
+        return 8;
+    }
+}
+
+static void write_sync(const binlog_site_t *site, va_list ap)
+{
+    // A binary log has no place for text.
+    if (atomic_load_explicit(&logger.running, memory_order_relaxed) && logger.options.mode == BINLOG_TEXT)
+        vdprintf(logger.options.fd, site->format, ap);
+    else
+        vfprintf(stderr, site->format, ap);
+}
+
+static void site_write(binlog_site_t *site, va_list ap)
+{
+    int id = atomic_load_explicit(&site->id, memory_order_acquire);
+    ring_t *ring = thread_ring;
+
+    if (__builtin_expect(id == 0, 0))
+        id = site_register(site);
+    if (id < 0 || !atomic_load_explicit(&logger.accepting, memory_order_relaxed) ||
+        (!ring && !(ring = ring_attach()))) {
+        write_sync(site, ap);
+        return;
+    }
+    // Either binlog_stop sees the flag and waits for the record, or this thread sees that it stopped accepting.
+    atomic_store_explicit(&ring->writing, 1, memory_order_seq_cst);
+    if (!atomic_load_explicit(&logger.accepting, memory_order_seq_cst)) {
+        atomic_store_explicit(&ring->writing, 0, memory_order_relaxed);
+        write_sync(site, ap);
+        return;
+    }
+
+    // Strings have to be measured first; without them the size is known from the site.
+    size_t size = sizeof(binlog_record_t);
+    if (site->strings) {
+        va_list measure;
+        va_copy(measure, ap);
+        for (int i = 0; i < site->arg_count; i++) {
+            size += arg_size(site->types[i], &measure);
+        }
+        va_end(measure);
+    } else {
+        for (int i = 0; i < site->arg_count; i++)
+            size += site->types[i] == ARG_LDOUBLE ? 16 : 8;
+    }
+
+    uint64_t end;
+    unsigned char *record = ring_reserve(ring, size, &end);
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    binlog_record_t *header = (binlog_record_t *) record;
+    header->size = (uint32_t) size;
+    header->site = (uint16_t) id;
+    header->thread = ring->thread;
+    header->time_ns = (uint64_t) now.tv_sec * 1000000000u + (uint64_t) now.tv_nsec;
+
+    unsigned char *p = record + sizeof(binlog_record_t);
+    for (int i = 0; i < site->arg_count; i++) {
+        uint64_t value;
+        switch (site->types[i]) {
+        case ARG_STRING: {
+            const char *string = va_arg(ap, const char *);
+            uint32_t length = string ? (uint32_t) strnlen(string, BINLOG_MAX_STRING) : UINT32_MAX;
+            memcpy(p, &length, sizeof(length));
+            if (string)
+                memcpy(p + sizeof(length), string, length);
+            p += (sizeof(length) + (string ? length : 0) + 7) / 8 * 8;
+            continue;
+        }
+        case ARG_LDOUBLE: {
+            long double ldouble = va_arg(ap, long double);
+            memcpy(p, &ldouble, sizeof(ldouble));
+            p += 16;
+            continue;
+        }
+        case ARG_DOUBLE: {
+            double dvalue = va_arg(ap, double);
+            memcpy(p, &dvalue, sizeof(dvalue));
+            p += 8;
+            continue;
+        }
+        case ARG_LONG:
+            value = (uint64_t) va_arg(ap, long);
+            break;
+        case ARG_LLONG:
+            value = (uint64_t) va_arg(ap, long long);
+            break;
+        case ARG_INTMAX:
+            value = (uint64_t) va_arg(ap, intmax_t);
+            break;
+        case ARG_SIZE:
+            value = (uint64_t) va_arg(ap, size_t);
+            break;
+        case ARG_PTRDIFF:
+            value = (uint64_t) va_arg(ap, ptrdiff_t);
+            break;
+        case ARG_POINTER:
+            value = (uint64_t) (uintptr_t) va_arg(ap, void *);
+            break;
+        default:
+            value = (uint64_t) (int64_t) va_arg(ap, int);
+            break;
+        }
+        memcpy(p, &value, sizeof(value));
+        p += 8;
+    }
+    atomic_store_explicit(&ring->head, end, memory_order_release);
+    atomic_store_explicit(&ring->writing, 0, memory_order_release);
+}
+
+void binlog_write(binlog_site_t *site, ...)
+{
+    va_list ap;
+
+    va_start(ap, site);
+    site_write(site, ap);
+    va_end(ap);
+}
+
+/**
+ * Logs with a format that is not a literal at the call site, such as the one exit_sys gets. The site is looked up
+ * by the address of the format under a lock: for rare paths only.
+ */
+void binlog_vprintf(const char *format, va_list ap)
+{
+    struct dynamic_site_t *dynamic;
+
+    pthread_mutex_lock(&logger.sites_lock);
+    for (dynamic = logger.dynamic; dynamic && dynamic->site.format != format; dynamic = dynamic->next)
+        ;
+    if (!dynamic && (dynamic = (struct dynamic_site_t *) calloc(1, sizeof(*dynamic))) != NULL) {
+        dynamic->site.format = format;
+        dynamic->site.file = "";
+        dynamic->next = logger.dynamic;
+        logger.dynamic = dynamic;
+    }
+    pthread_mutex_unlock(&logger.sites_lock);
+    if (!dynamic) {
+        vfprintf(stderr, format, ap);
+        return;
+    }
+    site_write(&dynamic->site, ap);
+}
+
+static void output_flush(void)
+{
+    size_t done = 0;
+
+    while (done < logger.output_used) {
+        ssize_t n = write(logger.options.fd, logger.output + done, logger.output_used - done);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            atomic_fetch_add_explicit(&logger.dropped, 1, memory_order_relaxed);
+            break;
+        }
+        done += (size_t) n;
+        atomic_fetch_add_explicit(&logger.bytes_written, (uint64_t) n, memory_order_relaxed);
+        atomic_fetch_add_explicit(&logger.writes, 1, memory_order_relaxed);
+    }
+    logger.output_used = 0;
+}
+
+static void output_append(const void *data, size_t size)
+{
+    if (logger.output_used + size > OUTPUT_BUFFER)
+        output_flush();
+    memcpy(logger.output + logger.output_used, data, size);
+    logger.output_used += size;
+}
+
+static void output_definition(int id)
+{
+    const binlog_site_t *site = logger.sites[id - 1];
+    binlog_definition_t definition = {(uint32_t) site->line, (uint32_t) strlen(site->format),
+                                      (uint32_t) strlen(site->file), 0};
+    size_t size = sizeof(binlog_record_t) + sizeof(definition) + definition.format_length + definition.file_length;
+    binlog_record_t header = {(uint32_t) ((size + 7) / 8 * 8), (uint16_t) id, BINLOG_DEFINITION, 0};
+    static const char padding[8];
+
+    output_append(&header, sizeof(header));
+    output_append(&definition, sizeof(definition));
+    output_append(site->format, definition.format_length);
+    output_append(site->file, definition.file_length);
+    output_append(padding, header.size - size);
+    logger.defined[id - 1] = 1;
+}
+
+static void output_record(const binlog_record_t *record)
+{
+    const binlog_site_t *site = logger.sites[record->site - 1];
+
+    if (logger.options.mode == BINLOG_BINARY) {
+        if (!logger.defined[record->site - 1])
+            output_definition(record->site);
+        output_append(record, record->size);
+        return;
+    }
+    const unsigned char *args = (const unsigned char *) (record + 1);
+    size_t length = record->size - sizeof(binlog_record_t);
+    size_t room = OUTPUT_BUFFER - logger.output_used;
+    size_t n = binlog_format(site->format, args, length, (char *) logger.output + logger.output_used, room);
+    if (n >= room) {
+        output_flush();
+        n = binlog_format(site->format, args, length, (char *) logger.output, OUTPUT_BUFFER);
+        if (n >= OUTPUT_BUFFER)
+            n = OUTPUT_BUFFER - 1;
+    }
+    logger.output_used += n;
+}
+
+/**
+ * Drains one ring into the output buffer.
+ * @return number of records
+ */
+static size_t ring_drain(ring_t *ring)
+{
+    uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    size_t records = 0;
+
+    while (tail != head) {
+        const binlog_record_t *record = (const binlog_record_t *) (ring->data + (tail & ring->mask));
+        if (record->site) {
+            output_record(record);
+            records++;
+        }
+        tail += record->size;
+    }
+    atomic_store_explicit(&ring->tail, tail, memory_order_release);
+    return records;
+}
+
+static size_t drain_all(void)
+{
+    size_t records = 0;
+
+    pthread_mutex_lock(&logger.rings_lock);
+    for (ring_t **link = &logger.rings; *link;) {
+        ring_t *ring = *link;
+        int closed = atomic_load_explicit(&ring->closed, memory_order_acquire);
+        records += ring_drain(ring);
+        if (!closed) {
+            link = &ring->next;
+            continue;
+        }
+        // Its thread is gone, and everything it wrote was before the flag.
+        *link = ring->next;
+        atomic_fetch_add_explicit(&logger.retired_stalls, atomic_load_explicit(&ring->stalls, memory_order_relaxed),
+                                  memory_order_relaxed);
+        free(ring->data);
+        free(ring);
+    }
+    pthread_mutex_unlock(&logger.rings_lock);
+    atomic_fetch_add_explicit(&logger.records, records, memory_order_relaxed);
+    return records;
+}
+
+static void *background(void *arg)
+{
+    (void) arg;
+    for (;;) {
+        pthread_mutex_lock(&logger.lock);
+        uint64_t requested = logger.flush_requested;
+        int stopping = logger.stopping;
+        pthread_mutex_unlock(&logger.lock);
+
+        if (drain_all())
+            continue;
+        output_flush();
+
+        pthread_mutex_lock(&logger.lock);
+        if (logger.flush_completed != requested) {
+            logger.flush_completed = requested;
+            pthread_cond_broadcast(&logger.flushed);
+        }
+        if (stopping) {
+            pthread_mutex_unlock(&logger.lock);
+            break;
+        }
+        if (!logger.stopping && logger.flush_requested == requested) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += (long) logger.options.flush_interval_ms * 1000000;
+            deadline.tv_sec += deadline.tv_nsec / 1000000000;
+            deadline.tv_nsec %= 1000000000;
+            pthread_cond_timedwait(&logger.wake, &logger.lock, &deadline);
+        }
+        pthread_mutex_unlock(&logger.lock);
+    }
+    return NULL;
+}
+
+/**
+ * Hands the message of exit_sys to the logger and stops it, which writes what is pending. In binary mode the message
+ * also goes to stderr, where it is expected.
+ */
+static void exit_sys_log(int error, const char *format, va_list ap)
+{
+    int binary = logger.options.mode == BINLOG_BINARY;
+    va_list copy;
+
+    va_copy(copy, ap);
+    binlog_vprintf(format, ap);
+    BINLOG(": %s\n", strerror(error));
+    binlog_stop();
+    if (binary) {
+        vfprintf(stderr, format, copy);
+        fprintf(stderr, ": %s\n", strerror(error));
+    }
+    va_end(copy);
+}
+
+static void register_exit(void)
+{
+    atexit(binlog_stop);
+}
+
+/**
+ * Starts the background thread. NULL options log text to stderr. Entries of threads that logged before stay where
+ * they were: BINLOG wrote them directly.
+ * @return 0, or -1 with errno set
+ */
+int binlog_start(const binlog_options_t *options)
+{
+    static pthread_once_t exit_once = PTHREAD_ONCE_INIT;
+    binlog_options_t defaults = {STDERR_FILENO, BINLOG_TEXT, 256 * 1024, 1};
+    int error;
+
+    if (!options)
+        options = &defaults;
+    if (options->ring_size < MIN_RING || (options->ring_size & (options->ring_size - 1)) ||
+        options->flush_interval_ms < 1) {
+        errno = EINVAL;
+        return -1;
+    }
+    pthread_mutex_lock(&logger.lock);
+    if (atomic_load_explicit(&logger.running, memory_order_relaxed)) {
+        pthread_mutex_unlock(&logger.lock);
+        errno = EBUSY;
+        return -1;
+    }
+    // Rings of an earlier start keep their size; only new threads get the new one.
+    logger.options = *options;
+    logger.stopping = 0;
+    logger.output_used = 0;
+    memset(logger.defined, 0, sizeof(logger.defined));
+    if (!logger.output && !(logger.output = (unsigned char *) malloc(OUTPUT_BUFFER))) {
+        pthread_mutex_unlock(&logger.lock);
+        return -1;
+    }
+    if (options->mode == BINLOG_BINARY)
+        output_append(BINLOG_MAGIC, strlen(BINLOG_MAGIC));
+    atomic_store_explicit(&logger.running, 1, memory_order_release);
+    atomic_store_explicit(&logger.accepting, 1, memory_order_release);
+    if ((error = pthread_create(&logger.thread, NULL, background, NULL)) != 0) {
+        atomic_store_explicit(&logger.accepting, 0, memory_order_relaxed);
+        atomic_store_explicit(&logger.running, 0, memory_order_relaxed);
+        pthread_mutex_unlock(&logger.lock);
+        errno = error;
+        return -1;
+    }
+    pthread_mutex_unlock(&logger.lock);
+    pthread_once(&exit_once, register_exit);
+    exit_sys_handler(exit_sys_log);
+    return 0;
+}
+
+/**
+ * Waits until what the calling thread logged before is written.
+ */
+void binlog_flush(void)
+{
+    pthread_mutex_lock(&logger.lock);
+    uint64_t request = ++logger.flush_requested;
+    pthread_cond_signal(&logger.wake);
+    while (atomic_load_explicit(&logger.running, memory_order_relaxed) && logger.flush_completed < request)
+        pthread_cond_wait(&logger.flushed, &logger.lock);
+    pthread_mutex_unlock(&logger.lock);
+}
+
+/**
+ * Writes what is pending and stops the background thread; BINLOG then writes to stderr directly. Runs at exit.
+ */
+void binlog_stop(void)
+{
+    pthread_mutex_lock(&logger.lock);
+    if (!atomic_load_explicit(&logger.running, memory_order_relaxed) ||
+        !atomic_load_explicit(&logger.accepting, memory_order_relaxed)) {
+        pthread_mutex_unlock(&logger.lock);
+        return;
+    }
+    exit_sys_handler(NULL);
+    atomic_store_explicit(&logger.accepting, 0, memory_order_seq_cst);
+    pthread_mutex_unlock(&logger.lock);
+
+    // The background thread drains on while the records in flight are finished, so a writer waiting for room gets it.
+    for (;;) {
+        int writing = 0;
+        pthread_mutex_lock(&logger.rings_lock);
+        for (const ring_t *ring = logger.rings; ring && !writing; ring = ring->next)
+            writing = atomic_load_explicit(&ring->writing, memory_order_seq_cst);
+        pthread_mutex_unlock(&logger.rings_lock);
+        if (!writing)
+            break;
+        sched_yield();
+    }
+    pthread_mutex_lock(&logger.lock);
+    logger.stopping = 1;
+    pthread_cond_signal(&logger.wake);
+    pthread_mutex_unlock(&logger.lock);
+    pthread_join(logger.thread, NULL);
+
+    // A last pass for what was published while the thread was finishing.
+    drain_all();
+    output_flush();
+    pthread_mutex_lock(&logger.lock);
+    atomic_store_explicit(&logger.running, 0, memory_order_release);
+    pthread_cond_broadcast(&logger.flushed);
+    pthread_mutex_unlock(&logger.lock);
+}
+
+void binlog_stats(binlog_stats_t *stats)
+{
+    uint64_t stalls = atomic_load_explicit(&logger.retired_stalls, memory_order_relaxed);
+
+    pthread_mutex_lock(&logger.rings_lock);
+    for (const ring_t *ring = logger.rings; ring; ring = ring->next)
+        stalls += atomic_load_explicit(&ring->stalls, memory_order_relaxed);
+    pthread_mutex_unlock(&logger.rings_lock);
+    stats->records = atomic_load_explicit(&logger.records, memory_order_relaxed);
+    stats->bytes_written = atomic_load_explicit(&logger.bytes_written, memory_order_relaxed);
+    stats->writes = atomic_load_explicit(&logger.writes, memory_order_relaxed);
+    stats->stalls = stalls;
+    stats->dropped = atomic_load_explicit(&logger.dropped, memory_order_relaxed);
+    stats->threads = atomic_load_explicit(&logger.threads, memory_order_relaxed);
+}
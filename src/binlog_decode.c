@@ -0,0 +1,184 @@
+/** \file binlog_decode.c
+ *
+ * @brief Turns a binary log of binlog.c into text
+ *
+ * In binary mode the logger writes the records as they are in the rings: a header with the time, the site and the
+ * thread, and the raw arguments. The first record of every site defines it, with its format and source position, so a
+ * log can be read without the program that wrote it. The arguments are formatted with binlog_format, the same code
+ * that formats them in text mode, so both modes give the same text.
+ *
+ * Every entry is printed with its time and thread; -r prints the messages only, exactly as text mode would have
+ * written them. The logger writes the entries of several threads in the order it drained them; -s sorts the entries
+ * by time first (stable, so the entries of a thread keep their order). Logs of several runs appended to one file are
+ * read run after run; site ids start again with every run.
+ *
+ * \code{.sh}
+ * ./binlog_decode [-r] [-s] file
+ * \endcode
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "binlog.h"
+#include "helpers.h"
+
+#define MESSAGE_MAX (64 * 1024)
+
+typedef struct {
+    char *format;
+    char *file;
+    uint32_t line;
+} site_t;
+
+typedef struct {
+    const binlog_record_t *record;
+    const site_t *site;
+} entry_t;
+
+/** Sites of the current run, by id. Never freed: sorted entries of earlier runs point to theirs. */
+static site_t *sites[65536];
+static int raw;
+
+static int by_time(const void *a, const void *b)
+{
+    const binlog_record_t *x = ((const entry_t *) a)->record, *y = ((const entry_t *) b)->record;
+
+    if (x->time_ns != y->time_ns)
+        return x->time_ns < y->time_ns ? -1 : 1;
+    // qsort is not stable; records are in file order in memory.
+    return x < y ? -1 : x > y;
+}
+
+static void define(const binlog_record_t *record)
+{
+    const binlog_definition_t *definition = (const binlog_definition_t *) (record + 1);
+    const char *text = (const char *) (definition + 1);
+
+    if (record->size < sizeof(*record) + sizeof(*definition) ||
+        sizeof(*record) + sizeof(*definition) + (uint64_t) definition->format_length + definition->file_length >
+            record->size) {
+        fprintf(stderr, "FATAL: damaged definition of site %u\n", record->site);
+        exit(1);
+    }
+    site_t *site = (site_t *) malloc(sizeof(site_t));
+    if (!site || !(site->format = strndup(text, definition->format_length)) ||
+        !(site->file = strndup(text + definition->format_length, definition->file_length)))
+        exit_sys("strndup");
+    site->line = definition->line;
+    sites[record->site] = site;
+}
+
+static void print(const binlog_record_t *record, const site_t *site)
+{
+    static char message[MESSAGE_MAX];
+
+    size_t length = binlog_format(site->format, (const unsigned char *) (record + 1), record->size - sizeof(*record),
+                                  message, sizeof(message));
+    if (length >= sizeof(message))
+        length = sizeof(message) - 1;
+    if (raw) {
+        fwrite(message, 1, length, stdout);
+        return;
+    }
+
+    time_t seconds = (time_t) (record->time_ns / 1000000000u);
+    struct tm tm;
+    char when[32];
+    localtime_r(&seconds, &tm);
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &tm);
+    printf("%s.%09lu [%u] %.*s%s", when, (unsigned long) (record->time_ns % 1000000000u), record->thread, (int) length,
+           message, length && message[length - 1] == '\n' ? "" : "\n");
+}
+
+int main(int argc, char **argv)
+{
+    int sort = 0;
+    int result;
+
+    while ((result = getopt(argc, argv, "rs")) != -1) {
+        switch (result) {
+        case 'r':
+            raw = 1;
+            break;
+        case 's':
+            sort = 1;
+            break;
+        default:
+            optind = argc;
+            break;
+        }
+    }
+    if (optind != argc - 1) {
+        fprintf(stderr, "Usage: %s [-r] [-s] file\n", argv[0]);
+        exit(1);
+    }
+    const char *path = argv[optind];
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1)
+        exit_sys("open %s", path);
+    size_t size = (size_t) st.st_size, magic = strlen(BINLOG_MAGIC);
+    if (size < magic) {
+        fprintf(stderr, "FATAL: %s is not a binary log\n", path);
+        exit(1);
+    }
+    const unsigned char *data = (const unsigned char *) mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED)
+        exit_sys("mmap %s", path);
+    close(fd);
+    if (memcmp(data, BINLOG_MAGIC, magic) != 0) {
+        fprintf(stderr, "FATAL: %s is not a binary log\n", path);
+        exit(1);
+    }
+
+    entry_t *entries = NULL;
+    size_t count = 0, capacity = 0, offset = 0;
+    while (offset + sizeof(binlog_record_t) <= size) {
+        if (memcmp(data + offset, BINLOG_MAGIC, magic) == 0) {
+            memset(sites, 0, sizeof(sites));
+            offset += magic;
+            continue;
+        }
+        const binlog_record_t *record = (const binlog_record_t *) (data + offset);
+        if (record->size < sizeof(*record) || record->size % 8 || record->size > size - offset) {
+            fprintf(stderr, "FATAL: damaged record at offset %zu\n", offset);
+            exit(1);
+        }
+        offset += record->size;
+        if (record->thread == BINLOG_DEFINITION) {
+            define(record);
+            continue;
+        }
+        if (!sites[record->site]) {
+            fprintf(stderr, "FATAL: entry of site %u before its definition\n", record->site);
+            exit(1);
+        }
+        if (!sort) {
+            print(record, sites[record->site]);
+            continue;
+        }
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 4096;
+            if (!(entries = (entry_t *) realloc(entries, capacity * sizeof(entry_t))))
+                exit_sys("realloc");
+        }
+        entries[count++] = (entry_t) {record, sites[record->site]};
+    }
+    if (offset != size)
+        fprintf(stderr, "WARNING: %zu bytes of a cut record at the end\n", size - offset);
+    if (sort) {
+        qsort(entries, count, sizeof(*entries), by_time);
+        for (size_t i = 0; i < count; i++)
+            print(entries[i].record, entries[i].site);
+    }
+    free(entries);
+    return 0;
+}
@@ -0,0 +1,136 @@
+/** \file buffer_growth.c
+ *
+ * @brief Doubling a buffer: realloc, malloc and copy, and the mremap buffer of growbuf.c
+ *
+ * A buffer starts at one page and doubles until it reaches the maximum size. After every step the new half is
+ * written, as a growing buffer would be. For every size the time of the grow call alone is reported:
+ *
+ * - `copy`: malloc a new block, memcpy, free the old one. This is what realloc does for blocks that cannot grow in
+ *   place, e.g. with libslab.so, or in the brk heap.
+ * - `realloc`: glibc serves blocks above its mmap threshold with mmap, and its realloc of such a block uses mremap.
+ *   Below the threshold it copies.
+ * - `growbuf`: mremap from the first page on.
+ *
+ * A copy costs time proportional to the bytes, mremap proportional to the pages, so the gap grows with the buffer. At
+ * the end the growbuf is cut to an eighth and its tail released with MADV_DONTNEED, which shows up in the RSS.
+ *
+ * \code{.sh}
+ * ./buffer_growth [log2-of-max-size]
+ * \endcode
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+#include "growbuf.h"
+#include "helpers.h"
+#include "proc_maps.h"
+
+#define MIN_LOG2 12
+#define MAX_LOG2 40
+
+typedef enum { GROW_COPY, GROW_REALLOC, GROW_GROWBUF } strategy_t;
+
+static const char *strategy_names[] = {"copy", "realloc", "growbuf"};
+
+/**
+ * Doubles a buffer from 2^MIN_LOG2 to 2^max_log2 bytes, filling each new half.
+ * @param grow_ns receives the time of each grow call, indexed by the log2 of the new size
+ */
+static void run(strategy_t strategy, int max_log2, uint64_t *grow_ns)
+{
+    size_t size = (size_t) 1 << MIN_LOG2;
+    growbuf_t buffer;
+    char *data;
+
+    if (strategy == GROW_GROWBUF) {
+        if (growbuf_init(&buffer, size) == -1 || growbuf_resize(&buffer, size) == -1)
+            exit_sys("growbuf_init");
+        data = buffer.data;
+    } else if (!(data = (char *) malloc(size))) {
+        exit_sys("malloc");
+    }
+    memset(data, 1, size);
+
+    for (int log2 = MIN_LOG2 + 1; log2 <= max_log2; log2++) {
+        size_t new_size = (size_t) 1 << log2;
+        uint64_t begin = bench_now_ns();
+        switch (strategy) {
+        case GROW_COPY: {
+            char *moved = (char *) malloc(new_size);
+            if (!moved)
+                exit_sys("malloc");
+            memcpy(moved, data, size);
+            free(data);
+            data = moved;
+            break;
+        }
+        case GROW_REALLOC:
+            if (!(data = (char *) realloc(data, new_size)))
+                exit_sys("realloc");
+            break;
+        case GROW_GROWBUF:
+            if (growbuf_resize(&buffer, new_size) == -1)
+                exit_sys("growbuf_resize");
+            data = buffer.data;
+            break;
+        }
+        grow_ns[log2] = bench_now_ns() - begin;
+        if (data[size - 1] != 1 || data[0] != 1) {
+            fprintf(stderr, "FATAL: %s lost the contents at %zu bytes\n", strategy_names[strategy], new_size);
+            exit(1);
+        }
+        memset(data + size, 1, new_size - size);
+        size = new_size;
+    }
+
+    if (strategy != GROW_GROWBUF) {
+        free(data);
+        return;
+    }
+    mem_rollup_t before, after;
+    mem_rollup_read(&before);
+    buffer.size = size / 8;
+    if (growbuf_release_tail(&buffer) == -1)
+        exit_sys("growbuf_release_tail");
+    mem_rollup_read(&after);
+    printf("growbuf cut to %zu MiB: RSS %lu -> %lu MiB, capacity still %zu MiB\n", buffer.size >> 20,
+           (unsigned long) before.rss_kb >> 10, (unsigned long) after.rss_kb >> 10, buffer.capacity >> 20);
+    growbuf_free(&buffer);
+}
+
+int main(int argc, char **argv)
+{
+    static uint64_t grow_ns[3][MAX_LOG2 + 1];
+    long max_log2 = argc > 1 ? strtol(argv[1], NULL, 10) : 30;
+
+    if (max_log2 <= MIN_LOG2 || max_log2 > MAX_LOG2) {
+        fprintf(stderr, "Usage: %s [log2-of-max-size (%d-%d)]\n", argv[0], MIN_LOG2 + 1, MAX_LOG2);
+        exit(1);
+    }
+    for (strategy_t strategy = GROW_COPY; strategy <= GROW_GROWBUF; strategy++)
+        run(strategy, (int) max_log2, grow_ns[strategy]);
+
+    printf("time of the grow call to the new size, microseconds\n");
+    printf("  %10s %12s %12s %12s\n", "size", strategy_names[0], strategy_names[1], strategy_names[2]);
+    uint64_t total[3] = {0, 0, 0};
+    for (int log2 = MIN_LOG2 + 1; log2 <= max_log2; log2++) {
+        char size[16];
+        if (log2 >= 30)
+            snprintf(size, sizeof(size), "%d GiB", 1 << (log2 - 30));
+        else if (log2 >= 20)
+            snprintf(size, sizeof(size), "%d MiB", 1 << (log2 - 20));
+        else
+            snprintf(size, sizeof(size), "%d KiB", 1 << (log2 - 10));
+        printf("  %10s %12.1f %12.1f %12.1f\n", size, (double) grow_ns[0][log2] / 1e3, (double) grow_ns[1][log2] / 1e3,
+               (double) grow_ns[2][log2] / 1e3);
+        for (int s = 0; s < 3; s++)
+            total[s] += grow_ns[s][log2];
+    }
+    printf("  %10s %12.1f %12.1f %12.1f\n", "total", (double) total[0] / 1e3, (double) total[1] / 1e3,
+           (double) total[2] / 1e3);
+    return 0;
+}
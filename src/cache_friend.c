@@ -1,6 +1,14 @@
 #include <stdio.h>  // For printf function
 #include <stdlib.h> // For heap memory functions
 #include <string.h> // For strcmp function
+#include <time.h>   // For clock_gettime function
+
+#include "parallel.h"
+
+typedef struct {
+  int* matrix;
+  int columns;
+} matrix_ctx_t;
 void fill(int* matrix, int rows, int columns) {
   int counter = 1;
   for (int i = 0; i < rows; i++) {
@@ -36,6 +44,70 @@ int friendly_sum(int* matrix, int rows, int columns) {
   }
   return sum;
 }
+void fill_rows(size_t begin, size_t end, void* ctx) {
+  matrix_ctx_t* m = (matrix_ctx_t*)ctx;
+  for (size_t i = begin; i < end; i++) {
+    for (int j = 0; j < m->columns; j++) {
+      *(m->matrix + i * (size_t)m->columns + (size_t)j) = (int)i + 1;
+    }
+  }
+}
+void parallel_fill(int* matrix, int rows, int columns) {
+  matrix_ctx_t ctx = {matrix, columns};
+  parallel_for(0, (size_t)rows, 0, fill_rows, &ctx);
+}
+void sum_rows(size_t begin, size_t end, void* partial, void* ctx) {
+  matrix_ctx_t* m = (matrix_ctx_t*)ctx;
+  // Unsigned, so an overflow wraps like the serial sum does.
+  unsigned int sum = *(unsigned int*)partial;
+  for (size_t i = begin; i < end; i++) {
+    for (int j = 0; j < m->columns; j++) {
+      sum += (unsigned int)*(m->matrix + i * (size_t)m->columns + (size_t)j);
+    }
+  }
+  *(unsigned int*)partial = sum;
+}
+void add_sums(void* into, const void* from, void* ctx) {
+  (void)ctx;
+  *(unsigned int*)into += *(const unsigned int*)from;
+}
+int parallel_friendly_sum(int* matrix, int rows, int columns) {
+  matrix_ctx_t ctx = {matrix, columns};
+  unsigned int sum = 0;
+  parallel_reduce(0, (size_t)rows, 0, &sum, sizeof(sum), sum_rows, add_sums, &ctx);
+  return (int)sum;
+}
+double now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec * 1e3 + (double)ts.tv_nsec / 1e6;
+}
+void speedup(int* matrix, int rows, int columns) {
+  double begin = now_ms();
+  fill(matrix, rows, columns);
+  double serial_fill = now_ms() - begin;
+  begin = now_ms();
+  int serial_sum = friendly_sum(matrix, rows, columns);
+  double serial_time = now_ms() - begin;
+  // The first loop pays for starting the workers.
+  parallel_init(0);
+  begin = now_ms();
+  parallel_fill(matrix, rows, columns);
+  double parallel_fill_time = now_ms() - begin;
+  begin = now_ms();
+  int parallel_sum = parallel_friendly_sum(matrix, rows, columns);
+  double parallel_time = now_ms() - begin;
+  printf("Workers: %d\n", parallel_workers());
+  printf("Fill:         serial %8.2f ms, parallel %8.2f ms, speedup %.2fx\n", serial_fill,
+         parallel_fill_time, serial_fill / parallel_fill_time);
+  printf("Friendly sum: serial %8.2f ms, parallel %8.2f ms, speedup %.2fx\n", serial_time,
+         parallel_time, serial_time / parallel_time);
+  if (serial_sum != parallel_sum) {
+    printf("FATAL: Parallel sum %d differs from serial sum %d!\n", parallel_sum, serial_sum);
+    exit(1);
+  }
+  parallel_shutdown();
+}
 int not_friendly_sum(int* matrix, int rows, int columns) {
   int sum = 0;
   for (int j = 0; j < columns; j++) {
@@ -47,7 +119,7 @@ int not_friendly_sum(int* matrix, int rows, int columns) {
 }
 int main(int argc, char** argv) {
   if (argc < 4) {
-    printf("Usage: %s [print|friendly-sum|not-friendly-sum] ");
+    printf("Usage: %s [print|friendly-sum|not-friendly-sum|speedup] ");
     printf("[number-of-rows] [number-of-columns]\n", argv[0]);
     exit(1);
   }
@@ -68,6 +140,9 @@ int main(int argc, char** argv) {
     int sum = not_friendly_sum(matrix, rows, columns);
     printf("Not friendly sum: %d\n", sum);
   }
+  else if (strcmp(operation, "speedup") == 0) {
+    speedup(matrix, rows, columns);
+  }
   else {
     printf("FATAL: Not supported operation!\n");
     exit(1);
@@ -79,4 +154,5 @@ int main(int argc, char** argv) {
 /*
  * time friendly-sum 20000 20000
  * not-friendly-sum 20000 20000
+ * speedup 20000 20000
  */
\ No newline at end of file
@@ -1,3 +1,868 @@
-//
-// Created by blgnksy on 23/12/2025.
-//
\ No newline at end of file
+/** \file concurrency.c
+ *
+ * @brief Benchmarks of the concurrency building blocks: the work-stealing scheduler, parallel loops, the locks and the
+ * lock-free map
+ *
+ * `fib` and `qsort` are recursive divide-and-conquer workloads on the work-stealing scheduler of scheduler.c, each
+ * run serially and then on pools of 1, 2, 4, ... workers:
+ *
+ * - `fib`: the naive doubly recursive Fibonacci. Almost no work per task, so it mostly measures the cost of
+ *   spawn/sync and stealing. Below a cutoff the recursion runs serially.
+ * - `qsort`: quicksort of random integers. The partition step is serial and the two halves are sorted in parallel,
+ *   so the speedup is limited by the first partitions and by memory bandwidth.
+ *
+ * The one-worker run against the serial baseline shows the overhead of the scheduler itself; the other runs show how
+ * it scales.
+ *
+ * `loops` runs the data-parallel loops of parallel.c over `n` integers, with the grain picked automatically: a
+ * parallel_for that fills the array and a parallel_reduce that sums it, against the serial loops and checked against
+ * their result.
+ *
+ * `locks` compares the locks of locks.c with `pthread_mutex_t` and `pthread_spinlock_t`. 1, 2, 4, ... threads keep
+ * taking the same lock for `n` milliseconds and increment a shared counter inside the critical section, which comes in
+ * three lengths. Per lock it reports the throughput, the fairness as the spread between the threads that got the most
+ * and the fewest acquisitions, and the latency of acquiring the lock, sampled every few acquisitions.
+ *
+ * `map` first fills the lock-free map of concurrent_map.c from all threads, starting from a tiny table so that it
+ * resizes many times under contention, and checks the result. Then threads run a random mix of lookups, puts and
+ * removes on a key range that is half full, against the lock-free map and a chained map with one lock per stripe of
+ * buckets, for `n` milliseconds per run.
+ *
+ * \code{.sh}
+ * ./concurrency [fib|qsort|loops|locks|map|all] [n] [max-workers]
+ * \endcode
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "concurrent_map.h"
+#include "helpers.h"
+#include "locks.h"
+#include "parallel.h"
+#include "scheduler.h"
+
+#define FIB_CUTOFF 12
+#define QSORT_CUTOFF 4096
+#define SAMPLE_EVERY 8
+#define MAX_SAMPLES (1 << 16)
+#define MAP_KEYS (1 << 16)
+#define MAP_STRIPES 64
+#define FILL_PER_THREAD 100000
+
+typedef struct {
+    int n;
+    uint64_t result;
+} fib_args_t;
+
+typedef struct {
+    int *data;
+    size_t count;
+} sort_args_t;
+
+typedef union {
+    tas_lock_t tas;
+    ttas_lock_t ttas;
+    ticket_lock_t ticket;
+    mcs_lock_t mcs;
+    futex_mutex_t futex;
+    pthread_mutex_t mutex;
+    pthread_spinlock_t spin;
+} any_lock_t;
+
+typedef struct {
+    const char *name;
+    void (*init)(any_lock_t *lock);
+    void (*acquire)(any_lock_t *lock, mcs_node_t *node);
+    void (*release)(any_lock_t *lock, mcs_node_t *node);
+} lock_ops_t;
+
+typedef struct {
+    _Alignas(64) any_lock_t lock;
+    /** Protected by the lock. */
+    _Alignas(64) uint64_t counter;
+    _Alignas(64) atomic_int go;
+    atomic_int stop;
+    const lock_ops_t *ops;
+    int critical;
+} lock_bench_t;
+
+typedef struct striped_node_t {
+    int key;
+    int value;
+    struct striped_node_t *next;
+} striped_node_t;
+
+typedef struct {
+    _Alignas(64) pthread_mutex_t lock;
+} stripe_t;
+
+/**
+ * \struct striped_map_t
+ * \brief Baseline: chained buckets, bucket i guarded by lock i % MAP_STRIPES. Sized for the benchmark, it never grows.
+ */
+typedef struct {
+    stripe_t stripes[MAP_STRIPES];
+    size_t buckets;
+    striped_node_t **heads;
+} striped_map_t;
+
+typedef struct {
+    cmap_t *cmap;
+    striped_map_t *striped;
+    int read_percent;
+    _Alignas(64) atomic_int go;
+    atomic_int stop;
+} map_bench_t;
+
+typedef struct {
+    _Alignas(64) map_bench_t *bench;
+    pthread_t thread;
+    uint64_t operations;
+    uint64_t seed;
+    int first_key;
+} map_thread_t;
+
+typedef struct {
+    mcs_node_t node;
+    lock_bench_t *bench;
+    pthread_t thread;
+    uint64_t acquisitions;
+    uint64_t *samples;
+    size_t sampled;
+} lock_thread_t;
+
+static uint64_t fib_serial(int n)
+{
+    return n < 2 ? (uint64_t) n : fib_serial(n - 1) + fib_serial(n - 2);
+}
+
+static void fib_parallel(void *arg)
+{
+    fib_args_t *args = (fib_args_t *) arg;
+
+    if (args->n <= FIB_CUTOFF) {
+        args->result = fib_serial(args->n);
+        return;
+    }
+    fib_args_t left = {args->n - 1, 0};
+    fib_args_t right = {args->n - 2, 0};
+    ws_task_t task;
+
+    ws_spawn(&task, fib_parallel, &left);
+    fib_parallel(&right);
+    ws_sync(&task);
+    args->result = left.result + right.result;
+}
+
+static void insertion_sort(int *data, size_t count)
+{
+    for (size_t i = 1; i < count; i++) {
+        int value = data[i];
+        size_t j = i;
+        while (j > 0 && data[j - 1] > value) {
+            data[j] = data[j - 1];
+            j--;
+        }
+        data[j] = value;
+    }
+}
+
+/**
+ * Hoare partition around the median of three.
+ * @return number of elements in the left part, which are all <= the elements of the right part
+ */
+static size_t partition(int *data, size_t count)
+{
+    int a = data[0], b = data[count / 2], c = data[count - 1];
+    int pivot = a < b ? (b < c ? b : (a < c ? c : a)) : (a < c ? a : (b < c ? c : b));
+    size_t i = 0, j = count - 1;
+
+    for (;;) {
+        while (data[i] < pivot)
+            i++;
+        while (data[j] > pivot)
+            j--;
+        if (i >= j)
+            return j + 1;
+        int tmp = data[i];
+        data[i] = data[j];
+        data[j] = tmp;
+        i++;
+        j--;
+    }
+}
+
+static void quicksort_serial(int *data, size_t count)
+{
+    while (count > 16) {
+        size_t left = partition(data, count);
+        // Recurse into the smaller part, loop on the larger one.
+        if (left < count - left) {
+            quicksort_serial(data, left);
+            data += left;
+            count -= left;
+        } else {
+            quicksort_serial(data + left, count - left);
+            count = left;
+        }
+    }
+    insertion_sort(data, count);
+}
+
+static void quicksort_parallel(void *arg)
+{
+    sort_args_t *args = (sort_args_t *) arg;
+
+    if (args->count <= QSORT_CUTOFF) {
+        quicksort_serial(args->data, args->count);
+        return;
+    }
+    size_t left_count = partition(args->data, args->count);
+    sort_args_t left = {args->data, left_count};
+    sort_args_t right = {args->data + left_count, args->count - left_count};
+    ws_task_t task;
+
+    ws_spawn(&task, quicksort_parallel, &left);
+    quicksort_parallel(&right);
+    ws_sync(&task);
+}
+
+static void fill_random(int *data, size_t count)
+{
+    uint64_t seed = 88172645463325252u;
+
+    for (size_t i = 0; i < count; i++) {
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+        data[i] = (int) (seed >> 33);
+    }
+}
+
+static int is_sorted(const int *data, size_t count)
+{
+    for (size_t i = 1; i < count; i++)
+        if (data[i - 1] > data[i])
+            return 0;
+    return 1;
+}
+
+static void tas_acquire(any_lock_t *lock, mcs_node_t *node)
+{
+    (void) node;
+    tas_lock(&lock->tas);
+}
+
+static void tas_release(any_lock_t *lock, mcs_node_t *node)
+{
+    (void) node;
+    tas_unlock(&lock->tas);
+}
+
+static void ttas_acquire(any_lock_t *lock, mcs_node_t *node)
+{
+    (void) node;
+    ttas_lock(&lock->ttas);
+}
+
+static void ttas_release(any_lock_t *lock, mcs_node_t *node)
+{
+    (void) node;
+    ttas_unlock(&lock->ttas);
+}
+
+static void ticket_acquire(any_lock_t *lock, mcs_node_t *node)
+{
+    (void) node;
+    ticket_lock(&lock->ticket);
+}
+
+static void ticket_release(any_lock_t *lock, mcs_node_t *node)
+{
+    (void) node;
+    ticket_unlock(&lock->ticket);
+}
+
+static void mcs_acquire(any_lock_t *lock, mcs_node_t *node)
+{
+    mcs_lock(&lock->mcs, node);
+}
+
+static void mcs_release(any_lock_t *lock, mcs_node_t *node)
+{
+    mcs_unlock(&lock->mcs, node);
+}
+
+static void futex_acquire(any_lock_t *lock, mcs_node_t *node)
+{
+    (void) node;
+    futex_mutex_lock(&lock->futex);
+}
+
+static void futex_release(any_lock_t *lock, mcs_node_t *node)
+{
+    (void) node;
+    futex_mutex_unlock(&lock->futex);
+}
+
+static void mutex_init(any_lock_t *lock)
+{
+    pthread_mutex_init(&lock->mutex, NULL);
+}
+
+static void mutex_acquire(any_lock_t *lock, mcs_node_t *node)
+{
+    (void) node;
+    pthread_mutex_lock(&lock->mutex);
+}
+
+static void mutex_release(any_lock_t *lock, mcs_node_t *node)
+{
+    (void) node;
+    pthread_mutex_unlock(&lock->mutex);
+}
+
+static void spin_init(any_lock_t *lock)
+{
+    pthread_spin_init(&lock->spin, PTHREAD_PROCESS_PRIVATE);
+}
+
+static void spin_acquire(any_lock_t *lock, mcs_node_t *node)
+{
+    (void) node;
+    pthread_spin_lock(&lock->spin);
+}
+
+static void spin_release(any_lock_t *lock, mcs_node_t *node)
+{
+    (void) node;
+    pthread_spin_unlock(&lock->spin);
+}
+
+static const lock_ops_t lock_ops[] = {
+        {"tas", NULL, tas_acquire, tas_release},
+        {"ttas", NULL, ttas_acquire, ttas_release},
+        {"ticket", NULL, ticket_acquire, ticket_release},
+        {"mcs", NULL, mcs_acquire, mcs_release},
+        {"futex", NULL, futex_acquire, futex_release},
+        {"pthread_mutex", mutex_init, mutex_acquire, mutex_release},
+        {"pthread_spin", spin_init, spin_acquire, spin_release},
+};
+
+static void *lock_thread(void *arg)
+{
+    lock_thread_t *self = (lock_thread_t *) arg;
+    lock_bench_t *bench = self->bench;
+    const lock_ops_t *ops = bench->ops;
+
+    while (!atomic_load_explicit(&bench->go, memory_order_acquire))
+        __builtin_ia32_pause();
+    while (!atomic_load_explicit(&bench->stop, memory_order_relaxed)) {
+        int sample = self->acquisitions % SAMPLE_EVERY == 0 && self->sampled < MAX_SAMPLES;
+        uint64_t begin = sample ? bench_now_ns() : 0;
+
+        ops->acquire(&bench->lock, &self->node);
+        if (sample)
+            self->samples[self->sampled++] = bench_now_ns() - begin;
+        for (int i = 0; i < bench->critical; i++) {
+            bench->counter++;
+            // Keep the compiler from folding the loop into one addition.
+            __asm__ volatile("" ::: "memory");
+        }
+        ops->release(&bench->lock, &self->node);
+        self->acquisitions++;
+    }
+    return NULL;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+static void bench_lock(const lock_ops_t *ops, int threads, int critical, long ms, uint64_t *samples)
+{
+    lock_bench_t *bench = (lock_bench_t *) aligned_alloc(64, sizeof(lock_bench_t));
+    lock_thread_t *workers = (lock_thread_t *) aligned_alloc(64, (size_t) threads * sizeof(lock_thread_t));
+
+    if (!bench || !workers)
+        exit_sys("aligned_alloc");
+    memset(bench, 0, sizeof(*bench));
+    memset(workers, 0, (size_t) threads * sizeof(lock_thread_t));
+    bench->ops = ops;
+    bench->critical = critical;
+    if (ops->init)
+        ops->init(&bench->lock);
+    for (int i = 0; i < threads; i++) {
+        workers[i].bench = bench;
+        workers[i].samples = samples + (size_t) i * MAX_SAMPLES;
+        if (pthread_create(&workers[i].thread, NULL, lock_thread, &workers[i]) != 0)
+            exit_sys("pthread_create");
+    }
+
+    uint64_t begin = bench_now_ns();
+    atomic_store_explicit(&bench->go, 1, memory_order_release);
+    struct timespec duration = {ms / 1000, ms % 1000 * 1000000};
+    nanosleep(&duration, NULL);
+    atomic_store_explicit(&bench->stop, 1, memory_order_relaxed);
+    for (int i = 0; i < threads; i++)
+        pthread_join(workers[i].thread, NULL);
+    double seconds = (double) (bench_now_ns() - begin) / 1e9;
+
+    uint64_t total = 0, least = UINT64_MAX, most = 0;
+    size_t sampled = 0;
+    for (int i = 0; i < threads; i++) {
+        total += workers[i].acquisitions;
+        if (workers[i].acquisitions < least)
+            least = workers[i].acquisitions;
+        if (workers[i].acquisitions > most)
+            most = workers[i].acquisitions;
+        // Pack the samples of all threads together.
+        memmove(samples + sampled, workers[i].samples, workers[i].sampled * sizeof(uint64_t));
+        sampled += workers[i].sampled;
+    }
+    if (bench->counter != total * (uint64_t) critical) {
+        fprintf(stderr, "FATAL: %s lost updates: counter %lu, expected %lu\n", ops->name,
+                (unsigned long) bench->counter, (unsigned long) (total * (uint64_t) critical));
+        exit(1);
+    }
+    qsort(samples, sampled, sizeof(uint64_t), compare_u64);
+    printf("  %-14s %7d %9.2f %9.2f %9lu %9lu %11lu\n", ops->name, threads, (double) total / seconds / 1e6,
+           least ? (double) most / (double) least : 0.0, (unsigned long) samples[sampled / 2],
+           (unsigned long) samples[sampled * 99 / 100], (unsigned long) samples[sampled - 1]);
+    free(workers);
+    free(bench);
+}
+
+static void bench_locks(long ms, int max_threads)
+{
+    static const int critical_sections[] = {1, 50, 500};
+    uint64_t *samples = (uint64_t *) malloc((size_t) max_threads * MAX_SAMPLES * sizeof(uint64_t));
+
+    if (!samples)
+        exit_sys("malloc");
+    for (size_t c = 0; c < sizeof(critical_sections) / sizeof(critical_sections[0]); c++) {
+        printf("locks: %d increments in the critical section, %ld ms per run\n", critical_sections[c], ms);
+        printf("  %-14s %7s %9s %9s %9s %9s %11s\n", "lock", "threads", "Mops/s", "spread", "p50 ns", "p99 ns",
+               "max ns");
+        for (size_t l = 0; l < sizeof(lock_ops) / sizeof(lock_ops[0]); l++)
+            for (int threads = 1; threads <= max_threads; threads *= 2)
+                bench_lock(&lock_ops[l], threads, critical_sections[c], ms, samples);
+    }
+    free(samples);
+}
+
+static striped_map_t *striped_new(size_t buckets)
+{
+    striped_map_t *map = (striped_map_t *) aligned_alloc(64, sizeof(striped_map_t));
+
+    if (!map || !(map->heads = (striped_node_t **) calloc(buckets, sizeof(striped_node_t *))))
+        exit_sys("malloc");
+    map->buckets = buckets;
+    for (int i = 0; i < MAP_STRIPES; i++)
+        pthread_mutex_init(&map->stripes[i].lock, NULL);
+    return map;
+}
+
+static void striped_free(striped_map_t *map)
+{
+    for (size_t i = 0; i < map->buckets; i++) {
+        striped_node_t *node = map->heads[i];
+        while (node) {
+            striped_node_t *next = node->next;
+            free(node);
+            node = next;
+        }
+    }
+    for (int i = 0; i < MAP_STRIPES; i++)
+        pthread_mutex_destroy(&map->stripes[i].lock);
+    free(map->heads);
+    free(map);
+}
+
+static size_t striped_bucket(const striped_map_t *map, int key)
+{
+    return ((uint32_t) key * 2654435761u) % map->buckets;
+}
+
+static void striped_put(striped_map_t *map, int key, int value)
+{
+    size_t bucket = striped_bucket(map, key);
+    pthread_mutex_t *lock = &map->stripes[bucket % MAP_STRIPES].lock;
+
+    pthread_mutex_lock(lock);
+    striped_node_t *node = map->heads[bucket];
+    while (node && node->key != key)
+        node = node->next;
+    if (node) {
+        node->value = value;
+    } else {
+        node = (striped_node_t *) malloc(sizeof(striped_node_t));
+        if (!node)
+            exit_sys("malloc");
+        node->key = key;
+        node->value = value;
+        node->next = map->heads[bucket];
+        map->heads[bucket] = node;
+    }
+    pthread_mutex_unlock(lock);
+}
+
+static int striped_get(striped_map_t *map, int key, int *value)
+{
+    size_t bucket = striped_bucket(map, key);
+    pthread_mutex_t *lock = &map->stripes[bucket % MAP_STRIPES].lock;
+    int found = 0;
+
+    pthread_mutex_lock(lock);
+    for (striped_node_t *node = map->heads[bucket]; node; node = node->next) {
+        if (node->key == key) {
+            *value = node->value;
+            found = 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(lock);
+    return found;
+}
+
+static int striped_remove(striped_map_t *map, int key)
+{
+    size_t bucket = striped_bucket(map, key);
+    pthread_mutex_t *lock = &map->stripes[bucket % MAP_STRIPES].lock;
+    striped_node_t *removed = NULL;
+
+    pthread_mutex_lock(lock);
+    for (striped_node_t **link = &map->heads[bucket]; *link; link = &(*link)->next) {
+        if ((*link)->key == key) {
+            removed = *link;
+            *link = removed->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(lock);
+    free(removed);
+    return removed != NULL;
+}
+
+static void *map_fill_thread(void *arg)
+{
+    map_thread_t *self = (map_thread_t *) arg;
+    cmap_t *map = self->bench->cmap;
+
+    for (int i = 0; i < FILL_PER_THREAD; i++)
+        if (cmap_put_int(map, self->first_key + i, ~(self->first_key + i)) == -1)
+            exit_sys("cmap_put_int");
+    // Remove every other key again, to leave tombstones behind for the next resizes.
+    for (int i = 0; i < FILL_PER_THREAD; i += 2)
+        if (cmap_remove(map, self->first_key + i) != 1) {
+            fprintf(stderr, "FATAL: key %d missing before its removal\n", self->first_key + i);
+            exit(1);
+        }
+    return NULL;
+}
+
+/**
+ * Concurrent inserts and removes of disjoint key ranges into a map that starts with 16 slots.
+ */
+static void check_map(int threads)
+{
+    map_bench_t bench = {.cmap = cmap_new(1)};
+    map_thread_t *workers = (map_thread_t *) aligned_alloc(64, (size_t) threads * sizeof(map_thread_t));
+
+    if (!bench.cmap || !workers)
+        exit_sys("malloc");
+    uint64_t begin = bench_now_ns();
+    for (int i = 0; i < threads; i++) {
+        workers[i].bench = &bench;
+        workers[i].first_key = i * FILL_PER_THREAD;
+        if (pthread_create(&workers[i].thread, NULL, map_fill_thread, &workers[i]) != 0)
+            exit_sys("pthread_create");
+    }
+    for (int i = 0; i < threads; i++)
+        pthread_join(workers[i].thread, NULL);
+    double ms = (double) (bench_now_ns() - begin) / 1e6;
+
+    for (int key = 0; key < threads * FILL_PER_THREAD; key++) {
+        int value, found = cmap_get_int(bench.cmap, key, &value);
+        if (found != (key % 2) || (found && value != ~key)) {
+            fprintf(stderr, "FATAL: key %d: found %d, value %d\n", key, found, found ? value : 0);
+            exit(1);
+        }
+    }
+    printf("map: %d threads inserted %d keys and removed half of them in %.1f ms, %zu slots at the end\n", threads,
+           threads * FILL_PER_THREAD, ms, cmap_capacity(bench.cmap));
+    cmap_free(bench.cmap);
+    free(workers);
+}
+
+static void *map_thread(void *arg)
+{
+    map_thread_t *self = (map_thread_t *) arg;
+    map_bench_t *bench = self->bench;
+
+    while (!atomic_load_explicit(&bench->go, memory_order_acquire))
+        __builtin_ia32_pause();
+    while (!atomic_load_explicit(&bench->stop, memory_order_relaxed)) {
+        self->seed ^= self->seed << 13;
+        self->seed ^= self->seed >> 7;
+        self->seed ^= self->seed << 17;
+        int key = (int) (self->seed % MAP_KEYS);
+        int percent = (int) ((self->seed >> 32) % 100);
+        int value;
+
+        if (percent < bench->read_percent) {
+            if (bench->cmap ? cmap_get_int(bench->cmap, key, &value) : striped_get(bench->striped, key, &value))
+                if (value != ~key) {
+                    fprintf(stderr, "FATAL: key %d has value %d\n", key, value);
+                    exit(1);
+                }
+        } else if (percent % 2 == 0) {
+            if (bench->cmap) {
+                if (cmap_put_int(bench->cmap, key, ~key) == -1)
+                    exit_sys("cmap_put_int");
+            } else {
+                striped_put(bench->striped, key, ~key);
+            }
+        } else {
+            if (bench->cmap ? cmap_remove(bench->cmap, key) == -1 : striped_remove(bench->striped, key) == -1)
+                exit_sys("remove");
+        }
+        self->operations++;
+    }
+    return NULL;
+}
+
+static void bench_map_run(int lock_free, int threads, int read_percent, long ms)
+{
+    map_bench_t *bench = (map_bench_t *) aligned_alloc(64, sizeof(map_bench_t));
+    map_thread_t *workers = (map_thread_t *) aligned_alloc(64, (size_t) threads * sizeof(map_thread_t));
+
+    if (!bench || !workers)
+        exit_sys("aligned_alloc");
+    memset(bench, 0, sizeof(*bench));
+    bench->read_percent = read_percent;
+    if (lock_free) {
+        if (!(bench->cmap = cmap_new(MAP_KEYS)))
+            exit_sys("cmap_new");
+    } else {
+        bench->striped = striped_new(MAP_KEYS);
+    }
+    for (int key = 0; key < MAP_KEYS; key += 2) {
+        if (lock_free)
+            cmap_put_int(bench->cmap, key, ~key);
+        else
+            striped_put(bench->striped, key, ~key);
+    }
+    for (int i = 0; i < threads; i++) {
+        workers[i].bench = bench;
+        workers[i].operations = 0;
+        workers[i].seed = 0x9e3779b97f4a7c15u * (uint64_t) (i + 1);
+        if (pthread_create(&workers[i].thread, NULL, map_thread, &workers[i]) != 0)
+            exit_sys("pthread_create");
+    }
+
+    uint64_t begin = bench_now_ns();
+    atomic_store_explicit(&bench->go, 1, memory_order_release);
+    struct timespec duration = {ms / 1000, ms % 1000 * 1000000};
+    nanosleep(&duration, NULL);
+    atomic_store_explicit(&bench->stop, 1, memory_order_relaxed);
+    uint64_t operations = 0;
+    for (int i = 0; i < threads; i++) {
+        pthread_join(workers[i].thread, NULL);
+        operations += workers[i].operations;
+    }
+    double seconds = (double) (bench_now_ns() - begin) / 1e9;
+    printf("  %-10s %5d%% %7d %9.2f\n", lock_free ? "lock-free" : "striped", read_percent, threads,
+           (double) operations / seconds / 1e6);
+
+    if (lock_free)
+        cmap_free(bench->cmap);
+    else
+        striped_free(bench->striped);
+    free(workers);
+    free(bench);
+}
+
+static void bench_map(long ms, int max_threads)
+{
+    static const int read_percents[] = {90, 50};
+
+    check_map(max_threads > 1 ? max_threads : 2);
+    printf("map: random operations on %d keys, %ld ms per run\n", MAP_KEYS, ms);
+    printf("  %-10s %6s %7s %9s\n", "map", "reads", "threads", "Mops/s");
+    for (size_t r = 0; r < sizeof(read_percents) / sizeof(read_percents[0]); r++)
+        for (int lock_free = 1; lock_free >= 0; lock_free--)
+            for (int threads = 1; threads <= max_threads; threads *= 2)
+                bench_map_run(lock_free, threads, read_percents[r], ms);
+}
+
+static ws_pool_t *pool_create(int workers)
+{
+    ws_pool_t *pool = ws_pool_create(workers);
+
+    if (!pool)
+        exit_sys("ws_pool_create");
+    return pool;
+}
+
+static void bench_fib(int n, int max_workers)
+{
+    uint64_t begin = bench_now_ns();
+    uint64_t expected = fib_serial(n);
+    double serial = (double) (bench_now_ns() - begin) / 1e6;
+
+    printf("fib(%d) = %lu\n", n, (unsigned long) expected);
+    printf("  serial     %10.1f ms\n", serial);
+    for (int workers = 1; workers <= max_workers; workers *= 2) {
+        ws_pool_t *pool = pool_create(workers);
+        fib_args_t args = {n, 0};
+
+        begin = bench_now_ns();
+        ws_run(pool, fib_parallel, &args);
+        double ms = (double) (bench_now_ns() - begin) / 1e6;
+        ws_pool_destroy(pool);
+        if (args.result != expected) {
+            fprintf(stderr, "FATAL: fib(%d) returned %lu on %d workers\n", n, (unsigned long) args.result, workers);
+            exit(1);
+        }
+        printf("  %2d workers %10.1f ms  speedup %5.2fx\n", workers, ms, serial / ms);
+    }
+}
+
+static void bench_qsort(size_t count, int max_workers)
+{
+    int *data = (int *) malloc(count * sizeof(int));
+
+    if (!data)
+        exit_sys("malloc");
+    fill_random(data, count);
+    uint64_t begin = bench_now_ns();
+    quicksort_serial(data, count);
+    double serial = (double) (bench_now_ns() - begin) / 1e6;
+
+    printf("quicksort of %zu ints\n", count);
+    printf("  serial     %10.1f ms\n", serial);
+    for (int workers = 1; workers <= max_workers; workers *= 2) {
+        ws_pool_t *pool = pool_create(workers);
+        sort_args_t args = {data, count};
+
+        fill_random(data, count);
+        begin = bench_now_ns();
+        ws_run(pool, quicksort_parallel, &args);
+        double ms = (double) (bench_now_ns() - begin) / 1e6;
+        ws_pool_destroy(pool);
+        if (!is_sorted(data, count)) {
+            fprintf(stderr, "FATAL: quicksort on %d workers left the data unsorted\n", workers);
+            exit(1);
+        }
+        printf("  %2d workers %10.1f ms  speedup %5.2fx\n", workers, ms, serial / ms);
+    }
+    free(data);
+}
+
+static void loop_fill(size_t begin, size_t end, void *ctx)
+{
+    uint64_t *data = (uint64_t *) ctx;
+
+    for (size_t i = begin; i < end; i++)
+        data[i] = (i * 0x9e3779b97f4a7c15u) >> 40;
+}
+
+static void loop_sum(size_t begin, size_t end, void *partial, void *ctx)
+{
+    const uint64_t *data = (const uint64_t *) ctx;
+    uint64_t sum = *(uint64_t *) partial;
+
+    for (size_t i = begin; i < end; i++)
+        sum += data[i];
+    *(uint64_t *) partial = sum;
+}
+
+static void loop_add(void *into, const void *from, void *ctx)
+{
+    (void) ctx;
+    *(uint64_t *) into += *(const uint64_t *) from;
+}
+
+static void bench_loops(size_t count, int max_workers)
+{
+    uint64_t *data = (uint64_t *) malloc(count * sizeof(uint64_t));
+    uint64_t expected = 0;
+
+    if (!data)
+        exit_sys("malloc");
+    // Faulted in first, so that no run pays for the page faults.
+    memset(data, 0, count * sizeof(uint64_t));
+    uint64_t begin = bench_now_ns();
+    loop_fill(0, count, data);
+    double fill_serial = (double) (bench_now_ns() - begin) / 1e6;
+    begin = bench_now_ns();
+    loop_sum(0, count, &expected, data);
+    double sum_serial = (double) (bench_now_ns() - begin) / 1e6;
+
+    printf("parallel loops over %zu integers\n", count);
+    printf("  serial     fill %8.1f ms                  sum %8.1f ms\n", fill_serial, sum_serial);
+    for (int workers = 1; workers <= max_workers; workers *= 2) {
+        uint64_t sum = 0;
+
+        // The loops share one pool; a new one per worker count.
+        parallel_shutdown();
+        if (parallel_init(workers) == -1)
+            exit_sys("parallel_init");
+        memset(data, 0, count * sizeof(uint64_t));
+        begin = bench_now_ns();
+        parallel_for(0, count, 0, loop_fill, data);
+        double fill = (double) (bench_now_ns() - begin) / 1e6;
+        begin = bench_now_ns();
+        parallel_reduce(0, count, 0, &sum, sizeof(sum), loop_sum, loop_add, data);
+        double reduce = (double) (bench_now_ns() - begin) / 1e6;
+        if (sum != expected) {
+            fprintf(stderr, "FATAL: the sum on %d workers was %lu, expected %lu\n", workers, (unsigned long) sum,
+                    (unsigned long) expected);
+            exit(1);
+        }
+        printf("  %2d workers fill %8.1f ms  speedup %5.2fx  sum %8.1f ms  speedup %5.2fx\n", workers, fill,
+               fill_serial / fill, reduce, sum_serial / reduce);
+    }
+    parallel_shutdown();
+    free(data);
+}
+
+int main(int argc, char **argv)
+{
+    const char *workload = argc > 1 ? argv[1] : "all";
+    long n = argc > 2 ? strtol(argv[2], NULL, 10) : 0;
+    long max_workers = argc > 3 ? strtol(argv[3], NULL, 10) : sysconf(_SC_NPROCESSORS_ONLN);
+    int fib = strcmp(workload, "fib") == 0 || strcmp(workload, "all") == 0;
+    int sort = strcmp(workload, "qsort") == 0 || strcmp(workload, "all") == 0;
+    int loops = strcmp(workload, "loops") == 0 || strcmp(workload, "all") == 0;
+    int locks = strcmp(workload, "locks") == 0 || strcmp(workload, "all") == 0;
+    int map = strcmp(workload, "map") == 0 || strcmp(workload, "all") == 0;
+    int all = fib && sort && loops && locks && map;
+
+    if ((!fib && !sort && !loops && !locks && !map) || n < 0 || max_workers < 1 || max_workers > 1024 ||
+        (fib && !all && n > 90)) {
+        fprintf(stderr, "Usage: %s [fib|qsort|loops|locks|map|all] [n] [max-workers]\n", argv[0]);
+        exit(1);
+    }
+    if (fib)
+        bench_fib(n > 0 && !all ? (int) n : 36, (int) max_workers);
+    if (sort)
+        bench_qsort(n > 0 && !all ? (size_t) n : 20000000, (int) max_workers);
+    if (loops)
+        bench_loops(n > 0 && !all ? (size_t) n : 50000000, (int) max_workers);
+    if (locks)
+        bench_locks(n > 0 && !all ? n : 100, (int) max_workers);
+    if (map)
+        bench_map(n > 0 && !all ? n : 200, (int) max_workers);
+    return 0;
+}
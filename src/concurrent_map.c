@@ -0,0 +1,476 @@
+/** \file concurrent_map.c
+ *
+ * @brief Lock-free open-addressing hash map from int keys to ints or pointers
+ *
+ * The table is an array of {key, value} slots probed linearly. Both words are atomics and every change is a single
+ * compare-and-swap, in the style of Cliff Click's non-blocking hash map:
+ *
+ * - A key is claimed by swapping an empty key word for it. Once claimed, a slot keeps its key for the lifetime of the
+ *   table, so a lookup never sees a key change under it.
+ * - The value is then swapped in. A removal swaps in a tombstone; the key stays, and a later put of the same key
+ *   reuses the slot.
+ * - Lookups are plain loads. They take no lock and cannot be blocked by a stalled writer; the only store is the
+ *   epoch announcement below, to the calling thread's own record.
+ *
+ * Tombstones and new keys fill the table up. When 3/4 of the slots are claimed, a new table is allocated and linked
+ * from the old one, twice as large unless most of the claimed slots are tombstones. Nobody stops to copy: every put
+ * that finds a newer table first copies a chunk of old slots, and puts of a key in an old slot move that slot first.
+ * Moving a slot freezes its value by setting the PRIME bit, puts it into the new table unless a newer value got there
+ * first, and finally replaces it with MOVED. A lookup that finds a frozen or moved value continues in the newer table.
+ * When all slots of a table were moved, the map switches to the next table.
+ *
+ * A table the map has switched away from may still be read by operations that started on it, so it is retired to the
+ * epoch-based reclamation of ebr.c: every operation is an EBR critical section, and the table is freed once every
+ * operation that could have seen it has finished. All maps share one EBR domain; a thread gets its record on its
+ * first operation and gives it back when it exits.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "concurrent_map.h"
+#include "ebr.h"
+
+#define KEY_EMPTY UINT64_C(0)
+#define VALUE_EMPTY UINT64_C(0)
+#define VALUE_TOMBSTONE UINT64_C(1)
+#define VALUE_MOVED UINT64_C(2)
+/** Set on a live value while its slot is being copied to the next table. */
+#define VALUE_PRIME (UINT64_C(1) << 63)
+#define MIN_CAPACITY 16
+#define COPY_CHUNK 256
+
+typedef struct {
+    _Atomic uint64_t key;
+    _Atomic uint64_t value;
+} slot_t;
+
+typedef struct table_t {
+    size_t capacity;
+    _Atomic(struct table_t *) next;
+    _Alignas(64) atomic_size_t claimed;
+    _Alignas(64) atomic_size_t copy_index;
+    atomic_size_t copied;
+    _Alignas(64) slot_t slots[];
+} table_t;
+
+struct cmap_t {
+    /** The current table. Newer ones are reachable through `next`; older ones are retired. */
+    _Alignas(64) _Atomic(table_t *) table;
+};
+
+static ebr_t *reclaim;
+static pthread_key_t reclaim_key;
+static pthread_once_t reclaim_once = PTHREAD_ONCE_INIT;
+static _Thread_local ebr_thread_t *reclaim_thread;
+
+static void reclaim_exit(void *arg)
+{
+    ebr_unregister((ebr_thread_t *) arg);
+    reclaim_thread = NULL;
+}
+
+static void reclaim_init(void)
+{
+    if (!(reclaim = ebr_new()) || pthread_key_create(&reclaim_key, reclaim_exit) != 0)
+        abort();
+}
+
+/**
+ * Starts an operation: a critical section of the calling thread's EBR record, which is created on first use.
+ * @return the record, for op_end
+ */
+static ebr_thread_t *op_begin(void)
+{
+    ebr_thread_t *thread = reclaim_thread;
+
+    if (__builtin_expect(!thread, 0)) {
+        pthread_once(&reclaim_once, reclaim_init);
+        if (!(thread = ebr_register(reclaim)))
+            abort();
+        pthread_setspecific(reclaim_key, thread);
+        reclaim_thread = thread;
+    }
+    ebr_enter(thread);
+    return thread;
+}
+
+static void op_end(ebr_thread_t *thread)
+{
+    ebr_exit(thread);
+}
+
+/*
+ * Live values carry the payload shifted left by two with both low bits set, so they never collide with the special
+ * values. Payloads are ints or user-space pointers and fit in 61 bits.
+ */
+static uint64_t value_encode(uint64_t payload)
+{
+    return (payload << 2) | 3;
+}
+
+static uint64_t value_decode(uint64_t value)
+{
+    return (value & ~VALUE_PRIME) >> 2;
+}
+
+static int value_is_live(uint64_t value)
+{
+    return (value & 3) == 3;
+}
+
+static uint64_t key_word(int key)
+{
+    return (uint64_t) (uint32_t) key + 1;
+}
+
+static size_t key_hash(uint64_t key)
+{
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdu;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53u;
+    key ^= key >> 33;
+    return (size_t) key;
+}
+
+static table_t *table_new(size_t capacity)
+{
+    table_t *table = (table_t *) aligned_alloc(64, sizeof(table_t) + capacity * sizeof(slot_t));
+
+    if (!table)
+        return NULL;
+    memset(table, 0, sizeof(table_t) + capacity * sizeof(slot_t));
+    table->capacity = capacity;
+    return table;
+}
+
+/**
+ * @param capacity number of keys expected without a resize
+ * @return the map, or NULL if out of memory
+ */
+cmap_t *cmap_new(size_t capacity)
+{
+    cmap_t *map = (cmap_t *) aligned_alloc(64, sizeof(cmap_t));
+    size_t slots = MIN_CAPACITY;
+
+    if (!map)
+        return NULL;
+    while (slots / 4 * 3 < capacity)
+        slots *= 2;
+    table_t *table = table_new(slots);
+    if (!table) {
+        free(map);
+        return NULL;
+    }
+    atomic_init(&map->table, table);
+    return map;
+}
+
+/**
+ * Frees the map. No other thread may use it any more; retired tables are freed by the threads that retired them.
+ */
+void cmap_free(cmap_t *map)
+{
+    table_t *table = atomic_load_explicit(&map->table, memory_order_relaxed);
+
+    while (table) {
+        table_t *next = atomic_load_explicit(&table->next, memory_order_relaxed);
+        free(table);
+        table = next;
+    }
+    free(map);
+}
+
+/**
+ * @return number of slots of the current table
+ */
+size_t cmap_capacity(const cmap_t *map)
+{
+    ebr_thread_t *thread = op_begin();
+    size_t capacity = atomic_load_explicit(&map->table, memory_order_acquire)->capacity;
+
+    op_end(thread);
+    return capacity;
+}
+
+/**
+ * Links a new table behind the given one, unless another thread already did.
+ * @return the next table, or NULL if out of memory
+ */
+static table_t *table_resize(table_t *table)
+{
+    table_t *next = atomic_load_explicit(&table->next, memory_order_acquire);
+    size_t live = 0;
+
+    if (next)
+        return next;
+    for (size_t i = 0; i < table->capacity; i++)
+        if (value_is_live(atomic_load_explicit(&table->slots[i].value, memory_order_relaxed)))
+            live++;
+    // Mostly tombstones: the same size is enough, copying drops them.
+    next = table_new(live >= table->capacity / 4 ? table->capacity * 2 : table->capacity);
+    if (!next)
+        return NULL;
+    table_t *expected = NULL;
+    if (!atomic_compare_exchange_strong_explicit(&table->next, &expected, next, memory_order_acq_rel,
+                                                 memory_order_acquire)) {
+        free(next);
+        return expected;
+    }
+    return next;
+}
+
+static int table_put(table_t *table, uint64_t key, uint64_t value, int if_empty, uint64_t *previous);
+
+/**
+ * Makes sure the slot's value lives in the next table and the slot reads MOVED.
+ */
+static void slot_copy(table_t *table, slot_t *slot)
+{
+    uint64_t value = atomic_load_explicit(&slot->value, memory_order_acquire);
+
+    while (!(value & VALUE_PRIME) && value != VALUE_MOVED) {
+        // Empty and deleted values are not copied at all.
+        uint64_t frozen = value_is_live(value) ? value | VALUE_PRIME : VALUE_MOVED;
+        if (atomic_compare_exchange_weak_explicit(&slot->value, &value, frozen, memory_order_acq_rel,
+                                                  memory_order_acquire))
+            value = frozen;
+    }
+    if (value == VALUE_MOVED)
+        return;
+
+    uint64_t previous;
+    table_t *next = atomic_load_explicit(&table->next, memory_order_acquire);
+    uint64_t key = atomic_load_explicit(&slot->key, memory_order_relaxed);
+    // A newer value that is already in the next table wins over the copy.
+    if (table_put(next, key, value & ~VALUE_PRIME, 1, &previous) == -1)
+        abort();
+    atomic_store_explicit(&slot->value, VALUE_MOVED, memory_order_release);
+}
+
+/**
+ * Copies one chunk of the table to the next one, and switches the map to the next table when it was the last chunk.
+ * The thread that switches retires the old table.
+ */
+static void table_help_copy(cmap_t *map, table_t *table)
+{
+    size_t begin = atomic_fetch_add_explicit(&table->copy_index, COPY_CHUNK, memory_order_relaxed);
+    table_t *next = atomic_load_explicit(&table->next, memory_order_acquire);
+
+    if (begin < table->capacity) {
+        size_t end = begin + COPY_CHUNK < table->capacity ? begin + COPY_CHUNK : table->capacity;
+        for (size_t i = begin; i < end; i++)
+            slot_copy(table, &table->slots[i]);
+        atomic_fetch_add_explicit(&table->copied, end - begin, memory_order_acq_rel);
+    }
+    // Also retried after the copy was finished, in case an older table was still current then.
+    if (atomic_load_explicit(&table->copied, memory_order_acquire) == table->capacity) {
+        table_t *expected = table;
+        if (atomic_compare_exchange_strong_explicit(&map->table, &expected, next, memory_order_acq_rel,
+                                                    memory_order_relaxed)) {
+            // Resizes are rare: reclaim right away rather than after EBR's usual batch of retirements.
+            ebr_retire(reclaim_thread, table, free);
+            ebr_reclaim(reclaim_thread);
+        }
+    }
+}
+
+/**
+ * Stores value (an encoded value or VALUE_TOMBSTONE) for key, starting at the given table.
+ * @param if_empty only store if the key has no value yet, used when copying slots
+ * @param previous the value replaced
+ * @return 0, or -1 if a new table could not be allocated
+ */
+static int table_put(table_t *table, uint64_t key, uint64_t value, int if_empty, uint64_t *previous)
+{
+    size_t hash = key_hash(key);
+
+    for (;;) {
+        table_t *next = atomic_load_explicit(&table->next, memory_order_acquire);
+        size_t mask = table->capacity - 1;
+        slot_t *slot = NULL;
+
+        for (size_t probe = 0, i = hash & mask; probe < table->capacity; probe++, i = (i + 1) & mask) {
+            uint64_t found = atomic_load_explicit(&table->slots[i].key, memory_order_acquire);
+            if (found == KEY_EMPTY) {
+                if (value == VALUE_TOMBSTONE && !next) {
+                    *previous = VALUE_EMPTY;
+                    return 0;
+                }
+                // New keys go to the newest table only.
+                if (next || (next = atomic_load_explicit(&table->next, memory_order_acquire)))
+                    break;
+                if (atomic_load_explicit(&table->claimed, memory_order_relaxed) >= table->capacity / 4 * 3) {
+                    if (!(next = table_resize(table)))
+                        return -1;
+                    break;
+                }
+                if (atomic_compare_exchange_strong_explicit(&table->slots[i].key, &found, key, memory_order_acq_rel,
+                                                            memory_order_acquire)) {
+                    atomic_fetch_add_explicit(&table->claimed, 1, memory_order_relaxed);
+                    slot = &table->slots[i];
+                    break;
+                }
+            }
+            if (found == key) {
+                slot = &table->slots[i];
+                break;
+            }
+        }
+        if (!slot) {
+            if (!next && !(next = table_resize(table)))
+                return -1;
+            table = next;
+            continue;
+        }
+
+        uint64_t current = atomic_load_explicit(&slot->value, memory_order_acquire);
+        for (;;) {
+            if (current == VALUE_MOVED || (current & VALUE_PRIME) ||
+                atomic_load_explicit(&table->next, memory_order_acquire)) {
+                // A resize is going on: move the slot, then update the newer table.
+                slot_copy(table, slot);
+                break;
+            }
+            if (if_empty && current != VALUE_EMPTY) {
+                *previous = current;
+                return 0;
+            }
+            if (atomic_compare_exchange_weak_explicit(&slot->value, &current, value, memory_order_acq_rel,
+                                                      memory_order_acquire)) {
+                *previous = current;
+                return 0;
+            }
+        }
+        table = atomic_load_explicit(&table->next, memory_order_acquire);
+    }
+}
+
+static int map_put(cmap_t *map, int key, uint64_t value, uint64_t *previous)
+{
+    ebr_thread_t *thread = op_begin();
+    table_t *table = atomic_load_explicit(&map->table, memory_order_acquire);
+    int result = 0;
+
+    if (atomic_load_explicit(&table->next, memory_order_acquire))
+        table_help_copy(map, table);
+    if (table_put(table, key_word(key), value, 0, previous) == -1) {
+        errno = ENOMEM;
+        result = -1;
+    }
+    op_end(thread);
+    return result;
+}
+
+static slot_t *table_find(table_t *table, uint64_t key, size_t hash)
+{
+    size_t mask = table->capacity - 1;
+
+    for (size_t probe = 0, i = hash & mask; probe < table->capacity; probe++, i = (i + 1) & mask) {
+        uint64_t found = atomic_load_explicit(&table->slots[i].key, memory_order_acquire);
+        if (found == key)
+            return &table->slots[i];
+        if (found == KEY_EMPTY)
+            return NULL;
+    }
+    return NULL;
+}
+
+/**
+ * @return 1 if found, 0 if deleted, -1 if this table and the newer ones know nothing about the key
+ */
+static int table_get(table_t *table, uint64_t key, size_t hash, uint64_t *payload)
+{
+    slot_t *slot = table_find(table, key, hash);
+    uint64_t value = slot ? atomic_load_explicit(&slot->value, memory_order_acquire) : VALUE_EMPTY;
+
+    if (value_is_live(value) && !(value & VALUE_PRIME)) {
+        *payload = value_decode(value);
+        return 1;
+    }
+    table_t *next = atomic_load_explicit(&table->next, memory_order_acquire);
+    if (next) {
+        int found = table_get(next, key, hash, payload);
+        if (found != -1)
+            return found;
+    }
+    // Frozen but not copied yet: still the current value.
+    if (value_is_live(value)) {
+        *payload = value_decode(value);
+        return 1;
+    }
+    return value == VALUE_TOMBSTONE ? 0 : -1;
+}
+
+static int map_get(const cmap_t *map, int key, uint64_t *payload)
+{
+    ebr_thread_t *thread = op_begin();
+    uint64_t word = key_word(key);
+    int found = table_get(atomic_load_explicit(&map->table, memory_order_acquire), word, key_hash(word), payload);
+
+    op_end(thread);
+    return found == 1;
+}
+
+/**
+ * Inserts or replaces. Safe to call from any number of threads.
+ * @return 0, or -1 with errno set to ENOMEM if the table could not grow
+ */
+int cmap_put_int(cmap_t *map, int key, int value)
+{
+    uint64_t previous;
+    return map_put(map, key, value_encode((uint32_t) value), &previous);
+}
+
+/**
+ * @return 1 and the value in *value if the key is present, 0 otherwise. Lock-free.
+ */
+int cmap_get_int(const cmap_t *map, int key, int *value)
+{
+    uint64_t payload;
+
+    if (!map_get(map, key, &payload))
+        return 0;
+    *value = (int) (uint32_t) payload;
+    return 1;
+}
+
+/**
+ * Inserts or replaces. A map holds either ints or pointers, not both.
+ * @return 0, or -1 with errno set to ENOMEM if the table could not grow
+ */
+int cmap_put_ptr(cmap_t *map, int key, void *value)
+{
+    uint64_t previous;
+    return map_put(map, key, value_encode((uintptr_t) value), &previous);
+}
+
+/**
+ * @return 1 and the value in *value if the key is present, 0 otherwise. Lock-free.
+ */
+int cmap_get_ptr(const cmap_t *map, int key, void **value)
+{
+    uint64_t payload;
+
+    if (!map_get(map, key, &payload))
+        return 0;
+    *value = (void *) (uintptr_t) payload;
+    return 1;
+}
+
+/**
+ * @return 1 if the key was present, 0 if not, -1 with errno set if out of memory
+ */
+int cmap_remove(cmap_t *map, int key)
+{
+    uint64_t previous = VALUE_EMPTY;
+
+    if (map_put(map, key, VALUE_TOMBSTONE, &previous) == -1)
+        return -1;
+    return value_is_live(previous);
+}
@@ -0,0 +1,170 @@
+/** \file context_switch.c
+ *
+ * @brief Cost of a context switch: coroutines, ucontext and threads
+ *
+ * Three ways to hand the CPU from one flow of control to another and back, N times:
+ *
+ * - `coroutine`: coro_yield of coroutine.c, two calls of the hand-written coro_switch per yield (coroutine to
+ *   scheduler and scheduler to coroutine),
+ * - `ucontext`: `swapcontext` between the main context and one other context,
+ * - `condvar`: two threads that wake each other with a mutex and a condition variable.
+ *
+ * A last run spawns many short coroutines twice to show that the second round reuses the pooled stacks.
+ *
+ * \code{.sh}
+ * ./context_switch [number-of-round-trips] [number-of-coroutines]
+ * \endcode
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <ucontext.h>
+
+#include "bench.h"
+#include "coroutine.h"
+#include "helpers.h"
+
+#define STACK_SIZE (64 * 1024)
+
+static size_t rounds;
+
+static void yielder(void *arg)
+{
+    size_t *count = (size_t *) arg;
+
+    for (size_t i = 0; i < rounds; i++) {
+        (*count)++;
+        coro_yield();
+    }
+}
+
+static void short_task(void *arg)
+{
+    size_t *count = (size_t *) arg;
+
+    for (int i = 0; i < 10; i++) {
+        (*count)++;
+        coro_yield();
+    }
+}
+
+static void print_switch(const char *name, uint64_t ns, size_t switches)
+{
+    printf("%-10s %8.1f ns/switch (%zu switches)\n", name, (double) ns / (double) switches, switches);
+}
+
+static void bench_coroutine(void)
+{
+    coro_sched_t *sched = coro_sched_new(STACK_SIZE);
+    size_t count = 0;
+
+    if (!sched || !coro_spawn(sched, yielder, &count))
+        exit_sys("coro_spawn");
+    uint64_t begin = bench_now_ns();
+    coro_sched_run(sched);
+    print_switch("coroutine", bench_now_ns() - begin, 2 * rounds);
+    coro_sched_free(sched);
+}
+
+static ucontext_t main_context;
+static ucontext_t other_context;
+
+static void ucontext_loop(void)
+{
+    for (;;)
+        swapcontext(&other_context, &main_context);
+}
+
+static void bench_ucontext(void)
+{
+    static char stack[STACK_SIZE];
+
+    if (getcontext(&other_context) == -1)
+        exit_sys("getcontext");
+    other_context.uc_stack.ss_sp = stack;
+    other_context.uc_stack.ss_size = sizeof(stack);
+    other_context.uc_link = NULL;
+    makecontext(&other_context, ucontext_loop, 0);
+
+    uint64_t begin = bench_now_ns();
+    for (size_t i = 0; i < rounds; i++)
+        swapcontext(&main_context, &other_context);
+    print_switch("ucontext", bench_now_ns() - begin, 2 * rounds);
+}
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int turn;
+} ping_pong_t;
+
+static void *pong(void *arg)
+{
+    ping_pong_t *pp = (ping_pong_t *) arg;
+
+    pthread_mutex_lock(&pp->lock);
+    for (size_t i = 0; i < rounds; i++) {
+        while (pp->turn != 1)
+            pthread_cond_wait(&pp->cond, &pp->lock);
+        pp->turn = 0;
+        pthread_cond_signal(&pp->cond);
+    }
+    pthread_mutex_unlock(&pp->lock);
+    return NULL;
+}
+
+static void bench_condvar(void)
+{
+    ping_pong_t pp = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0};
+    pthread_t thread;
+
+    if (pthread_create(&thread, NULL, pong, &pp) != 0)
+        exit_sys("pthread_create");
+    uint64_t begin = bench_now_ns();
+    pthread_mutex_lock(&pp.lock);
+    for (size_t i = 0; i < rounds; i++) {
+        pp.turn = 1;
+        pthread_cond_signal(&pp.cond);
+        while (pp.turn != 0)
+            pthread_cond_wait(&pp.cond, &pp.lock);
+    }
+    pthread_mutex_unlock(&pp.lock);
+    print_switch("condvar", bench_now_ns() - begin, 2 * rounds);
+    pthread_join(thread, NULL);
+}
+
+static void bench_spawn(size_t coroutines)
+{
+    coro_sched_t *sched = coro_sched_new(STACK_SIZE);
+    size_t count = 0;
+
+    if (!sched)
+        exit_sys("coro_sched_new");
+    for (int round = 0; round < 2; round++) {
+        uint64_t begin = bench_now_ns();
+        for (size_t i = 0; i < coroutines; i++)
+            if (!coro_spawn(sched, short_task, &count))
+                exit_sys("coro_spawn");
+        coro_sched_run(sched);
+        printf("spawn round %d: %zu coroutines, %.1f ms, %zu stacks mapped\n", round + 1, coroutines,
+               (double) (bench_now_ns() - begin) / 1e6, coro_sched_stacks(sched));
+    }
+    coro_sched_free(sched);
+}
+
+int main(int argc, char **argv)
+{
+    rounds = argc > 1 ? strtoul(argv[1], NULL, 10) : 10000000;
+    size_t coroutines = argc > 2 ? strtoul(argv[2], NULL, 10) : 10000;
+
+    if (rounds == 0 || coroutines == 0) {
+        fprintf(stderr, "Usage: %s [number-of-round-trips] [number-of-coroutines]\n", argv[0]);
+        exit(1);
+    }
+    bench_coroutine();
+    bench_ucontext();
+    bench_condvar();
+    bench_spawn(coroutines);
+    return 0;
+}
@@ -0,0 +1,255 @@
+/** \file coroutine.c
+ *
+ * @brief Stackful coroutines with a hand-written x86-64 context switch
+ *
+ * A coroutine is a function with its own stack that can stop in the middle (`coro_yield`) and be resumed later
+ * where it stopped. Many of them can run on one thread, each written as ordinary blocking code, without paying for a
+ * kernel thread per task.
+ *
+ * Switching between two coroutines only has to save what the callee of a function call must preserve according to
+ * the System V x86-64 ABI: rbx, rbp, r12-r15, the stack pointer, and the control words of the SSE (mxcsr) and x87
+ * units. Everything else is caller-saved and already spilled by the compiler around the call to `coro_switch`.
+ * `swapcontext` saves the whole register file and, above all, the signal mask with a `rt_sigprocmask` syscall on
+ * every switch, which is why it is an order of magnitude slower.
+ *
+ * Stacks are `mmap`ed with a PROT_NONE guard page below them, so an overflow faults instead of silently corrupting
+ * the neighbouring memory. Stacks of finished coroutines go back to a per-scheduler pool and are reused by the next
+ * `coro_spawn`, which avoids an mmap/munmap pair per coroutine. The coroutine's control block lives at the top of its
+ * own stack, so spawning needs no other allocation.
+ *
+ * The scheduler is round robin: `coro_sched_run` resumes the coroutines in FIFO order, a yielding coroutine goes to
+ * the back of the queue.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "coroutine.h"
+
+#if !defined(__x86_64__)
+#error "coroutine.c implements the context switch for x86-64 only"
+#endif
+
+/*
+ * void coro_switch(void **from_sp, void *to_sp)
+ * rdi = from_sp, rsi = to_sp
+ */
+__asm__(".text\n"
+        ".globl coro_switch\n"
+        ".type coro_switch, @function\n"
+        "coro_switch:\n"
+        "    pushq %rbp\n"
+        "    pushq %rbx\n"
+        "    pushq %r12\n"
+        "    pushq %r13\n"
+        "    pushq %r14\n"
+        "    pushq %r15\n"
+        "    subq $8, %rsp\n"
+        "    stmxcsr (%rsp)\n"
+        "    fnstcw 4(%rsp)\n"
+        "    movq %rsp, (%rdi)\n"
+        "    movq %rsi, %rsp\n"
+        "    ldmxcsr (%rsp)\n"
+        "    fldcw 4(%rsp)\n"
+        "    addq $8, %rsp\n"
+        "    popq %r15\n"
+        "    popq %r14\n"
+        "    popq %r13\n"
+        "    popq %r12\n"
+        "    popq %rbx\n"
+        "    popq %rbp\n"
+        "    ret\n"
+        ".size coro_switch, .-coro_switch\n"
+        /* First resume of a new coroutine: coro_switch "returns" here with the coroutine in r12. */
+        ".type coro_trampoline, @function\n"
+        "coro_trampoline:\n"
+        "    movq %r12, %rdi\n"
+        "    call coro_main\n"
+        "    ud2\n"
+        ".size coro_trampoline, .-coro_trampoline\n");
+
+void coro_trampoline(void);
+void coro_main(coro_t *coro);
+
+/**
+ * \struct coro_t
+ * \brief Control block, stored at the top of the coroutine's stack.
+ */
+struct coro_t {
+    void *sp;
+    coro_fn_t fn;
+    void *arg;
+    coro_sched_t *sched;
+    coro_t *next;
+    void *stack;
+    int dead;
+};
+
+struct coro_sched_t {
+    void *main_sp;
+    size_t stack_size;
+    size_t page_size;
+    size_t stacks;
+    coro_t *current;
+    coro_t *head;
+    coro_t *tail;
+    /** Finished coroutines whose stacks can be reused. */
+    coro_t *pool;
+};
+
+static _Thread_local coro_sched_t *current_sched;
+
+/**
+ * @param stack_size usable stack size of each coroutine, rounded up to pages
+ * @return the scheduler, or NULL if out of memory
+ */
+coro_sched_t *coro_sched_new(size_t stack_size)
+{
+    coro_sched_t *sched = (coro_sched_t *) calloc(1, sizeof(coro_sched_t));
+
+    if (!sched)
+        return NULL;
+    sched->page_size = (size_t) sysconf(_SC_PAGESIZE);
+    sched->stack_size = (stack_size + sched->page_size - 1) / sched->page_size * sched->page_size;
+    return sched;
+}
+
+/**
+ * Unmaps the pooled stacks. Call it after coro_sched_run returned.
+ */
+void coro_sched_free(coro_sched_t *sched)
+{
+    while (sched->pool) {
+        coro_t *next = sched->pool->next;
+        munmap(sched->pool->stack, sched->stack_size + sched->page_size);
+        sched->pool = next;
+    }
+    free(sched);
+}
+
+/**
+ * @return number of stacks currently mapped, in use or pooled
+ */
+size_t coro_sched_stacks(const coro_sched_t *sched)
+{
+    return sched->stacks;
+}
+
+static coro_t *stack_acquire(coro_sched_t *sched)
+{
+    if (sched->pool) {
+        coro_t *coro = sched->pool;
+        sched->pool = coro->next;
+        return coro;
+    }
+
+    size_t length = sched->stack_size + sched->page_size;
+    unsigned char *stack =
+            (unsigned char *) mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+    if (stack == MAP_FAILED)
+        return NULL;
+    // The stack grows down, so the guard page is the lowest one.
+    if (mprotect(stack, sched->page_size, PROT_NONE) == -1) {
+        munmap(stack, length);
+        return NULL;
+    }
+    coro_t *coro = (coro_t *) (stack + length - sizeof(coro_t));
+    coro->stack = stack;
+    sched->stacks++;
+    return coro;
+}
+
+static void queue_push(coro_sched_t *sched, coro_t *coro)
+{
+    coro->next = NULL;
+    if (sched->tail)
+        sched->tail->next = coro;
+    else
+        sched->head = coro;
+    sched->tail = coro;
+}
+
+/**
+ * Creates a coroutine that runs fn(arg) when the scheduler gets to it.
+ * @return the coroutine, or NULL if no stack could be mapped
+ */
+coro_t *coro_spawn(coro_sched_t *sched, coro_fn_t fn, void *arg)
+{
+    coro_t *coro = stack_acquire(sched);
+
+    if (!coro)
+        return NULL;
+    coro->fn = fn;
+    coro->arg = arg;
+    coro->sched = sched;
+    coro->dead = 0;
+
+    /*
+     * Initial frame, popped by the second half of coro_switch:
+     * [mxcsr | x87 cw] [r15] [r14] [r13] [r12 = coro] [rbx] [rbp] [return address = coro_trampoline]
+     * After `ret` pops the return address rsp is 16-byte aligned, as the ABI requires before the trampoline's call.
+     */
+    uintptr_t top = ((uintptr_t) coro) & ~(uintptr_t) 15;
+    uint64_t *sp = (uint64_t *) top;
+    *--sp = (uint64_t) (uintptr_t) coro_trampoline;
+    *--sp = 0;                           // rbp
+    *--sp = 0;                           // rbx
+    *--sp = (uint64_t) (uintptr_t) coro; // r12
+    *--sp = 0;                           // r13
+    *--sp = 0;                           // r14
+    *--sp = 0;                           // r15
+    // Default mxcsr in the low 32 bits, default x87 control word above it.
+    *--sp = 0x1f80u | (UINT64_C(0x037f) << 32);
+    coro->sp = sp;
+    queue_push(sched, coro);
+    return coro;
+}
+
+/**
+ * Entry point of every coroutine, reached through coro_trampoline. It never returns: after fn the coroutine is marked
+ * dead and control goes back to the scheduler for good.
+ */
+void coro_main(coro_t *coro)
+{
+    coro->fn(coro->arg);
+    coro->dead = 1;
+    coro_switch(&coro->sp, coro->sched->main_sp);
+    __builtin_unreachable();
+}
+
+/**
+ * Gives the CPU to the next coroutine. Must be called from inside a coroutine.
+ */
+void coro_yield(void)
+{
+    coro_t *coro = current_sched->current;
+    coro_switch(&coro->sp, current_sched->main_sp);
+}
+
+/**
+ * Runs the coroutines round robin until all of them finished. Coroutines may spawn more coroutines.
+ */
+void coro_sched_run(coro_sched_t *sched)
+{
+    coro_sched_t *saved = current_sched;
+
+    current_sched = sched;
+    while (sched->head) {
+        coro_t *coro = sched->head;
+        sched->head = coro->next;
+        if (!sched->head)
+            sched->tail = NULL;
+        sched->current = coro;
+        coro_switch(&sched->main_sp, coro->sp);
+        if (coro->dead) {
+            coro->next = sched->pool;
+            sched->pool = coro;
+        } else {
+            queue_push(sched, coro);
+        }
+    }
+    sched->current = NULL;
+    current_sched = saved;
+}
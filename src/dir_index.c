@@ -0,0 +1,924 @@
+/** \file dir_index.c
+ *
+ * @brief In-memory index of a directory tree, built once and kept current with inotify
+ *
+ * A tree that is rescanned to stay current costs a full walk per rescan, however little changed, and is stale for
+ * half the rescan period on average. Here the tree is scanned once, every directory gets an inotify watch, and each
+ * event updates one entry: the cost follows the changes, not the size of the tree, and the index is current as soon
+ * as the events are read.
+ *
+ * Entries are nodes in one array, addressed by index so that the array can grow. A directory links its children in
+ * a list; one hash table keyed by (parent, name) finds a child without walking that list; a swiss_map_t maps watch
+ * descriptors to directories. Paths are not stored, only names, so renaming a directory is a relink of one node and
+ * its watches, which follow the inode, stay valid.
+ *
+ * Every directory keeps the totals of its subtree: files, directories, bytes, and a histogram of file sizes in
+ * power-of-two buckets. A change updates the ancestors, which costs the depth of the entry. In return, the size of any
+ * subtree is read from one node, and size queries skip subtrees whose histograms have no file in the range; counting
+ * even takes whole buckets from the histogram and only descends for the two buckets the bounds fall into.
+ *
+ * inotify has limits to cope with:
+ *
+ * - Watches are per directory, so a new directory is watched and then scanned, in that order: what is created in it
+ *   before the watch exists is found by the scan, what comes after by an event, and seeing both is harmless.
+ * - A rename is an IN_MOVED_FROM and an IN_MOVED_TO with the same cookie. The moved node is detached at the first and
+ *   attached again at the second; a node whose second half never comes was moved out of the tree and is dropped.
+ * - The event queue is bounded (fs.inotify.max_queued_events). When it overflows, events are lost and IN_Q_OVERFLOW
+ *   is queued; the index then resyncs with a full scan that marks every entry it sees with a new generation and
+ *   sweeps the rest.
+ * - Directories beyond fs.inotify.max_user_watches cannot be watched. They are indexed but not kept current, and
+ *   counted in watch_failures.
+ */
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "dir_index.h"
+#include "swiss_map.h"
+
+#define NO_NODE (-1)
+#define ROOT 0
+/** Bucket 0 holds empty files, bucket b > 0 the sizes in [2^(b-1), 2^b). */
+#define HIST_BUCKETS 65
+#define EVENT_BUFFER (64 * 1024)
+#define WATCH_MASK                                                                                                     \
+    (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_ONLYDIR |      \
+     IN_EXCL_UNLINK)
+
+typedef struct {
+    dir_totals_t totals;
+    uint32_t histogram[HIST_BUCKETS];
+} dir_stats_t;
+
+typedef struct {
+    char *name;
+    uint64_t size;
+    uint64_t generation;
+    /** Directories only; a node is a directory iff it has stats. */
+    dir_stats_t *stats;
+    uint32_t hash;
+    int parent;
+    int first_child;
+    int prev_sibling;
+    int next_sibling;
+    int hash_next;
+    int wd;
+} node_t;
+
+typedef struct {
+    uint32_t cookie;
+    int node;
+} pending_move_t;
+
+struct dir_index_t {
+    int inotify_fd;
+    int root_fd;
+    char *root;
+    node_t *nodes;
+    size_t node_capacity;
+    size_t node_used;
+    int free_node;
+    int *buckets;
+    size_t bucket_count;
+    size_t entries;
+    size_t dirs;
+    size_t name_bytes;
+    swiss_map_t *watches;
+    uint64_t generation;
+    pending_move_t *moves;
+    size_t move_count;
+    size_t move_capacity;
+    uint64_t events;
+    uint64_t resyncs;
+    uint64_t watch_failures;
+    int overflow;
+};
+
+static int size_bucket(uint64_t size)
+{
+    return size ? 64 - __builtin_clzll(size) : 0;
+}
+
+static uint64_t bucket_low(int bucket)
+{
+    return bucket ? UINT64_C(1) << (bucket - 1) : 0;
+}
+
+static uint64_t bucket_high(int bucket)
+{
+    return bucket == 0 ? 0 : bucket == 64 ? UINT64_MAX : (UINT64_C(1) << bucket) - 1;
+}
+
+static uint32_t name_hash(int parent, const char *name, size_t length)
+{
+    uint32_t hash = 2166136261u ^ ((uint32_t) parent * 0x9e3779b1u);
+
+    for (size_t i = 0; i < length; i++)
+        hash = (hash ^ (unsigned char) name[i]) * 16777619u;
+    return hash;
+}
+
+static int node_find(const dir_index_t *index, int parent, const char *name, size_t length)
+{
+    uint32_t hash = name_hash(parent, name, length);
+
+    for (int id = index->buckets[hash & (index->bucket_count - 1)]; id != NO_NODE; id = index->nodes[id].hash_next) {
+        const node_t *node = &index->nodes[id];
+        if (node->hash == hash && node->parent == parent && strncmp(node->name, name, length) == 0 &&
+            node->name[length] == '\0')
+            return id;
+    }
+    return NO_NODE;
+}
+
+static int hash_grow(dir_index_t *index)
+{
+    size_t count = index->bucket_count * 2;
+    int *buckets = (int *) malloc(count * sizeof(int));
+
+    if (!buckets)
+        return -1;
+    for (size_t i = 0; i < count; i++)
+        buckets[i] = NO_NODE;
+    for (size_t i = 0; i < index->bucket_count; i++) {
+        for (int id = index->buckets[i], next; id != NO_NODE; id = next) {
+            next = index->nodes[id].hash_next;
+            size_t bucket = index->nodes[id].hash & (count - 1);
+            index->nodes[id].hash_next = buckets[bucket];
+            buckets[bucket] = id;
+        }
+    }
+    free(index->buckets);
+    index->buckets = buckets;
+    index->bucket_count = count;
+    return 0;
+}
+
+static void hash_insert(dir_index_t *index, int id)
+{
+    node_t *node = &index->nodes[id];
+    size_t bucket = node->hash & (index->bucket_count - 1);
+
+    node->hash_next = index->buckets[bucket];
+    index->buckets[bucket] = id;
+}
+
+static void hash_remove(dir_index_t *index, int id)
+{
+    int *link = &index->buckets[index->nodes[id].hash & (index->bucket_count - 1)];
+
+    while (*link != id)
+        link = &index->nodes[*link].hash_next;
+    *link = index->nodes[id].hash_next;
+}
+
+/**
+ * Adds (sign 1) or removes (sign -1) what a node counts for to the totals of its ancestors, starting at parent.
+ */
+static void account(dir_index_t *index, int parent, int id, int sign)
+{
+    const node_t *node = &index->nodes[id];
+    const dir_stats_t *sub = node->stats;
+    int bucket = size_bucket(node->size);
+
+    for (int p = parent; p != NO_NODE; p = index->nodes[p].parent) {
+        dir_stats_t *stats = index->nodes[p].stats;
+        if (!sub) {
+            stats->totals.files += (uint64_t) (int64_t) sign;
+            stats->totals.bytes += (uint64_t) ((int64_t) sign * (int64_t) node->size);
+            stats->histogram[bucket] += (uint32_t) sign;
+            continue;
+        }
+        stats->totals.dirs += (uint64_t) ((int64_t) sign * (int64_t) (sub->totals.dirs + 1));
+        stats->totals.files += (uint64_t) ((int64_t) sign * (int64_t) sub->totals.files);
+        stats->totals.bytes += (uint64_t) ((int64_t) sign * (int64_t) sub->totals.bytes);
+        for (int b = 0; b < HIST_BUCKETS; b++)
+            stats->histogram[b] += (uint32_t) ((int64_t) sign * (int64_t) sub->histogram[b]);
+    }
+}
+
+static void resize_file(dir_index_t *index, int id, uint64_t size)
+{
+    node_t *node = &index->nodes[id];
+    int old_bucket = size_bucket(node->size), new_bucket = size_bucket(size);
+
+    for (int p = node->parent; p != NO_NODE; p = index->nodes[p].parent) {
+        dir_stats_t *stats = index->nodes[p].stats;
+        stats->totals.bytes += size - node->size;
+        stats->histogram[old_bucket]--;
+        stats->histogram[new_bucket]++;
+    }
+    node->size = size;
+}
+
+/** Links a detached node under parent with the given name. */
+static int attach(dir_index_t *index, int id, int parent, const char *name)
+{
+    size_t length = strlen(name);
+
+    if (!index->nodes[id].name || strcmp(index->nodes[id].name, name) != 0) {
+        char *copy = (char *) malloc(length + 1);
+        if (!copy)
+            return -1;
+        memcpy(copy, name, length + 1);
+        if (index->nodes[id].name)
+            index->name_bytes -= strlen(index->nodes[id].name) + 1;
+        free(index->nodes[id].name);
+        index->nodes[id].name = copy;
+        index->name_bytes += length + 1;
+    }
+    if (index->entries >= index->bucket_count && hash_grow(index) == -1)
+        return -1;
+
+    node_t *node = &index->nodes[id];
+    node->parent = parent;
+    node->hash = name_hash(parent, name, length);
+    node->prev_sibling = NO_NODE;
+    node->next_sibling = index->nodes[parent].first_child;
+    if (node->next_sibling != NO_NODE)
+        index->nodes[node->next_sibling].prev_sibling = id;
+    index->nodes[parent].first_child = id;
+    hash_insert(index, id);
+    index->entries++;
+    account(index, parent, id, 1);
+    return 0;
+}
+
+/** Unlinks a node and its subtree from its parent; the subtree stays intact. */
+static void detach(dir_index_t *index, int id)
+{
+    node_t *node = &index->nodes[id];
+
+    account(index, node->parent, id, -1);
+    hash_remove(index, id);
+    if (node->prev_sibling != NO_NODE)
+        index->nodes[node->prev_sibling].next_sibling = node->next_sibling;
+    else
+        index->nodes[node->parent].first_child = node->next_sibling;
+    if (node->next_sibling != NO_NODE)
+        index->nodes[node->next_sibling].prev_sibling = node->prev_sibling;
+    node->parent = NO_NODE;
+    index->entries--;
+}
+
+/** Frees a detached subtree and removes its watches. */
+static void free_subtree(dir_index_t *index, int id)
+{
+    for (int child = index->nodes[id].first_child, next; child != NO_NODE; child = next) {
+        next = index->nodes[child].next_sibling;
+        hash_remove(index, child);
+        index->entries--;
+        free_subtree(index, child);
+    }
+    node_t *node = &index->nodes[id];
+    if (node->wd >= 0) {
+        swiss_erase(index->watches, node->wd);
+        inotify_rm_watch(index->inotify_fd, node->wd);
+    }
+    if (node->stats) {
+        free(node->stats);
+        index->dirs--;
+    }
+    index->name_bytes -= strlen(node->name) + 1;
+    free(node->name);
+    memset(node, 0, sizeof(*node));
+    node->parent = NO_NODE;
+    node->next_sibling = index->free_node;
+    index->free_node = id;
+}
+
+static void remove_subtree(dir_index_t *index, int id)
+{
+    detach(index, id);
+    free_subtree(index, id);
+}
+
+static int node_new(dir_index_t *index, int is_dir)
+{
+    int id = index->free_node;
+
+    if (id != NO_NODE) {
+        index->free_node = index->nodes[id].next_sibling;
+    } else {
+        if (index->node_used == index->node_capacity) {
+            size_t capacity = index->node_capacity ? index->node_capacity * 2 : 1024;
+            node_t *nodes = (node_t *) realloc(index->nodes, capacity * sizeof(node_t));
+            if (!nodes)
+                return NO_NODE;
+            index->nodes = nodes;
+            index->node_capacity = capacity;
+        }
+        id = (int) index->node_used++;
+    }
+    node_t *node = &index->nodes[id];
+    memset(node, 0, sizeof(*node));
+    node->parent = node->first_child = node->prev_sibling = node->next_sibling = node->hash_next = NO_NODE;
+    node->wd = -1;
+    node->generation = index->generation;
+    if (is_dir) {
+        if (!(node->stats = (dir_stats_t *) calloc(1, sizeof(dir_stats_t)))) {
+            node->next_sibling = index->free_node;
+            index->free_node = id;
+            return NO_NODE;
+        }
+        index->dirs++;
+    }
+    return id;
+}
+
+/**
+ * @return whether the node is in the tree, not in a subtree that was moved out and waits for its IN_MOVED_TO
+ */
+static int attached(const dir_index_t *index, int id)
+{
+    while (id != ROOT && id != NO_NODE)
+        id = index->nodes[id].parent;
+    return id == ROOT;
+}
+
+/**
+ * Writes the path of a node relative to the root, "." for the root.
+ * @return 0, or -1 if it does not fit or the node is detached
+ */
+static int node_path(const dir_index_t *index, int id, char *path, size_t size)
+{
+    size_t length = 0;
+
+    if (id == ROOT) {
+        if (size < 2)
+            return -1;
+        memcpy(path, ".", 2);
+        return 0;
+    }
+    for (int p = id; p != ROOT; p = index->nodes[p].parent) {
+        if (p == NO_NODE)
+            return -1;
+        length += strlen(index->nodes[p].name) + (p == id ? 0 : 1);
+    }
+    if (length + 1 > size)
+        return -1;
+    path[length] = '\0';
+    for (int p = id; p != ROOT; p = index->nodes[p].parent) {
+        size_t name_length = strlen(index->nodes[p].name);
+        length -= name_length;
+        memcpy(path + length, index->nodes[p].name, name_length);
+        if (length)
+            path[--length] = '/';
+    }
+    return 0;
+}
+
+/**
+ * Inserts or updates the entry name of the directory parent.
+ * @return the node, or NO_NODE if out of memory
+ */
+static int upsert(dir_index_t *index, int parent, const char *name, const struct stat *st)
+{
+    int is_dir = S_ISDIR(st->st_mode);
+    uint64_t size = is_dir ? 0 : (uint64_t) st->st_size;
+    int id = node_find(index, parent, name, strlen(name));
+
+    if (id != NO_NODE && (index->nodes[id].stats != NULL) != is_dir) {
+        remove_subtree(index, id);
+        id = NO_NODE;
+    }
+    if (id != NO_NODE) {
+        if (!is_dir && index->nodes[id].size != size)
+            resize_file(index, id, size);
+        index->nodes[id].generation = index->generation;
+        return id;
+    }
+    if ((id = node_new(index, is_dir)) == NO_NODE)
+        return NO_NODE;
+    index->nodes[id].size = size;
+    if (attach(index, id, parent, name) == -1) {
+        free(index->nodes[id].stats);
+        index->nodes[id].next_sibling = index->free_node;
+        index->free_node = id;
+        return NO_NODE;
+    }
+    return id;
+}
+
+static void watch(dir_index_t *index, int id)
+{
+    char relative[PATH_MAX], path[PATH_MAX + 1024];
+
+    if (index->nodes[id].wd >= 0 || node_path(index, id, relative, sizeof(relative)) == -1)
+        return;
+    snprintf(path, sizeof(path), "%s/%s", index->root, relative);
+    int wd = inotify_add_watch(index->inotify_fd, path, WATCH_MASK);
+    if (wd == -1) {
+        index->watch_failures++;
+        return;
+    }
+    int other;
+    // The same directory reached twice, e.g. through a bind mount, keeps its first node.
+    if (swiss_find(index->watches, wd, &other) && other != id)
+        return;
+    swiss_insert(index->watches, wd, id);
+    index->nodes[id].wd = wd;
+}
+
+/**
+ * Watches and scans a directory and, recursively, its subdirectories. Entries not seen in this generation are
+ * removed.
+ * @return 0, or -1 with errno set if out of memory
+ */
+static int scan(dir_index_t *index, int dir)
+{
+    char path[PATH_MAX];
+
+    watch(index, dir);
+    if (node_path(index, dir, path, sizeof(path)) == -1)
+        return 0;
+    int fd = openat(index->root_fd, path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    DIR *dp = fd == -1 ? NULL : fdopendir(fd);
+    if (dp) {
+        struct dirent *entry;
+        struct stat st;
+        while ((entry = readdir(dp)) != NULL) {
+            const char *name = entry->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+                continue;
+            if (fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) == -1)
+                continue;
+            if (upsert(index, dir, name, &st) == NO_NODE) {
+                closedir(dp);
+                errno = ENOMEM;
+                return -1;
+            }
+        }
+        closedir(dp);
+    } else if (fd != -1) {
+        close(fd);
+    }
+
+    // Sweep what is gone, then descend; the directory is closed by now, so the depth costs no descriptors.
+    for (int child = index->nodes[dir].first_child, next; child != NO_NODE; child = next) {
+        next = index->nodes[child].next_sibling;
+        if (index->nodes[child].generation != index->generation)
+            remove_subtree(index, child);
+        else if (index->nodes[child].stats && scan(index, child) == -1)
+            return -1;
+    }
+    return 0;
+}
+
+/**
+ * Scans the whole tree again, e.g. after the event queue overflowed. Unchanged entries stay as they are.
+ * @return 0, or -1 with errno set
+ */
+int dir_index_rescan(dir_index_t *index)
+{
+    index->generation++;
+    index->nodes[ROOT].generation = index->generation;
+    return scan(index, ROOT);
+}
+
+/**
+ * Scans the tree under root and starts watching it.
+ * @return the index, or NULL with errno set
+ */
+dir_index_t *dir_index_open(const char *root)
+{
+    dir_index_t *index = (dir_index_t *) calloc(1, sizeof(dir_index_t));
+    int error;
+
+    if (!index)
+        return NULL;
+    index->inotify_fd = index->root_fd = -1;
+    index->free_node = NO_NODE;
+    index->bucket_count = 1024;
+    index->root = strdup(root);
+    index->buckets = (int *) malloc(index->bucket_count * sizeof(int));
+    index->watches = swiss_new(64);
+    if (!index->root || !index->buckets || !index->watches)
+        goto fail;
+    for (size_t i = 0; i < index->bucket_count; i++)
+        index->buckets[i] = NO_NODE;
+    if ((index->root_fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1 ||
+        (index->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1)
+        goto fail;
+    if (node_new(index, 1) != ROOT || !(index->nodes[ROOT].name = strdup("")))
+        goto fail;
+    index->name_bytes = 1;
+    if (scan(index, ROOT) == -1)
+        goto fail;
+    return index;
+
+fail:
+    error = errno ? errno : ENOMEM;
+    dir_index_close(index);
+    errno = error;
+    return NULL;
+}
+
+void dir_index_close(dir_index_t *index)
+{
+    for (size_t i = 0; i < index->node_used; i++) {
+        free(index->nodes[i].name);
+        free(index->nodes[i].stats);
+    }
+    free(index->nodes);
+    free(index->moves);
+    free(index->buckets);
+    if (index->watches)
+        swiss_free(index->watches);
+    if (index->inotify_fd != -1)
+        close(index->inotify_fd);
+    if (index->root_fd != -1)
+        close(index->root_fd);
+    free(index->root);
+    free(index);
+}
+
+/**
+ * @return the inotify descriptor, readable when dir_index_update has work; for poll or an event loop
+ */
+int dir_index_fd(const dir_index_t *index)
+{
+    return index->inotify_fd;
+}
+
+/** Stats name in directory dir and updates the index with the result; new directories are scanned. */
+static int refresh(dir_index_t *index, int dir, const char *name)
+{
+    char path[PATH_MAX];
+    struct stat st;
+    size_t length;
+
+    if (node_path(index, dir, path, sizeof(path)) == -1 || (length = strlen(path)) + strlen(name) + 2 > sizeof(path))
+        return 0;
+    path[length] = '/';
+    strcpy(path + length + 1, name);
+    if (fstatat(index->root_fd, path, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+        // Gone again before we looked: its IN_DELETE is on the way or was already handled.
+        int id = node_find(index, dir, name, strlen(name));
+        if (id != NO_NODE)
+            remove_subtree(index, id);
+        return 0;
+    }
+    int id = upsert(index, dir, name, &st);
+    if (id == NO_NODE)
+        return -1;
+    if (index->nodes[id].stats && index->nodes[id].wd < 0)
+        return scan(index, id);
+    return 0;
+}
+
+static int handle_event(dir_index_t *index, const struct inotify_event *event)
+{
+    int dir, id;
+
+    index->events++;
+    if (event->mask & IN_Q_OVERFLOW) {
+        index->overflow = 1;
+        return 0;
+    }
+    if (!swiss_find(index->watches, event->wd, &dir))
+        return 0;
+    if (event->mask & IN_IGNORED) {
+        swiss_erase(index->watches, event->wd);
+        if (index->nodes[dir].wd == event->wd)
+            index->nodes[dir].wd = -1;
+        return 0;
+    }
+    // Events about the watched directory itself come as events about an entry of its parent too. A directory that was
+    // moved out keeps its watches until the end of the update; what happens in it is no longer in the tree.
+    if (event->len == 0 || index->overflow || !attached(index, dir))
+        return 0;
+
+    const char *name = event->name;
+    if (event->mask & (IN_MOVED_FROM | IN_DELETE)) {
+        if ((id = node_find(index, dir, name, strlen(name))) == NO_NODE)
+            return 0;
+        if (event->mask & IN_DELETE) {
+            remove_subtree(index, id);
+            return 0;
+        }
+        if (index->move_count == index->move_capacity) {
+            size_t capacity = index->move_capacity ? index->move_capacity * 2 : 16;
+            pending_move_t *moves = (pending_move_t *) realloc(index->moves, capacity * sizeof(pending_move_t));
+            if (!moves)
+                return -1;
+            index->moves = moves;
+            index->move_capacity = capacity;
+        }
+        detach(index, id);
+        index->moves[index->move_count++] = (pending_move_t) {event->cookie, id};
+        return 0;
+    }
+    if (event->mask & IN_MOVED_TO) {
+        for (size_t i = 0; i < index->move_count; i++) {
+            if (index->moves[i].cookie != event->cookie)
+                continue;
+            id = index->moves[i].node;
+            index->moves[i] = index->moves[--index->move_count];
+            // A rename replaces what had the target name.
+            int replaced = node_find(index, dir, name, strlen(name));
+            if (replaced != NO_NODE)
+                remove_subtree(index, replaced);
+            if (attach(index, id, dir, name) == -1)
+                return -1;
+            return 0;
+        }
+    }
+    return refresh(index, dir, name);
+}
+
+/**
+ * Applies the pending events, waiting up to timeout_ms for the first one (0 to only take what is there, -1 forever).
+ * Resyncs if the queue overflowed.
+ * @return number of events applied, or -1 with errno set
+ */
+int dir_index_update(dir_index_t *index, int timeout_ms)
+{
+    _Alignas(struct inotify_event) char buffer[EVENT_BUFFER];
+    int applied = 0;
+
+    if (timeout_ms != 0) {
+        struct pollfd pfd = {.fd = index->inotify_fd, .events = POLLIN};
+        if (poll(&pfd, 1, timeout_ms) == -1 && errno != EINTR)
+            return -1;
+    }
+    for (;;) {
+        ssize_t n = read(index->inotify_fd, buffer, sizeof(buffer));
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN)
+                break;
+            return -1;
+        }
+        for (ssize_t offset = 0; offset < n;) {
+            const struct inotify_event *event = (const struct inotify_event *) (buffer + offset);
+            if (handle_event(index, event) == -1)
+                return -1;
+            offset += (ssize_t) (sizeof(struct inotify_event) + event->len);
+            applied++;
+        }
+    }
+
+    // Moved out of the tree, or the IN_MOVED_TO was lost in an overflow.
+    for (size_t i = 0; i < index->move_count; i++)
+        free_subtree(index, index->moves[i].node);
+    index->move_count = 0;
+    if (index->overflow) {
+        index->overflow = 0;
+        index->resyncs++;
+        if (dir_index_rescan(index) == -1)
+            return -1;
+    }
+    return applied;
+}
+
+/**
+ * @return the node of a relative path ("" or "." for the root), or NO_NODE
+ */
+static int resolve(const dir_index_t *index, const char *path, size_t length)
+{
+    int id = ROOT;
+
+    for (size_t begin = 0; begin < length && id != NO_NODE;) {
+        size_t end = begin;
+        while (end < length && path[end] != '/')
+            end++;
+        if (end > begin && !(end - begin == 1 && path[begin] == '.'))
+            id = node_find(index, id, path + begin, end - begin);
+        begin = end + 1;
+    }
+    return id;
+}
+
+/**
+ * Splits "dir/name-prefix" into the node of dir and the name prefix.
+ * @return the directory node, or NO_NODE with errno set
+ */
+static int split_prefix(const dir_index_t *index, const char *prefix, const char **name)
+{
+    const char *slash = strrchr(prefix, '/');
+    int dir = slash ? resolve(index, prefix, (size_t) (slash - prefix)) : ROOT;
+
+    *name = slash ? slash + 1 : prefix;
+    if (dir == NO_NODE) {
+        errno = ENOENT;
+        return NO_NODE;
+    }
+    if (!index->nodes[dir].stats) {
+        errno = ENOTDIR;
+        return NO_NODE;
+    }
+    return dir;
+}
+
+/**
+ * Sums the entries whose paths start with prefix: "src/" is everything under src, "src/ma" everything under src
+ * whose name starts with "ma", and "" the whole tree.
+ * @return 0, or -1 with errno set if the directory part does not exist
+ */
+int dir_index_totals(const dir_index_t *index, const char *prefix, dir_totals_t *totals)
+{
+    const char *name;
+    int dir = split_prefix(index, prefix, &name);
+    size_t length = strlen(name);
+
+    if (dir == NO_NODE)
+        return -1;
+    if (length == 0) {
+        *totals = index->nodes[dir].stats->totals;
+        return 0;
+    }
+    memset(totals, 0, sizeof(*totals));
+    for (int id = index->nodes[dir].first_child; id != NO_NODE; id = index->nodes[id].next_sibling) {
+        const node_t *node = &index->nodes[id];
+        if (strncmp(node->name, name, length) != 0)
+            continue;
+        if (!node->stats) {
+            totals->files++;
+            totals->bytes += node->size;
+            continue;
+        }
+        totals->dirs += node->stats->totals.dirs + 1;
+        totals->files += node->stats->totals.files;
+        totals->bytes += node->stats->totals.bytes;
+    }
+    return 0;
+}
+
+/** Counts files in [min_size, max_size] of the buckets first and last only; the others come from histograms. */
+static long count_edges(const dir_index_t *index, int dir, int first, int last, uint64_t min_size, uint64_t max_size)
+{
+    long count = 0;
+
+    for (int id = index->nodes[dir].first_child; id != NO_NODE; id = index->nodes[id].next_sibling) {
+        const node_t *node = &index->nodes[id];
+        if (!node->stats) {
+            int bucket = size_bucket(node->size);
+            count += (bucket == first || bucket == last) && node->size >= min_size && node->size <= max_size;
+        } else if (node->stats->histogram[first] || node->stats->histogram[last]) {
+            count += count_edges(index, id, first, last, min_size, max_size);
+        }
+    }
+    return count;
+}
+
+static long count_in(const dir_index_t *index, int id, uint64_t min_size, uint64_t max_size)
+{
+    const node_t *node = &index->nodes[id];
+    int first = size_bucket(min_size), last = size_bucket(max_size);
+    long count = 0;
+
+    if (!node->stats)
+        return node->size >= min_size && node->size <= max_size;
+    for (int b = first; b <= last; b++)
+        if (bucket_low(b) >= min_size && bucket_high(b) <= max_size)
+            count += node->stats->histogram[b];
+    // Buckets the bounds cut through need a look at the files.
+    int edge_first = bucket_low(first) >= min_size && bucket_high(first) <= max_size ? -1 : first;
+    int edge_last = bucket_low(last) >= min_size && bucket_high(last) <= max_size ? -1 : last;
+    if (edge_first == -1 && edge_last == -1)
+        return count;
+    if (edge_first == -1)
+        edge_first = edge_last;
+    if (edge_last == -1)
+        edge_last = edge_first;
+    return count + count_edges(index, id, edge_first, edge_last, min_size, max_size);
+}
+
+/**
+ * Counts the files under prefix (as for dir_index_totals) with sizes in [min_size, max_size].
+ * @return the count, or -1 with errno set
+ */
+long dir_index_count_size(const dir_index_t *index, const char *prefix, uint64_t min_size, uint64_t max_size)
+{
+    const char *name;
+    int dir = split_prefix(index, prefix, &name);
+    size_t length = strlen(name);
+    long count = 0;
+
+    if (dir == NO_NODE)
+        return -1;
+    if (min_size > max_size)
+        return 0;
+    if (length == 0)
+        return count_in(index, dir, min_size, max_size);
+    for (int id = index->nodes[dir].first_child; id != NO_NODE; id = index->nodes[id].next_sibling)
+        if (strncmp(index->nodes[id].name, name, length) == 0)
+            count += count_in(index, id, min_size, max_size);
+    return count;
+}
+
+typedef struct {
+    const dir_index_t *index;
+    uint64_t min_size;
+    uint64_t max_size;
+    int first;
+    int last;
+    dir_entry_fn_t fn;
+    void *ctx;
+    char path[PATH_MAX];
+} query_t;
+
+static int has_sizes_in(const query_t *query, const dir_stats_t *stats)
+{
+    for (int b = query->first; b <= query->last; b++)
+        if (stats->histogram[b])
+            return 1;
+    return 0;
+}
+
+static int query_node(query_t *query, int id, size_t length)
+{
+    const node_t *node = &query->index->nodes[id];
+    size_t name_length = strlen(node->name);
+
+    if (length + name_length + 2 > sizeof(query->path))
+        return 0;
+    memcpy(query->path + length, node->name, name_length + 1);
+    length += name_length;
+    if (!node->stats) {
+        if (node->size >= query->min_size && node->size <= query->max_size)
+            return query->fn(query->path, node->size, 0, query->ctx);
+        return 0;
+    }
+    if (query->min_size == 0 && query->fn(query->path, 0, 1, query->ctx))
+        return 1;
+    if (!has_sizes_in(query, node->stats) && query->min_size > 0)
+        return 0;
+    query->path[length++] = '/';
+    for (int child = node->first_child; child != NO_NODE; child = query->index->nodes[child].next_sibling)
+        if (query_node(query, child, length))
+            return 1;
+    return 0;
+}
+
+/**
+ * Calls fn for every file under prefix (as for dir_index_totals) with a size in [min_size, max_size], and for every
+ * directory if min_size is 0. Subtrees without files in the range are skipped.
+ * @return 0, or -1 with errno set
+ */
+int dir_index_query(const dir_index_t *index, const char *prefix, uint64_t min_size, uint64_t max_size,
+                    dir_entry_fn_t fn, void *ctx)
+{
+    const char *name;
+    int dir = split_prefix(index, prefix, &name);
+    size_t length = strlen(name);
+
+    if (dir == NO_NODE)
+        return -1;
+    if (min_size > max_size)
+        return 0;
+    query_t *query = (query_t *) malloc(sizeof(query_t));
+    if (!query)
+        return -1;
+    *query = (query_t) {index, min_size, max_size, size_bucket(min_size), size_bucket(max_size), fn, ctx, ""};
+    size_t base = 0;
+    if (dir != ROOT && node_path(index, dir, query->path, sizeof(query->path)) == 0) {
+        base = strlen(query->path);
+        query->path[base++] = '/';
+    }
+    for (int id = index->nodes[dir].first_child; id != NO_NODE; id = index->nodes[id].next_sibling)
+        if (strncmp(index->nodes[id].name, name, length) == 0 && query_node(query, id, base))
+            break;
+    free(query);
+    return 0;
+}
+
+/**
+ * @return 0 and the entry at path, or -1 with errno ENOENT
+ */
+int dir_index_lookup(const dir_index_t *index, const char *path, uint64_t *size, int *is_dir)
+{
+    int id = resolve(index, path, strlen(path));
+
+    if (id == NO_NODE) {
+        errno = ENOENT;
+        return -1;
+    }
+    *size = index->nodes[id].size;
+    *is_dir = index->nodes[id].stats != NULL;
+    return 0;
+}
+
+void dir_index_stats(const dir_index_t *index, dir_index_stats_t *stats)
+{
+    stats->entries = index->entries;
+    stats->watches = swiss_size(index->watches);
+    stats->memory = index->node_capacity * sizeof(node_t) + index->name_bytes + index->dirs * sizeof(dir_stats_t) +
+                    index->bucket_count * sizeof(int) + swiss_capacity(index->watches) * (2 * sizeof(int) + 1);
+    stats->events = index->events;
+    stats->resyncs = index->resyncs;
+    stats->watch_failures = index->watch_failures;
+}
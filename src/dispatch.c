@@ -0,0 +1,289 @@
+/** \file dispatch.c
+ *
+ * @brief The cost of polymorphism in C
+ *
+ * function.c says that function pointers are the only way to support polymorphism in C. The usual shape is a virtual
+ * table: every object starts with a pointer to a table of function pointers shared by all objects of the same type, and
+ * a behavior call becomes `obj->vtable->update(obj)`.
+ *
+ * An indirect call is cheap when the branch predictor guesses its target. In a mixed array of objects the target
+ * changes from one element to the next, the predictor misses and the compiler cannot inline anything. This program
+ * runs the same mixed array through four dispatch strategies:
+ *
+ * | Strategy   | How the behavior is selected                                          |
+ * | ---------- | --------------------------------------------------------------------- |
+ * | `vtable`   | indirect call through the object's virtual table                      |
+ * | `switch`   | `switch` on a type tag stored in the object, direct (inlinable) calls |
+ * | `sorted`   | objects grouped by type first, then the same indirect call            |
+ * | `batch`    | objects grouped by type, one macro-generated monomorphic loop per type |
+ *
+ * Grouping costs one counting-sort pass, which is amortized when the same population is updated many times.
+ *
+ * \code{.sh}
+ * ./dispatch [number-of-objects] [rounds]
+ * \endcode
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bench.h"
+
+/**
+ * X-macro list of every concrete type. Adding a type here adds its tag, its virtual table and its batch loop.
+ */
+#define OBJECT_TYPES(X)                                                                                                \
+    X(ENGINE, engine)                                                                                                  \
+    X(GUN, gun)                                                                                                        \
+    X(CAR, car)
+
+typedef enum {
+#define AS_TAG(TAG, name) TYPE_##TAG,
+    OBJECT_TYPES(AS_TAG)
+#undef AS_TAG
+    TYPE_COUNT
+} type_tag_t;
+
+struct object_t;
+
+/**
+ * \struct object_vtable_t
+ * \brief The virtual table. One instance per type, shared by all objects of that type.
+ */
+typedef struct {
+    void (*update)(struct object_t *);
+    const char *name;
+} object_vtable_t;
+
+/**
+ * \struct object_t
+ * \brief Base "class". Derived types nest it as their first field, the same way student_t nests person_t in
+ * c_style_oop.c, so a pointer to any derived object is also a valid object_t pointer.
+ */
+typedef struct object_t {
+    const object_vtable_t *vtable;
+    type_tag_t tag;
+} object_t;
+
+typedef enum {
+    ON,
+    OFF
+} state_t;
+
+typedef struct {
+    object_t base;
+    state_t state;
+    double temperature;
+} engine_t;
+
+typedef struct {
+    object_t base;
+    int bullets;
+} gun_t;
+
+typedef struct {
+    object_t base;
+    double speed;
+    double fuel;
+} car_t;
+
+/* Behaviors, the same ones c_style_oop.c implements. */
+static void engine_update(engine_t *engine)
+{
+    if (engine->state == ON) {
+        engine->state = OFF;
+        engine->temperature = 15;
+    } else {
+        engine->state = ON;
+        engine->temperature = 75;
+    }
+}
+
+static void gun_update(gun_t *gun)
+{
+    if (gun->bullets > 0)
+        gun->bullets--;
+    else
+        gun->bullets = 30;
+}
+
+static void car_update(car_t *car)
+{
+    car->speed += 0.05;
+    car->fuel -= 1.0;
+    if (car->fuel < 0.0)
+        car->fuel = 100.0;
+}
+
+/* Virtual table entries. The wrappers only adapt the argument type. */
+#define DEFINE_VTABLE(TAG, name)                                                                                       \
+    static void name##_virtual_update(object_t *obj) { name##_update((name##_t *) obj); }                              \
+    static const object_vtable_t name##_vtable = {name##_virtual_update, #name};
+OBJECT_TYPES(DEFINE_VTABLE)
+#undef DEFINE_VTABLE
+
+/**
+ * Monomorphic loops. Inside each loop the callee is known at compile time, so it is inlined and the loop has no
+ * indirect branch at all.
+ */
+#define DEFINE_BATCH(TAG, name)                                                                                        \
+    static void name##_update_batch(object_t **objs, size_t count)                                                     \
+    {                                                                                                                  \
+        for (size_t i = 0; i < count; i++)                                                                             \
+            name##_update((name##_t *) objs[i]);                                                                       \
+    }
+OBJECT_TYPES(DEFINE_BATCH)
+#undef DEFINE_BATCH
+
+static object_t *object_new(type_tag_t tag)
+{
+    object_t *obj = NULL;
+
+    switch (tag) {
+#define NEW_CASE(TAG, name)                                                                                            \
+    case TYPE_##TAG:                                                                                                   \
+        obj = (object_t *) calloc(1, sizeof(name##_t));                                                                \
+        if (obj)                                                                                                       \
+            obj->vtable = &name##_vtable;                                                                              \
+        break;
+        OBJECT_TYPES(NEW_CASE)
+#undef NEW_CASE
+        case TYPE_COUNT:
+            break;
+    }
+    if (obj)
+        obj->tag = tag;
+    return obj;
+}
+
+static void run_vtable(object_t **objs, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+        objs[i]->vtable->update(objs[i]);
+}
+
+static void run_switch(object_t **objs, size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        switch (objs[i]->tag) {
+#define SWITCH_CASE(TAG, name)                                                                                         \
+    case TYPE_##TAG:                                                                                                   \
+        name##_update((name##_t *) objs[i]);                                                                           \
+        break;
+            OBJECT_TYPES(SWITCH_CASE)
+#undef SWITCH_CASE
+            case TYPE_COUNT:
+                break;
+        }
+    }
+}
+
+/**
+ * Counting sort by type tag. It is stable and O(n), and it fills `starts` so that type t occupies
+ * `sorted[starts[t] .. starts[t + 1])`.
+ */
+static void group_by_type(object_t **objs, object_t **sorted, size_t count, size_t starts[TYPE_COUNT + 1])
+{
+    size_t next[TYPE_COUNT] = {0};
+
+    for (size_t i = 0; i < count; i++)
+        next[objs[i]->tag]++;
+    starts[0] = 0;
+    for (size_t t = 0; t < TYPE_COUNT; t++) {
+        starts[t + 1] = starts[t] + next[t];
+        next[t] = starts[t];
+    }
+    for (size_t i = 0; i < count; i++)
+        sorted[next[objs[i]->tag]++] = objs[i];
+}
+
+static void run_batch(object_t **sorted, const size_t starts[TYPE_COUNT + 1])
+{
+#define BATCH_CALL(TAG, name) name##_update_batch(sorted + starts[TYPE_##TAG], starts[TYPE_##TAG + 1] - starts[TYPE_##TAG]);
+    OBJECT_TYPES(BATCH_CALL)
+#undef BATCH_CALL
+}
+
+typedef enum {
+    STRATEGY_VTABLE,
+    STRATEGY_SWITCH,
+    STRATEGY_SORTED,
+    STRATEGY_BATCH
+} strategy_t;
+
+static const char *strategy_names[] = {"vtable", "switch", "sorted", "batch"};
+
+static void measure(strategy_t strategy, object_t **objs, object_t **sorted, size_t count, int rounds)
+{
+    size_t starts[TYPE_COUNT + 1] = {0};
+    int fd = bench_counter_open(BENCH_BRANCH_MISSES);
+
+    bench_counter_start(fd);
+    uint64_t begin = bench_now_ns();
+    if (strategy == STRATEGY_SORTED || strategy == STRATEGY_BATCH)
+        group_by_type(objs, sorted, count, starts);
+    for (int r = 0; r < rounds; r++) {
+        switch (strategy) {
+            case STRATEGY_VTABLE:
+                run_vtable(objs, count);
+                break;
+            case STRATEGY_SWITCH:
+                run_switch(objs, count);
+                break;
+            case STRATEGY_SORTED:
+                run_vtable(sorted, count);
+                break;
+            case STRATEGY_BATCH:
+                run_batch(sorted, starts);
+                break;
+        }
+    }
+    uint64_t elapsed = bench_now_ns() - begin;
+    uint64_t misses = bench_counter_stop(fd);
+
+    double calls = (double) count * rounds;
+    printf("%-8s %10.2f Mcalls/s %8.3f ns/call ", strategy_names[strategy], calls / ((double) elapsed / 1e3),
+           (double) elapsed / calls);
+    if (fd == -1)
+        printf("branch-misses: n/a\n");
+    else
+        printf("branch-misses: %.4f/call\n", (double) misses / calls);
+    bench_counter_close(fd);
+}
+
+int main(int argc, char **argv)
+{
+    size_t count = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+    int rounds = argc > 2 ? atoi(argv[2]) : 20;
+
+    if (count == 0 || rounds <= 0) {
+        fprintf(stderr, "Usage: %s [number-of-objects] [rounds]\n", argv[0]);
+        exit(1);
+    }
+
+    object_t **objs = (object_t **) malloc(count * sizeof(object_t *));
+    object_t **sorted = (object_t **) malloc(count * sizeof(object_t *));
+    if (!objs || !sorted) {
+        fprintf(stderr, "FATAL: Out of memory!\n");
+        exit(1);
+    }
+    // A fixed seed keeps the mix identical between runs.
+    srand(42);
+    for (size_t i = 0; i < count; i++) {
+        objs[i] = object_new((type_tag_t) (rand() % TYPE_COUNT));
+        if (!objs[i]) {
+            fprintf(stderr, "FATAL: Out of memory!\n");
+            exit(1);
+        }
+    }
+
+    printf("%zu objects of %d types, %d rounds\n", count, TYPE_COUNT, rounds);
+    for (int s = STRATEGY_VTABLE; s <= STRATEGY_BATCH; s++)
+        measure((strategy_t) s, objs, sorted, count, rounds);
+
+    for (size_t i = 0; i < count; i++)
+        free(objs[i]);
+    free(objs);
+    free(sorted);
+    return 0;
+}
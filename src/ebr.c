@@ -0,0 +1,221 @@
+/** \file ebr.c
+ *
+ * @brief Epoch-based memory reclamation
+ *
+ * Readers of a lock-free structure may still be looking at a node that a writer just unlinked, so the writer cannot
+ * free it right away. With epochs, the writer hands the node to ebr_retire instead, and it is freed once no reader can
+ * hold it any more.
+ *
+ * There is a global epoch counter. A reader announces the epoch it has seen in its per-thread record when it enters a
+ * read-side critical section (ebr_enter) and withdraws it when it leaves (ebr_exit). The global epoch may only advance
+ * from e to e+1 when every active reader has announced e. A node retired in epoch e is therefore safe to free once the
+ * global epoch reached e+2: every reader active at that time entered after the node was unlinked. Each thread keeps
+ * its retired nodes in three lists, one per epoch modulo 3.
+ *
+ * Entering costs one atomic exchange and leaving one store, both on the reader's own cache line, so readers scale with
+ * the number of cores, unlike a read-write lock where every reader writes to the lock word. The price is memory: a
+ * reader that stays inside a critical section blocks the epoch, and everything retired meanwhile waits.
+ *
+ * Freeing is amortized: every EBR_RECLAIM_EVERY retirements the retiring thread tries to advance the epoch and frees
+ * what became safe. Thread records are never freed before ebr_free; an unregistered record is reused by the next
+ * thread that registers, together with the nodes it still holds.
+ */
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ebr.h"
+
+#define EBR_ACTIVE UINT64_C(1)
+#define EBR_RECLAIM_EVERY 64
+
+typedef struct retired_t {
+    void *ptr;
+    ebr_free_fn_t free_fn;
+    struct retired_t *next;
+} retired_t;
+
+typedef struct {
+    retired_t *head;
+    uint64_t epoch;
+    size_t count;
+} limbo_t;
+
+struct ebr_thread_t {
+    /** Announced epoch shifted left by one, or'ed with EBR_ACTIVE inside a critical section. */
+    _Alignas(64) _Atomic uint64_t state;
+    ebr_t *ebr;
+    struct ebr_thread_t *next;
+    atomic_int in_use;
+    size_t since_reclaim;
+    limbo_t limbo[3];
+};
+
+struct ebr_t {
+    _Alignas(64) _Atomic uint64_t epoch;
+    _Alignas(64) _Atomic(ebr_thread_t *) threads;
+};
+
+/**
+ * @return the domain, or NULL if out of memory
+ */
+ebr_t *ebr_new(void)
+{
+    ebr_t *ebr = (ebr_t *) aligned_alloc(64, sizeof(ebr_t));
+
+    if (!ebr)
+        return NULL;
+    atomic_init(&ebr->epoch, 0);
+    atomic_init(&ebr->threads, NULL);
+    return ebr;
+}
+
+static void limbo_free(limbo_t *limbo)
+{
+    retired_t *node = limbo->head;
+
+    while (node) {
+        retired_t *next = node->next;
+        node->free_fn(node->ptr);
+        free(node);
+        node = next;
+    }
+    limbo->head = NULL;
+    limbo->count = 0;
+}
+
+/**
+ * Frees everything still retired and the thread records. No thread may use the domain any more.
+ */
+void ebr_free(ebr_t *ebr)
+{
+    ebr_thread_t *thread = atomic_load(&ebr->threads);
+
+    while (thread) {
+        ebr_thread_t *next = thread->next;
+        for (int i = 0; i < 3; i++)
+            limbo_free(&thread->limbo[i]);
+        free(thread);
+        thread = next;
+    }
+    free(ebr);
+}
+
+/**
+ * Gives the calling thread a record, reusing one of an unregistered thread if there is one.
+ * @return the record, or NULL if out of memory
+ */
+ebr_thread_t *ebr_register(ebr_t *ebr)
+{
+    for (ebr_thread_t *thread = atomic_load(&ebr->threads); thread; thread = thread->next) {
+        int unused = 0;
+        if (atomic_compare_exchange_strong(&thread->in_use, &unused, 1))
+            return thread;
+    }
+
+    ebr_thread_t *thread = (ebr_thread_t *) aligned_alloc(64, sizeof(ebr_thread_t));
+    if (!thread)
+        return NULL;
+    memset(thread, 0, sizeof(*thread));
+    atomic_init(&thread->state, 0);
+    atomic_init(&thread->in_use, 1);
+    thread->ebr = ebr;
+    ebr_thread_t *head = atomic_load(&ebr->threads);
+    do {
+        thread->next = head;
+    } while (!atomic_compare_exchange_weak(&ebr->threads, &head, thread));
+    return thread;
+}
+
+/**
+ * Gives the record back. Nodes it still holds are freed by the thread that reuses it, or by ebr_free.
+ */
+void ebr_unregister(ebr_thread_t *thread)
+{
+    atomic_store_explicit(&thread->state, 0, memory_order_release);
+    atomic_store_explicit(&thread->in_use, 0, memory_order_release);
+}
+
+/**
+ * Starts a read-side critical section. Pointers loaded from the shared structure stay valid until ebr_exit. Critical
+ * sections do not nest.
+ */
+void ebr_enter(ebr_thread_t *thread)
+{
+    uint64_t epoch = atomic_load_explicit(&thread->ebr->epoch, memory_order_relaxed);
+
+    // The announcement must be visible before the first load from the structure. A sequentially consistent exchange
+    // orders it like a store followed by a full fence, and is cheaper than mfence on x86.
+    atomic_exchange_explicit(&thread->state, (epoch << 1) | EBR_ACTIVE, memory_order_seq_cst);
+}
+
+void ebr_exit(ebr_thread_t *thread)
+{
+    atomic_store_explicit(&thread->state, 0, memory_order_release);
+}
+
+/**
+ * Advances the global epoch if every thread inside a critical section has seen the current one.
+ * @return the global epoch afterwards
+ */
+static uint64_t try_advance(ebr_t *ebr)
+{
+    uint64_t epoch = atomic_load(&ebr->epoch);
+
+    for (ebr_thread_t *thread = atomic_load(&ebr->threads); thread; thread = thread->next) {
+        uint64_t state = atomic_load(&thread->state);
+        if ((state & EBR_ACTIVE) && (state >> 1) != epoch)
+            return epoch;
+    }
+    if (atomic_compare_exchange_strong(&ebr->epoch, &epoch, epoch + 1))
+        return epoch + 1;
+    return epoch;
+}
+
+/**
+ * Frees the retired nodes that no reader can hold any more, after trying to advance the epoch.
+ */
+void ebr_reclaim(ebr_thread_t *thread)
+{
+    uint64_t epoch = try_advance(thread->ebr);
+
+    for (int i = 0; i < 3; i++)
+        if (thread->limbo[i].head && thread->limbo[i].epoch + 2 <= epoch)
+            limbo_free(&thread->limbo[i]);
+    thread->since_reclaim = 0;
+}
+
+/**
+ * Schedules free_fn(ptr) for when no reader can hold ptr any more. ptr must already be unreachable for new readers.
+ */
+void ebr_retire(ebr_thread_t *thread, void *ptr, ebr_free_fn_t free_fn)
+{
+    uint64_t epoch = atomic_load(&thread->ebr->epoch);
+    limbo_t *limbo = &thread->limbo[epoch % 3];
+    retired_t *node = (retired_t *) malloc(sizeof(retired_t));
+
+    if (!node)
+        abort();
+    // The list of the same slot holds nodes from epoch - 3 or older, which are safe by now.
+    if (limbo->epoch != epoch) {
+        limbo_free(limbo);
+        limbo->epoch = epoch;
+    }
+    node->ptr = ptr;
+    node->free_fn = free_fn;
+    node->next = limbo->head;
+    limbo->head = node;
+    limbo->count++;
+    if (++thread->since_reclaim >= EBR_RECLAIM_EVERY)
+        ebr_reclaim(thread);
+}
+
+/**
+ * @return number of nodes the thread retired that are not freed yet
+ */
+size_t ebr_pending(const ebr_thread_t *thread)
+{
+    return thread->limbo[0].count + thread->limbo[1].count + thread->limbo[2].count;
+}
@@ -0,0 +1,216 @@
+/** \file event_driven.c
+ *
+ * @brief Event-oriented programming with the loop of event_loop.c
+ *
+ * Three workloads, each measured on its own:
+ *
+ * - `io`: tokens travel around a ring of pipes. Every readable callback reads a token and writes it to the next pipe.
+ * - `post`: another thread posts tasks to the loop, the loop runs their callbacks.
+ * - `timers`: a large number of timers is started with random timeouts, half of them are stopped again, and the loop
+ *   runs until the others fired. Insert and cancel cost and the firing lateness are reported.
+ *
+ * \code{.sh}
+ * ./event_driven [number-of-callbacks] [number-of-timers]
+ * \endcode
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "event_loop.h"
+#include "helpers.h"
+
+#define RING_SIZE 64
+#define TOKENS 16
+#define MAX_TIMEOUT_MS 2000
+
+typedef struct {
+    io_watcher_t watcher;
+    int write_fd;
+} ring_node_t;
+
+typedef struct {
+    size_t calls;
+    size_t limit;
+} counter_t;
+
+typedef struct {
+    loop_timer_t timer;
+    uint64_t deadline_ns;
+} bench_timer_t;
+
+typedef struct {
+    size_t fired;
+    size_t expected;
+    /** Timers that expired while they were still being inserted are measured from the start of the loop. */
+    uint64_t run_begin_ns;
+    uint64_t late_total_ns;
+    uint64_t late_max_ns;
+} timer_stats_t;
+
+typedef struct {
+    loop_t *loop;
+    loop_task_t *tasks;
+    size_t count;
+    counter_t *counter;
+} poster_t;
+
+static void on_readable(loop_t *loop, io_watcher_t *watcher, uint32_t events)
+{
+    ring_node_t *node = (ring_node_t *) watcher;
+    counter_t *counter = (counter_t *) watcher->ctx;
+    char token;
+
+    (void) events;
+    if (read(watcher->fd, &token, 1) != 1)
+        return;
+    if (write(node->write_fd, &token, 1) != 1)
+        exit_sys("write");
+    if (++counter->calls == counter->limit)
+        loop_stop(loop);
+}
+
+static void on_task(loop_t *loop, loop_task_t *task)
+{
+    counter_t *counter = (counter_t *) task->ctx;
+
+    if (++counter->calls == counter->limit)
+        loop_stop(loop);
+}
+
+static void on_timer(loop_t *loop, loop_timer_t *timer)
+{
+    bench_timer_t *bt = (bench_timer_t *) timer;
+    timer_stats_t *stats = (timer_stats_t *) timer->ctx;
+    uint64_t now = bench_now_ns();
+    uint64_t deadline = bt->deadline_ns > stats->run_begin_ns ? bt->deadline_ns : stats->run_begin_ns;
+    uint64_t late = now > deadline ? now - deadline : 0;
+
+    stats->late_total_ns += late;
+    if (late > stats->late_max_ns)
+        stats->late_max_ns = late;
+    if (++stats->fired == stats->expected)
+        loop_stop(loop);
+}
+
+static void *post_tasks(void *arg)
+{
+    poster_t *poster = (poster_t *) arg;
+
+    for (size_t i = 0; i < poster->count; i++)
+        if (loop_post(poster->loop, &poster->tasks[i], on_task, poster->counter) == -1)
+            exit_sys("loop_post");
+    return NULL;
+}
+
+static void bench_io(loop_t *loop, size_t calls)
+{
+    ring_node_t ring[RING_SIZE];
+    int fds[RING_SIZE][2];
+    counter_t counter = {0, calls};
+
+    for (int i = 0; i < RING_SIZE; i++)
+        if (pipe(fds[i]) == -1)
+            exit_sys("pipe");
+    for (int i = 0; i < RING_SIZE; i++) {
+        ring[i].write_fd = fds[(i + 1) % RING_SIZE][1];
+        if (loop_io_start(loop, &ring[i].watcher, fds[i][0], EPOLLIN, on_readable, &counter) == -1)
+            exit_sys("loop_io_start");
+    }
+    for (int i = 0; i < TOKENS; i++)
+        if (write(fds[i * (RING_SIZE / TOKENS)][1], "x", 1) != 1)
+            exit_sys("write");
+
+    uint64_t begin = bench_now_ns();
+    if (loop_run(loop) == -1)
+        exit_sys("loop_run");
+    double seconds = (double) (bench_now_ns() - begin) / 1e9;
+    printf("io:     %10.0f callbacks/s (%d pipes, %d tokens)\n", (double) counter.calls / seconds, RING_SIZE, TOKENS);
+
+    for (int i = 0; i < RING_SIZE; i++) {
+        loop_io_stop(loop, &ring[i].watcher);
+        close(fds[i][0]);
+        close(fds[i][1]);
+    }
+}
+
+static void bench_post(loop_t *loop, size_t calls)
+{
+    loop_task_t *tasks = (loop_task_t *) malloc(calls * sizeof(loop_task_t));
+    counter_t counter = {0, calls};
+    poster_t poster = {loop, tasks, calls, &counter};
+    pthread_t thread;
+
+    if (!tasks)
+        exit_sys("malloc");
+    uint64_t begin = bench_now_ns();
+    if (pthread_create(&thread, NULL, post_tasks, &poster) != 0)
+        exit_sys("pthread_create");
+    if (loop_run(loop) == -1)
+        exit_sys("loop_run");
+    double seconds = (double) (bench_now_ns() - begin) / 1e9;
+    pthread_join(thread, NULL);
+    printf("post:   %10.0f callbacks/s (cross-thread)\n", (double) counter.calls / seconds);
+    free(tasks);
+}
+
+static void bench_timers(loop_t *loop, size_t count)
+{
+    bench_timer_t *timers = (bench_timer_t *) malloc(count * sizeof(bench_timer_t));
+    // The loop below stops the timers with even indexes, (count + 1) / 2 of them.
+    timer_stats_t stats = {0, count / 2, 0, 0, 0};
+    uint64_t seed = 88172645463325252u;
+
+    if (!timers)
+        exit_sys("malloc");
+    uint64_t begin = bench_now_ns();
+    for (size_t i = 0; i < count; i++) {
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+        uint64_t timeout = 1 + seed % MAX_TIMEOUT_MS;
+        loop_timer_init(&timers[i].timer);
+        timers[i].deadline_ns = begin + timeout * 1000000u;
+        loop_timer_start(loop, &timers[i].timer, timeout, 0, on_timer, &stats);
+    }
+    uint64_t inserted = bench_now_ns();
+    for (size_t i = 0; i < count; i += 2)
+        loop_timer_stop(loop, &timers[i].timer);
+    uint64_t cancelled = bench_now_ns();
+    stats.run_begin_ns = cancelled;
+
+    if (loop_run(loop) == -1)
+        exit_sys("loop_run");
+    printf("timers: insert %6.1f ns/timer, cancel %6.1f ns/timer, %zu pending\n",
+           (double) (inserted - begin) / (double) count, (double) (cancelled - inserted) / (double) ((count + 1) / 2),
+           stats.expected);
+    printf("        fired %zu, lateness mean %.3f ms, max %.3f ms\n", stats.fired,
+           (double) stats.late_total_ns / (double) stats.fired / 1e6, (double) stats.late_max_ns / 1e6);
+    free(timers);
+}
+
+int main(int argc, char **argv)
+{
+    size_t calls = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+    // Half of them are stopped, which leaves a million pending.
+    size_t timers = argc > 2 ? strtoul(argv[2], NULL, 10) : 2000000;
+
+    if (calls == 0 || timers < 2) {
+        fprintf(stderr, "Usage: %s [number-of-callbacks] [number-of-timers]\n", argv[0]);
+        exit(1);
+    }
+    loop_t *loop = loop_new();
+    if (!loop)
+        exit_sys("%s - loop_new", argv[0]);
+
+    bench_io(loop, calls);
+    bench_post(loop, calls);
+    bench_timers(loop, timers);
+
+    loop_free(loop);
+    return 0;
+}
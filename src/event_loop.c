@@ -0,0 +1,403 @@
+/** \file event_loop.c
+ *
+ * @brief A single-threaded event loop on epoll, eventfd and timerfd
+ *
+ * function.c describes event-oriented programming as frameworks like libuv and libev do it: the program registers
+ * callbacks and one event loop calls them when their event happens. This is a small loop of that kind.
+ *
+ * - File descriptors are watched with epoll. A callback runs when its descriptor is readable or writable.
+ * - Timers live in a hierarchical timer wheel with a resolution of one millisecond. The wheel has 4 levels of 256
+ *   slots; level 0 covers the next 256 ms, level 1 the next 65 s, level 2 the next 4.6 hours and level 3 about 49
+ *   days. A timer is put in the slot of the level that matches its distance to the current tick, so starting and
+ *   stopping a timer is O(1) list surgery whatever the number of pending timers. Every 256 ticks the next slot of the
+ *   level above is emptied and its timers are put again one level lower (cascading), so every timer is moved at most
+ *   3 times before it fires; a timer further away than the top level reaches goes round the top level first. While
+ *   timers are pending a timerfd ticks the loop every millisecond.
+ * - Other threads hand work to the loop with `loop_post`. Posted tasks are pushed on a lock-free stack, and the
+ *   poster writes to an eventfd only when the stack was empty, so a burst of posts costs a single wake-up.
+ *
+ * The loop never allocates: watchers, timers and tasks are owned by the caller.
+ */
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "event_loop.h"
+
+#define WHEEL_BITS 8
+#define WHEEL_SIZE (1u << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS 4
+#define MAX_EVENTS 256
+
+struct loop_t {
+    int epfd;
+    int eventfd;
+    int timerfd;
+    int timerfd_armed;
+    uint64_t start_ns;
+    /** All timers with `expires <= tick` have fired. */
+    uint64_t tick;
+    size_t timer_count;
+    atomic_int stop;
+    _Atomic(loop_task_t *) posted;
+    /** Events of the current epoll_wait batch, so that loop_io_stop can drop events of a stopped watcher. */
+    struct epoll_event *pending;
+    int pending_count;
+    /** Slot heads. Each slot is a circular doubly linked list with the head as sentinel. */
+    loop_timer_t wheel[WHEEL_LEVELS][WHEEL_SIZE];
+};
+
+static uint64_t monotonic_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+static uint64_t elapsed_ms(const loop_t *loop)
+{
+    return (monotonic_ns() - loop->start_ns) / 1000000u;
+}
+
+loop_t *loop_new(void)
+{
+    loop_t *loop = (loop_t *) calloc(1, sizeof(loop_t));
+    struct epoll_event ev;
+
+    if (!loop)
+        return NULL;
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+    loop->eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    loop->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (loop->epfd == -1 || loop->eventfd == -1 || loop->timerfd == -1)
+        goto fail;
+
+    // The two internal descriptors are recognized by the address of their field in the loop.
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = &loop->eventfd;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->eventfd, &ev) == -1)
+        goto fail;
+    ev.data.ptr = &loop->timerfd;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->timerfd, &ev) == -1)
+        goto fail;
+
+    for (int level = 0; level < WHEEL_LEVELS; level++)
+        for (unsigned slot = 0; slot < WHEEL_SIZE; slot++)
+            loop->wheel[level][slot].prev = loop->wheel[level][slot].next = &loop->wheel[level][slot];
+    loop->start_ns = monotonic_ns();
+    return loop;
+
+fail:
+    loop_free(loop);
+    return NULL;
+}
+
+void loop_free(loop_t *loop)
+{
+    if (loop->epfd != -1)
+        close(loop->epfd);
+    if (loop->eventfd != -1)
+        close(loop->eventfd);
+    if (loop->timerfd != -1)
+        close(loop->timerfd);
+    free(loop);
+}
+
+/**
+ * @param loop
+ * @return milliseconds since the loop was created, as seen by the timers
+ */
+uint64_t loop_now(const loop_t *loop)
+{
+    return loop->tick;
+}
+
+/*---------------------------------- File descriptors ----------------------------------*/
+
+/**
+ * Starts watching fd for events (EPOLLIN, EPOLLOUT, EPOLLET, ...).
+ * @return 0 for success, -1 for error with errno set
+ */
+int loop_io_start(loop_t *loop, io_watcher_t *watcher, int fd, uint32_t events, io_cb_t cb, void *ctx)
+{
+    struct epoll_event ev;
+
+    watcher->fd = fd;
+    watcher->events = events;
+    watcher->cb = cb;
+    watcher->ctx = ctx;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = watcher;
+    return epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+/**
+ * Stops watching. The watcher may be freed as soon as this returns, even from inside a callback of the same batch.
+ * @return 0 for success, -1 for error with errno set
+ */
+int loop_io_stop(loop_t *loop, io_watcher_t *watcher)
+{
+    for (int i = 0; i < loop->pending_count; i++)
+        if (loop->pending[i].data.ptr == watcher)
+            loop->pending[i].data.ptr = NULL;
+    return epoll_ctl(loop->epfd, EPOLL_CTL_DEL, watcher->fd, NULL);
+}
+
+/*---------------------------------- Timers ----------------------------------*/
+
+static void timer_link(loop_timer_t *head, loop_timer_t *timer)
+{
+    timer->prev = head->prev;
+    timer->next = head;
+    head->prev->next = timer;
+    head->prev = timer;
+}
+
+static void timer_unlink(loop_timer_t *timer)
+{
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->prev = timer->next = NULL;
+}
+
+/**
+ * Puts the timer in the slot that matches its distance to the current tick: O(1).
+ */
+static void wheel_insert(loop_t *loop, loop_timer_t *timer)
+{
+    uint64_t due = timer->expires;
+    int level = 0;
+
+    if ((due - loop->tick) >> (WHEEL_BITS * WHEEL_LEVELS)) {
+        // Beyond the top level: park it in the last slot the wheel reaches. When that slot cascades it is put again
+        // from its own expiry, which is left untouched, so it goes round the top level until it is in reach.
+        due = loop->tick + (UINT64_C(1) << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+    }
+    uint64_t delta = due - loop->tick;
+    while (level < WHEEL_LEVELS - 1 && delta >> (WHEEL_BITS * (level + 1)))
+        level++;
+    timer_link(&loop->wheel[level][(due >> (WHEEL_BITS * level)) & WHEEL_MASK], timer);
+}
+
+void loop_timer_init(loop_timer_t *timer)
+{
+    memset(timer, 0, sizeof(*timer));
+}
+
+int loop_timer_active(const loop_timer_t *timer)
+{
+    return timer->next != NULL;
+}
+
+static void timerfd_update(loop_t *loop)
+{
+    struct itimerspec spec;
+    int armed = loop->timer_count > 0;
+
+    if (armed == loop->timerfd_armed)
+        return;
+    memset(&spec, 0, sizeof(spec));
+    if (armed) {
+        spec.it_value.tv_nsec = 1000000;
+        spec.it_interval.tv_nsec = 1000000;
+    }
+    timerfd_settime(loop->timerfd, 0, &spec, NULL);
+    loop->timerfd_armed = armed;
+}
+
+/**
+ * Starts (or restarts) a timer. It fires after timeout_ms and then every repeat_ms if repeat_ms is not 0.
+ * @return 0
+ */
+int loop_timer_start(loop_t *loop, loop_timer_t *timer, uint64_t timeout_ms, uint64_t repeat_ms, timer_cb_t cb,
+                     void *ctx)
+{
+    if (loop_timer_active(timer))
+        loop_timer_stop(loop, timer);
+    timer->cb = cb;
+    timer->ctx = ctx;
+    timer->repeat = repeat_ms;
+    // With no timer pending the wheel can jump to the current time without cascading anything.
+    if (loop->timer_count == 0)
+        loop->tick = elapsed_ms(loop);
+    // A timer never fires in the tick that started it.
+    timer->expires = loop->tick + (timeout_ms ? timeout_ms : 1);
+    wheel_insert(loop, timer);
+    loop->timer_count++;
+    timerfd_update(loop);
+    return 0;
+}
+
+/** O(1): the timer is unlinked from its slot, wherever it is. */
+void loop_timer_stop(loop_t *loop, loop_timer_t *timer)
+{
+    if (!loop_timer_active(timer))
+        return;
+    timer_unlink(timer);
+    loop->timer_count--;
+}
+
+/** Moves every timer of a slot one or more levels down. */
+static void wheel_cascade(loop_t *loop, int level)
+{
+    loop_timer_t *head = &loop->wheel[level][(loop->tick >> (WHEEL_BITS * level)) & WHEEL_MASK];
+
+    while (head->next != head) {
+        loop_timer_t *timer = head->next;
+        timer_unlink(timer);
+        wheel_insert(loop, timer);
+    }
+}
+
+static void wheel_advance(loop_t *loop, uint64_t now)
+{
+    if (loop->timer_count == 0) {
+        loop->tick = now > loop->tick ? now : loop->tick;
+        return;
+    }
+    while (loop->tick < now) {
+        loop->tick++;
+        // Cascade the levels whose lower digits all wrapped to 0, the highest first.
+        int top = 0;
+        while (top < WHEEL_LEVELS - 1 && ((loop->tick >> (WHEEL_BITS * top)) & WHEEL_MASK) == 0)
+            top++;
+        for (int level = top; level > 0; level--)
+            wheel_cascade(loop, level);
+
+        // Detach the due slot first: callbacks may start and stop timers, including ones of this list.
+        loop_timer_t due;
+        loop_timer_t *head = &loop->wheel[0][loop->tick & WHEEL_MASK];
+        if (head->next == head)
+            continue;
+        due.next = head->next;
+        due.prev = head->prev;
+        due.next->prev = &due;
+        due.prev->next = &due;
+        head->next = head->prev = head;
+        while (due.next != &due) {
+            loop_timer_t *timer = due.next;
+            timer_unlink(timer);
+            loop->timer_count--;
+            if (timer->repeat) {
+                timer->expires = loop->tick + timer->repeat;
+                wheel_insert(loop, timer);
+                loop->timer_count++;
+            }
+            timer->cb(loop, timer);
+        }
+        if (loop->timer_count == 0) {
+            loop->tick = now;
+            break;
+        }
+    }
+}
+
+/*---------------------------------- Cross-thread tasks ----------------------------------*/
+
+/**
+ * Queues task->cb to run on the loop thread. Safe to call from any thread.
+ * @return 0 for success, -1 if the loop could not be woken up
+ */
+int loop_post(loop_t *loop, loop_task_t *task, task_cb_t cb, void *ctx)
+{
+    loop_task_t *head = atomic_load_explicit(&loop->posted, memory_order_relaxed);
+
+    task->cb = cb;
+    task->ctx = ctx;
+    do {
+        task->next = head;
+    } while (!atomic_compare_exchange_weak_explicit(&loop->posted, &head, task, memory_order_release,
+                                                    memory_order_relaxed));
+    if (head == NULL) {
+        uint64_t one = 1;
+        if (write(loop->eventfd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+            return -1;
+    }
+    return 0;
+}
+
+static void run_posted(loop_t *loop)
+{
+    loop_task_t *list = atomic_exchange_explicit(&loop->posted, NULL, memory_order_acquire);
+    loop_task_t *fifo = NULL;
+
+    // The stack holds the newest task first; reverse it to run tasks in posting order.
+    while (list) {
+        loop_task_t *next = list->next;
+        list->next = fifo;
+        fifo = list;
+        list = next;
+    }
+    while (fifo) {
+        loop_task_t *next = fifo->next;
+        fifo->cb(loop, fifo);
+        fifo = next;
+    }
+}
+
+/**
+ * Asks the loop to return from loop_run. Safe to call from any thread and from callbacks.
+ */
+void loop_stop(loop_t *loop)
+{
+    uint64_t one = 1;
+
+    atomic_store_explicit(&loop->stop, 1, memory_order_release);
+    if (write(loop->eventfd, &one, sizeof(one)) == -1)
+        return;
+}
+
+/**
+ * Runs callbacks until loop_stop is called.
+ * @return 0 when stopped, -1 if epoll_wait failed
+ */
+int loop_run(loop_t *loop)
+{
+    struct epoll_event events[MAX_EVENTS];
+    uint64_t counter;
+
+    atomic_store_explicit(&loop->stop, 0, memory_order_relaxed);
+    while (!atomic_load_explicit(&loop->stop, memory_order_acquire)) {
+        int n = epoll_wait(loop->epfd, events, MAX_EVENTS, -1);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        // Published before the timers fire, so a timer callback that stops a watcher also clears its event here.
+        loop->pending = events;
+        loop->pending_count = n;
+        // Timers first: callbacks below then start their timers relative to an up to date tick.
+        wheel_advance(loop, elapsed_ms(loop));
+        for (int i = 0; i < n; i++) {
+            void *ptr = events[i].data.ptr;
+            if (ptr == NULL)
+                continue;
+            if (ptr == &loop->eventfd) {
+                if (read(loop->eventfd, &counter, sizeof(counter)) == -1 && errno != EAGAIN)
+                    return -1;
+            } else if (ptr == &loop->timerfd) {
+                if (read(loop->timerfd, &counter, sizeof(counter)) == -1 && errno != EAGAIN)
+                    return -1;
+            } else {
+                io_watcher_t *watcher = (io_watcher_t *) ptr;
+                watcher->cb(loop, watcher, events[i].events);
+            }
+        }
+        loop->pending_count = 0;
+        run_posted(loop);
+        timerfd_update(loop);
+    }
+    return 0;
+}
@@ -0,0 +1,206 @@
+/** \file false_sharing.c
+ *
+ * @brief Cache-line effects on shared counters
+ *
+ * 1, 2, 4, ... threads increment a counter as fast as they can, kept in different ways:
+ *
+ * - `atomic`: one shared atomic. All threads fight for the same cache line.
+ * - `packed`: an array with one slot per thread. No slot is shared, but the slots are neighbours on one cache line, so
+ *   the line still bounces between the cores: false sharing.
+ * - `padded`: the same array with every slot aligned to its own cache line.
+ * - `per-cpu` and `per-thread`: the sharded counter of counters.c.
+ * - `histogram`: recording into the sharded histogram of counters.c.
+ *
+ * With more than one core, `atomic` and `packed` get slower per increment as threads are added while the padded and
+ * sharded ones scale.
+ *
+ * \code{.sh}
+ * ./false_sharing [increments-per-thread] [max-threads]
+ * \endcode
+ */
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "counters.h"
+#include "helpers.h"
+
+#define MAX_THREADS 256
+
+typedef enum { KIND_ATOMIC, KIND_PACKED, KIND_PADDED, KIND_PER_CPU, KIND_PER_THREAD, KIND_HISTOGRAM } kind_t;
+
+static const char *kind_names[] = {"atomic", "packed", "padded", "per-cpu", "per-thread", "histogram"};
+
+typedef struct {
+    _Alignas(64) _Atomic int64_t value;
+} padded_slot_t;
+
+typedef struct {
+    kind_t kind;
+    size_t increments;
+    pthread_barrier_t start;
+    _Alignas(64) _Atomic int64_t shared;
+    _Alignas(64) _Atomic int64_t packed[MAX_THREADS];
+    padded_slot_t padded[MAX_THREADS];
+    counter_t *per_cpu;
+    counter_t *per_thread;
+    histogram_t *histogram;
+} bench_state_t;
+
+typedef struct {
+    bench_state_t *state;
+    int index;
+    pthread_t thread;
+} worker_t;
+
+static void *run_worker(void *arg)
+{
+    worker_t *worker = (worker_t *) arg;
+    bench_state_t *state = worker->state;
+    size_t increments = state->increments;
+
+    pthread_barrier_wait(&state->start);
+    switch (state->kind) {
+    case KIND_ATOMIC:
+        for (size_t i = 0; i < increments; i++)
+            atomic_fetch_add_explicit(&state->shared, 1, memory_order_relaxed);
+        break;
+    case KIND_PACKED:
+        for (size_t i = 0; i < increments; i++)
+            atomic_fetch_add_explicit(&state->packed[worker->index], 1, memory_order_relaxed);
+        break;
+    case KIND_PADDED:
+        for (size_t i = 0; i < increments; i++)
+            atomic_fetch_add_explicit(&state->padded[worker->index].value, 1, memory_order_relaxed);
+        break;
+    case KIND_PER_CPU:
+        for (size_t i = 0; i < increments; i++)
+            counter_add(state->per_cpu, 1);
+        break;
+    case KIND_PER_THREAD:
+        for (size_t i = 0; i < increments; i++)
+            counter_add(state->per_thread, 1);
+        break;
+    case KIND_HISTOGRAM:
+        for (size_t i = 0; i < increments; i++)
+            histogram_record(state->histogram, i & 1023);
+        break;
+    }
+    pthread_barrier_wait(&state->start);
+    return NULL;
+}
+
+static int64_t total_of(bench_state_t *state, int threads)
+{
+    int64_t total = 0;
+
+    switch (state->kind) {
+    case KIND_ATOMIC:
+        return atomic_load(&state->shared);
+    case KIND_PACKED:
+        for (int i = 0; i < threads; i++)
+            total += atomic_load(&state->packed[i]);
+        return total;
+    case KIND_PADDED:
+        for (int i = 0; i < threads; i++)
+            total += atomic_load(&state->padded[i].value);
+        return total;
+    case KIND_PER_CPU:
+        return counter_read(state->per_cpu);
+    case KIND_PER_THREAD:
+        return counter_read(state->per_thread);
+    case KIND_HISTOGRAM:
+        return (int64_t) histogram_count(state->histogram);
+    }
+    return 0;
+}
+
+static void reset(bench_state_t *state)
+{
+    atomic_store(&state->shared, 0);
+    for (int i = 0; i < MAX_THREADS; i++) {
+        atomic_store(&state->packed[i], 0);
+        atomic_store(&state->padded[i].value, 0);
+    }
+    counter_reset(state->per_cpu);
+    counter_reset(state->per_thread);
+    histogram_free(state->histogram);
+    state->histogram = histogram_new(SHARD_PER_CPU);
+    if (!state->histogram)
+        exit_sys("histogram_new");
+}
+
+static void run(bench_state_t *state, kind_t kind, int threads)
+{
+    worker_t workers[MAX_THREADS];
+
+    reset(state);
+    state->kind = kind;
+    if (pthread_barrier_init(&state->start, NULL, (unsigned) threads + 1) != 0)
+        exit_sys("pthread_barrier_init");
+    for (int i = 0; i < threads; i++) {
+        workers[i].state = state;
+        workers[i].index = i;
+        if (pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]) != 0)
+            exit_sys("pthread_create");
+    }
+    pthread_barrier_wait(&state->start);
+    uint64_t begin = bench_now_ns();
+    pthread_barrier_wait(&state->start);
+    uint64_t elapsed = bench_now_ns() - begin;
+    for (int i = 0; i < threads; i++)
+        pthread_join(workers[i].thread, NULL);
+    pthread_barrier_destroy(&state->start);
+
+    int64_t expected = (int64_t) state->increments * threads;
+    int64_t total = total_of(state, threads);
+    if (total != expected) {
+        fprintf(stderr, "FATAL: %s counted %ld, expected %ld\n", kind_names[kind], (long) total, (long) expected);
+        exit(1);
+    }
+    printf("  %-11s %7d %10.2f %10.2f\n", kind_names[kind], threads, (double) expected / (double) elapsed * 1e3,
+           (double) elapsed / (double) state->increments);
+}
+
+int main(int argc, char **argv)
+{
+    size_t increments = argc > 1 ? strtoul(argv[1], NULL, 10) : 10000000;
+    long max_threads = argc > 2 ? strtol(argv[2], NULL, 10) : sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (increments == 0 || max_threads < 1 || max_threads > MAX_THREADS) {
+        fprintf(stderr, "Usage: %s [increments-per-thread] [max-threads (1-%d)]\n", argv[0], MAX_THREADS);
+        exit(1);
+    }
+    bench_state_t *state = (bench_state_t *) aligned_alloc(64, sizeof(bench_state_t));
+    if (!state)
+        exit_sys("aligned_alloc");
+    memset(state, 0, sizeof(*state));
+    state->increments = increments;
+    state->per_cpu = counter_new(SHARD_PER_CPU);
+    state->per_thread = counter_new(SHARD_PER_THREAD);
+    state->histogram = histogram_new(SHARD_PER_CPU);
+    if (!state->per_cpu || !state->per_thread || !state->histogram)
+        exit_sys("counter_new");
+
+    printf("%zu increments per thread, running on CPU %d\n", increments, shard_current_cpu());
+    printf("  %-11s %7s %10s %10s\n", "counter", "threads", "Mops/s", "ns/op");
+    for (kind_t kind = KIND_ATOMIC; kind <= KIND_HISTOGRAM; kind++)
+        for (int threads = 1; threads <= max_threads; threads *= 2)
+            run(state, kind, threads);
+
+    histogram_t *histogram = state->histogram;
+    printf("histogram of the last run: p50 %lu, p99 %lu, p100 %lu (recorded 0..1023)\n",
+           (unsigned long) histogram_percentile(histogram, 50), (unsigned long) histogram_percentile(histogram, 99),
+           (unsigned long) histogram_percentile(histogram, 100));
+
+    histogram_free(state->histogram);
+    counter_free(state->per_thread);
+    counter_free(state->per_cpu);
+    free(state);
+    return 0;
+}
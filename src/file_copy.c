@@ -0,0 +1,299 @@
+/** \file file_copy.c
+ *
+ * @brief Copying files without moving the bytes through user space
+ *
+ * A read/write loop copies every byte twice, from the page cache into a buffer and back, and makes two system calls
+ * per buffer. The kernel can do better, depending on what the files and the kernel support:
+ *
+ * - copy_file_range (Linux 4.5, across file systems since 5.3 and again only within one since 5.19) copies inside
+ *   the kernel, and file systems with reflinks (btrfs, XFS) or server-side copy (NFS 4.2, SMB) share the extents or
+ *   let the server copy without any data transfer at all;
+ * - sendfile (any output file since 2.6.33) copies page cache to page cache in one call;
+ * - splice moves pages through a pipe in kernel space, two calls per pipe-full;
+ * - read/write is always possible.
+ *
+ * copy_range tries them in that order and falls back at the point where one fails with EXDEV, EINVAL, EOPNOTSUPP
+ * or ENOSYS, continuing at the same offset. copy_file also tells the kernel how the files will be used: the input is
+ * read sequentially (POSIX_FADV_SEQUENTIAL doubles the readahead window), the output is allocated up front so the
+ * file system can lay it out in one piece, and optionally both are dropped from the page cache afterwards so that a
+ * large copy does not evict everything else. Large files can be split into parts copied by several threads, which
+ * helps where one thread cannot keep the device busy (NVMe, network file systems) and not on a single disk.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "file_copy.h"
+
+#define DEFAULT_BUFFER (1024 * 1024)
+#define DEFAULT_PARALLEL_MIN (64 * 1024 * 1024)
+/** Parts of a parallel copy start at multiples of this. */
+#define PART_ALIGN (1024 * 1024)
+/** Most bytes asked from the kernel in one call. */
+#define MAX_STEP (1L << 30)
+#define MAX_THREADS 64
+
+typedef struct {
+    size_t buffer_size;
+    char *buffer;
+    int pipe[2];
+} copy_state_t;
+
+typedef struct {
+    pthread_t thread;
+    const char *from;
+    const char *to;
+    off_t offset;
+    off_t length;
+    const copy_options_t *options;
+    copy_method_t method;
+    int error;
+} part_t;
+
+const char *copy_method_name(copy_method_t method)
+{
+    static const char *names[] = {"copy_file_range", "sendfile", "splice", "read/write"};
+
+    return method <= COPY_READ_WRITE ? names[method] : "?";
+}
+
+static int can_fall_back(copy_method_t method)
+{
+    return method < COPY_READ_WRITE &&
+           (errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP || errno == ENOSYS);
+}
+
+static ssize_t write_all(int fd, const char *data, size_t length, off_t offset)
+{
+    size_t done = 0;
+
+    while (done < length) {
+        ssize_t n = pwrite(fd, data + done, length - done, offset + (off_t) done);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        done += (size_t) n;
+    }
+    return (ssize_t) done;
+}
+
+/**
+ * Copies up to length bytes at offset with one method.
+ * @return bytes copied, 0 at the end of the input, or -1 with errno set
+ */
+static ssize_t copy_step(copy_method_t method, int in, int out, off_t offset, size_t length, copy_state_t *state)
+{
+    switch (method) {
+    case COPY_FILE_RANGE: {
+        off_t in_offset = offset, out_offset = offset;
+        return copy_file_range(in, &in_offset, out, &out_offset, length, 0);
+    }
+    case COPY_SENDFILE: {
+        // sendfile writes at the file position of the output.
+        off_t in_offset = offset;
+        if (lseek(out, offset, SEEK_SET) == -1)
+            return -1;
+        return sendfile(out, in, &in_offset, length);
+    }
+    case COPY_SPLICE: {
+        if (state->pipe[0] == -1) {
+            if (pipe2(state->pipe, O_CLOEXEC) == -1)
+                return -1;
+            // A larger pipe moves more pages per call; without the permission it stays at 64 KiB.
+            fcntl(state->pipe[1], F_SETPIPE_SZ, (int) state->buffer_size);
+        }
+        off_t in_offset = offset, out_offset = offset;
+        ssize_t moved = splice(in, &in_offset, state->pipe[1], NULL, length, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (moved <= 0)
+            return moved;
+        // Once in the pipe the data has to go out: a failure from here on is not one to fall back from.
+        for (ssize_t left = moved; left > 0;) {
+            ssize_t n = splice(state->pipe[0], NULL, out, &out_offset, (size_t) left, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (n == -1 && errno == EINTR)
+                continue;
+            if (n <= 0) {
+                if (n == 0 || can_fall_back(COPY_SPLICE))
+                    errno = EIO;
+                return -1;
+            }
+            left -= n;
+        }
+        return moved;
+    }
+    case COPY_READ_WRITE: {
+        if (!state->buffer && !(state->buffer = (char *) malloc(state->buffer_size)))
+            return -1;
+        ssize_t n = pread(in, state->buffer, length < state->buffer_size ? length : state->buffer_size, offset);
+        if (n <= 0)
+            return n;
+        return write_all(out, state->buffer, (size_t) n, offset);
+    }
+    }
+    errno = EINVAL;
+    return -1;
+}
+
+/**
+ * Copies the bytes [offset, offset + length) of in to the same place in out, or up to the end of in if it is shorter.
+ * @param options NULL for the defaults
+ * @param method the method to start with, receives the one that did the (last) work
+ * @return 0, or -1 with errno set
+ */
+int copy_range(int in, int out, off_t offset, off_t length, const copy_options_t *options, copy_method_t *method)
+{
+    copy_state_t state = {.pipe = {-1, -1}};
+    int result = 0;
+
+    state.buffer_size = options && options->buffer_size ? options->buffer_size : DEFAULT_BUFFER;
+    while (length > 0) {
+        size_t step = length < MAX_STEP ? (size_t) length : (size_t) MAX_STEP;
+        ssize_t n = copy_step(*method, in, out, offset, step, &state);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            if (can_fall_back(*method)) {
+                (*method)++;
+                continue;
+            }
+            result = -1;
+            break;
+        }
+        if (n == 0)
+            break;
+        offset += n;
+        length -= n;
+    }
+
+    int error = errno;
+    free(state.buffer);
+    if (state.pipe[0] != -1) {
+        close(state.pipe[0]);
+        close(state.pipe[1]);
+    }
+    errno = error;
+    return result;
+}
+
+static void *copy_part(void *arg)
+{
+    part_t *part = (part_t *) arg;
+    int in = open(part->from, O_RDONLY | O_CLOEXEC);
+    // Every part has its own descriptors: sendfile moves the file position of the output.
+    int out = open(part->to, O_WRONLY | O_CLOEXEC);
+
+    if (in == -1 || out == -1 || copy_range(in, out, part->offset, part->length, part->options, &part->method) == -1)
+        part->error = errno;
+    if (in != -1)
+        close(in);
+    if (out != -1)
+        close(out);
+    return NULL;
+}
+
+static int copy_parallel(const char *from, const char *to, off_t size, int threads, const copy_options_t *options,
+                         copy_method_t *method)
+{
+    part_t parts[MAX_THREADS];
+    off_t part_size = (size / threads + PART_ALIGN - 1) / PART_ALIGN * PART_ALIGN;
+    int started = 0, error = 0;
+    copy_method_t used = *method;
+
+    for (off_t offset = 0; offset < size && started < threads; offset += part_size, started++) {
+        part_t *part = &parts[started];
+        *part = (part_t) {.from = from, .to = to, .offset = offset, .options = options, .method = *method};
+        part->length = size - offset < part_size ? size - offset : part_size;
+        if ((error = pthread_create(&part->thread, NULL, copy_part, part)) != 0)
+            break;
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(parts[i].thread, NULL);
+        if (parts[i].error && !error)
+            error = parts[i].error;
+        if (parts[i].method > used)
+            used = parts[i].method;
+    }
+    *method = used;
+    if (error) {
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Copies the file from into to, which is created or truncated with the permission bits of from.
+ * @param options NULL for the defaults
+ * @param method receives the method that did the (last) work, may be NULL
+ * @return 0, or -1 with errno set, EINVAL if from and to are the same file
+ */
+int copy_file(const char *from, const char *to, const copy_options_t *options, copy_method_t *method)
+{
+    copy_options_t defaults = {0};
+    copy_method_t used;
+    struct stat st, to_st;
+    int in, out, result, error;
+
+    if (!options)
+        options = &defaults;
+    used = options->method;
+    if ((in = open(from, O_RDONLY | O_CLOEXEC)) == -1)
+        return -1;
+    if (fstat(in, &st) == -1 || (out = open(to, O_WRONLY | O_CREAT | O_CLOEXEC, st.st_mode & 0777)) == -1) {
+        error = errno;
+        close(in);
+        errno = error;
+        return -1;
+    }
+    // Truncated only once it is known not to be the source, under another name or the same one.
+    result = fstat(out, &to_st);
+    if (result == 0 && st.st_dev == to_st.st_dev && st.st_ino == to_st.st_ino) {
+        errno = EINVAL;
+        result = -1;
+    }
+    if (result == -1 || ftruncate(out, 0) == -1) {
+        error = errno;
+        close(in);
+        close(out);
+        errno = error;
+        return -1;
+    }
+
+    off_t size = st.st_size;
+    size_t parallel_min = options->parallel_min ? options->parallel_min : DEFAULT_PARALLEL_MIN;
+    int threads = options->threads < MAX_THREADS ? options->threads : MAX_THREADS;
+    posix_fadvise(in, 0, 0, POSIX_FADV_SEQUENTIAL);
+    // The parts of a parallel copy need the full size from the start; fallocate is not supported everywhere.
+    result = size > 0 && fallocate(out, 0, 0, size) == -1 ? ftruncate(out, size) : 0;
+    if (result == 0 && threads > 1 && (size_t) size >= parallel_min)
+        result = copy_parallel(from, to, size, threads, options, &used);
+    else if (result == 0)
+        result = copy_range(in, out, 0, size, options, &used);
+    error = errno;
+
+    if (result == 0 && options->drop_cache) {
+        // Dirty pages cannot be dropped, so the output is written back first.
+        result = sync_file_range(out, 0, 0,
+                                 SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+        error = errno;
+        posix_fadvise(out, 0, 0, POSIX_FADV_DONTNEED);
+        posix_fadvise(in, 0, 0, POSIX_FADV_DONTNEED);
+    }
+    close(in);
+    if (close(out) == -1 && result == 0) {
+        result = -1;
+        error = errno;
+    }
+    if (method)
+        *method = used;
+    errno = error;
+    return result;
+}
@@ -0,0 +1,445 @@
+/** \file file_ring.c
+ *
+ * @brief Batched statx, openat, read and close through io_uring, with a thread pool where io_uring is missing
+ *
+ * Scanning a tree costs a system call per file for the metadata and three for the contents, each a round trip into
+ * the kernel, and each blocking the thread on a cold cache. io_uring takes the requests from a ring of submission
+ * entries in shared memory: one io_uring_enter submits a whole batch and waits for completions, which come back in
+ * a second ring. Requests that block are handed to kernel workers, so many of them are in flight at once.
+ *
+ * liburing is not needed: the ring is set up with the raw io_uring_setup, mmap and io_uring_enter system calls,
+ * which is a few dozen lines. Where io_uring is unavailable (older kernels, seccomp filters, the io_uring_disabled
+ * sysctl, or an operation the kernel does not support according to IORING_REGISTER_PROBE), the same requests run as
+ * blocking calls on the async_pool_t of async.c, with as many threads as requests may be in flight.
+ *
+ * file_ring_submit only queues a request. file_ring_run moves queued requests into flight, up to the depth, and
+ * calls the callbacks of completed ones on the calling thread until nothing is queued or in flight. Callbacks may
+ * submit more, which is how a file is opened, read and closed in a chain. A ring is used by one thread at a time.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "async.h"
+#include "file_ring.h"
+
+#define MAX_THREADS 64
+
+typedef struct {
+    int fd;
+    unsigned to_submit;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    void *sq_map;
+    size_t sq_map_size;
+    void *cq_map;
+    size_t cq_map_size;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    _Atomic unsigned *sq_head;
+    _Atomic unsigned *sq_tail;
+    unsigned *sq_array;
+    unsigned cq_mask;
+    _Atomic unsigned *cq_head;
+    _Atomic unsigned *cq_tail;
+    struct io_uring_cqe *cqes;
+} uring_t;
+
+struct file_ring_t {
+    file_backend_t backend;
+    unsigned depth;
+    unsigned in_flight;
+    file_req_t *queue_head;
+    file_req_t *queue_tail;
+    uring_t uring;
+    async_pool_t *pool;
+    /** Requests completed by the pool, pushed by its workers. */
+    pthread_mutex_t lock;
+    pthread_cond_t completed;
+    file_req_t *done;
+};
+
+static int uring_setup(unsigned entries, struct io_uring_params *params)
+{
+    return (int) syscall(SYS_io_uring_setup, entries, params);
+}
+
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return (int) syscall(SYS_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int uring_register(int fd, unsigned opcode, void *arg, unsigned count)
+{
+    return (int) syscall(SYS_io_uring_register, fd, opcode, arg, count);
+}
+
+static void uring_close(uring_t *uring)
+{
+    if (uring->sqes)
+        munmap(uring->sqes, uring->sqes_size);
+    if (uring->cq_map && uring->cq_map != uring->sq_map)
+        munmap(uring->cq_map, uring->cq_map_size);
+    if (uring->sq_map)
+        munmap(uring->sq_map, uring->sq_map_size);
+    if (uring->fd >= 0)
+        close(uring->fd);
+}
+
+/**
+ * @return 1 if the kernel supports all four operations, 0 if not or if it cannot tell (probing is Linux 5.6)
+ */
+static int uring_probe(int fd)
+{
+    static const int needed[] = {IORING_OP_STATX, IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_CLOSE};
+    size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = (struct io_uring_probe *) calloc(1, size);
+    int supported = 0;
+
+    if (probe && uring_register(fd, IORING_REGISTER_PROBE, probe, 256) == 0) {
+        supported = 1;
+        for (size_t i = 0; i < sizeof(needed) / sizeof(needed[0]); i++)
+            if (needed[i] > probe->last_op || !(probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED))
+                supported = 0;
+    }
+    free(probe);
+    return supported;
+}
+
+/**
+ * @return 0, or -1 with errno set
+ */
+static int uring_open(uring_t *uring, unsigned entries)
+{
+    struct io_uring_params params;
+
+    memset(uring, 0, sizeof(*uring));
+    memset(&params, 0, sizeof(params));
+    // Keep submitting the rest of a batch when one request fails; the flag is Linux 5.18.
+    params.flags = IORING_SETUP_SUBMIT_ALL;
+    if ((uring->fd = uring_setup(entries, &params)) == -1 && errno == EINVAL) {
+        memset(&params, 0, sizeof(params));
+        uring->fd = uring_setup(entries, &params);
+    }
+    if (uring->fd == -1)
+        return -1;
+    if (!uring_probe(uring->fd)) {
+        close(uring->fd);
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+
+    uring->sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    uring->cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (uring->cq_map_size > uring->sq_map_size)
+            uring->sq_map_size = uring->cq_map_size;
+        uring->cq_map_size = uring->sq_map_size;
+    }
+    uring->sq_map = mmap(NULL, uring->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->fd,
+                         IORING_OFF_SQ_RING);
+    if (uring->sq_map == MAP_FAILED) {
+        uring->sq_map = NULL;
+        goto fail;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        uring->cq_map = uring->sq_map;
+    } else {
+        uring->cq_map = mmap(NULL, uring->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->fd,
+                             IORING_OFF_CQ_RING);
+        if (uring->cq_map == MAP_FAILED) {
+            uring->cq_map = NULL;
+            goto fail;
+        }
+    }
+    uring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    uring->sqes = (struct io_uring_sqe *) mmap(NULL, uring->sqes_size, PROT_READ | PROT_WRITE,
+                                               MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQES);
+    if (uring->sqes == MAP_FAILED) {
+        uring->sqes = NULL;
+        goto fail;
+    }
+
+    char *sq = (char *) uring->sq_map, *cq = (char *) uring->cq_map;
+    uring->sq_head = (_Atomic unsigned *) (sq + params.sq_off.head);
+    uring->sq_tail = (_Atomic unsigned *) (sq + params.sq_off.tail);
+    uring->sq_mask = *(unsigned *) (sq + params.sq_off.ring_mask);
+    uring->sq_entries = params.sq_entries;
+    uring->sq_array = (unsigned *) (sq + params.sq_off.array);
+    uring->cq_head = (_Atomic unsigned *) (cq + params.cq_off.head);
+    uring->cq_tail = (_Atomic unsigned *) (cq + params.cq_off.tail);
+    uring->cq_mask = *(unsigned *) (cq + params.cq_off.ring_mask);
+    uring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+    return 0;
+
+fail:;
+    int error = errno;
+    uring_close(uring);
+    errno = error;
+    return -1;
+}
+
+static void fill_sqe(struct io_uring_sqe *sqe, const file_req_t *req)
+{
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->fd = req->fd;
+    sqe->user_data = (uint64_t) (uintptr_t) req;
+    switch (req->op) {
+    case FILE_OP_STATX:
+        sqe->opcode = IORING_OP_STATX;
+        sqe->addr = (uint64_t) (uintptr_t) req->path;
+        sqe->len = req->mask;
+        sqe->off = (uint64_t) (uintptr_t) req->statx;
+        sqe->statx_flags = (uint32_t) req->flags;
+        break;
+    case FILE_OP_OPENAT:
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->addr = (uint64_t) (uintptr_t) req->path;
+        sqe->len = req->mask;
+        sqe->open_flags = (uint32_t) req->flags;
+        break;
+    case FILE_OP_READ:
+        sqe->opcode = IORING_OP_READ;
+        sqe->addr = (uint64_t) (uintptr_t) req->buffer;
+        sqe->len = req->length;
+        sqe->off = req->offset;
+        break;
+    case FILE_OP_CLOSE:
+        sqe->opcode = IORING_OP_CLOSE;
+        break;
+    }
+}
+
+static file_req_t *queue_pop(file_ring_t *ring)
+{
+    file_req_t *req = ring->queue_head;
+
+    if (req && !(ring->queue_head = req->next))
+        ring->queue_tail = NULL;
+    return req;
+}
+
+/**
+ * One round: fills the submission ring, submits and waits for at least one completion in the same system call, then
+ * calls back everything that completed.
+ */
+static int uring_round(file_ring_t *ring)
+{
+    uring_t *uring = &ring->uring;
+    unsigned tail = atomic_load_explicit(uring->sq_tail, memory_order_relaxed);
+    unsigned head = atomic_load_explicit(uring->sq_head, memory_order_acquire);
+    file_req_t *req;
+
+    while (ring->in_flight < ring->depth && tail - head < uring->sq_entries && (req = queue_pop(ring))) {
+        unsigned index = tail & uring->sq_mask;
+        fill_sqe(&uring->sqes[index], req);
+        uring->sq_array[index] = index;
+        tail++;
+        uring->to_submit++;
+        ring->in_flight++;
+    }
+    atomic_store_explicit(uring->sq_tail, tail, memory_order_release);
+
+    int submitted = uring_enter(uring->fd, uring->to_submit, 1, IORING_ENTER_GETEVENTS);
+    if (submitted == -1) {
+        if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+            return -1;
+        // Out of resources for new requests: only wait for some to complete.
+        if (uring_enter(uring->fd, 0, 1, IORING_ENTER_GETEVENTS) == -1 && errno != EINTR)
+            return -1;
+        submitted = 0;
+    }
+    uring->to_submit -= (unsigned) submitted;
+
+    unsigned cq_head = atomic_load_explicit(uring->cq_head, memory_order_relaxed);
+    unsigned cq_tail = atomic_load_explicit(uring->cq_tail, memory_order_acquire);
+    file_req_t *completed = NULL, **last = &completed;
+    for (; cq_head != cq_tail; cq_head++) {
+        struct io_uring_cqe *cqe = &uring->cqes[cq_head & uring->cq_mask];
+        req = (file_req_t *) (uintptr_t) cqe->user_data;
+        req->result = cqe->res;
+        *last = req;
+        last = &req->next;
+        ring->in_flight--;
+    }
+    *last = NULL;
+    // Hand the entries back before the callbacks run, they may submit again.
+    atomic_store_explicit(uring->cq_head, cq_head, memory_order_release);
+    while (completed) {
+        req = completed;
+        completed = req->next;
+        req->cb(ring, req);
+    }
+    return 0;
+}
+
+static void *run_request(void *arg)
+{
+    file_req_t *req = (file_req_t *) arg;
+    long result = -1;
+
+    switch (req->op) {
+    case FILE_OP_STATX:
+        result = statx(req->fd, req->path, req->flags, req->mask, req->statx);
+        break;
+    case FILE_OP_OPENAT:
+        result = openat(req->fd, req->path, req->flags, req->mask);
+        break;
+    case FILE_OP_READ:
+        result = pread(req->fd, req->buffer, req->length, (off_t) req->offset);
+        break;
+    case FILE_OP_CLOSE:
+        result = close(req->fd);
+        break;
+    }
+    req->result = result == -1 ? -errno : result;
+    return NULL;
+}
+
+static void on_pool_done(future_t *future, future_status_t status, void *ctx)
+{
+    file_req_t *req = (file_req_t *) ctx;
+    file_ring_t *ring = req->ring;
+
+    (void) future;
+    if (status == FUTURE_CANCELLED)
+        req->result = -ECANCELED;
+    pthread_mutex_lock(&ring->lock);
+    req->next = ring->done;
+    ring->done = req;
+    pthread_cond_signal(&ring->completed);
+    pthread_mutex_unlock(&ring->lock);
+}
+
+static int pool_round(file_ring_t *ring)
+{
+    file_req_t *req;
+
+    while (ring->in_flight < ring->depth && (req = queue_pop(ring))) {
+        future_t *future = async_submit(ring->pool, run_request, req);
+        if (!future) {
+            req->next = ring->queue_head;
+            ring->queue_head = req;
+            if (!ring->queue_tail)
+                ring->queue_tail = req;
+            return -1;
+        }
+        req->ring = ring;
+        ring->in_flight++;
+        future_then(future, on_pool_done, req);
+    }
+
+    pthread_mutex_lock(&ring->lock);
+    while (!ring->done)
+        pthread_cond_wait(&ring->completed, &ring->lock);
+    file_req_t *completed = ring->done;
+    ring->done = NULL;
+    pthread_mutex_unlock(&ring->lock);
+    while (completed) {
+        req = completed;
+        completed = req->next;
+        ring->in_flight--;
+        req->cb(ring, req);
+    }
+    return 0;
+}
+
+/**
+ * @param depth most requests in flight at once
+ * @param backend FILE_RING_AUTO takes io_uring if it works and the thread pool otherwise
+ * @return the ring, or NULL with errno set
+ */
+file_ring_t *file_ring_create(unsigned depth, file_backend_t backend)
+{
+    if (depth == 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    file_ring_t *ring = (file_ring_t *) calloc(1, sizeof(file_ring_t));
+    if (!ring)
+        return NULL;
+    ring->depth = depth;
+    ring->uring.fd = -1;
+
+    if (backend != FILE_RING_THREADS) {
+        if (uring_open(&ring->uring, depth) == 0) {
+            ring->backend = FILE_RING_URING;
+            return ring;
+        }
+        if (backend == FILE_RING_URING) {
+            int error = errno;
+            free(ring);
+            errno = error;
+            return NULL;
+        }
+    }
+
+    ring->backend = FILE_RING_THREADS;
+    // A worker returns its future to the pool only after the callback, so up to one future per thread is done but
+    // not yet free while the ring already counts its request as complete.
+    if (!(ring->pool = async_pool_create(depth < MAX_THREADS ? (int) depth : MAX_THREADS, 2 * (size_t) depth))) {
+        int error = errno;
+        free(ring);
+        errno = error;
+        return NULL;
+    }
+    pthread_mutex_init(&ring->lock, NULL);
+    pthread_cond_init(&ring->completed, NULL);
+    return ring;
+}
+
+/**
+ * Frees the ring. Nothing may be in flight; queued requests are dropped without their callbacks.
+ */
+void file_ring_destroy(file_ring_t *ring)
+{
+    if (ring->backend == FILE_RING_URING) {
+        uring_close(&ring->uring);
+    } else {
+        async_pool_destroy(ring->pool);
+        pthread_cond_destroy(&ring->completed);
+        pthread_mutex_destroy(&ring->lock);
+    }
+    free(ring);
+}
+
+file_backend_t file_ring_backend(const file_ring_t *ring)
+{
+    return ring->backend;
+}
+
+/**
+ * Queues a request prepared with one of the file_prep_ functions. Nothing is started before file_ring_run.
+ */
+void file_ring_submit(file_ring_t *ring, file_req_t *req)
+{
+    req->next = NULL;
+    if (ring->queue_tail)
+        ring->queue_tail->next = req;
+    else
+        ring->queue_head = req;
+    ring->queue_tail = req;
+}
+
+/**
+ * Runs the queued requests, and those their callbacks submit, until none is left.
+ * @return 0, or -1 with errno set if the ring failed; requests still in flight then never complete
+ */
+int file_ring_run(file_ring_t *ring)
+{
+    while (ring->queue_head || ring->in_flight) {
+        int result = ring->backend == FILE_RING_URING ? uring_round(ring) : pool_round(ring);
+        if (result == -1)
+            return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,117 @@
+/** \file growbuf.c
+ *
+ * @brief Growable buffer that moves page mappings instead of bytes
+ *
+ * realloc of a block that cannot grow in place allocates a new one and copies, so doubling a buffer up to n bytes
+ * copies about n bytes in total, and at the last step needs the old and the new block at once. Here the buffer is a
+ * mapping of its own and grows with mremap(MREMAP_MAYMOVE): when the address range after it is taken, the kernel
+ * moves the page table entries to a new range. No byte is copied, and the cost depends on the number of pages (or
+ * huge pages) mapped, not on their contents.
+ *
+ * Shrinking keeps the mapping: growbuf_release_tail gives the pages past `size` back with MADV_DONTNEED, so they stop
+ * counting in the RSS but the address range stays reserved, and growing again only faults in fresh zero pages.
+ *
+ * Everything is in whole pages, so the buffer is for large data; a small one still takes a page.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "growbuf.h"
+
+static size_t page_round(size_t bytes)
+{
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    return (bytes + page - 1) & ~(page - 1);
+}
+
+/**
+ * @param capacity bytes to map up front, at least one page is mapped
+ * @return 0, or -1 with errno set
+ */
+int growbuf_init(growbuf_t *buffer, size_t capacity)
+{
+    size_t length = page_round(capacity ? capacity : 1);
+    void *data = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (data == MAP_FAILED)
+        return -1;
+    buffer->data = (char *) data;
+    buffer->size = 0;
+    buffer->capacity = length;
+    return 0;
+}
+
+void growbuf_free(growbuf_t *buffer)
+{
+    munmap(buffer->data, buffer->capacity);
+    buffer->data = NULL;
+    buffer->size = buffer->capacity = 0;
+}
+
+/**
+ * Makes room for capacity bytes, at least doubling the mapping so that appends stay amortized O(1). data may move.
+ * @return 0, or -1 with errno set
+ */
+int growbuf_reserve(growbuf_t *buffer, size_t capacity)
+{
+    if (capacity <= buffer->capacity)
+        return 0;
+    size_t length = buffer->capacity * 2 > capacity ? buffer->capacity * 2 : capacity;
+    if (length < buffer->capacity) {
+        errno = ENOMEM;
+        return -1;
+    }
+    length = page_round(length);
+    void *data = mremap(buffer->data, buffer->capacity, length, MREMAP_MAYMOVE);
+    if (data == MAP_FAILED)
+        return -1;
+    buffer->data = (char *) data;
+    buffer->capacity = length;
+    return 0;
+}
+
+/**
+ * Sets the size. Bytes that become part of the buffer are zero if they were never written or were released.
+ * @return 0, or -1 with errno set
+ */
+int growbuf_resize(growbuf_t *buffer, size_t size)
+{
+    if (growbuf_reserve(buffer, size) == -1)
+        return -1;
+    buffer->size = size;
+    return 0;
+}
+
+/**
+ * @return 0, or -1 with errno set
+ */
+int growbuf_append(growbuf_t *buffer, const void *bytes, size_t length)
+{
+    if (buffer->size + length < buffer->size) {
+        errno = ENOMEM;
+        return -1;
+    }
+    if (growbuf_reserve(buffer, buffer->size + length) == -1)
+        return -1;
+    memcpy(buffer->data + buffer->size, bytes, length);
+    buffer->size += length;
+    return 0;
+}
+
+/**
+ * Returns the whole pages past size to the kernel. They read as zero afterwards; the capacity is unchanged.
+ * @return 0, or -1 with errno set
+ */
+int growbuf_release_tail(growbuf_t *buffer)
+{
+    size_t used = page_round(buffer->size);
+
+    if (used >= buffer->capacity)
+        return 0;
+    return madvise(buffer->data + used, buffer->capacity - used, MADV_DONTNEED);
+}
@@ -13,23 +13,71 @@
 #include <stdio.h>  // For printf function
 #include <stdlib.h> // For C library's heap memory functions
 #include <string.h>
+#include <time.h>
 
+#include "helpers.h"
+#include "proc_maps.h"
+
+#define MAX_REGIONS 256
 
 void print_mem_maps() {
 #ifdef __linux__
-    FILE* fd = fopen("/proc/self/maps", "r");
-    if (!fd) {
-        printf("Could not open maps file.\n");
+    // The parser reads /proc/self/maps without allocating, so what it shows is not disturbed by the looking.
+    static mem_region_t regions[MAX_REGIONS];
+    long count = mem_maps_read(regions, MAX_REGIONS);
+    if (count == -1) {
+        perror("mem_maps_read");
+        exit(1);
+    }
+    for (long i = 0; i < count && i < MAX_REGIONS; i++) {
+        printf("> %012lx-%012lx %s %8zu KiB %s\n", (unsigned long)regions[i].start, (unsigned long)regions[i].end,
+               regions[i].perms, (size_t)(regions[i].end - regions[i].start) / 1024, regions[i].path);
+    }
+    mem_rollup_t rollup;
+    if (mem_rollup_read(&rollup) == 0) {
+        printf("> RSS %lu KiB, PSS %lu KiB, anonymous %lu KiB, anonymous huge pages %lu KiB, swap %lu KiB\n",
+               (unsigned long)rollup.rss_kb, (unsigned long)rollup.pss_kb, (unsigned long)rollup.anonymous_kb,
+               (unsigned long)rollup.anon_huge_kb, (unsigned long)rollup.swap_kb);
+    }
+#endif
+}
+
+/*
+ * Small blocks come from the [heap] mapping, which malloc extends with brk as it runs out. A sampler thread watching
+ * /proc sees it grow together with the RSS.
+ */
+void watch_heap_growth() {
+#ifdef __linux__
+    mem_sampler_t* sampler = mem_sampler_start(5, 64);
+    if (!sampler) {
+        perror("mem_sampler_start");
         exit(1);
     }
-    char line[1024];
-    while (!feof(fd)) {
-        fgets(line, 1024, fd);
-        printf("> %s", line);
+    char* blocks[64];
+    struct timespec pause = {0, 2000000};
+    for (int i = 0; i < 64; i++) {
+        blocks[i] = (char*)malloc(64 * 1024);
+        if (!blocks[i]) {
+            exit_sys("malloc");
+        }
+        memset(blocks[i], i, 64 * 1024); // Touch it, so that it counts in the RSS
+        nanosleep(&pause, NULL);
+    }
+    mem_sample_t samples[64];
+    size_t count = mem_sampler_read(sampler, samples, 64);
+    mem_sampler_stop(sampler);
+    for (size_t i = 0; i < count; i += count / 8 + 1) {
+        printf("+%4lu ms: heap %6lu KiB, stack %4lu KiB, RSS %6lu KiB\n",
+               (unsigned long)((samples[i].time_ns - samples[0].time_ns) / 1000000),
+               (unsigned long)(samples[i].heap_bytes / 1024), (unsigned long)(samples[i].stack_bytes / 1024),
+               (unsigned long)samples[i].rollup.rss_kb);
+    }
+    for (int i = 0; i < 64; i++) {
+        free(blocks[i]);
     }
-    fclose(fd);
 #endif
 }
+
 int main(int argc, char** argv) {
     // Allocate 10 bytes without initialization
     char* ptr1 = (char*)malloc(10 * sizeof(char));
@@ -68,5 +116,6 @@ int main(int argc, char** argv) {
     printf("Address of ptr: %p\n", (void*)&ptr);
     printf("Memory allocated by remalloc at %p: \n", (void*)ptr);
     free(ptr);
+    watch_heap_growth();
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,655 @@
+/** \file heap_profiler.c
+ *
+ * @brief Sampling heap profiler, preloaded in front of malloc
+ *
+ * Wraps the malloc family of whatever allocator comes next (glibc, or libslab.so), the aligned and array variants
+ * included so that every block that is freed was counted when it was allocated, and keeps:
+ *
+ * - a histogram of allocation counts and bytes per power-of-two size class, and the bytes in use. Sizes are the usable
+ *   sizes the allocator reports, so frees are counted with the same size as their allocation. Each thread counts into
+ *   its own buffer and adds it to the shared totals every FLUSH_EVERY events and when it exits.
+ * - call stacks of sampled allocations. As in tcmalloc, the allocated bytes are treated as a Poisson process: every
+ *   thread draws the distance to its next sample from an exponential distribution with a mean of HEAPPROF_RATE bytes,
+ *   and counts it down by each allocation. An allocation of size s is sampled with probability 1 - exp(-s / rate), so
+ *   a sample stands for s / (1 - exp(-s / rate)) bytes. Big allocations are nearly always sampled, small ones rarely,
+ *   and the cost of a stack walk is paid about once per rate bytes.
+ *
+ * Sampled allocations are grouped by call stack into sites. Those not freed yet sit in a small lock-free table keyed
+ * by address, which free probes: one load for an unsampled block.
+ *
+ * The report lists the size classes and the top sites by allocated and by live bytes. It is written when the program
+ * exits, where the live sites are leaks, and whenever the process gets HEAPPROF_SIGNAL. The signal handler only sets a
+ * flag, the next malloc or free writes the report, so nothing unsafe runs in signal context.
+ *
+ * Environment:
+ * - `HEAPPROF_RATE`: mean bytes between samples, default 2 MiB as in tcmalloc. 1 samples every allocation.
+ * - `HEAPPROF_OUT`: file to append the reports to, default stderr.
+ * - `HEAPPROF_SIGNAL`: signal number that requests a report, default SIGUSR2, 0 for none.
+ *
+ * \code{.sh}
+ * HEAPPROF_RATE=1 LD_PRELOAD=./libheapprof.so ./heap
+ * \endcode
+ */
+
+#define _GNU_SOURCE
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <execinfo.h>
+#include <malloc.h>
+#include <math.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "locks.h"
+
+#define EXPORT __attribute__((visibility("default")))
+
+#define SIZE_CLASSES 28
+#define FLUSH_EVERY 1024
+#define DEFAULT_RATE (2 * 1024 * 1024)
+#define MAX_FRAMES 16
+/** Frames of the profiler itself at the top of every stack: take_sample, on_alloc and the wrapper. */
+#define SKIP_FRAMES 3
+#define SITE_SLOTS 4096
+#define LIVE_SLOTS (1u << 16)
+#define LIVE_PROBES 32
+#define LIVE_TOMBSTONE ((uintptr_t) 1)
+#define TOP_SITES 10
+#define BOOTSTRAP_BYTES 4096
+
+typedef void *(*malloc_fn_t)(size_t);
+typedef void *(*calloc_fn_t)(size_t, size_t);
+typedef void *(*realloc_fn_t)(void *, size_t);
+typedef int (*posix_memalign_fn_t)(void **, size_t, size_t);
+typedef void *(*aligned_fn_t)(size_t, size_t);
+typedef void (*free_fn_t)(void *);
+typedef size_t (*usable_size_fn_t)(void *);
+
+typedef struct {
+    uint64_t hash;
+    int depth;
+    void *frames[MAX_FRAMES];
+    uint64_t samples;
+    double alloc_bytes;
+    double alloc_count;
+    double live_bytes;
+    double live_count;
+} site_t;
+
+typedef struct {
+    _Atomic uintptr_t ptr;
+    uint32_t site;
+    double weight;
+    double count;
+} live_t;
+
+typedef struct {
+    int64_t in_use;
+    uint64_t count[SIZE_CLASSES];
+    uint64_t bytes[SIZE_CLASSES];
+    uint64_t frees;
+    unsigned events;
+    int64_t until_sample;
+    uint64_t seed;
+    /** 0 untouched, 1 counting, 2 counting and flushed at thread exit. */
+    int state;
+} thread_stats_t;
+
+static malloc_fn_t real_malloc;
+static calloc_fn_t real_calloc;
+static realloc_fn_t real_realloc;
+static posix_memalign_fn_t real_posix_memalign;
+static aligned_fn_t real_aligned_alloc;
+static aligned_fn_t real_memalign;
+static malloc_fn_t real_valloc;
+static malloc_fn_t real_pvalloc;
+static free_fn_t real_free;
+static usable_size_fn_t real_usable_size;
+
+/** Serves the allocations dlsym makes while the real functions are being looked up. */
+static _Alignas(16) char bootstrap[BOOTSTRAP_BYTES];
+static atomic_size_t bootstrap_used;
+static atomic_int resolved;
+
+static double sample_rate = DEFAULT_RATE;
+static char output_path[256];
+static atomic_int report_requested;
+static pthread_key_t stats_key;
+static atomic_int key_created;
+
+static _Atomic int64_t total_in_use;
+static _Atomic uint64_t total_count[SIZE_CLASSES];
+static _Atomic uint64_t total_bytes[SIZE_CLASSES];
+static _Atomic uint64_t total_frees;
+static _Atomic uint64_t dropped_samples;
+
+static futex_mutex_t site_lock = FUTEX_MUTEX_INIT;
+static site_t sites[SITE_SLOTS];
+static size_t site_count;
+static live_t live[LIVE_SLOTS];
+
+static __thread thread_stats_t thread_stats __attribute__((tls_model("initial-exec")));
+/** Set while the profiler itself runs: its own allocations, e.g. by backtrace or stdio, go straight through. */
+static __thread int in_profiler __attribute__((tls_model("initial-exec")));
+
+/**
+ * Looks up the functions of the next allocator. Until that is done (resolved == 2), allocations are served from
+ * bootstrap, since dlsym itself may call calloc.
+ */
+static void resolve(void)
+{
+    int expected = 0;
+
+    if (!atomic_compare_exchange_strong(&resolved, &expected, 1))
+        return;
+    // Through void ** as in the dlsym manual: ISO C has no conversion from object to function pointers.
+    *(void **) &real_malloc = dlsym(RTLD_NEXT, "malloc");
+    *(void **) &real_calloc = dlsym(RTLD_NEXT, "calloc");
+    *(void **) &real_realloc = dlsym(RTLD_NEXT, "realloc");
+    *(void **) &real_posix_memalign = dlsym(RTLD_NEXT, "posix_memalign");
+    *(void **) &real_aligned_alloc = dlsym(RTLD_NEXT, "aligned_alloc");
+    *(void **) &real_memalign = dlsym(RTLD_NEXT, "memalign");
+    *(void **) &real_valloc = dlsym(RTLD_NEXT, "valloc");
+    *(void **) &real_pvalloc = dlsym(RTLD_NEXT, "pvalloc");
+    *(void **) &real_usable_size = dlsym(RTLD_NEXT, "malloc_usable_size");
+    *(void **) &real_free = dlsym(RTLD_NEXT, "free");
+    if (!real_malloc || !real_calloc || !real_realloc || !real_posix_memalign || !real_aligned_alloc ||
+        !real_memalign || !real_valloc || !real_pvalloc || !real_usable_size || !real_free)
+        abort();
+    atomic_store_explicit(&resolved, 2, memory_order_release);
+}
+
+static int is_resolved(void)
+{
+    if (__builtin_expect(atomic_load_explicit(&resolved, memory_order_acquire) == 2, 1))
+        return 1;
+    resolve();
+    return atomic_load_explicit(&resolved, memory_order_acquire) == 2;
+}
+
+static void *bootstrap_alloc(size_t size)
+{
+    size_t offset = atomic_fetch_add(&bootstrap_used, (size + 15) & ~(size_t) 15);
+
+    return offset + size <= BOOTSTRAP_BYTES ? bootstrap + offset : NULL;
+}
+
+static int is_bootstrap(const void *ptr)
+{
+    return (const char *) ptr >= bootstrap && (const char *) ptr < bootstrap + BOOTSTRAP_BYTES;
+}
+
+static size_t size_class(size_t size)
+{
+    if (size <= 16)
+        return 0;
+    size_t size_class = (size_t) (64 - __builtin_clzl(size - 1)) - 4;
+    return size_class < SIZE_CLASSES ? size_class : SIZE_CLASSES - 1;
+}
+
+static uint64_t next_random(uint64_t *seed)
+{
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 7;
+    *seed ^= *seed << 17;
+    return *seed;
+}
+
+/**
+ * @return bytes to the next sample, drawn from an exponential distribution with mean sample_rate
+ */
+static int64_t sample_distance(thread_stats_t *stats)
+{
+    double uniform = (double) (next_random(&stats->seed) >> 11) * 0x1p-53;
+    return (int64_t) (-log(1.0 - uniform) * sample_rate) + 1;
+}
+
+static void stats_flush(thread_stats_t *stats)
+{
+    atomic_fetch_add_explicit(&total_in_use, stats->in_use, memory_order_relaxed);
+    atomic_fetch_add_explicit(&total_frees, stats->frees, memory_order_relaxed);
+    for (size_t i = 0; i < SIZE_CLASSES; i++) {
+        if (stats->count[i]) {
+            atomic_fetch_add_explicit(&total_count[i], stats->count[i], memory_order_relaxed);
+            atomic_fetch_add_explicit(&total_bytes[i], stats->bytes[i], memory_order_relaxed);
+        }
+    }
+    memset(stats->count, 0, sizeof(stats->count));
+    memset(stats->bytes, 0, sizeof(stats->bytes));
+    stats->in_use = 0;
+    stats->frees = 0;
+    stats->events = 0;
+}
+
+static void stats_exit(void *arg)
+{
+    in_profiler = 1;
+    stats_flush((thread_stats_t *) arg);
+    in_profiler = 0;
+}
+
+static thread_stats_t *stats_get(void)
+{
+    thread_stats_t *stats = &thread_stats;
+
+    if (__builtin_expect(stats->state != 2, 0)) {
+        if (stats->state == 0) {
+            stats->seed = (uint64_t) (uintptr_t) stats * 0x9e3779b97f4a7c15u | 1;
+            stats->until_sample = sample_distance(stats);
+            stats->state = 1;
+        }
+        // Allocations can come before the constructor has created the key.
+        if (atomic_load_explicit(&key_created, memory_order_acquire)) {
+            pthread_setspecific(stats_key, stats);
+            stats->state = 2;
+        }
+    }
+    return stats;
+}
+
+static uint64_t hash_frames(void *const *frames, int depth)
+{
+    uint64_t hash = 14695981039346656037u;
+
+    for (int i = 0; i < depth; i++)
+        hash = (hash ^ (uint64_t) (uintptr_t) frames[i]) * 1099511628211u;
+    return hash;
+}
+
+static uint64_t hash_ptr(uintptr_t ptr)
+{
+    uint64_t hash = (uint64_t) ptr * 0x9e3779b97f4a7c15u;
+    return hash ^ (hash >> 29);
+}
+
+/**
+ * Finds or creates the site of a stack. The caller holds site_lock.
+ * @return the site index, or SITE_SLOTS if the table is full
+ */
+static size_t site_find(void *const *frames, int depth)
+{
+    uint64_t hash = hash_frames(frames, depth);
+
+    for (size_t i = 0, index = hash % SITE_SLOTS; i < SITE_SLOTS; i++, index = (index + 1) % SITE_SLOTS) {
+        site_t *site = &sites[index];
+        if (site->depth == 0) {
+            if (site_count == SITE_SLOTS / 2)
+                return SITE_SLOTS;
+            site->hash = hash;
+            site->depth = depth;
+            memcpy(site->frames, frames, (size_t) depth * sizeof(void *));
+            site_count++;
+            return index;
+        }
+        if (site->hash == hash && site->depth == depth && !memcmp(site->frames, frames, (size_t) depth * sizeof(void *)))
+            return index;
+    }
+    return SITE_SLOTS;
+}
+
+__attribute__((noinline)) static void take_sample(void *ptr, size_t size)
+{
+    void *frames[MAX_FRAMES + SKIP_FRAMES];
+    int depth = backtrace(frames, MAX_FRAMES + SKIP_FRAMES) - SKIP_FRAMES;
+    double weight = size >= sample_rate * 64 ? (double) size : (double) size / -expm1(-(double) size / sample_rate);
+
+    if (depth <= 0)
+        return;
+    futex_mutex_lock(&site_lock);
+    size_t index = site_find(frames + SKIP_FRAMES, depth);
+    if (index != SITE_SLOTS) {
+        sites[index].samples++;
+        sites[index].alloc_bytes += weight;
+        sites[index].alloc_count += weight / (double) size;
+        sites[index].live_bytes += weight;
+        sites[index].live_count += weight / (double) size;
+    }
+    futex_mutex_unlock(&site_lock);
+    if (index == SITE_SLOTS) {
+        atomic_fetch_add_explicit(&dropped_samples, 1, memory_order_relaxed);
+        return;
+    }
+
+    uint64_t hash = hash_ptr((uintptr_t) ptr);
+    for (unsigned i = 0; i < LIVE_PROBES; i++) {
+        live_t *slot = &live[(hash + i) % LIVE_SLOTS];
+        uintptr_t seen = atomic_load_explicit(&slot->ptr, memory_order_relaxed);
+        if ((seen == 0 || seen == LIVE_TOMBSTONE) &&
+            atomic_compare_exchange_strong(&slot->ptr, &seen, (uintptr_t) ptr)) {
+            slot->site = (uint32_t) index;
+            slot->weight = weight;
+            slot->count = weight / (double) size;
+            return;
+        }
+    }
+    // No room to follow it: it will look like a leak, so take it back out of the live bytes.
+    futex_mutex_lock(&site_lock);
+    sites[index].live_bytes -= weight;
+    sites[index].live_count -= weight / (double) size;
+    futex_mutex_unlock(&site_lock);
+    atomic_fetch_add_explicit(&dropped_samples, 1, memory_order_relaxed);
+}
+
+static void forget_sample(void *ptr)
+{
+    uint64_t hash = hash_ptr((uintptr_t) ptr);
+
+    for (unsigned i = 0; i < LIVE_PROBES; i++) {
+        live_t *slot = &live[(hash + i) % LIVE_SLOTS];
+        uintptr_t seen = atomic_load_explicit(&slot->ptr, memory_order_acquire);
+        if (seen == 0)
+            return;
+        if (seen == (uintptr_t) ptr) {
+            futex_mutex_lock(&site_lock);
+            sites[slot->site].live_bytes -= slot->weight;
+            sites[slot->site].live_count -= slot->count;
+            futex_mutex_unlock(&site_lock);
+            atomic_store_explicit(&slot->ptr, LIVE_TOMBSTONE, memory_order_release);
+            return;
+        }
+    }
+}
+
+static void report(const char *reason);
+
+__attribute__((noinline)) static void on_alloc(void *ptr)
+{
+    thread_stats_t *stats = stats_get();
+    size_t size = real_usable_size(ptr);
+    size_t index = size_class(size);
+
+    stats->count[index]++;
+    stats->bytes[index] += size;
+    stats->in_use += (int64_t) size;
+    if ((stats->until_sample -= (int64_t) size) <= 0) {
+        take_sample(ptr, size);
+        stats->until_sample = sample_distance(stats);
+    }
+    if (++stats->events >= FLUSH_EVERY)
+        stats_flush(stats);
+}
+
+static void on_free(void *ptr)
+{
+    thread_stats_t *stats = stats_get();
+
+    stats->in_use -= (int64_t) real_usable_size(ptr);
+    stats->frees++;
+    forget_sample(ptr);
+    if (++stats->events >= FLUSH_EVERY)
+        stats_flush(stats);
+}
+
+static void check_report(void)
+{
+    if (__builtin_expect(atomic_load_explicit(&report_requested, memory_order_relaxed), 0) &&
+        atomic_exchange(&report_requested, 0))
+        report("signal");
+}
+
+/**
+ * Counts a block the real allocator returned. The wrapper sets in_profiler before calling the real function, which
+ * may call other functions of the family itself, as libslab.so's memalign calls aligned_alloc. Inlined, so the wrapper
+ * is the frame above on_alloc.
+ */
+static inline __attribute__((always_inline)) void *allocated(void *ptr)
+{
+    if (ptr)
+        on_alloc(ptr);
+    check_report();
+    in_profiler = 0;
+    return ptr;
+}
+
+EXPORT void *malloc(size_t size)
+{
+    if (!is_resolved())
+        return bootstrap_alloc(size);
+    if (in_profiler)
+        return real_malloc(size);
+    in_profiler = 1;
+    return allocated(real_malloc(size));
+}
+
+EXPORT void *calloc(size_t count, size_t size)
+{
+    if (!is_resolved()) {
+        // Bootstrap memory is static, hence zeroed.
+        size_t total;
+        return __builtin_mul_overflow(count, size, &total) ? NULL : bootstrap_alloc(total);
+    }
+    if (in_profiler)
+        return real_calloc(count, size);
+    in_profiler = 1;
+    return allocated(real_calloc(count, size));
+}
+
+EXPORT void free(void *ptr)
+{
+    if (!ptr || is_bootstrap(ptr) || !is_resolved())
+        return;
+    if (in_profiler) {
+        real_free(ptr);
+        return;
+    }
+    in_profiler = 1;
+    on_free(ptr);
+    real_free(ptr);
+    check_report();
+    in_profiler = 0;
+}
+
+EXPORT void *realloc(void *ptr, size_t size)
+{
+    if (!ptr)
+        return malloc(size);
+    if (is_bootstrap(ptr)) {
+        // The size of a bootstrap block is not kept: copy up to the end of the buffer at most.
+        size_t room = BOOTSTRAP_BYTES - (size_t) ((char *) ptr - bootstrap);
+        void *moved = malloc(size);
+        if (moved)
+            memcpy(moved, ptr, size < room ? size : room);
+        return moved;
+    }
+    if (in_profiler)
+        return real_realloc(ptr, size);
+    // Accounted as a free of the old block and an allocation of the new one, so growth shows up at its call site.
+    in_profiler = 1;
+    thread_stats_t *stats = stats_get();
+    int64_t old_size = (int64_t) real_usable_size(ptr);
+    forget_sample(ptr);
+    void *moved = real_realloc(ptr, size);
+    if (moved || size == 0) {
+        stats->in_use -= old_size;
+        stats->frees++;
+    }
+    if (moved)
+        on_alloc(moved);
+    check_report();
+    in_profiler = 0;
+    return moved;
+}
+
+EXPORT void *reallocarray(void *ptr, size_t count, size_t size)
+{
+    size_t total;
+
+    if (__builtin_mul_overflow(count, size, &total)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return realloc(ptr, total);
+}
+
+/*
+ * dlsym only calls malloc and calloc, so the aligned functions are never called before the real ones are known.
+ */
+
+EXPORT int posix_memalign(void **out, size_t alignment, size_t size)
+{
+    if (!is_resolved())
+        return ENOMEM;
+    if (in_profiler)
+        return real_posix_memalign(out, alignment, size);
+    in_profiler = 1;
+    int result = real_posix_memalign(out, alignment, size);
+    allocated(result == 0 ? *out : NULL);
+    return result;
+}
+
+EXPORT void *aligned_alloc(size_t alignment, size_t size)
+{
+    if (!is_resolved())
+        return NULL;
+    if (in_profiler)
+        return real_aligned_alloc(alignment, size);
+    in_profiler = 1;
+    return allocated(real_aligned_alloc(alignment, size));
+}
+
+EXPORT void *memalign(size_t alignment, size_t size)
+{
+    if (!is_resolved())
+        return NULL;
+    if (in_profiler)
+        return real_memalign(alignment, size);
+    in_profiler = 1;
+    return allocated(real_memalign(alignment, size));
+}
+
+EXPORT void *valloc(size_t size)
+{
+    if (!is_resolved())
+        return NULL;
+    if (in_profiler)
+        return real_valloc(size);
+    in_profiler = 1;
+    return allocated(real_valloc(size));
+}
+
+EXPORT void *pvalloc(size_t size)
+{
+    if (!is_resolved())
+        return NULL;
+    if (in_profiler)
+        return real_pvalloc(size);
+    in_profiler = 1;
+    return allocated(real_pvalloc(size));
+}
+
+static int compare_alloc_bytes(const void *a, const void *b)
+{
+    double x = sites[*(const size_t *) a].alloc_bytes, y = sites[*(const size_t *) b].alloc_bytes;
+    return (x < y) - (x > y);
+}
+
+static int compare_live_bytes(const void *a, const void *b)
+{
+    double x = sites[*(const size_t *) a].live_bytes, y = sites[*(const size_t *) b].live_bytes;
+    return (x < y) - (x > y);
+}
+
+static void print_sites(FILE *out, size_t *order, size_t count, int live_only)
+{
+    for (size_t i = 0; i < count && i < TOP_SITES; i++) {
+        site_t *site = &sites[order[i]];
+        // Rounding leaves dust in the live sums of fully freed sites.
+        double live_bytes = site->live_bytes >= 0.5 ? site->live_bytes : 0.0;
+        double live_count = live_bytes > 0.0 ? site->live_count : 0.0;
+        if (live_only && live_bytes == 0.0)
+            break;
+        fprintf(out, "  #%zu: %.0f bytes in ~%.0f blocks allocated (%lu samples), %.0f bytes in ~%.0f blocks live\n",
+                i + 1, site->alloc_bytes, site->alloc_count,
+                (unsigned long) site->samples, live_bytes, live_count);
+        fflush(out);
+        backtrace_symbols_fd(site->frames, site->depth, fileno(out));
+    }
+}
+
+/**
+ * Writes the histogram and the top sites. Runs with in_profiler set, so stdio and qsort allocate from the real
+ * allocator without being profiled.
+ */
+static void report(const char *reason)
+{
+    FILE *out = output_path[0] ? fopen(output_path, "a") : stderr;
+    size_t order[SITE_SLOTS];
+    size_t count = 0;
+
+    if (!out)
+        return;
+    stats_flush(stats_get());
+    fprintf(out, "heapprof report (%s), pid %d, sample rate %.0f bytes\n", reason, (int) getpid(), sample_rate);
+    fprintf(out, "  %-12s %12s %14s\n", "size", "allocations", "bytes");
+    for (size_t i = 0; i < SIZE_CLASSES; i++) {
+        uint64_t n = atomic_load(&total_count[i]);
+        if (n)
+            fprintf(out, "  <= %-9zu %12lu %14lu\n", (size_t) 16 << i, (unsigned long) n,
+                    (unsigned long) atomic_load(&total_bytes[i]));
+    }
+    fprintf(out, "  frees %lu, bytes in use %ld, dropped samples %lu\n", (unsigned long) atomic_load(&total_frees),
+            (long) atomic_load(&total_in_use), (unsigned long) atomic_load(&dropped_samples));
+
+    futex_mutex_lock(&site_lock);
+    for (size_t i = 0; i < SITE_SLOTS; i++)
+        if (sites[i].depth)
+            order[count++] = i;
+    qsort(order, count, sizeof(size_t), compare_alloc_bytes);
+    fprintf(out, "top allocation sites:\n");
+    print_sites(out, order, count, 0);
+    qsort(order, count, sizeof(size_t), compare_live_bytes);
+    fprintf(out, "%s:\n", strcmp(reason, "exit") == 0 ? "leaks (sampled blocks never freed)" : "live sampled blocks");
+    print_sites(out, order, count, 1);
+    futex_mutex_unlock(&site_lock);
+
+    if (out != stderr)
+        fclose(out);
+}
+
+static void on_signal(int signal)
+{
+    (void) signal;
+    atomic_store(&report_requested, 1);
+}
+
+__attribute__((constructor)) static void profiler_init(void)
+{
+    const char *rate = getenv("HEAPPROF_RATE");
+    const char *path = getenv("HEAPPROF_OUT");
+    const char *signal_number = getenv("HEAPPROF_SIGNAL");
+    int signal = signal_number ? atoi(signal_number) : SIGUSR2;
+
+    in_profiler = 1;
+    if (!is_resolved())
+        abort();
+    if (rate && atof(rate) >= 1)
+        sample_rate = atof(rate);
+    if (path)
+        snprintf(output_path, sizeof(output_path), "%s", path);
+    if (pthread_key_create(&stats_key, stats_exit) != 0)
+        abort();
+    atomic_store_explicit(&key_created, 1, memory_order_release);
+    // The first backtrace loads the unwinder, which must not happen in the middle of a sample.
+    void *frame;
+    backtrace(&frame, 1);
+    if (signal > 0) {
+        struct sigaction action = {0};
+        action.sa_handler = on_signal;
+        action.sa_flags = SA_RESTART;
+        sigaction(signal, &action, NULL);
+    }
+    in_profiler = 0;
+}
+
+__attribute__((destructor)) static void profiler_exit(void)
+{
+    in_profiler = 1;
+    report("exit");
+}
@@ -6,13 +6,29 @@
 
 #include "helpers.h"
 
+static exit_sys_handler_t handler;
+
+/**
+ * Installs a handler for the message of exit_sys, NULL to print it to stderr again.
+ */
+void exit_sys_handler(exit_sys_handler_t fn)
+{
+    handler = fn;
+}
+
 void exit_sys(const char *format, ...)
 {
     va_list ap;
+    // Formatting may change errno.
+    int error = errno;
 
     va_start(ap, format);
-    vfprintf(stderr, format, ap);
-    fprintf(stderr, ": %s\n", strerror(errno));
+    if (handler) {
+        handler(error, format, ap);
+    } else {
+        vfprintf(stderr, format, ap);
+        fprintf(stderr, ": %s\n", strerror(error));
+    }
 
     va_end(ap);
 
@@ -0,0 +1,289 @@
+/** \file line_scan.c
+ *
+ * @brief Counting and locating bytes 32 at a time with AVX2, for scanning large logs
+ *
+ * A log scanner spends its time looking for newlines and field delimiters. Testing one byte per iteration does about
+ * one byte per cycle. With AVX2 one compare tests 32 bytes and movemask turns the result into a bit mask:
+ *
+ * - scan_count compares and subtracts the result (0 or -1 per byte) from 32 byte-sized counters, so a match costs no
+ *   branch and no popcount. After at most 255 rounds, before a counter can wrap, _mm256_sad_epu8 adds the counters up
+ *   into four 64-bit sums. Two vectors per iteration keep two independent dependency chains busy.
+ * - scan_find2 looks for either of two bytes, e.g. a delimiter and the newline, like memchr does for one. It tests 64
+ *   bytes per iteration with a single branch, and the lowest set bit of the mask is the position.
+ * - scan_positions writes the offsets of all such bytes into an index, as simdjson does for the structural
+ *   characters of JSON. Where they are dense, a call per hit costs more than the hit; here the 64-bit mask of a
+ *   64-byte chunk is walked with ctz and mask &= mask - 1, without a branch per byte and without leaving the loop.
+ *
+ * The kernel is picked at run time: AVX2 where __builtin_cpu_supports says so, SSE2 (part of x86-64, 16 bytes at a
+ * time) otherwise, and a byte loop on other architectures. The AVX2 functions are compiled with the target attribute,
+ * so the rest of the program does not need -mavx2 and still runs on CPUs without it.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "line_scan.h"
+
+#ifdef __x86_64__
+#include <immintrin.h>
+#define HAVE_X86 1
+#endif
+
+typedef enum { KERNEL_SCALAR, KERNEL_SSE2, KERNEL_AVX2, KERNEL_COUNT } kernel_t;
+
+static const char *kernel_names[KERNEL_COUNT] = {"scalar", "sse2", "avx2"};
+static int kernel = -1;
+
+static size_t count_scalar(const char *data, size_t length, char byte)
+{
+    size_t count = 0;
+
+    for (size_t i = 0; i < length; i++)
+        count += data[i] == byte;
+    return count;
+}
+
+static const char *find2_scalar(const char *data, size_t length, char a, char b)
+{
+    for (size_t i = 0; i < length; i++)
+        if (data[i] == a || data[i] == b)
+            return data + i;
+    return NULL;
+}
+
+static size_t positions_scalar(const char *data, size_t length, char a, char b, uint32_t *positions, size_t base)
+{
+    size_t count = 0;
+
+    for (size_t i = 0; i < length; i++)
+        if (data[i] == a || data[i] == b)
+            positions[count++] = (uint32_t) (base + i);
+    return count;
+}
+
+static size_t store_mask(uint64_t mask, size_t offset, uint32_t *positions)
+{
+    size_t count = 0;
+
+    for (; mask; mask &= mask - 1)
+        positions[count++] = (uint32_t) (offset + (size_t) __builtin_ctzll(mask));
+    return count;
+}
+
+#ifdef HAVE_X86
+
+__attribute__((target("avx2"))) static size_t count_avx2(const char *data, size_t length, char byte)
+{
+    const __m256i needle = _mm256_set1_epi8(byte);
+    const __m256i zero = _mm256_setzero_si256();
+    size_t count = 0, i = 0;
+
+    while (length - i >= 64) {
+        size_t rounds = (length - i) / 64;
+        if (rounds > 255)
+            rounds = 255;
+        __m256i counters0 = zero, counters1 = zero;
+        for (size_t round = 0; round < rounds; round++, i += 64) {
+            __m256i chunk0 = _mm256_loadu_si256((const __m256i *) (data + i));
+            __m256i chunk1 = _mm256_loadu_si256((const __m256i *) (data + i + 32));
+            counters0 = _mm256_sub_epi8(counters0, _mm256_cmpeq_epi8(chunk0, needle));
+            counters1 = _mm256_sub_epi8(counters1, _mm256_cmpeq_epi8(chunk1, needle));
+        }
+        __m256i sums = _mm256_add_epi64(_mm256_sad_epu8(counters0, zero), _mm256_sad_epu8(counters1, zero));
+        count += (uint64_t) _mm256_extract_epi64(sums, 0) + (uint64_t) _mm256_extract_epi64(sums, 1) +
+                 (uint64_t) _mm256_extract_epi64(sums, 2) + (uint64_t) _mm256_extract_epi64(sums, 3);
+    }
+    return count + count_scalar(data + i, length - i, byte);
+}
+
+__attribute__((target("avx2"))) static const char *find2_avx2(const char *data, size_t length, char a, char b)
+{
+    const __m256i needle_a = _mm256_set1_epi8(a);
+    const __m256i needle_b = _mm256_set1_epi8(b);
+    size_t i = 0;
+
+    for (; length - i >= 64; i += 64) {
+        __m256i chunk0 = _mm256_loadu_si256((const __m256i *) (data + i));
+        __m256i chunk1 = _mm256_loadu_si256((const __m256i *) (data + i + 32));
+        __m256i match0 = _mm256_or_si256(_mm256_cmpeq_epi8(chunk0, needle_a), _mm256_cmpeq_epi8(chunk0, needle_b));
+        __m256i match1 = _mm256_or_si256(_mm256_cmpeq_epi8(chunk1, needle_a), _mm256_cmpeq_epi8(chunk1, needle_b));
+        __m256i any = _mm256_or_si256(match0, match1);
+        if (_mm256_testz_si256(any, any))
+            continue;
+        uint32_t mask = (uint32_t) _mm256_movemask_epi8(match0);
+        if (mask)
+            return data + i + __builtin_ctz(mask);
+        return data + i + 32 + __builtin_ctz((uint32_t) _mm256_movemask_epi8(match1));
+    }
+    for (; length - i >= 32; i += 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i *) (data + i));
+        uint32_t mask = (uint32_t) _mm256_movemask_epi8(
+            _mm256_or_si256(_mm256_cmpeq_epi8(chunk, needle_a), _mm256_cmpeq_epi8(chunk, needle_b)));
+        if (mask)
+            return data + i + __builtin_ctz(mask);
+    }
+    return find2_scalar(data + i, length - i, a, b);
+}
+
+__attribute__((target("avx2"))) static size_t positions_avx2(const char *data, size_t length, char a, char b,
+                                                              uint32_t *positions)
+{
+    const __m256i needle_a = _mm256_set1_epi8(a);
+    const __m256i needle_b = _mm256_set1_epi8(b);
+    size_t count = 0, i = 0;
+
+    for (; length - i >= 64; i += 64) {
+        __m256i chunk0 = _mm256_loadu_si256((const __m256i *) (data + i));
+        __m256i chunk1 = _mm256_loadu_si256((const __m256i *) (data + i + 32));
+        uint64_t mask0 = (uint32_t) _mm256_movemask_epi8(
+            _mm256_or_si256(_mm256_cmpeq_epi8(chunk0, needle_a), _mm256_cmpeq_epi8(chunk0, needle_b)));
+        uint64_t mask1 = (uint32_t) _mm256_movemask_epi8(
+            _mm256_or_si256(_mm256_cmpeq_epi8(chunk1, needle_a), _mm256_cmpeq_epi8(chunk1, needle_b)));
+        count += store_mask(mask0 | mask1 << 32, i, positions + count);
+    }
+    return count + positions_scalar(data + i, length - i, a, b, positions + count, i);
+}
+
+static size_t count_sse2(const char *data, size_t length, char byte)
+{
+    const __m128i needle = _mm_set1_epi8(byte);
+    const __m128i zero = _mm_setzero_si128();
+    size_t count = 0, i = 0;
+
+    while (length - i >= 32) {
+        size_t rounds = (length - i) / 32;
+        if (rounds > 255)
+            rounds = 255;
+        __m128i counters0 = zero, counters1 = zero;
+        for (size_t round = 0; round < rounds; round++, i += 32) {
+            __m128i chunk0 = _mm_loadu_si128((const __m128i *) (data + i));
+            __m128i chunk1 = _mm_loadu_si128((const __m128i *) (data + i + 16));
+            counters0 = _mm_sub_epi8(counters0, _mm_cmpeq_epi8(chunk0, needle));
+            counters1 = _mm_sub_epi8(counters1, _mm_cmpeq_epi8(chunk1, needle));
+        }
+        __m128i sums = _mm_add_epi64(_mm_sad_epu8(counters0, zero), _mm_sad_epu8(counters1, zero));
+        count += (uint64_t) _mm_cvtsi128_si64(sums) + (uint64_t) _mm_cvtsi128_si64(_mm_unpackhi_epi64(sums, sums));
+    }
+    return count + count_scalar(data + i, length - i, byte);
+}
+
+static const char *find2_sse2(const char *data, size_t length, char a, char b)
+{
+    const __m128i needle_a = _mm_set1_epi8(a);
+    const __m128i needle_b = _mm_set1_epi8(b);
+    size_t i = 0;
+
+    for (; length - i >= 16; i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *) (data + i));
+        uint32_t mask = (uint32_t) _mm_movemask_epi8(
+            _mm_or_si128(_mm_cmpeq_epi8(chunk, needle_a), _mm_cmpeq_epi8(chunk, needle_b)));
+        if (mask)
+            return data + i + __builtin_ctz(mask);
+    }
+    return find2_scalar(data + i, length - i, a, b);
+}
+
+static size_t positions_sse2(const char *data, size_t length, char a, char b, uint32_t *positions)
+{
+    const __m128i needle_a = _mm_set1_epi8(a);
+    const __m128i needle_b = _mm_set1_epi8(b);
+    size_t count = 0, i = 0;
+
+    for (; length - i >= 64; i += 64) {
+        uint64_t mask = 0;
+        for (int part = 0; part < 4; part++) {
+            __m128i chunk = _mm_loadu_si128((const __m128i *) (data + i + 16 * (size_t) part));
+            uint64_t bits = (uint32_t) _mm_movemask_epi8(
+                _mm_or_si128(_mm_cmpeq_epi8(chunk, needle_a), _mm_cmpeq_epi8(chunk, needle_b)));
+            mask |= bits << (16 * part);
+        }
+        count += store_mask(mask, i, positions + count);
+    }
+    return count + positions_scalar(data + i, length - i, a, b, positions + count, i);
+}
+
+#endif
+
+static int default_kernel(void)
+{
+#ifdef HAVE_X86
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") ? KERNEL_AVX2 : KERNEL_SSE2;
+#else
+    return KERNEL_SCALAR;
+#endif
+}
+
+/**
+ * Picks the kernel by name instead of by CPU, to compare them.
+ * @return 0, or -1 if the name is unknown or the CPU cannot run it
+ */
+int scan_use_kernel(const char *name)
+{
+    int best = default_kernel();
+
+    for (int i = 0; i <= best; i++) {
+        if (strcmp(name, kernel_names[i]) == 0) {
+            kernel = i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+const char *scan_kernel_name(void)
+{
+    if (kernel == -1)
+        kernel = default_kernel();
+    return kernel_names[kernel];
+}
+
+/**
+ * @return number of times byte occurs in data[0, length)
+ */
+size_t scan_count(const char *data, size_t length, char byte)
+{
+    if (kernel == -1)
+        kernel = default_kernel();
+#ifdef HAVE_X86
+    if (kernel == KERNEL_AVX2)
+        return count_avx2(data, length, byte);
+    if (kernel == KERNEL_SSE2)
+        return count_sse2(data, length, byte);
+#endif
+    return count_scalar(data, length, byte);
+}
+
+/**
+ * @return the first byte of data[0, length) that is a or b, or NULL
+ */
+const char *scan_find2(const char *data, size_t length, char a, char b)
+{
+    if (kernel == -1)
+        kernel = default_kernel();
+#ifdef HAVE_X86
+    if (kernel == KERNEL_AVX2)
+        return find2_avx2(data, length, a, b);
+    if (kernel == KERNEL_SSE2)
+        return find2_sse2(data, length, a, b);
+#endif
+    return find2_scalar(data, length, a, b);
+}
+
+/**
+ * Writes the offset of every byte of data[0, length) that is a or b into positions, in order.
+ * @param positions room for as many offsets as there may be matches, at most length
+ * @return number of offsets written
+ */
+size_t scan_positions(const char *data, size_t length, char a, char b, uint32_t *positions)
+{
+    if (kernel == -1)
+        kernel = default_kernel();
+#ifdef HAVE_X86
+    if (kernel == KERNEL_AVX2)
+        return positions_avx2(data, length, a, b, positions);
+    if (kernel == KERNEL_SSE2)
+        return positions_sse2(data, length, a, b, positions);
+#endif
+    return positions_scalar(data, length, a, b, positions, 0);
+}
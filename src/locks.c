@@ -0,0 +1,150 @@
+/** \file locks.c
+ *
+ * @brief Spin locks and a futex mutex
+ *
+ * The locks differ in what waiting threads do to the cache line of the lock:
+ *
+ * - test-and-set: every attempt is an atomic exchange, i.e. a write. Waiters keep stealing the line from each other and
+ *   from the owner, who needs it back to unlock.
+ * - test-and-test-and-set: waiters spin on a plain load, which the cache serves locally until the owner writes. After
+ *   an unlock all of them rush to exchange; the losers back off for an exponentially growing time.
+ * - ticket: like a bakery. Handover is FIFO, hence fair, but every waiter still reads the same `serving` word and all
+ *   of them miss when it changes.
+ * - MCS: waiters form a linked queue and each one spins on a flag in its own node, so an unlock touches the line of the
+ *   next waiter only.
+ * - futex mutex: spins briefly, then sleeps in the kernel. The state remembers whether anybody may be sleeping, so an
+ *   uncontended lock and unlock are one atomic operation each and need no system call (Drepper, "Futexes Are Tricky").
+ *
+ * Spinning waiters burn a CPU, and a spin lock whose owner is preempted keeps everybody spinning until the owner runs
+ * again, which is why only the futex mutex is safe with more threads than CPUs.
+ */
+
+#include <linux/futex.h>
+#include <stddef.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "locks.h"
+
+#define BACKOFF_MIN 4
+#define BACKOFF_MAX 1024
+#define FUTEX_SPINS 100
+
+static inline void cpu_relax(void)
+{
+    __builtin_ia32_pause();
+}
+
+void tas_lock(tas_lock_t *lock)
+{
+    while (atomic_exchange_explicit(&lock->locked, 1, memory_order_acquire))
+        cpu_relax();
+}
+
+void tas_unlock(tas_lock_t *lock)
+{
+    atomic_store_explicit(&lock->locked, 0, memory_order_release);
+}
+
+void ttas_lock(ttas_lock_t *lock)
+{
+    unsigned backoff = BACKOFF_MIN;
+
+    for (;;) {
+        while (atomic_load_explicit(&lock->locked, memory_order_relaxed))
+            cpu_relax();
+        if (!atomic_exchange_explicit(&lock->locked, 1, memory_order_acquire))
+            return;
+        for (unsigned i = 0; i < backoff; i++)
+            cpu_relax();
+        if (backoff < BACKOFF_MAX)
+            backoff *= 2;
+    }
+}
+
+void ttas_unlock(ttas_lock_t *lock)
+{
+    atomic_store_explicit(&lock->locked, 0, memory_order_release);
+}
+
+void ticket_lock(ticket_lock_t *lock)
+{
+    unsigned ticket = atomic_fetch_add_explicit(&lock->next, 1, memory_order_relaxed);
+
+    while (atomic_load_explicit(&lock->serving, memory_order_acquire) != ticket)
+        cpu_relax();
+}
+
+void ticket_unlock(ticket_lock_t *lock)
+{
+    // Only the owner writes `serving`, so no read-modify-write is needed.
+    unsigned serving = atomic_load_explicit(&lock->serving, memory_order_relaxed);
+    atomic_store_explicit(&lock->serving, serving + 1, memory_order_release);
+}
+
+void mcs_lock(mcs_lock_t *lock, mcs_node_t *node)
+{
+    atomic_store_explicit(&node->next, NULL, memory_order_relaxed);
+    atomic_store_explicit(&node->locked, 1, memory_order_relaxed);
+
+    mcs_node_t *prev = atomic_exchange_explicit(&lock->tail, node, memory_order_acq_rel);
+    if (!prev)
+        return;
+    atomic_store_explicit(&prev->next, node, memory_order_release);
+    while (atomic_load_explicit(&node->locked, memory_order_acquire))
+        cpu_relax();
+}
+
+void mcs_unlock(mcs_lock_t *lock, mcs_node_t *node)
+{
+    mcs_node_t *next = atomic_load_explicit(&node->next, memory_order_acquire);
+
+    if (!next) {
+        mcs_node_t *expected = node;
+        if (atomic_compare_exchange_strong_explicit(&lock->tail, &expected, NULL, memory_order_release,
+                                                    memory_order_relaxed))
+            return;
+        // A successor swapped itself into the tail but has not linked itself to us yet.
+        while (!(next = atomic_load_explicit(&node->next, memory_order_acquire)))
+            cpu_relax();
+    }
+    atomic_store_explicit(&next->locked, 0, memory_order_release);
+}
+
+static void futex_wait(atomic_uint *addr, unsigned expected)
+{
+    syscall(SYS_futex, (unsigned *) addr, FUTEX_WAIT_PRIVATE, expected, NULL, NULL, 0);
+}
+
+static void futex_wake(atomic_uint *addr, int count)
+{
+    syscall(SYS_futex, (unsigned *) addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+void futex_mutex_lock(futex_mutex_t *mutex)
+{
+    unsigned state = 0;
+
+    if (atomic_compare_exchange_strong_explicit(&mutex->state, &state, 1, memory_order_acquire, memory_order_relaxed))
+        return;
+    for (int i = 0; i < FUTEX_SPINS && state == 1; i++) {
+        cpu_relax();
+        state = 0;
+        if (atomic_compare_exchange_strong_explicit(&mutex->state, &state, 1, memory_order_acquire,
+                                                    memory_order_relaxed))
+            return;
+    }
+    // Taking the lock from here on marks it as contended, because other sleepers may still be queued behind us.
+    if (state != 2)
+        state = atomic_exchange_explicit(&mutex->state, 2, memory_order_acquire);
+    while (state != 0) {
+        futex_wait(&mutex->state, 2);
+        state = atomic_exchange_explicit(&mutex->state, 2, memory_order_acquire);
+    }
+}
+
+void futex_mutex_unlock(futex_mutex_t *mutex)
+{
+    if (atomic_exchange_explicit(&mutex->state, 0, memory_order_release) == 2)
+        futex_wake(&mutex->state, 1);
+}
@@ -0,0 +1,221 @@
+/** \file log_cost.c
+ *
+ * @brief What a log call costs the thread that makes it: fprintf against the asynchronous logger of binlog.c
+ *
+ * Every thread logs the same kind of line, "request 12 from worker-3 took 1.234 ms, status 200", `calls` times, with
+ * `work` iterations of a busy loop between calls as the work that the log line is about. Each call is timed on its
+ * own; the table shows the mean, the median, the 99th percentile and the maximum, and the time until everything is
+ * in the file. Timing a call adds the cost of two clock reads, some 20-40 ns, to every method alike.
+ *
+ * - `fprintf stderr`: what LOG_ERROR and exit_sys did, with stderr pointed at the file: stderr is unbuffered, so every
+ *   call formats, locks the stream and makes a write system call.
+ * - `fprintf buffered`: the same into a FILE with a 64 KiB buffer: a write per 64 KiB, but still formatting and the
+ *   lock on the calling thread, and lines stay in the buffer until it fills.
+ * - `binlog text`: BINLOG; the background thread formats into the file.
+ * - `binlog binary`: BINLOG in binary mode; the background thread copies records, binlog_decode formats later.
+ *
+ * Text goes to file.txt, the binary log to file.bin; with one thread, `binlog_decode -r file.bin` gives file.txt. With
+ * more threads the lines are the same but their order differs.
+ *
+ * \code{.sh}
+ * ./log_cost [-n calls] [-t threads] [-w work] [-r ring-KiB] file
+ * \endcode
+ */
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "binlog.h"
+#include "helpers.h"
+
+#define MAX_THREADS 64
+
+typedef enum { METHOD_STDERR, METHOD_BUFFERED, METHOD_TEXT, METHOD_BINARY, METHODS } method_t;
+
+typedef struct {
+    pthread_t thread;
+    int index;
+    uint32_t *latencies;
+} worker_t;
+
+static const char *method_names[] = {"fprintf stderr", "fprintf buffered", "binlog text", "binlog binary"};
+
+static long calls = 200000;
+static long work = 0;
+static method_t method;
+static FILE *buffered;
+static pthread_barrier_t start;
+
+static void busy(long iterations)
+{
+    for (volatile long i = 0; i < iterations; i++)
+        ;
+}
+
+static void *worker_run(void *arg)
+{
+    worker_t *worker = (worker_t *) arg;
+    char name[32];
+
+    snprintf(name, sizeof(name), "worker-%d", worker->index);
+    pthread_barrier_wait(&start);
+    for (long i = 0; i < calls; i++) {
+        unsigned request = (unsigned) i;
+        double took = (double) (i % 5000) / 1000.0;
+        int status = i % 50 ? 200 : 503;
+
+        uint64_t begin = bench_now_ns();
+        switch (method) {
+        case METHOD_STDERR:
+            fprintf(stderr, "request %u from %s took %.3f ms, status %d\n", request, name, took, status);
+            break;
+        case METHOD_BUFFERED:
+            fprintf(buffered, "request %u from %s took %.3f ms, status %d\n", request, name, took, status);
+            break;
+        default:
+            BINLOG("request %u from %s took %.3f ms, status %d\n", request, name, took, status);
+            break;
+        }
+        uint64_t elapsed = bench_now_ns() - begin;
+        worker->latencies[i] = elapsed > UINT32_MAX ? UINT32_MAX : (uint32_t) elapsed;
+        busy(work);
+    }
+    return NULL;
+}
+
+static int by_value(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+static int open_output(const char *path)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+    if (fd == -1)
+        exit_sys("open %s", path);
+    return fd;
+}
+
+int main(int argc, char **argv)
+{
+    long threads = 1, ring_kib = 1024;
+    int result;
+
+    while ((result = getopt(argc, argv, "n:t:w:r:")) != -1) {
+        switch (result) {
+        case 'n':
+            calls = strtol(optarg, NULL, 10);
+            break;
+        case 't':
+            threads = strtol(optarg, NULL, 10);
+            break;
+        case 'w':
+            work = strtol(optarg, NULL, 10);
+            break;
+        case 'r':
+            ring_kib = strtol(optarg, NULL, 10);
+            break;
+        default:
+            optind = argc;
+            break;
+        }
+    }
+    if (optind != argc - 1 || calls < 1 || threads < 1 || threads > MAX_THREADS || work < 0 || ring_kib < 64) {
+        fprintf(stderr, "Usage: %s [-n calls] [-t threads (1-%d)] [-w work] [-r ring-KiB (64 or more)] file\n", argv[0],
+                MAX_THREADS);
+        exit(1);
+    }
+    char text_path[4096], binary_path[4096];
+    snprintf(text_path, sizeof(text_path), "%s.txt", argv[optind]);
+    snprintf(binary_path, sizeof(binary_path), "%s.bin", argv[optind]);
+
+    worker_t workers[MAX_THREADS];
+    uint32_t *all = (uint32_t *) malloc((size_t) (calls * threads) * sizeof(uint32_t));
+    if (!all)
+        exit_sys("malloc");
+    for (long t = 0; t < threads; t++) {
+        workers[t].index = (int) t;
+        workers[t].latencies = all + t * calls;
+    }
+
+    printf("%ld threads, %ld calls each, %ld iterations of work between calls, rings of %ld KiB\n", threads, calls,
+           work, ring_kib);
+    printf("  %-17s %9s %9s %9s %10s %12s %10s %8s\n", "method", "mean ns", "p50 ns", "p99 ns", "max us", "all in ms",
+           "MiB", "stalls");
+    int saved_stderr = dup(STDERR_FILENO);
+    for (method = 0; method < METHODS; method++) {
+        int fd = open_output(method == METHOD_BINARY ? binary_path : text_path);
+        binlog_options_t options = {fd, method == METHOD_BINARY ? BINLOG_BINARY : BINLOG_TEXT,
+                                    (size_t) ring_kib * 1024, 1};
+        binlog_stats_t before, after;
+
+        if (method == METHOD_STDERR && dup2(fd, STDERR_FILENO) == -1)
+            exit_sys("dup2");
+        if (method == METHOD_BUFFERED) {
+            if (!(buffered = fdopen(fd, "w")))
+                exit_sys("fdopen");
+            setvbuf(buffered, NULL, _IOFBF, 64 * 1024);
+        }
+        if (method >= METHOD_TEXT && binlog_start(&options) == -1)
+            exit_sys("binlog_start");
+        binlog_stats(&before);
+
+        pthread_barrier_init(&start, NULL, (unsigned) threads + 1);
+        for (long t = 0; t < threads; t++)
+            if (pthread_create(&workers[t].thread, NULL, worker_run, &workers[t]) != 0)
+                exit_sys("pthread_create");
+        pthread_barrier_wait(&start);
+        uint64_t begin = bench_now_ns();
+        for (long t = 0; t < threads; t++)
+            pthread_join(workers[t].thread, NULL);
+        if (method == METHOD_BUFFERED)
+            fflush(buffered);
+        if (method >= METHOD_TEXT)
+            binlog_flush();
+        uint64_t elapsed = bench_now_ns() - begin;
+        pthread_barrier_destroy(&start);
+        binlog_stats(&after);
+        if (method >= METHOD_TEXT)
+            binlog_stop();
+
+        if (method == METHOD_STDERR && dup2(saved_stderr, STDERR_FILENO) == -1)
+            exit_sys("dup2");
+        if (method == METHOD_BUFFERED)
+            fclose(buffered);
+        else
+            close(fd);
+
+        size_t count = (size_t) (calls * threads);
+        uint64_t sum = 0;
+        for (size_t i = 0; i < count; i++)
+            sum += all[i];
+        qsort(all, count, sizeof(uint32_t), by_value);
+        struct stat st;
+        if (stat(method == METHOD_BINARY ? binary_path : text_path, &st) == -1)
+            exit_sys("stat");
+        printf("  %-17s %9.1f %9u %9u %10.1f %12.1f %10.1f %8lu\n", method_names[method], (double) sum / (double) count,
+               all[count / 2], all[count * 99 / 100], (double) all[count - 1] / 1e3, (double) elapsed / 1e6,
+               (double) st.st_size / 1048576.0, (unsigned long) (after.stalls - before.stalls));
+        if (method >= METHOD_TEXT && (after.records - before.records != count || after.dropped != before.dropped)) {
+            fprintf(stderr, "FATAL: the logger wrote %lu of %zu records and dropped %lu\n",
+                    (unsigned long) (after.records - before.records), count,
+                    (unsigned long) (after.dropped - before.dropped));
+            exit(1);
+        }
+    }
+    close(saved_stderr);
+    free(all);
+    return 0;
+}
@@ -0,0 +1,317 @@
+/** \file log_scan.c
+ *
+ * @brief Counting lines and delimiters of a large file: fgets against the kernels of line_scan.c over mmap and pread
+ *
+ * Every method counts the newlines and the delimiters of the file, and they must agree:
+ *
+ * - `fgets`: a line at a time into a 4 KiB buffer through stdio, then strchr for the delimiters, the loop that
+ *   print_mem_maps in heap.c used to have. stdio copies every byte into its buffer and again into the line.
+ * - `mmap count`: the file mapped with MADV_SEQUENTIAL, and scan_count for newlines and delimiters, block by block
+ *   so that the second pass finds the block in the cache.
+ * - `mmap find2`: scan_find2 stops at every newline and delimiter, as a parser that splits fields would.
+ * - `mmap index`, `pread index`, `direct index`: scan_positions lists the newlines and delimiters of a block first,
+ *   and the loop then walks the list. The input is mapped, read with pread into an aligned buffer, or read with
+ *   O_DIRECT, which bypasses the page cache: no copy from the cache, but also no readahead, so every read waits for
+ *   the device.
+ *
+ * For the mapped and buffered inputs the kernel is told to read ahead: MADV_WILLNEED or POSIX_FADV_WILLNEED for the
+ * part of the file `readahead` bytes ahead of the scan, on top of the doubled window of the sequential hints.
+ *
+ * With -c the page cache is dropped before each method (needs root), otherwise every method runs twice and the
+ * second, hot run is reported. -m writes a log file of that many MiB first.
+ *
+ * \code{.sh}
+ * ./log_scan [-c] [-k avx2|sse2|scalar] [-r readahead-MiB] [-b buffer-KiB] [-d delimiter] [-m MiB] file
+ * \endcode
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "helpers.h"
+#include "line_scan.h"
+
+#define BLOCK (64 * 1024)
+#define DIRECT_ALIGN 4096
+
+typedef struct {
+    uint64_t lines;
+    uint64_t delimiters;
+} counts_t;
+
+typedef enum { SCAN_COUNT, SCAN_FIND2, SCAN_INDEX } scan_mode_t;
+
+static int drop_caches;
+static size_t readahead_bytes = 32 * 1024 * 1024;
+static size_t buffer_bytes = 1024 * 1024;
+static char delimiter = ',';
+
+static void cache_drop(void)
+{
+    if (!drop_caches)
+        return;
+    sync();
+    int fd = open("/proc/sys/vm/drop_caches", O_WRONLY | O_CLOEXEC);
+    if (fd == -1 || write(fd, "3", 1) != 1)
+        exit_sys("drop_caches");
+    close(fd);
+}
+
+static void make_log(const char *path, size_t size)
+{
+    static const char *levels[] = {"INFO", "DEBUG", "WARN", "ERROR"};
+    FILE *f = fopen(path, "w");
+    size_t written = 0;
+
+    if (!f)
+        exit_sys("fopen %s", path);
+    for (unsigned i = 0; written < size; i++) {
+        int n = fprintf(f, "2026-10-18T%02u:%02u:%02u.%06u,%s,worker-%u,request %u took %u ms%s\n", i / 3600000 % 24,
+                        i / 60000 % 60, i / 1000 % 60, i * 7919 % 1000000, levels[i % 7 % 4], i % 37, i,
+                        i * 2654435761u % 997, i % 5 ? "" : ",retry");
+        if (n < 0)
+            exit_sys("fprintf %s", path);
+        written += (size_t) n;
+    }
+    if (fclose(f) == EOF)
+        exit_sys("fclose %s", path);
+}
+
+static counts_t scan_fgets(const char *path)
+{
+    counts_t counts = {0, 0};
+    char line[4096];
+    FILE *f = fopen(path, "r");
+
+    if (!f)
+        exit_sys("fopen %s", path);
+    while (fgets(line, sizeof(line), f)) {
+        for (char *p = line; (p = strchr(p, delimiter)); p++)
+            counts.delimiters++;
+        if (strchr(line, '\n'))
+            counts.lines++;
+    }
+    fclose(f);
+    return counts;
+}
+
+static void count_find2(const char *data, size_t length, counts_t *counts)
+{
+    const char *end = data + length;
+
+    for (const char *p = data; (p = scan_find2(p, (size_t) (end - p), '\n', delimiter)); p++) {
+        if (*p == '\n')
+            counts->lines++;
+        else
+            counts->delimiters++;
+    }
+}
+
+static void count_index(const char *data, size_t length, counts_t *counts)
+{
+    static uint32_t positions[BLOCK];
+
+    for (size_t offset = 0; offset < length; offset += BLOCK) {
+        size_t block = length - offset < BLOCK ? length - offset : BLOCK;
+        size_t found = scan_positions(data + offset, block, '\n', delimiter, positions);
+        uint64_t lines = 0;
+        for (size_t i = 0; i < found; i++)
+            lines += data[offset + positions[i]] == '\n';
+        counts->lines += lines;
+        counts->delimiters += found - lines;
+    }
+}
+
+static counts_t scan_mmap(const char *path, scan_mode_t mode)
+{
+    counts_t counts = {0, 0};
+    struct stat st;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (fd == -1 || fstat(fd, &st) == -1)
+        exit_sys("open %s", path);
+    size_t size = (size_t) st.st_size;
+    if (size == 0) {
+        close(fd);
+        return counts;
+    }
+    char *data = (char *) mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED)
+        exit_sys("mmap %s", path);
+    close(fd);
+    madvise(data, size, MADV_SEQUENTIAL);
+
+    size_t advised = 0, step = (readahead_bytes / 4) & ~(size_t) (DIRECT_ALIGN - 1);
+    for (size_t offset = 0; offset < size; offset += BLOCK) {
+        // Keep the WILLNEED hints a readahead distance ahead of the scan, a quarter of it at a time.
+        while (step && advised < size && advised < offset + readahead_bytes) {
+            madvise(data + advised, size - advised < step ? size - advised : step, MADV_WILLNEED);
+            advised += step;
+        }
+        size_t length = size - offset < BLOCK ? size - offset : BLOCK;
+        if (mode == SCAN_FIND2) {
+            count_find2(data + offset, length, &counts);
+        } else if (mode == SCAN_INDEX) {
+            count_index(data + offset, length, &counts);
+        } else {
+            counts.lines += scan_count(data + offset, length, '\n');
+            counts.delimiters += scan_count(data + offset, length, delimiter);
+        }
+    }
+    munmap(data, size);
+    return counts;
+}
+
+/**
+ * @return the counts, or lines == UINT64_MAX if the file system does not support O_DIRECT
+ */
+static counts_t scan_pread(const char *path, int direct)
+{
+    counts_t counts = {0, 0};
+    char *buffer = NULL;
+    int fd = open(path, O_RDONLY | O_CLOEXEC | (direct ? O_DIRECT : 0));
+
+    if (fd == -1 && direct && errno == EINVAL) {
+        counts.lines = UINT64_MAX;
+        return counts;
+    }
+    if (fd == -1)
+        exit_sys("open %s", path);
+    // O_DIRECT needs the buffer, the offsets and the lengths aligned to the logical block size.
+    if (posix_memalign((void **) &buffer, DIRECT_ALIGN, buffer_bytes) != 0)
+        exit_sys("posix_memalign");
+    if (!direct)
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    off_t offset = 0, advised = 0;
+    off_t step = (off_t) (readahead_bytes / 4);
+    ssize_t n;
+    for (;;) {
+        while (!direct && step && advised < offset + (off_t) readahead_bytes) {
+            posix_fadvise(fd, advised, step, POSIX_FADV_WILLNEED);
+            advised += step;
+        }
+        if ((n = pread(fd, buffer, buffer_bytes, offset)) <= 0)
+            break;
+        count_index(buffer, (size_t) n, &counts);
+        offset += n;
+    }
+    if (n == -1)
+        exit_sys("pread %s", path);
+    free(buffer);
+    close(fd);
+    return counts;
+}
+
+static counts_t run(const char *path, int method)
+{
+    switch (method) {
+    case 0:
+        return scan_fgets(path);
+    case 1:
+        return scan_mmap(path, SCAN_COUNT);
+    case 2:
+        return scan_mmap(path, SCAN_FIND2);
+    case 3:
+        return scan_mmap(path, SCAN_INDEX);
+    case 4:
+        return scan_pread(path, 0);
+    default:
+        return scan_pread(path, 1);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    static const char *method_names[] = {"fgets",       "mmap count",  "mmap find2",
+                                          "mmap index",  "pread index", "direct index"};
+    long make_mib = 0;
+    int result;
+
+    while ((result = getopt(argc, argv, "ck:r:b:d:m:")) != -1) {
+        switch (result) {
+        case 'c':
+            drop_caches = 1;
+            break;
+        case 'k':
+            if (scan_use_kernel(optarg) == -1) {
+                fprintf(stderr, "FATAL: kernel %s is unknown or not supported by this CPU\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'r':
+            readahead_bytes = (size_t) strtol(optarg, NULL, 10) << 20;
+            break;
+        case 'b':
+            buffer_bytes = (size_t) strtol(optarg, NULL, 10) << 10;
+            break;
+        case 'd':
+            delimiter = optarg[0];
+            break;
+        case 'm':
+            make_mib = strtol(optarg, NULL, 10);
+            break;
+        default:
+            optind = argc;
+            break;
+        }
+    }
+    if (optind != argc - 1 || buffer_bytes == 0 || buffer_bytes % DIRECT_ALIGN || make_mib < 0 ||
+        delimiter == '\n' || delimiter == '\0') {
+        fprintf(stderr,
+                "Usage: %s [-c] [-k avx2|sse2|scalar] [-r readahead-MiB] [-b buffer-KiB (multiple of 4)] "
+                "[-d delimiter] [-m MiB] file\n",
+                argv[0]);
+        exit(1);
+    }
+    const char *path = argv[optind];
+
+    if (make_mib) {
+        make_log(path, (size_t) make_mib << 20);
+        printf("wrote %ld MiB to %s\n", make_mib, path);
+    }
+    struct stat st;
+    if (stat(path, &st) == -1)
+        exit_sys("stat %s", path);
+
+    printf("%s, %.0f MiB, kernel %s, readahead %zu MiB, buffer %zu KiB, page cache %s\n", path,
+           (double) st.st_size / 1048576.0, scan_kernel_name(), readahead_bytes >> 20, buffer_bytes >> 10,
+           drop_caches ? "dropped before every method" : "hot");
+    printf("  %-14s %12s %12s %10s %8s\n", "method", "lines", "delimiters", "ms", "GB/s");
+    counts_t expected = {0, 0};
+    for (int method = 0; method < 6; method++) {
+        counts_t counts;
+        uint64_t elapsed = 0;
+        for (int round = drop_caches ? 1 : 0; round < 2; round++) {
+            cache_drop();
+            uint64_t begin = bench_now_ns();
+            counts = run(path, method);
+            elapsed = bench_now_ns() - begin;
+        }
+        if (counts.lines == UINT64_MAX) {
+            printf("  %-14s O_DIRECT is not supported here\n", method_names[method]);
+            continue;
+        }
+        if (method == 0) {
+            expected = counts;
+        } else if (counts.lines != expected.lines || counts.delimiters != expected.delimiters) {
+            fprintf(stderr, "FATAL: %s counted %lu lines and %lu delimiters, fgets %lu and %lu\n",
+                    method_names[method], (unsigned long) counts.lines, (unsigned long) counts.delimiters,
+                    (unsigned long) expected.lines, (unsigned long) expected.delimiters);
+            exit(1);
+        }
+        printf("  %-14s %12lu %12lu %10.1f %8.2f\n", method_names[method], (unsigned long) counts.lines,
+               (unsigned long) counts.delimiters, (double) elapsed / 1e6, (double) st.st_size / (double) elapsed);
+    }
+    return 0;
+}
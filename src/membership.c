@@ -0,0 +1,217 @@
+/** \file membership.c
+ *
+ * @brief Int membership and lookup: Swiss table against chained buckets
+ *
+ * list_t offers only linear access, so "is x in the list" costs a scan. Both maps here answer it in constant time, and
+ * differ in how many cache lines a lookup touches:
+ *
+ * - `swiss`: the flat table of swiss_map.c, probed 16 control bytes at a time with SSE2.
+ * - `chained`: an array of bucket heads with linked nodes. The nodes come from one preallocated array, which is the
+ *   friendliest possible allocator for chaining; with malloc per node it would only get worse.
+ *
+ * For each load factor both maps get the same random distinct keys. Reported are the time per insert, per lookup of a
+ * present key (hit) and per lookup of an absent key (miss), with lookups in random order. The Swiss table is also
+ * checked: erase half of the keys, then iterate and look up what is left.
+ *
+ * \code{.sh}
+ * ./membership [log2-of-capacity]
+ * \endcode
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bench.h"
+#include "helpers.h"
+#include "swiss_map.h"
+
+typedef struct chained_node_t {
+    int key;
+    int value;
+    struct chained_node_t *next;
+} chained_node_t;
+
+typedef struct {
+    chained_node_t **heads;
+    size_t mask;
+    chained_node_t *nodes;
+    size_t used;
+} chained_map_t;
+
+typedef struct {
+    double insert_ns;
+    double hit_ns;
+    double miss_ns;
+} timings_t;
+
+static int key_of(size_t i)
+{
+    // Multiplying by an odd constant is a bijection on 32 bits, so the keys are distinct.
+    return (int) ((uint32_t) i * 2654435761u ^ 0x5bd1e995u);
+}
+
+static size_t chained_bucket(const chained_map_t *map, int key)
+{
+    uint64_t hash = (uint64_t) (uint32_t) key * 0x9e3779b97f4a7c15u;
+    return (size_t) (hash ^ (hash >> 32)) & map->mask;
+}
+
+static void chained_insert(chained_map_t *map, int key, int value)
+{
+    size_t bucket = chained_bucket(map, key);
+
+    for (chained_node_t *node = map->heads[bucket]; node; node = node->next) {
+        if (node->key == key) {
+            node->value = value;
+            return;
+        }
+    }
+    chained_node_t *node = &map->nodes[map->used++];
+    node->key = key;
+    node->value = value;
+    node->next = map->heads[bucket];
+    map->heads[bucket] = node;
+}
+
+static int chained_find(const chained_map_t *map, int key, int *value)
+{
+    for (chained_node_t *node = map->heads[chained_bucket(map, key)]; node; node = node->next) {
+        if (node->key == key) {
+            *value = node->value;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void check_found(const char *name, size_t found, size_t expected)
+{
+    if (found != expected) {
+        fprintf(stderr, "FATAL: %s found %zu keys, expected %zu\n", name, found, expected);
+        exit(1);
+    }
+}
+
+static timings_t bench_swiss(size_t count, size_t slots, const int *hits, const int *misses, size_t lookups)
+{
+    timings_t t;
+    size_t found = 0;
+    int value;
+    // Room for 7/8 of the slots, so that all load factors run on the same table size.
+    swiss_map_t *map = swiss_new(slots - slots / 8);
+
+    if (!map || swiss_capacity(map) != slots)
+        exit_sys("swiss_new");
+    uint64_t begin = bench_now_ns();
+    for (size_t i = 0; i < count; i++)
+        swiss_insert(map, key_of(i), (int) i);
+    t.insert_ns = (double) (bench_now_ns() - begin) / (double) count;
+
+    begin = bench_now_ns();
+    for (size_t i = 0; i < lookups; i++)
+        found += (size_t) swiss_find(map, hits[i], &value);
+    t.hit_ns = (double) (bench_now_ns() - begin) / (double) lookups;
+    check_found("swiss", found, lookups);
+
+    found = 0;
+    begin = bench_now_ns();
+    for (size_t i = 0; i < lookups; i++)
+        found += (size_t) swiss_find(map, misses[i], &value);
+    t.miss_ns = (double) (bench_now_ns() - begin) / (double) lookups;
+    check_found("swiss", found, 0);
+
+    // Erase the even keys, then every odd one must still be reachable, by iteration and by lookup.
+    for (size_t i = 0; i < count; i += 2)
+        if (swiss_erase(map, key_of(i)) != 1)
+            check_found("swiss erase", 0, 1);
+    size_t cursor = 0, iterated = 0;
+    int key;
+    while (swiss_next(map, &cursor, &key, &value)) {
+        if (value % 2 == 0 || key_of((size_t) value) != key)
+            check_found("swiss iteration", 0, 1);
+        iterated++;
+    }
+    check_found("swiss iteration", iterated, count / 2);
+    found = 0;
+    for (size_t i = 1; i < count; i += 2)
+        found += (size_t) swiss_find(map, key_of(i), NULL);
+    check_found("swiss after erase", found, count / 2);
+
+    swiss_free(map);
+    return t;
+}
+
+static timings_t bench_chained(size_t count, size_t buckets, const int *hits, const int *misses, size_t lookups)
+{
+    timings_t t;
+    size_t found = 0;
+    int value;
+    chained_map_t map = {(chained_node_t **) calloc(buckets, sizeof(chained_node_t *)), buckets - 1,
+                         (chained_node_t *) malloc(count * sizeof(chained_node_t)), 0};
+
+    if (!map.heads || !map.nodes)
+        exit_sys("malloc");
+    uint64_t begin = bench_now_ns();
+    for (size_t i = 0; i < count; i++)
+        chained_insert(&map, key_of(i), (int) i);
+    t.insert_ns = (double) (bench_now_ns() - begin) / (double) count;
+
+    begin = bench_now_ns();
+    for (size_t i = 0; i < lookups; i++)
+        found += (size_t) chained_find(&map, hits[i], &value);
+    t.hit_ns = (double) (bench_now_ns() - begin) / (double) lookups;
+    check_found("chained", found, lookups);
+
+    found = 0;
+    begin = bench_now_ns();
+    for (size_t i = 0; i < lookups; i++)
+        found += (size_t) chained_find(&map, misses[i], &value);
+    t.miss_ns = (double) (bench_now_ns() - begin) / (double) lookups;
+    check_found("chained", found, 0);
+
+    free(map.nodes);
+    free(map.heads);
+    return t;
+}
+
+int main(int argc, char **argv)
+{
+    static const double load_factors[] = {0.25, 0.5, 0.75, 0.875};
+    long log2_capacity = argc > 1 ? strtol(argv[1], NULL, 10) : 22;
+
+    if (log2_capacity < 4 || log2_capacity > 30) {
+        fprintf(stderr, "Usage: %s [log2-of-capacity (4-30)]\n", argv[0]);
+        exit(1);
+    }
+    size_t capacity = (size_t) 1 << log2_capacity;
+    size_t lookups = capacity;
+    int *hits = (int *) malloc(lookups * sizeof(int));
+    int *misses = (int *) malloc(lookups * sizeof(int));
+    uint64_t seed = 88172645463325252u;
+
+    if (!hits || !misses)
+        exit_sys("malloc");
+    printf("%zu slots/buckets, %zu lookups per measurement\n", capacity, lookups);
+    printf("  %-8s %6s %10s %10s %10s\n", "map", "load", "insert ns", "hit ns", "miss ns");
+    for (size_t l = 0; l < sizeof(load_factors) / sizeof(load_factors[0]); l++) {
+        size_t count = (size_t) ((double) capacity * load_factors[l]);
+        for (size_t i = 0; i < lookups; i++) {
+            seed ^= seed << 13;
+            seed ^= seed >> 7;
+            seed ^= seed << 17;
+            hits[i] = key_of(seed % count);
+            misses[i] = key_of(count + seed % count);
+        }
+
+        timings_t swiss = bench_swiss(count, capacity, hits, misses, lookups);
+        timings_t chained = bench_chained(count, capacity, hits, misses, lookups);
+        printf("  %-8s %6.3f %10.1f %10.1f %10.1f\n", "swiss", (double) count / (double) capacity,
+               swiss.insert_ns, swiss.hit_ns, swiss.miss_ns);
+        printf("  %-8s %6.3f %10.1f %10.1f %10.1f\n", "chained", (double) count / (double) capacity,
+               chained.insert_ns, chained.hit_ns, chained.miss_ns);
+    }
+    free(misses);
+    free(hits);
+    return 0;
+}
@@ -0,0 +1,205 @@
+/** \file parallel.c
+ *
+ * @brief parallel_for and parallel_reduce on the work-stealing pool of scheduler.c
+ *
+ * The pool is created once, on the first call or by parallel_init, and reused by every loop, so a loop costs a
+ * wake-up of the workers rather than a pthread_create/pthread_join per thread.
+ *
+ * Splitting is adaptive, in the style of TBB's auto partitioner. A range is halved a few times up front, enough to give
+ * every worker some pieces, and is then run as a whole. When a piece turns out to have been stolen, other workers are
+ * evidently idle, so the thief gets a new splitting budget and divides it further. Balanced loops therefore end up with
+ * a handful of large chunks, while unbalanced ones keep being divided where the work is. No piece gets smaller than the
+ * grain; a grain of 0 picks one from the length of the range and the number of workers.
+ *
+ * parallel_reduce gives each worker its own partial result, padded to a cache line, and combines them after the loop.
+ * Partial results packed next to each other would share cache lines, and every update by one worker would invalidate
+ * the line in the caches of the others.
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "parallel.h"
+#include "scheduler.h"
+
+#define CACHE_LINE 64
+/** Pieces per worker aimed at when the grain is picked automatically. */
+#define AUTO_PIECES_PER_WORKER 32
+/** Extra halvings granted to a stolen piece. */
+#define STEAL_SPLITS 2
+/** Bounds the spawned halves kept on the stack of one piece. */
+#define MAX_SPLITS 48
+
+typedef struct {
+    size_t grain;
+    parallel_for_fn_t fn;
+    parallel_reduce_fn_t reduce;
+    unsigned char *partials;
+    size_t stride;
+    void *ctx;
+} loop_t;
+
+typedef struct {
+    size_t begin;
+    size_t end;
+    /** Worker that spawned the piece. Running on another one means it was stolen. */
+    int spawner;
+    int splits;
+    const loop_t *loop;
+} range_t;
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static ws_pool_t *pool;
+
+/**
+ * Creates the worker pool. Calling it is optional, the first loop creates a pool with one worker per online CPU.
+ * @param workers number of workers, 0 for one per online CPU
+ * @return 0 on success (also if the pool already exists), -1 with errno set on failure
+ */
+int parallel_init(int workers)
+{
+    int result = 0;
+
+    pthread_mutex_lock(&pool_lock);
+    if (!pool) {
+        if (workers <= 0)
+            workers = (int) sysconf(_SC_NPROCESSORS_ONLN);
+        pool = ws_pool_create(workers > 0 ? workers : 1);
+        if (!pool)
+            result = -1;
+    }
+    pthread_mutex_unlock(&pool_lock);
+    return result;
+}
+
+/**
+ * Stops the workers. A later loop creates a new pool.
+ */
+void parallel_shutdown(void)
+{
+    pthread_mutex_lock(&pool_lock);
+    if (pool) {
+        ws_pool_destroy(pool);
+        pool = NULL;
+    }
+    pthread_mutex_unlock(&pool_lock);
+}
+
+/**
+ * @return number of workers, 1 if no pool could be created
+ */
+int parallel_workers(void)
+{
+    if (parallel_init(0) == -1)
+        return 1;
+    return ws_pool_workers(pool);
+}
+
+static int log2_ceil(int value)
+{
+    int log = 0;
+
+    while ((1 << log) < value)
+        log++;
+    return log;
+}
+
+static void range_body(const loop_t *loop, size_t begin, size_t end, int worker)
+{
+    if (loop->fn)
+        loop->fn(begin, end, loop->ctx);
+    else
+        loop->reduce(begin, end, loop->partials + (size_t) worker * loop->stride, loop->ctx);
+}
+
+static void range_run(void *arg)
+{
+    const range_t *range = (const range_t *) arg;
+    const loop_t *loop = range->loop;
+    int self = ws_worker_index();
+    int splits = range->splits;
+    size_t begin = range->begin, end = range->end;
+    range_t right[MAX_SPLITS];
+    ws_task_t tasks[MAX_SPLITS];
+    int spawned = 0;
+
+    if (self != range->spawner && splits < STEAL_SPLITS)
+        splits = STEAL_SPLITS;
+    // Keep the left half, hand the right half to whoever is idle.
+    while (end - begin > loop->grain && splits > 0 && spawned < MAX_SPLITS) {
+        size_t middle = begin + (end - begin) / 2;
+        splits--;
+        right[spawned] = (range_t) {middle, end, self, splits, loop};
+        ws_spawn(&tasks[spawned], range_run, &right[spawned]);
+        spawned++;
+        end = middle;
+    }
+    range_body(loop, begin, end, self);
+    while (spawned > 0)
+        ws_sync(&tasks[--spawned]);
+}
+
+static void loop_run(loop_t *loop, size_t begin, size_t end, int workers)
+{
+    size_t count = end - begin;
+
+    if (loop->grain == 0) {
+        loop->grain = count / ((size_t) workers * AUTO_PIECES_PER_WORKER);
+        if (loop->grain == 0)
+            loop->grain = 1;
+    }
+    range_t root = {begin, end, -1, log2_ceil(workers) + 2, loop};
+    ws_run(pool, range_run, &root);
+}
+
+/**
+ * Calls fn on disjoint subranges that together cover [begin, end), in parallel. Returns when all calls returned.
+ * @param grain smallest subrange worth a task of its own, 0 to pick one automatically
+ */
+void parallel_for(size_t begin, size_t end, size_t grain, parallel_for_fn_t fn, void *ctx)
+{
+    if (end <= begin)
+        return;
+    int workers = parallel_workers();
+    if (workers == 1 || end - begin <= grain) {
+        fn(begin, end, ctx);
+        return;
+    }
+    loop_t loop = {grain, fn, NULL, NULL, 0, ctx};
+    loop_run(&loop, begin, end, workers);
+}
+
+/**
+ * Folds [begin, end) in parallel. Every worker starts from a copy of *result, which must therefore hold the identity of
+ * combine on entry; on return it holds the combination of all partial results.
+ * @param size size of the partial result in bytes
+ * @param fn folds a subrange into the partial result of the calling worker
+ * @param combine merges two partial results
+ */
+void parallel_reduce(size_t begin, size_t end, size_t grain, void *result, size_t size, parallel_reduce_fn_t fn,
+                     parallel_combine_fn_t combine, void *ctx)
+{
+    if (end <= begin)
+        return;
+    int workers = parallel_workers();
+    size_t stride = (size + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+    unsigned char *partials = NULL;
+
+    if (workers > 1 && end - begin > grain)
+        partials = (unsigned char *) aligned_alloc(CACHE_LINE, (size_t) workers * stride);
+    if (!partials) {
+        fn(begin, end, result, ctx);
+        return;
+    }
+    for (int i = 0; i < workers; i++)
+        memcpy(partials + (size_t) i * stride, result, size);
+
+    loop_t loop = {grain, NULL, fn, partials, stride, ctx};
+    loop_run(&loop, begin, end, workers);
+    for (int i = 0; i < workers; i++)
+        combine(result, partials + (size_t) i * stride, ctx);
+    free(partials);
+}
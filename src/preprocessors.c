@@ -16,6 +16,8 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "binlog.h"
+
 /**
  * \brief Here ABC is not a variable
  *
@@ -69,9 +71,14 @@
 /**
  * Variadic macros which can accept a variable number of input arguments.
  *
+ * It used to expand to `fprintf(stderr, format, __VA_ARGS__)`, which formats and writes on the calling thread. BINLOG
+ * of binlog.h expands to a block with a `static` site of its own, so every place LOG_ERROR is written gets one: the
+ * format is parsed on its first call only, and afterwards the arguments are copied to a ring that a background thread
+ * formats. That is something a function cannot do, since it has one set of statics for all its callers.
+ *
  * @param format
  */
-#define LOG_ERROR(format, ...) fprintf(stderr, format, __VA_ARGS__)
+#define LOG_ERROR(format, ...) BINLOG(format, __VA_ARGS__)
 
 /**
  * \brief Conditionals
@@ -94,6 +101,8 @@ gcc -DCONDITION -E main.c
  */
 #define CONDITION
 int main() {
+    binlog_start(NULL);
+
     int x = 2;
     int y = ABC;
     int z = x + y;
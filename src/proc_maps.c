@@ -0,0 +1,382 @@
+/** \file proc_maps.c
+ *
+ * @brief Allocation-free parser of /proc/self/maps and /proc/self/smaps_rollup, and a periodic memory sampler
+ *
+ * Both files are read with read(2) into a buffer on the stack and parsed in place, so the parser can run where
+ * malloc must not be called: inside an allocator, a profiler, or a process that is short of memory. A line of maps
+ * becomes a mem_region_t; paths longer than MEM_PATH_MAX are truncated. smaps_rollup (Linux 4.14) sums the per-mapping
+ * counters of smaps for the whole process, which is much cheaper than reading smaps and adding them up.
+ *
+ * The sampler is a thread that takes a mem_sample_t every interval: RSS, PSS, anonymous and huge-page totals, and the
+ * sizes of the [heap] and [stack] mappings. It keeps the last `capacity` samples in a ring, so a long-running process
+ * can report how its heap and stack grew without keeping an unbounded log. A sample costs two opens and a few reads;
+ * the kernel work for smaps_rollup grows with the number of mapped pages.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "proc_maps.h"
+
+#define READ_BUFFER 8192
+
+typedef struct {
+    int fd;
+    int eof;
+    int error;
+    /** Set while dropping the rest of a line that did not fit into the buffer. */
+    int skipping;
+    size_t begin;
+    size_t end;
+    char buffer[READ_BUFFER];
+} line_reader_t;
+
+struct mem_sampler_t {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    int stop;
+    unsigned interval_ms;
+    size_t capacity;
+    size_t taken;
+    mem_sample_t *ring;
+};
+
+static ssize_t read_retry(int fd, char *buffer, size_t size)
+{
+    ssize_t n;
+
+    do {
+        n = read(fd, buffer, size);
+    } while (n == -1 && errno == EINTR);
+    return n;
+}
+
+/**
+ * @return the next line without its newline and NUL-terminated, or NULL at the end or on error (reader->error)
+ */
+static char *next_line(line_reader_t *reader)
+{
+    for (;;) {
+        char *start = reader->buffer + reader->begin;
+        char *newline = (char *) memchr(start, '\n', reader->end - reader->begin);
+        if (newline) {
+            *newline = '\0';
+            reader->begin = (size_t) (newline - reader->buffer) + 1;
+            if (reader->skipping) {
+                reader->skipping = 0;
+                continue;
+            }
+            return start;
+        }
+        if (reader->eof) {
+            if (reader->begin == reader->end || reader->skipping)
+                return NULL;
+            reader->buffer[reader->end] = '\0';
+            reader->begin = reader->end;
+            return start;
+        }
+
+        size_t rest = reader->end - reader->begin;
+        if (rest == READ_BUFFER - 1) {
+            // A line longer than the buffer: hand out its beginning and drop the remainder.
+            int was_skipping = reader->skipping;
+            reader->begin = reader->end = 0;
+            reader->skipping = 1;
+            if (was_skipping)
+                continue;
+            reader->buffer[READ_BUFFER - 1] = '\0';
+            return reader->buffer;
+        }
+        memmove(reader->buffer, start, rest);
+        reader->begin = 0;
+        reader->end = rest;
+        ssize_t n = read_retry(reader->fd, reader->buffer + reader->end, READ_BUFFER - 1 - reader->end);
+        if (n == -1) {
+            reader->error = errno;
+            return NULL;
+        }
+        if (n == 0)
+            reader->eof = 1;
+        reader->end += (size_t) n;
+    }
+}
+
+static uint64_t parse_number(const char **p, int base)
+{
+    uint64_t value = 0;
+
+    for (;; (*p)++) {
+        int digit;
+        if (**p >= '0' && **p <= '9')
+            digit = **p - '0';
+        else if (base == 16 && **p >= 'a' && **p <= 'f')
+            digit = **p - 'a' + 10;
+        else
+            return value;
+        value = value * (uint64_t) base + (uint64_t) digit;
+    }
+}
+
+static const char *skip_spaces(const char *p)
+{
+    while (*p == ' ' || *p == '\t')
+        p++;
+    return p;
+}
+
+/**
+ * Parses "start-end perms offset dev inode path".
+ * @return 0, or -1 if the line does not look like one of maps
+ */
+static int parse_region(const char *line, mem_region_t *region)
+{
+    const char *p = line;
+
+    region->start = (uintptr_t) parse_number(&p, 16);
+    if (*p++ != '-')
+        return -1;
+    region->end = (uintptr_t) parse_number(&p, 16);
+    if (*p++ != ' ')
+        return -1;
+    for (int i = 0; i < 4; i++) {
+        if (!*p)
+            return -1;
+        region->perms[i] = *p++;
+    }
+    region->perms[4] = '\0';
+    p = skip_spaces(p);
+    region->offset = parse_number(&p, 16);
+    p = skip_spaces(p);
+    while (*p && *p != ' ')
+        p++;
+    p = skip_spaces(p);
+    region->inode = parse_number(&p, 10);
+    p = skip_spaces(p);
+    size_t length = strlen(p);
+    if (length >= MEM_PATH_MAX)
+        length = MEM_PATH_MAX - 1;
+    memcpy(region->path, p, length);
+    region->path[length] = '\0';
+    return 0;
+}
+
+/**
+ * Calls fn for every mapping of the process, in address order, until it returns non-zero.
+ * @return 0, or -1 with errno set
+ */
+int mem_maps_foreach(mem_region_fn_t fn, void *ctx)
+{
+    line_reader_t reader = {.fd = open("/proc/self/maps", O_RDONLY | O_CLOEXEC)};
+    mem_region_t region;
+    char *line;
+
+    if (reader.fd == -1)
+        return -1;
+    while ((line = next_line(&reader)))
+        if (parse_region(line, &region) == 0 && fn(&region, ctx) != 0)
+            break;
+    close(reader.fd);
+    if (reader.error) {
+        errno = reader.error;
+        return -1;
+    }
+    return 0;
+}
+
+typedef struct {
+    mem_region_t *regions;
+    size_t capacity;
+    size_t count;
+} region_array_t;
+
+static int store_region(const mem_region_t *region, void *ctx)
+{
+    region_array_t *array = (region_array_t *) ctx;
+
+    if (array->count < array->capacity)
+        array->regions[array->count] = *region;
+    array->count++;
+    return 0;
+}
+
+/**
+ * Fills regions with up to capacity mappings.
+ * @return the number of mappings, which may exceed capacity, or -1 with errno set
+ */
+long mem_maps_read(mem_region_t *regions, size_t capacity)
+{
+    region_array_t array = {regions, capacity, 0};
+
+    if (mem_maps_foreach(store_region, &array) == -1)
+        return -1;
+    return (long) array.count;
+}
+
+/**
+ * @return 0, or -1 with errno set
+ */
+int mem_rollup_read(mem_rollup_t *rollup)
+{
+    static const struct {
+        const char *key;
+        size_t offset;
+    } fields[] = {
+        {"Rss:", offsetof(mem_rollup_t, rss_kb)},
+        {"Pss:", offsetof(mem_rollup_t, pss_kb)},
+        {"Anonymous:", offsetof(mem_rollup_t, anonymous_kb)},
+        {"AnonHugePages:", offsetof(mem_rollup_t, anon_huge_kb)},
+        {"Swap:", offsetof(mem_rollup_t, swap_kb)},
+    };
+    line_reader_t reader = {.fd = open("/proc/self/smaps_rollup", O_RDONLY | O_CLOEXEC)};
+    char *line;
+
+    if (reader.fd == -1)
+        return -1;
+    memset(rollup, 0, sizeof(*rollup));
+    while ((line = next_line(&reader))) {
+        for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+            size_t length = strlen(fields[i].key);
+            if (strncmp(line, fields[i].key, length) == 0) {
+                const char *p = skip_spaces(line + length);
+                *(uint64_t *) ((char *) rollup + fields[i].offset) = parse_number(&p, 10);
+                break;
+            }
+        }
+    }
+    close(reader.fd);
+    if (reader.error) {
+        errno = reader.error;
+        return -1;
+    }
+    return 0;
+}
+
+static int find_heap_and_stack(const mem_region_t *region, void *ctx)
+{
+    mem_sample_t *sample = (mem_sample_t *) ctx;
+
+    if (strcmp(region->path, "[heap]") == 0)
+        sample->heap_bytes += region->end - region->start;
+    else if (strcmp(region->path, "[stack]") == 0)
+        sample->stack_bytes += region->end - region->start;
+    return 0;
+}
+
+/**
+ * Takes one sample now.
+ * @return 0, or -1 with errno set
+ */
+int mem_sample_take(mem_sample_t *sample)
+{
+    struct timespec now;
+
+    memset(sample, 0, sizeof(*sample));
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    sample->time_ns = (uint64_t) now.tv_sec * 1000000000u + (uint64_t) now.tv_nsec;
+    if (mem_rollup_read(&sample->rollup) == -1)
+        return -1;
+    return mem_maps_foreach(find_heap_and_stack, sample);
+}
+
+static void *run_sampler(void *arg)
+{
+    mem_sampler_t *sampler = (mem_sampler_t *) arg;
+    struct timespec deadline;
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    pthread_mutex_lock(&sampler->lock);
+    while (!sampler->stop) {
+        mem_sample_t sample;
+        // Sample without the lock, so that readers never wait for /proc.
+        pthread_mutex_unlock(&sampler->lock);
+        int taken = mem_sample_take(&sample);
+        pthread_mutex_lock(&sampler->lock);
+        if (taken == 0)
+            sampler->ring[sampler->taken++ % sampler->capacity] = sample;
+
+        deadline.tv_nsec += (long) sampler->interval_ms * 1000000;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000;
+        deadline.tv_nsec %= 1000000000;
+        while (!sampler->stop && pthread_cond_timedwait(&sampler->wake, &sampler->lock, &deadline) != ETIMEDOUT)
+            ;
+    }
+    pthread_mutex_unlock(&sampler->lock);
+    return NULL;
+}
+
+/**
+ * Starts a thread that takes a sample every interval_ms and keeps the last capacity of them.
+ * @return the sampler, or NULL with errno set
+ */
+mem_sampler_t *mem_sampler_start(unsigned interval_ms, size_t capacity)
+{
+    mem_sampler_t *sampler;
+    pthread_condattr_t attr;
+    int error;
+
+    if (interval_ms == 0 || capacity == 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (!(sampler = (mem_sampler_t *) calloc(1, sizeof(mem_sampler_t))))
+        return NULL;
+    if (!(sampler->ring = (mem_sample_t *) calloc(capacity, sizeof(mem_sample_t)))) {
+        free(sampler);
+        return NULL;
+    }
+    sampler->interval_ms = interval_ms;
+    sampler->capacity = capacity;
+    pthread_mutex_init(&sampler->lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&sampler->wake, &attr);
+    pthread_condattr_destroy(&attr);
+    if ((error = pthread_create(&sampler->thread, NULL, run_sampler, sampler)) != 0) {
+        pthread_cond_destroy(&sampler->wake);
+        pthread_mutex_destroy(&sampler->lock);
+        free(sampler->ring);
+        free(sampler);
+        errno = error;
+        return NULL;
+    }
+    return sampler;
+}
+
+/**
+ * Copies the most recent samples, oldest first.
+ * @return number of samples copied, at most capacity
+ */
+size_t mem_sampler_read(mem_sampler_t *sampler, mem_sample_t *samples, size_t capacity)
+{
+    pthread_mutex_lock(&sampler->lock);
+    size_t available = sampler->taken < sampler->capacity ? sampler->taken : sampler->capacity;
+    size_t count = available < capacity ? available : capacity;
+    for (size_t i = 0; i < count; i++)
+        samples[i] = sampler->ring[(sampler->taken - count + i) % sampler->capacity];
+    pthread_mutex_unlock(&sampler->lock);
+    return count;
+}
+
+/**
+ * Stops the thread and frees the sampler.
+ */
+void mem_sampler_stop(mem_sampler_t *sampler)
+{
+    pthread_mutex_lock(&sampler->lock);
+    sampler->stop = 1;
+    pthread_cond_signal(&sampler->wake);
+    pthread_mutex_unlock(&sampler->lock);
+    pthread_join(sampler->thread, NULL);
+    pthread_cond_destroy(&sampler->wake);
+    pthread_mutex_destroy(&sampler->lock);
+    free(sampler->ring);
+    free(sampler);
+}
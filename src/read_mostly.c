@@ -0,0 +1,222 @@
+/** \file read_mostly.c
+ *
+ * @brief Read-mostly shared data: epoch-based reclamation against pthread_rwlock_t
+ *
+ * A list_t is shared by 1, 2, 4, ... reader threads and one writer. Readers look up an item at a random index; the
+ * writer replaces the list with a new version every few microseconds.
+ *
+ * - `rwlock`: readers take the read lock around the lookup, the writer takes the write lock and updates the list in
+ *   place. Every read lock and unlock is an atomic write to the lock word, so the readers serialize on its cache line.
+ * - `ebr`: the current version is published through an atomic pointer. Readers load it inside an epoch critical
+ *   section of ebr.c and never write shared memory. The writer builds a copy, swaps it in and retires the old version,
+ *   which is freed once no reader can see it any more.
+ *
+ * Every version holds the same value in all items, so a reader that saw a half-updated or freed list would notice.
+ *
+ * \code{.sh}
+ * ./read_mostly [milliseconds-per-run] [max-readers]
+ * \endcode
+ */
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "ebr.h"
+#include "helpers.h"
+
+#define LIST_SIZE 256
+#define WRITE_INTERVAL_US 20
+#define MAX_READERS 256
+
+/* The record type of c_style_oop.c */
+typedef struct list_t {
+    size_t size;
+    int *items;
+} list_t;
+
+typedef struct {
+    _Alignas(64) _Atomic(list_t *) current;
+    ebr_t *ebr;
+    _Alignas(64) pthread_rwlock_t rwlock;
+    list_t locked;
+    _Alignas(64) atomic_int stop;
+    pthread_barrier_t start;
+    int use_ebr;
+} shared_t;
+
+typedef struct {
+    _Alignas(64) shared_t *shared;
+    pthread_t thread;
+    uint64_t reads;
+    uint64_t seed;
+} reader_t;
+
+static list_t *list_new(int value)
+{
+    list_t *list = (list_t *) malloc(sizeof(list_t));
+
+    if (!list || !(list->items = (int *) malloc(LIST_SIZE * sizeof(int))))
+        exit_sys("malloc");
+    list->size = LIST_SIZE;
+    for (size_t i = 0; i < LIST_SIZE; i++)
+        list->items[i] = value;
+    return list;
+}
+
+static void list_free(void *ptr)
+{
+    list_t *list = (list_t *) ptr;
+
+    // Poison the items, so that a use after free shows up as an inconsistent read.
+    memset(list->items, 0xff, list->size * sizeof(int));
+    free(list->items);
+    free(list);
+}
+
+static void check_read(int first, int item)
+{
+    if (first != item) {
+        fprintf(stderr, "FATAL: inconsistent read: %d and %d in the same version\n", first, item);
+        exit(1);
+    }
+}
+
+static void *run_reader(void *arg)
+{
+    reader_t *reader = (reader_t *) arg;
+    shared_t *shared = reader->shared;
+    ebr_thread_t *thread = shared->use_ebr ? ebr_register(shared->ebr) : NULL;
+
+    if (shared->use_ebr && !thread)
+        exit_sys("ebr_register");
+    pthread_barrier_wait(&shared->start);
+    while (!atomic_load_explicit(&shared->stop, memory_order_relaxed)) {
+        reader->seed ^= reader->seed << 13;
+        reader->seed ^= reader->seed >> 7;
+        reader->seed ^= reader->seed << 17;
+        size_t index = reader->seed % LIST_SIZE;
+        if (shared->use_ebr) {
+            ebr_enter(thread);
+            list_t *list = atomic_load_explicit(&shared->current, memory_order_acquire);
+            check_read(list->items[0], list->items[index % list->size]);
+            ebr_exit(thread);
+        } else {
+            pthread_rwlock_rdlock(&shared->rwlock);
+            check_read(shared->locked.items[0], shared->locked.items[index % shared->locked.size]);
+            pthread_rwlock_unlock(&shared->rwlock);
+        }
+        reader->reads++;
+    }
+    if (thread)
+        ebr_unregister(thread);
+    return NULL;
+}
+
+static uint64_t run_writer(shared_t *shared, long ms, size_t *pending)
+{
+    ebr_thread_t *thread = shared->use_ebr ? ebr_register(shared->ebr) : NULL;
+    struct timespec interval = {0, WRITE_INTERVAL_US * 1000};
+    uint64_t end = bench_now_ns() + (uint64_t) ms * 1000000u;
+    uint64_t writes = 0;
+
+    if (shared->use_ebr && !thread)
+        exit_sys("ebr_register");
+    while (bench_now_ns() < end) {
+        int value = (int) (writes + 1);
+        if (shared->use_ebr) {
+            list_t *old = atomic_exchange_explicit(&shared->current, list_new(value), memory_order_acq_rel);
+            ebr_retire(thread, old, list_free);
+        } else {
+            pthread_rwlock_wrlock(&shared->rwlock);
+            for (size_t i = 0; i < shared->locked.size; i++)
+                shared->locked.items[i] = value;
+            pthread_rwlock_unlock(&shared->rwlock);
+        }
+        writes++;
+        nanosleep(&interval, NULL);
+    }
+    if (thread) {
+        *pending = ebr_pending(thread);
+        ebr_unregister(thread);
+    }
+    return writes;
+}
+
+static void run(int use_ebr, int readers, long ms)
+{
+    shared_t *shared = (shared_t *) aligned_alloc(64, sizeof(shared_t));
+    reader_t *threads = (reader_t *) aligned_alloc(64, (size_t) readers * sizeof(reader_t));
+
+    if (!shared || !threads)
+        exit_sys("aligned_alloc");
+    memset(shared, 0, sizeof(*shared));
+    shared->use_ebr = use_ebr;
+    if (use_ebr) {
+        shared->ebr = ebr_new();
+        if (!shared->ebr)
+            exit_sys("ebr_new");
+        atomic_store(&shared->current, list_new(0));
+    } else {
+        list_t *list = list_new(0);
+        shared->locked = *list;
+        free(list);
+        pthread_rwlock_init(&shared->rwlock, NULL);
+    }
+    if (pthread_barrier_init(&shared->start, NULL, (unsigned) readers + 1) != 0)
+        exit_sys("pthread_barrier_init");
+    for (int i = 0; i < readers; i++) {
+        threads[i].shared = shared;
+        threads[i].reads = 0;
+        threads[i].seed = 0x9e3779b97f4a7c15u * (uint64_t) (i + 1);
+        if (pthread_create(&threads[i].thread, NULL, run_reader, &threads[i]) != 0)
+            exit_sys("pthread_create");
+    }
+
+    pthread_barrier_wait(&shared->start);
+    uint64_t begin = bench_now_ns();
+    size_t pending = 0;
+    uint64_t writes = run_writer(shared, ms, &pending);
+    atomic_store(&shared->stop, 1);
+    uint64_t reads = 0;
+    for (int i = 0; i < readers; i++) {
+        pthread_join(threads[i].thread, NULL);
+        reads += threads[i].reads;
+    }
+    double seconds = (double) (bench_now_ns() - begin) / 1e9;
+    printf("  %-7s %7d %12.2f %12.0f %10zu\n", use_ebr ? "ebr" : "rwlock", readers, (double) reads / seconds / 1e6,
+           (double) writes / seconds, pending);
+
+    pthread_barrier_destroy(&shared->start);
+    if (use_ebr) {
+        list_free(atomic_load(&shared->current));
+        ebr_free(shared->ebr);
+    } else {
+        pthread_rwlock_destroy(&shared->rwlock);
+        free(shared->locked.items);
+    }
+    free(threads);
+    free(shared);
+}
+
+int main(int argc, char **argv)
+{
+    long ms = argc > 1 ? strtol(argv[1], NULL, 10) : 500;
+    long max_readers = argc > 2 ? strtol(argv[2], NULL, 10) : sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (ms <= 0 || max_readers < 1 || max_readers > MAX_READERS) {
+        fprintf(stderr, "Usage: %s [milliseconds-per-run] [max-readers (1-%d)]\n", argv[0], MAX_READERS);
+        exit(1);
+    }
+    printf("one writer, a new version every %d us, %d items per list\n", WRITE_INTERVAL_US, LIST_SIZE);
+    printf("  %-7s %7s %12s %12s %10s\n", "sync", "readers", "Mreads/s", "writes/s", "unfreed");
+    for (int use_ebr = 0; use_ebr <= 1; use_ebr++)
+        for (int readers = 1; readers <= max_readers; readers *= 2)
+            run(use_ebr, readers, ms);
+    return 0;
+}
@@ -0,0 +1,480 @@
+/** \file scheduler.c
+ *
+ * @brief Work-stealing fork-join scheduler
+ *
+ * Every worker thread owns a Chase-Lev deque of tasks. The owner pushes and pops at the bottom, like a stack, so it
+ * keeps working on the most recently spawned (and cache-hot) task. Idle workers steal from the top of a randomly
+ * chosen victim, which takes the oldest task: in a recursive computation that is the biggest chunk of work, so a
+ * single steal keeps the thief busy for a long time and steals stay rare.
+ *
+ * The deque follows "Correct and Efficient Work-Stealing for Weak Memory Models" (Lê, Pop, Cohen, Zappa Nardelli):
+ * push and pop are plain loads and stores plus one fence, only the race for the last element and the steals use a
+ * compare-and-swap on `top`. When the array is full it is replaced by one twice as large; the old array is kept
+ * until the pool is destroyed because a thief may still be reading from it.
+ *
+ * Fork-join is `ws_spawn` and `ws_sync`. The task lives in the spawner's stack frame, so spawning allocates nothing.
+ * A worker that syncs on a task that was stolen and is not finished yet does not block: it runs other tasks in the
+ * meantime.
+ *
+ * A worker that found nothing to do for a while parks on a futex instead of spinning. Spawners only pay for a wake-up
+ * when some worker is actually parked.
+ */
+
+#include <errno.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "scheduler.h"
+
+#define DEQUE_INITIAL_SIZE 1024
+#define SPINS_BEFORE_PARK 256
+
+typedef struct deque_array_t {
+    int64_t size;
+    struct deque_array_t *retired;
+    _Atomic(ws_task_t *) items[];
+} deque_array_t;
+
+/**
+ * \struct deque_t
+ * \brief `top` is written by thieves and `bottom` by the owner, so they live on different cache lines.
+ */
+typedef struct {
+    _Alignas(64) _Atomic int64_t top;
+    _Alignas(64) _Atomic int64_t bottom;
+    _Atomic(deque_array_t *) array;
+} deque_t;
+
+typedef struct root_t {
+    ws_fn_t fn;
+    void *arg;
+    struct root_t *next;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int finished;
+} root_t;
+
+typedef struct {
+    deque_t deque;
+    ws_pool_t *pool;
+    int index;
+    uint64_t rng;
+    pthread_t thread;
+} worker_t;
+
+struct ws_pool_t {
+    int count;
+    worker_t *workers;
+    _Alignas(64) atomic_int sleepers;
+    _Atomic uint32_t epoch;
+    atomic_int shutdown;
+    /** Root tasks submitted by ws_run from outside the pool. */
+    _Alignas(64) atomic_int injected;
+    pthread_mutex_t inject_lock;
+    root_t *inject_head;
+    root_t *inject_tail;
+};
+
+static _Thread_local worker_t *current_worker;
+
+/*---------------------------------- Chase-Lev deque ----------------------------------*/
+
+static deque_array_t *deque_array_new(int64_t size)
+{
+    deque_array_t *a = (deque_array_t *) malloc(sizeof(deque_array_t) + (size_t) size * sizeof(ws_task_t *));
+
+    if (!a)
+        abort();
+    a->size = size;
+    a->retired = NULL;
+    return a;
+}
+
+static void deque_init(deque_t *d)
+{
+    atomic_init(&d->top, 0);
+    atomic_init(&d->bottom, 0);
+    atomic_init(&d->array, deque_array_new(DEQUE_INITIAL_SIZE));
+}
+
+static void deque_destroy(deque_t *d)
+{
+    deque_array_t *a = atomic_load_explicit(&d->array, memory_order_relaxed);
+
+    while (a) {
+        deque_array_t *retired = a->retired;
+        free(a);
+        a = retired;
+    }
+}
+
+static deque_array_t *deque_grow(deque_t *d, deque_array_t *a, int64_t top, int64_t bottom)
+{
+    deque_array_t *bigger = deque_array_new(a->size * 2);
+
+    for (int64_t i = top; i < bottom; i++)
+        atomic_store_explicit(&bigger->items[i % bigger->size],
+                              atomic_load_explicit(&a->items[i % a->size], memory_order_relaxed),
+                              memory_order_relaxed);
+    bigger->retired = a;
+    atomic_store_explicit(&d->array, bigger, memory_order_release);
+    return bigger;
+}
+
+/** Owner only. */
+static void deque_push(deque_t *d, ws_task_t *task)
+{
+    int64_t b = atomic_load_explicit(&d->bottom, memory_order_relaxed);
+    int64_t t = atomic_load_explicit(&d->top, memory_order_acquire);
+    deque_array_t *a = atomic_load_explicit(&d->array, memory_order_relaxed);
+
+    if (b - t > a->size - 1)
+        a = deque_grow(d, a, t, b);
+    atomic_store_explicit(&a->items[b % a->size], task, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+}
+
+/** Owner only. */
+static ws_task_t *deque_take(deque_t *d)
+{
+    int64_t b = atomic_load_explicit(&d->bottom, memory_order_relaxed) - 1;
+    deque_array_t *a = atomic_load_explicit(&d->array, memory_order_relaxed);
+    atomic_store_explicit(&d->bottom, b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t t = atomic_load_explicit(&d->top, memory_order_relaxed);
+    ws_task_t *task = NULL;
+
+    if (t <= b) {
+        task = atomic_load_explicit(&a->items[b % a->size], memory_order_relaxed);
+        if (t == b) {
+            // Last element: race against the thieves for it.
+            if (!atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1, memory_order_seq_cst,
+                                                         memory_order_relaxed))
+                task = NULL;
+            atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+        }
+    } else {
+        atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+    }
+    return task;
+}
+
+/** Any thread. Returns NULL when empty or when another thief won the race. */
+static ws_task_t *deque_steal(deque_t *d)
+{
+    int64_t t = atomic_load_explicit(&d->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t b = atomic_load_explicit(&d->bottom, memory_order_acquire);
+
+    if (t >= b)
+        return NULL;
+    deque_array_t *a = atomic_load_explicit(&d->array, memory_order_acquire);
+    ws_task_t *task = atomic_load_explicit(&a->items[t % a->size], memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1, memory_order_seq_cst, memory_order_relaxed))
+        return NULL;
+    return task;
+}
+
+/*---------------------------------- Parking ----------------------------------*/
+
+static void futex_wait(_Atomic uint32_t *addr, uint32_t expected)
+{
+    syscall(SYS_futex, (uint32_t *) addr, FUTEX_WAIT_PRIVATE, expected, NULL, NULL, 0);
+}
+
+static void futex_wake(_Atomic uint32_t *addr, int count)
+{
+    syscall(SYS_futex, (uint32_t *) addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+static int pool_has_work(ws_pool_t *pool)
+{
+    if (atomic_load(&pool->injected) > 0)
+        return 1;
+    for (int i = 0; i < pool->count; i++) {
+        deque_t *d = &pool->workers[i].deque;
+        if (atomic_load(&d->bottom) > atomic_load(&d->top))
+            return 1;
+    }
+    return 0;
+}
+
+/**
+ * Called after new work was published. Pairs with worker_park: either the parking worker sees the work in
+ * pool_has_work, or the publisher sees it in `sleepers` and bumps the epoch it sleeps on.
+ */
+static void pool_notify(ws_pool_t *pool)
+{
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&pool->sleepers, memory_order_relaxed) > 0) {
+        atomic_fetch_add(&pool->epoch, 1);
+        futex_wake(&pool->epoch, 1);
+    }
+}
+
+static void worker_park(ws_pool_t *pool)
+{
+    atomic_fetch_add(&pool->sleepers, 1);
+    uint32_t epoch = atomic_load(&pool->epoch);
+    if (!pool_has_work(pool) && !atomic_load(&pool->shutdown))
+        futex_wait(&pool->epoch, epoch);
+    atomic_fetch_sub(&pool->sleepers, 1);
+}
+
+/*---------------------------------- Workers ----------------------------------*/
+
+static void task_execute(ws_task_t *task)
+{
+    task->fn(task->arg);
+    atomic_store_explicit(&task->done, 1, memory_order_release);
+}
+
+static root_t *take_injected(ws_pool_t *pool)
+{
+    root_t *root = NULL;
+
+    if (atomic_load_explicit(&pool->injected, memory_order_relaxed) == 0)
+        return NULL;
+    pthread_mutex_lock(&pool->inject_lock);
+    root = pool->inject_head;
+    if (root) {
+        pool->inject_head = root->next;
+        if (!pool->inject_head)
+            pool->inject_tail = NULL;
+        atomic_fetch_sub_explicit(&pool->injected, 1, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&pool->inject_lock);
+    return root;
+}
+
+/** The root lives on the stack of the ws_run caller, so it must not be touched once `finished` is set. */
+static void root_execute(root_t *root)
+{
+    root->fn(root->arg);
+    pthread_mutex_lock(&root->lock);
+    root->finished = 1;
+    pthread_cond_signal(&root->cond);
+    pthread_mutex_unlock(&root->lock);
+}
+
+static uint64_t next_random(worker_t *w)
+{
+    w->rng ^= w->rng << 13;
+    w->rng ^= w->rng >> 7;
+    w->rng ^= w->rng << 17;
+    return w->rng;
+}
+
+/**
+ * Runs one task: the newest local one, else a root task, else one stolen from random victims.
+ * @return 1 if a task ran, 0 if none was found
+ */
+static int worker_run_one(worker_t *w)
+{
+    ws_pool_t *pool = w->pool;
+    ws_task_t *task = deque_take(&w->deque);
+
+    if (task) {
+        task_execute(task);
+        return 1;
+    }
+    root_t *root = take_injected(pool);
+    if (root) {
+        root_execute(root);
+        return 1;
+    }
+    for (int attempt = 0; attempt < 2 * pool->count; attempt++) {
+        int victim = (int) (next_random(w) % (uint64_t) pool->count);
+        if (victim == w->index)
+            continue;
+        task = deque_steal(&pool->workers[victim].deque);
+        if (task) {
+            task_execute(task);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void *worker_main(void *arg)
+{
+    worker_t *w = (worker_t *) arg;
+    ws_pool_t *pool = w->pool;
+    int idle = 0;
+
+    current_worker = w;
+    while (!atomic_load_explicit(&pool->shutdown, memory_order_acquire)) {
+        if (worker_run_one(w)) {
+            idle = 0;
+        } else if (++idle < SPINS_BEFORE_PARK) {
+            __builtin_ia32_pause();
+        } else {
+            worker_park(pool);
+            idle = 0;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @param workers number of worker threads
+ * @return the pool, or NULL with errno set
+ */
+ws_pool_t *ws_pool_create(int workers)
+{
+    if (workers <= 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    ws_pool_t *pool = (ws_pool_t *) aligned_alloc(64, sizeof(ws_pool_t));
+    if (!pool)
+        return NULL;
+    memset(pool, 0, sizeof(*pool));
+    pool->workers = (worker_t *) aligned_alloc(64, (size_t) workers * sizeof(worker_t));
+    if (!pool->workers) {
+        free(pool);
+        return NULL;
+    }
+    memset(pool->workers, 0, (size_t) workers * sizeof(worker_t));
+    pool->count = workers;
+    pthread_mutex_init(&pool->inject_lock, NULL);
+    for (int i = 0; i < workers; i++) {
+        deque_init(&pool->workers[i].deque);
+        pool->workers[i].pool = pool;
+        pool->workers[i].index = i;
+        pool->workers[i].rng = 0x9e3779b97f4a7c15u * (uint64_t) (i + 1);
+    }
+    for (int i = 0; i < workers; i++) {
+        int err = pthread_create(&pool->workers[i].thread, NULL, worker_main, &pool->workers[i]);
+        if (err) {
+            // Let the started workers exit, then give up.
+            atomic_store(&pool->shutdown, 1);
+            atomic_fetch_add(&pool->epoch, 1);
+            futex_wake(&pool->epoch, INT32_MAX);
+            for (int j = 0; j < i; j++)
+                pthread_join(pool->workers[j].thread, NULL);
+            for (int j = 0; j < workers; j++)
+                deque_destroy(&pool->workers[j].deque);
+            free(pool->workers);
+            free(pool);
+            errno = err;
+            return NULL;
+        }
+    }
+    return pool;
+}
+
+/**
+ * Stops and joins the workers. No ws_run may be in progress.
+ */
+void ws_pool_destroy(ws_pool_t *pool)
+{
+    atomic_store(&pool->shutdown, 1);
+    atomic_fetch_add(&pool->epoch, 1);
+    futex_wake(&pool->epoch, INT32_MAX);
+    for (int i = 0; i < pool->count; i++)
+        pthread_join(pool->workers[i].thread, NULL);
+    for (int i = 0; i < pool->count; i++)
+        deque_destroy(&pool->workers[i].deque);
+    pthread_mutex_destroy(&pool->inject_lock);
+    free(pool->workers);
+    free(pool);
+}
+
+int ws_pool_workers(const ws_pool_t *pool)
+{
+    return pool->count;
+}
+
+/**
+ * @return index of the calling worker in [0, workers), or -1 outside the pool
+ */
+int ws_worker_index(void)
+{
+    return current_worker ? current_worker->index : -1;
+}
+
+/**
+ * Runs fn(arg) on the pool and blocks until it returned. fn may spawn and sync tasks. Called from a worker of the same
+ * pool it simply calls fn; a worker of another pool submits it like any other thread and waits.
+ */
+void ws_run(ws_pool_t *pool, ws_fn_t fn, void *arg)
+{
+    root_t root;
+
+    if (current_worker && current_worker->pool == pool) {
+        fn(arg);
+        return;
+    }
+    root.fn = fn;
+    root.arg = arg;
+    root.next = NULL;
+    root.finished = 0;
+    pthread_mutex_init(&root.lock, NULL);
+    pthread_cond_init(&root.cond, NULL);
+
+    pthread_mutex_lock(&pool->inject_lock);
+    if (pool->inject_tail)
+        pool->inject_tail->next = &root;
+    else
+        pool->inject_head = &root;
+    pool->inject_tail = &root;
+    atomic_fetch_add(&pool->injected, 1);
+    pthread_mutex_unlock(&pool->inject_lock);
+    pool_notify(pool);
+
+    pthread_mutex_lock(&root.lock);
+    while (!root.finished)
+        pthread_cond_wait(&root.cond, &root.lock);
+    pthread_mutex_unlock(&root.lock);
+    pthread_cond_destroy(&root.cond);
+    pthread_mutex_destroy(&root.lock);
+}
+
+/**
+ * Makes fn(arg) available to the other workers. Outside the pool it runs fn right away.
+ * @param task storage owned by the caller until ws_sync(task) returns
+ */
+void ws_spawn(ws_task_t *task, ws_fn_t fn, void *arg)
+{
+    worker_t *w = current_worker;
+
+    task->fn = fn;
+    task->arg = arg;
+    atomic_store_explicit(&task->done, 0, memory_order_relaxed);
+    if (!w) {
+        task_execute(task);
+        return;
+    }
+    deque_push(&w->deque, task);
+    pool_notify(w->pool);
+}
+
+/**
+ * Waits until the task finished. If nobody stole it, the worker pops and runs it itself; otherwise it runs other
+ * tasks until the thief is done.
+ */
+void ws_sync(ws_task_t *task)
+{
+    worker_t *w = current_worker;
+    int misses = 0;
+
+    while (!atomic_load_explicit(&task->done, memory_order_acquire)) {
+        if (w && worker_run_one(w)) {
+            misses = 0;
+        } else if (++misses < 64) {
+            __builtin_ia32_pause();
+        } else {
+            // The thief may be descheduled, give it the CPU.
+            sched_yield();
+            misses = 0;
+        }
+    }
+}
@@ -0,0 +1,88 @@
+/** \file scratch.c
+ *
+ * @brief Per-thread scratch arena with marks
+ *
+ * stack.c shows why a function cannot hand out the address of one of its locals. The usual way out is malloc, which
+ * costs a call, a free list lookup and a matching free. A scratch arena is cheaper for temporaries that die together:
+ * scratch_alloc moves a thread-local pointer up, and scratch_release moves it back to a mark taken earlier, freeing
+ * everything allocated since in one store.
+ *
+ * \code{.c}
+ * scratch_mark_t mark = scratch_mark();
+ * char *line = scratch_alloc(4096);
+ * ... // line can be returned to callers, until
+ * scratch_release(mark);
+ * \endcode
+ *
+ * Each thread reserves SCRATCH_RESERVE bytes of address space on its first allocation. The kernel backs pages only
+ * when they are touched, so the RSS follows the high-water mark of the arena, which is kept after a release: the pages
+ * are hot for the next round. The reservation is unmapped when the thread exits.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "scratch.h"
+
+#define SCRATCH_RESERVE ((size_t) 64 * 1024 * 1024)
+
+_Thread_local scratch_arena_t scratch_arena;
+
+static pthread_key_t arena_key;
+static pthread_once_t arena_once = PTHREAD_ONCE_INIT;
+
+static void arena_unmap(void *base)
+{
+    munmap(base, SCRATCH_RESERVE);
+}
+
+static void create_key(void)
+{
+    pthread_key_create(&arena_key, arena_unmap);
+}
+
+/**
+ * Reserves the arena on first use; afterwards only reached when it is exhausted or for zero-byte requests.
+ * @return the memory, or NULL with errno set
+ */
+void *scratch_alloc_slow(size_t size)
+{
+    scratch_arena_t *arena = &scratch_arena;
+
+    if (!arena->base) {
+        void *base = mmap(NULL, SCRATCH_RESERVE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                          -1, 0);
+        if (base == MAP_FAILED)
+            return NULL;
+        pthread_once(&arena_once, create_key);
+        pthread_setspecific(arena_key, base);
+        arena->base = arena->top = (char *) base;
+        arena->end = arena->base + SCRATCH_RESERVE;
+    }
+    size_t rounded = size == 0 ? 16 : (size + 15) & ~(size_t) 15;
+    if (rounded < size || rounded > (size_t) (arena->end - arena->top)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    void *ptr = arena->top;
+    arena->top += rounded;
+    return ptr;
+}
+
+/**
+ * Frees everything the thread allocated after taking the mark.
+ */
+void scratch_release(scratch_mark_t mark)
+{
+    // A mark taken before the first allocation is the start of the arena.
+    scratch_arena.top = mark.top ? mark.top : scratch_arena.base;
+}
+
+/**
+ * @return bytes the calling thread has allocated and not released
+ */
+size_t scratch_used(void)
+{
+    return (size_t) (scratch_arena.top - scratch_arena.base);
+}
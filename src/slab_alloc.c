@@ -0,0 +1,488 @@
+/** \file slab_alloc.c
+ *
+ * @brief Size-class slab allocator with thread caches, a drop-in replacement for malloc
+ *
+ * heap.c and heap2.c call malloc and free without asking what they cost. This file implements them, in the layout of
+ * tcmalloc and friends, so the cost has a shape:
+ *
+ * - Sizes up to SMALL_MAX are rounded up to one of 40 size classes: steps of 16 bytes up to 128, then four classes per
+ *   power of two, so at most 25% of a block is lost to rounding.
+ * - Every thread keeps a free list per class. malloc pops from it and free pushes to it, without atomics or locks.
+ * - Behind the thread caches is one central free list per class, under a futex mutex of locks.c. An empty thread cache
+ *   takes a batch of blocks from it in one lock round trip, and a thread cache holding two batches too many gives one
+ *   back. A thread that exits gives back everything.
+ * - The central lists are fed from slabs: SLAB_SIZE-aligned runs of memory cut into blocks of a single class. The slab
+ *   header at the aligned start records the class, so free finds the size of any block by masking its address.
+ * - Larger requests get their own mmap, also SLAB_SIZE-aligned with the same kind of header, and free unmaps them.
+ *   A request aligned to SLAB_SIZE or more starts right after a whole slab that holds its header: free masks the
+ *   address of the byte before a block, which is in the slab of the header for every kind of block.
+ *
+ * Blocks migrate: a block freed by another thread than the one that allocated it goes to the freeing thread's cache.
+ * Slab memory goes back to the central lists but never to the kernel.
+ *
+ * Built as a shared library, it replaces the malloc family of every program it is preloaded into:
+ *
+ * \code{.sh}
+ * LD_PRELOAD=./libslab.so ./heap
+ * \endcode
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "locks.h"
+
+#define EXPORT __attribute__((visibility("default")))
+
+#define SLAB_SIZE ((size_t) 256 * 1024)
+#define SLAB_HEADER 64
+#define SLABS_PER_CHUNK 16
+#define SMALL_MAX ((size_t) 32 * 1024)
+#define CLASS_COUNT 40
+#define CLASS_LARGE UINT32_MAX
+#define SLAB_MAGIC 0x51ab51abu
+#define MIN_ALIGN 16
+
+/** Bytes moved between a thread cache and the central list at once. */
+#define BATCH_BYTES ((size_t) 8 * 1024)
+#define BATCH_MIN 2
+#define BATCH_MAX 64
+
+typedef struct {
+    uint32_t magic;
+    uint32_t size_class;
+    /** Block size of a slab, or the usable size of a large allocation. */
+    size_t block_size;
+    /** Length of the mapping, for large allocations. */
+    size_t mapped;
+} slab_header_t;
+
+_Static_assert(sizeof(slab_header_t) <= SLAB_HEADER, "slab header does not fit");
+
+typedef struct block_t {
+    struct block_t *next;
+} block_t;
+
+typedef struct {
+    _Alignas(64) futex_mutex_t lock;
+    block_t *free_list;
+    size_t free_count;
+    char *bump;
+    char *bump_end;
+} central_t;
+
+typedef struct {
+    block_t *free_list;
+    uint32_t count;
+} cache_list_t;
+
+typedef struct {
+    cache_list_t lists[CLASS_COUNT];
+    /** 0 before the first use, 1 registered for the exit flush, 2 flushed at thread exit. */
+    int state;
+} thread_cache_t;
+
+static central_t central[CLASS_COUNT];
+static futex_mutex_t chunk_lock = FUTEX_MUTEX_INIT;
+static char *chunk_next;
+static char *chunk_end;
+
+static pthread_key_t cache_key;
+static atomic_int init_state;
+
+// Initial-exec: the cache is reached with one %fs-relative load, and the first access cannot call malloc.
+static __thread thread_cache_t thread_cache __attribute__((tls_model("initial-exec")));
+
+static size_t class_of(size_t size)
+{
+    if (size <= 128)
+        return size == 0 ? 0 : (size - 1) / 16;
+    size_t rest = size - 1;
+    unsigned log2 = 63u - (unsigned) __builtin_clzl(rest);
+    return 8 + (log2 - 7) * 4 + ((rest >> (log2 - 2)) - 4);
+}
+
+static size_t class_size(size_t size_class)
+{
+    if (size_class < 8)
+        return (size_class + 1) * 16;
+    size_t log2 = 7 + (size_class - 8) / 4;
+    return ((size_class - 8) % 4 + 5) << (log2 - 2);
+}
+
+_Static_assert((SLAB_SIZE - SLAB_HEADER) / SMALL_MAX >= 4, "a slab must hold a few of the largest blocks");
+
+static uint32_t batch_of(size_t size_class)
+{
+    size_t batch = BATCH_BYTES / class_size(size_class);
+    return (uint32_t) (batch < BATCH_MIN ? BATCH_MIN : batch > BATCH_MAX ? BATCH_MAX : batch);
+}
+
+static slab_header_t *header_of(const void *ptr)
+{
+    // No block starts at a slab boundary but the ones aligned to SLAB_SIZE, whose header is in the slab below.
+    slab_header_t *header = (slab_header_t *) (((uintptr_t) ptr - 1) & ~(SLAB_SIZE - 1));
+
+    if (header->magic != SLAB_MAGIC)
+        abort();
+    return header;
+}
+
+/**
+ * Maps length bytes such that the byte at offset is at a multiple of alignment.
+ * @param alignment a power of two, SLAB_SIZE or more
+ * @param offset a multiple of SLAB_SIZE, so the start is SLAB_SIZE-aligned too
+ * @return the memory, or NULL
+ */
+static char *map_aligned(size_t length, size_t alignment, size_t offset)
+{
+    char *raw = (char *) mmap(NULL, length + alignment, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (raw == MAP_FAILED)
+        return NULL;
+    char *aligned = (char *) ((((uintptr_t) raw + offset + alignment - 1) & ~(alignment - 1)) - offset);
+    if (aligned != raw)
+        munmap(raw, (size_t) (aligned - raw));
+    munmap(aligned + length, (size_t) (raw + alignment - aligned));
+    return aligned;
+}
+
+static char *slab_new(size_t size_class)
+{
+    char *slab = NULL;
+
+    futex_mutex_lock(&chunk_lock);
+    if (chunk_next == chunk_end && (chunk_next = map_aligned(SLABS_PER_CHUNK * SLAB_SIZE, SLAB_SIZE, 0)))
+        chunk_end = chunk_next + SLABS_PER_CHUNK * SLAB_SIZE;
+    if (chunk_next) {
+        slab = chunk_next;
+        chunk_next += SLAB_SIZE;
+    } else {
+        chunk_end = NULL;
+    }
+    futex_mutex_unlock(&chunk_lock);
+    if (!slab)
+        return NULL;
+
+    slab_header_t *header = (slab_header_t *) slab;
+    header->magic = SLAB_MAGIC;
+    header->size_class = (uint32_t) size_class;
+    header->block_size = class_size(size_class);
+    header->mapped = SLAB_SIZE;
+    return slab;
+}
+
+/**
+ * Moves up to count blocks from the central list of the class to the thread cache, carving new blocks from slabs when
+ * the list runs dry.
+ * @return number of blocks moved, 0 if out of memory
+ */
+static uint32_t central_refill(size_t size_class, cache_list_t *list, uint32_t count)
+{
+    central_t *c = &central[size_class];
+    size_t size = class_size(size_class);
+    uint32_t moved = 0;
+
+    futex_mutex_lock(&c->lock);
+    while (moved < count && c->free_list) {
+        block_t *block = c->free_list;
+        c->free_list = block->next;
+        block->next = list->free_list;
+        list->free_list = block;
+        moved++;
+    }
+    c->free_count -= moved;
+    while (moved < count) {
+        if ((size_t) (c->bump_end - c->bump) < size) {
+            char *slab = slab_new(size_class);
+            if (!slab)
+                break;
+            c->bump = slab + SLAB_HEADER;
+            c->bump_end = slab + SLAB_SIZE;
+        }
+        block_t *block = (block_t *) c->bump;
+        c->bump += size;
+        block->next = list->free_list;
+        list->free_list = block;
+        moved++;
+    }
+    futex_mutex_unlock(&c->lock);
+    list->count += moved;
+    return moved;
+}
+
+/**
+ * Moves count blocks from the head of the thread cache list to the central list of the class.
+ */
+static void central_flush(size_t size_class, cache_list_t *list, uint32_t count)
+{
+    central_t *c = &central[size_class];
+    block_t *first = list->free_list;
+    block_t *last = first;
+
+    if (count == 0)
+        return;
+    for (uint32_t i = 1; i < count; i++)
+        last = last->next;
+    list->free_list = last->next;
+    list->count -= count;
+
+    futex_mutex_lock(&c->lock);
+    last->next = c->free_list;
+    c->free_list = first;
+    c->free_count += count;
+    futex_mutex_unlock(&c->lock);
+}
+
+static void cache_flush_all(void *arg)
+{
+    thread_cache_t *cache = (thread_cache_t *) arg;
+
+    for (size_t i = 0; i < CLASS_COUNT; i++)
+        central_flush(i, &cache->lists[i], cache->lists[i].count);
+    cache->state = 2;
+}
+
+/** Takes the locks in the order of central_refill, which calls slab_new under a central lock: chunk_lock last. */
+static void prefork(void)
+{
+    for (size_t i = 0; i < CLASS_COUNT; i++)
+        futex_mutex_lock(&central[i].lock);
+    futex_mutex_lock(&chunk_lock);
+}
+
+static void postfork(void)
+{
+    futex_mutex_unlock(&chunk_lock);
+    for (size_t i = CLASS_COUNT; i-- > 0;)
+        futex_mutex_unlock(&central[i].lock);
+}
+
+/**
+ * Creates the key whose destructor flushes a thread's cache, and the fork handlers. pthread_atfork may call malloc
+ * itself, so it runs after the allocator counts as initialized; other threads wait for the key only.
+ */
+static void global_init(void)
+{
+    int expected = 0;
+
+    if (atomic_compare_exchange_strong(&init_state, &expected, 1)) {
+        if (pthread_key_create(&cache_key, cache_flush_all) != 0)
+            abort();
+        atomic_store(&init_state, 2);
+        pthread_atfork(prefork, postfork, postfork);
+        return;
+    }
+    while (atomic_load(&init_state) != 2)
+        sched_yield();
+}
+
+/**
+ * @return the calling thread's cache, or NULL once the thread has been flushed at exit
+ */
+static thread_cache_t *cache_get(void)
+{
+    thread_cache_t *cache = &thread_cache;
+
+    if (__builtin_expect(cache->state != 1, 0)) {
+        if (cache->state == 2)
+            return NULL;
+        if (atomic_load_explicit(&init_state, memory_order_acquire) != 2)
+            global_init();
+        cache->state = 1;
+        pthread_setspecific(cache_key, cache);
+    }
+    return cache;
+}
+
+static void *large_alloc(size_t size, size_t alignment)
+{
+    size_t offset = alignment >= SLAB_SIZE ? SLAB_SIZE : alignment > SLAB_HEADER ? alignment : SLAB_HEADER;
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+
+    if (alignment < SLAB_SIZE)
+        alignment = SLAB_SIZE;
+    if (alignment > SIZE_MAX / 4 || size > SIZE_MAX - offset - alignment - page) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    size_t mapped = (offset + size + page - 1) & ~(page - 1);
+    char *base = map_aligned(mapped, alignment, offset == SLAB_SIZE ? SLAB_SIZE : 0);
+    if (!base) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    slab_header_t *header = (slab_header_t *) base;
+    header->magic = SLAB_MAGIC;
+    header->size_class = CLASS_LARGE;
+    header->block_size = mapped - offset;
+    header->mapped = mapped;
+    return base + offset;
+}
+
+static void *small_alloc(size_t size_class)
+{
+    thread_cache_t *cache = cache_get();
+    cache_list_t *list;
+    cache_list_t spill = {NULL, 0};
+
+    // An exiting thread has no cache any more: go through a one-block list straight to the central one.
+    list = cache ? &cache->lists[size_class] : &spill;
+    if (!list->free_list && central_refill(size_class, list, cache ? batch_of(size_class) : 1) == 0) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    block_t *block = list->free_list;
+    list->free_list = block->next;
+    list->count--;
+    return block;
+}
+
+static void *slab_malloc(size_t size, size_t alignment)
+{
+    if (alignment <= MIN_ALIGN && size <= SMALL_MAX)
+        return small_alloc(class_of(size));
+    // Blocks are only 16-byte aligned, so aligned small requests get alignment - 1 bytes of slack; free finds the
+    // start of the block from any address inside it.
+    if (alignment < SMALL_MAX && size <= SMALL_MAX - alignment) {
+        char *block = (char *) small_alloc(class_of(size + alignment - 1));
+        return block ? (void *) (((uintptr_t) block + alignment - 1) & ~(uintptr_t) (alignment - 1)) : NULL;
+    }
+    return large_alloc(size, alignment);
+}
+
+EXPORT void free(void *ptr)
+{
+    if (!ptr)
+        return;
+    slab_header_t *header = header_of(ptr);
+    if (header->size_class == CLASS_LARGE) {
+        munmap(header, header->mapped);
+        return;
+    }
+
+    size_t size_class = header->size_class;
+    size_t offset = (size_t) ((char *) ptr - (char *) header - SLAB_HEADER);
+    block_t *block = (block_t *) ((char *) ptr - offset % header->block_size);
+    thread_cache_t *cache = cache_get();
+    if (!cache) {
+        cache_list_t spill = {block, 1};
+        block->next = NULL;
+        central_flush(size_class, &spill, 1);
+        return;
+    }
+    cache_list_t *list = &cache->lists[size_class];
+    block->next = list->free_list;
+    list->free_list = block;
+    uint32_t batch = batch_of(size_class);
+    if (++list->count > 2 * batch)
+        central_flush(size_class, list, batch);
+}
+
+EXPORT void *malloc(size_t size)
+{
+    return slab_malloc(size, MIN_ALIGN);
+}
+
+EXPORT void *calloc(size_t count, size_t size)
+{
+    size_t total;
+
+    if (__builtin_mul_overflow(count, size, &total)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    void *ptr = slab_malloc(total, MIN_ALIGN);
+    // Fresh mappings are zero already; recycled blocks are not.
+    if (ptr && total <= SMALL_MAX)
+        memset(ptr, 0, total);
+    return ptr;
+}
+
+EXPORT size_t malloc_usable_size(void *ptr)
+{
+    if (!ptr)
+        return 0;
+    slab_header_t *header = header_of(ptr);
+    size_t offset = (size_t) ((char *) ptr - (char *) header - SLAB_HEADER);
+    if (header->size_class == CLASS_LARGE)
+        return header->mapped - SLAB_HEADER - offset;
+    return header->block_size - offset % header->block_size;
+}
+
+EXPORT void *realloc(void *ptr, size_t size)
+{
+    if (!ptr)
+        return malloc(size);
+    if (size == 0) {
+        free(ptr);
+        return NULL;
+    }
+    size_t usable = malloc_usable_size(ptr);
+    // Stay in place while the block fits and is not grossly oversized.
+    if (size <= usable && size >= usable / 2)
+        return ptr;
+    void *moved = malloc(size);
+    if (!moved)
+        return NULL;
+    memcpy(moved, ptr, size < usable ? size : usable);
+    free(ptr);
+    return moved;
+}
+
+EXPORT void *reallocarray(void *ptr, size_t count, size_t size)
+{
+    size_t total;
+
+    if (__builtin_mul_overflow(count, size, &total)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return realloc(ptr, total);
+}
+
+EXPORT int posix_memalign(void **out, size_t alignment, size_t size)
+{
+    if (alignment < sizeof(void *) || (alignment & (alignment - 1)))
+        return EINVAL;
+    void *ptr = slab_malloc(size, alignment);
+    if (!ptr)
+        return errno;
+    *out = ptr;
+    return 0;
+}
+
+EXPORT void *aligned_alloc(size_t alignment, size_t size)
+{
+    if (alignment == 0 || (alignment & (alignment - 1))) {
+        errno = EINVAL;
+        return NULL;
+    }
+    return slab_malloc(size, alignment);
+}
+
+EXPORT void *memalign(size_t alignment, size_t size)
+{
+    return aligned_alloc(alignment, size);
+}
+
+EXPORT void *valloc(size_t size)
+{
+    return slab_malloc(size, (size_t) sysconf(_SC_PAGESIZE));
+}
+
+EXPORT void *pvalloc(size_t size)
+{
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    return slab_malloc((size + page - 1) & ~(page - 1), page);
+}
@@ -0,0 +1,622 @@
+/** \file snapshot.c
+ *
+ * @brief Zero-copy binary snapshots of list_t and student_t collections
+ *
+ * Printing a collection as text (like `list_print` in c_style_oop.c) and parsing it back costs a formatting and a
+ * parsing step for every item. A binary snapshot stores the bytes exactly as they sit in memory, so loading it is a
+ * single `mmap` and the items are used in place, straight from the page cache.
+ *
+ * For that to work the file must be position independent: it can be mapped at any address, so it must not contain
+ * pointers. Every reference inside the file is an offset from the beginning of the file.
+ *
+ * \code
+ *  +-------------------+ 0
+ *  | snapshot_header_t |   magic, version, byte order, section table offset
+ *  +-------------------+ 64
+ *  | section table     |   one snapshot_section_t (64 bytes) per section
+ *  +-------------------+ 64-byte aligned
+ *  | list table        |   list_record_t {size, items_offset} per list
+ *  +-------------------+ 64-byte aligned
+ *  | list items        |   int32_t items of all lists back to back
+ *  +-------------------+ 64-byte aligned
+ *  | students          |   student_t records
+ *  +-------------------+
+ * \endcode
+ *
+ * Sections start on a 64-byte boundary, which is the cache line size, so the first element of every section is
+ * aligned for any type and never straddles a cache line because of the file layout.
+ *
+ * Writing gathers the header, the table and the items of every list with `writev`, without first copying them into one
+ * buffer. Each section carries a checksum that `snapshot_verify` can check when the file comes from an untrusted place;
+ * the normal load path does not read the data at all.
+ *
+ * \code{.sh}
+ * ./snapshot [number-of-items] [path]
+ * \endcode
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "helpers.h"
+
+#define SNAPSHOT_MAGIC "XCSNAP\0\0"
+#define SNAPSHOT_VERSION 1u
+#define SNAPSHOT_BYTE_ORDER 0x01020304u
+#define SNAPSHOT_ALIGN 64u
+#define SNAPSHOT_MAX_SECTIONS 8u
+
+/* The record types, the same as in c_style_oop.c */
+typedef struct list_t {
+    size_t size;
+    int *items;
+} list_t;
+
+typedef struct {
+    char first_name[32];
+    char last_name[32];
+    unsigned int birth_year;
+} person_t;
+
+typedef struct {
+    person_t person;
+    char student_number[16];
+    unsigned int passed_credits;
+} student_t;
+
+/* student_t is stored as is, so its layout is part of the file format. */
+_Static_assert(sizeof(student_t) == 88, "student_t layout changed, bump SNAPSHOT_VERSION");
+
+typedef enum {
+    SECTION_LIST_TABLE = 1,
+    SECTION_LIST_ITEMS = 2,
+    SECTION_STUDENTS = 3
+} section_type_t;
+
+/**
+ * \struct snapshot_header_t
+ * \brief First 64 bytes of every snapshot file.
+ */
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint64_t file_size;
+    uint64_t table_offset;
+    uint32_t section_count;
+    uint32_t reserved0;
+    uint64_t table_checksum;
+    uint8_t reserved[16];
+} snapshot_header_t;
+
+/**
+ * \struct snapshot_section_t
+ * \brief Section table entry. The data is `count` elements of `elem_size` bytes at `offset`.
+ */
+typedef struct {
+    uint32_t type;
+    uint32_t elem_size;
+    uint64_t count;
+    uint64_t offset;
+    uint64_t length;
+    uint64_t checksum;
+    uint8_t reserved[24];
+} snapshot_section_t;
+
+/**
+ * \struct list_record_t
+ * \brief A list_t as stored in the file: the items pointer became an offset.
+ */
+typedef struct {
+    uint64_t size;
+    uint64_t items_offset;
+} list_record_t;
+
+_Static_assert(sizeof(snapshot_header_t) == SNAPSHOT_ALIGN, "header must fill one cache line");
+_Static_assert(sizeof(snapshot_section_t) == SNAPSHOT_ALIGN, "section entry must fill one cache line");
+
+/**
+ * \struct snapshot_t
+ * \brief A mapped snapshot. All pointers point into the mapping.
+ */
+typedef struct {
+    const unsigned char *base;
+    size_t size;
+    const snapshot_section_t *sections;
+    uint32_t section_count;
+} snapshot_t;
+
+/**
+ * Streaming checksum over 32-bit words. Word i is mixed into lane i % 4, so the four multiplications are independent
+ * and the result does not depend on how the data is split between buffers. Every section is a multiple of 4 bytes.
+ */
+typedef struct {
+    uint64_t lanes[4];
+    uint64_t words;
+} checksum_t;
+
+static void checksum_init(checksum_t *sum)
+{
+    for (int i = 0; i < 4; i++)
+        sum->lanes[i] = 0xcbf29ce484222325u + (uint64_t) i;
+    sum->words = 0;
+}
+
+static void checksum_update(checksum_t *sum, const void *data, size_t length)
+{
+    const unsigned char *p = (const unsigned char *) data;
+    size_t n = length / sizeof(uint32_t);
+
+    for (size_t i = 0; i < n; i++) {
+        uint32_t word;
+        memcpy(&word, p + i * sizeof(uint32_t), sizeof(word));
+        uint64_t *lane = &sum->lanes[(sum->words + i) & 3u];
+        *lane = (*lane ^ word) * 0x100000001b3u;
+    }
+    sum->words += n;
+}
+
+static uint64_t checksum_final(const checksum_t *sum)
+{
+    uint64_t h = sum->words;
+
+    for (int i = 0; i < 4; i++)
+        h = (h ^ sum->lanes[i]) * 0x9e3779b97f4a7c15u;
+    return h ^ (h >> 29);
+}
+
+static uint64_t align_up(uint64_t value)
+{
+    return (value + SNAPSHOT_ALIGN - 1) & ~(uint64_t) (SNAPSHOT_ALIGN - 1);
+}
+
+/**
+ * \struct iov_writer_t
+ * \brief Collects iovecs and flushes them with writev when IOV_MAX entries are queued.
+ */
+typedef struct {
+    int fd;
+    int count;
+    struct iovec iov[IOV_MAX];
+} iov_writer_t;
+
+static int iov_flush(iov_writer_t *w)
+{
+    struct iovec *iov = w->iov;
+    int count = w->count;
+
+    while (count > 0) {
+        ssize_t written = writev(w->fd, iov, count);
+        if (written == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        // A short write stops anywhere, even in the middle of an entry.
+        size_t left = (size_t) written;
+        while (count > 0 && left >= iov->iov_len) {
+            left -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *) iov->iov_base + left;
+            iov->iov_len -= left;
+        }
+    }
+    w->count = 0;
+    return 0;
+}
+
+static int iov_push(iov_writer_t *w, const void *data, size_t length)
+{
+    if (length == 0)
+        return 0;
+    if (w->count == IOV_MAX && iov_flush(w) == -1)
+        return -1;
+    w->iov[w->count].iov_base = (void *) data;
+    w->iov[w->count].iov_len = length;
+    w->count++;
+    return 0;
+}
+
+static const unsigned char zero_pad[SNAPSHOT_ALIGN];
+
+/**
+ * Writes the lists and the students into a snapshot file. The file is written under a temporary name and renamed, so
+ * readers never map a half-written snapshot.
+ * @param path
+ * @param lists
+ * @param list_count
+ * @param students
+ * @param student_count
+ * @return 0 for success, -1 for error with errno set
+ */
+int snapshot_write(const char *path, list_t *const *lists, size_t list_count, const student_t *students,
+                   size_t student_count)
+{
+    snapshot_header_t header;
+    snapshot_section_t sections[3];
+    checksum_t sum;
+
+    list_record_t *records = (list_record_t *) malloc((list_count ? list_count : 1) * sizeof(list_record_t));
+    if (!records)
+        return -1;
+
+    memset(&header, 0, sizeof(header));
+    memset(sections, 0, sizeof(sections));
+
+    uint64_t offset = align_up(sizeof(header) + sizeof(sections));
+
+    sections[0].type = SECTION_LIST_TABLE;
+    sections[0].elem_size = sizeof(list_record_t);
+    sections[0].count = list_count;
+    sections[0].offset = offset;
+    sections[0].length = list_count * sizeof(list_record_t);
+    offset = align_up(offset + sections[0].length);
+
+    sections[1].type = SECTION_LIST_ITEMS;
+    sections[1].elem_size = sizeof(int32_t);
+    sections[1].offset = offset;
+    for (size_t i = 0; i < list_count; i++) {
+        records[i].size = lists[i]->size;
+        records[i].items_offset = offset + sections[1].count * sizeof(int32_t);
+        sections[1].count += lists[i]->size;
+    }
+    sections[1].length = sections[1].count * sizeof(int32_t);
+    offset = align_up(offset + sections[1].length);
+
+    sections[2].type = SECTION_STUDENTS;
+    sections[2].elem_size = sizeof(student_t);
+    sections[2].count = student_count;
+    sections[2].offset = offset;
+    sections[2].length = student_count * sizeof(student_t);
+
+    checksum_init(&sum);
+    checksum_update(&sum, records, sections[0].length);
+    sections[0].checksum = checksum_final(&sum);
+    checksum_init(&sum);
+    for (size_t i = 0; i < list_count; i++)
+        checksum_update(&sum, lists[i]->items, lists[i]->size * sizeof(int32_t));
+    sections[1].checksum = checksum_final(&sum);
+    checksum_init(&sum);
+    checksum_update(&sum, students, sections[2].length);
+    sections[2].checksum = checksum_final(&sum);
+
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.byte_order = SNAPSHOT_BYTE_ORDER;
+    header.file_size = sections[2].offset + sections[2].length;
+    header.table_offset = sizeof(header);
+    header.section_count = 3;
+    checksum_init(&sum);
+    checksum_update(&sum, sections, sizeof(sections));
+    header.table_checksum = checksum_final(&sum);
+
+    char tmp_path[PATH_MAX];
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path) >= (int) sizeof(tmp_path)) {
+        free(records);
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        free(records);
+        return -1;
+    }
+
+    iov_writer_t *w = (iov_writer_t *) malloc(sizeof(iov_writer_t));
+    int result = -1;
+    if (!w)
+        goto out;
+    w->fd = fd;
+    w->count = 0;
+
+    uint64_t position = sizeof(header) + sizeof(sections);
+    if (iov_push(w, &header, sizeof(header)) == -1 || iov_push(w, sections, sizeof(sections)) == -1)
+        goto out;
+    for (int s = 0; s < 3; s++) {
+        if (iov_push(w, zero_pad, sections[s].offset - position) == -1)
+            goto out;
+        if (sections[s].type == SECTION_LIST_TABLE) {
+            if (iov_push(w, records, sections[s].length) == -1)
+                goto out;
+        } else if (sections[s].type == SECTION_LIST_ITEMS) {
+            for (size_t i = 0; i < list_count; i++)
+                if (iov_push(w, lists[i]->items, lists[i]->size * sizeof(int32_t)) == -1)
+                    goto out;
+        } else {
+            if (iov_push(w, students, sections[s].length) == -1)
+                goto out;
+        }
+        position = sections[s].offset + sections[s].length;
+    }
+    if (iov_flush(w) == -1 || fsync(fd) == -1)
+        goto out;
+    result = 0;
+
+out:
+    free(w);
+    free(records);
+    if (close(fd) == -1)
+        result = -1;
+    if (result == 0 && rename(tmp_path, path) == -1)
+        result = -1;
+    if (result == -1) {
+        int saved = errno;
+        unlink(tmp_path);
+        errno = saved;
+    }
+    return result;
+}
+
+/**
+ * @return the element size the readers of a section type rely on, 0 for types this version does not read
+ */
+static size_t section_elem_size(uint32_t type)
+{
+    switch (type) {
+    case SECTION_LIST_TABLE:
+        return sizeof(list_record_t);
+    case SECTION_LIST_ITEMS:
+        return sizeof(int32_t);
+    case SECTION_STUDENTS:
+        return sizeof(student_t);
+    default:
+        return 0;
+    }
+}
+
+/**
+ * Maps a snapshot and validates its header and section table. The data sections are not touched, so the cost does
+ * not depend on the number of items.
+ * @param snap
+ * @param path
+ * @return 0 for success, -1 for error with errno set (EINVAL for a malformed file)
+ */
+int snapshot_open(snapshot_t *snap, const char *path)
+{
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+
+    if (fd == -1)
+        return -1;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return -1;
+    }
+    if ((size_t) st.st_size < sizeof(snapshot_header_t)) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+    void *base = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+        return -1;
+
+    const snapshot_header_t *header = (const snapshot_header_t *) base;
+    size_t size = (size_t) st.st_size;
+    const snapshot_section_t *sections = (const snapshot_section_t *) ((const unsigned char *) base + sizeof(*header));
+    int valid = memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) == 0 &&
+                header->version == SNAPSHOT_VERSION && header->byte_order == SNAPSHOT_BYTE_ORDER &&
+                header->file_size == size && header->table_offset == sizeof(*header) &&
+                header->section_count <= SNAPSHOT_MAX_SECTIONS &&
+                sizeof(*header) + header->section_count * sizeof(snapshot_section_t) <= size;
+    for (uint32_t s = 0; valid && s < header->section_count; s++) {
+        const snapshot_section_t *sec = &sections[s];
+        size_t expected = section_elem_size(sec->type);
+        valid = sec->offset % SNAPSHOT_ALIGN == 0 && sec->offset <= size && sec->length <= size - sec->offset &&
+                sec->elem_size != 0 && (expected == 0 || sec->elem_size == expected) &&
+                sec->length / sec->elem_size == sec->count && sec->length % sec->elem_size == 0;
+    }
+    if (!valid) {
+        munmap(base, size);
+        errno = EINVAL;
+        return -1;
+    }
+
+    snap->base = (const unsigned char *) base;
+    snap->size = size;
+    snap->sections = sections;
+    snap->section_count = header->section_count;
+    return 0;
+}
+
+void snapshot_close(snapshot_t *snap)
+{
+    munmap((void *) snap->base, snap->size);
+    snap->base = NULL;
+}
+
+static const snapshot_section_t *snapshot_section(const snapshot_t *snap, section_type_t type)
+{
+    for (uint32_t s = 0; s < snap->section_count; s++)
+        if (snap->sections[s].type == (uint32_t) type)
+            return &snap->sections[s];
+    return NULL;
+}
+
+/**
+ * Reads every section and compares it with the stored checksum.
+ * @param snap
+ * @return 0 if the file is intact, -1 otherwise
+ */
+int snapshot_verify(const snapshot_t *snap)
+{
+    const snapshot_header_t *header = (const snapshot_header_t *) snap->base;
+    checksum_t sum;
+
+    checksum_init(&sum);
+    checksum_update(&sum, snap->sections, snap->section_count * sizeof(snapshot_section_t));
+    if (checksum_final(&sum) != header->table_checksum)
+        return -1;
+    for (uint32_t s = 0; s < snap->section_count; s++) {
+        checksum_init(&sum);
+        checksum_update(&sum, snap->base + snap->sections[s].offset, snap->sections[s].length);
+        if (checksum_final(&sum) != snap->sections[s].checksum)
+            return -1;
+    }
+    return 0;
+}
+
+size_t snapshot_list_count(const snapshot_t *snap)
+{
+    const snapshot_section_t *table = snapshot_section(snap, SECTION_LIST_TABLE);
+    return table ? (size_t) table->count : 0;
+}
+
+/**
+ * Turns the stored offset back into a pointer into the mapping. This is the only work done per list.
+ * @param snap
+ * @param index
+ * @param size the number of items of the list
+ * @return the items of the list, or NULL if the index or the record is out of range or misaligned
+ */
+const int32_t *snapshot_list_items(const snapshot_t *snap, size_t index, size_t *size)
+{
+    const snapshot_section_t *table = snapshot_section(snap, SECTION_LIST_TABLE);
+    const snapshot_section_t *items = snapshot_section(snap, SECTION_LIST_ITEMS);
+
+    if (!table || !items || index >= table->count)
+        return NULL;
+    const list_record_t *record = (const list_record_t *) (snap->base + table->offset) + index;
+    // A crafted offset that is in range but not a multiple of the item size would give a misaligned pointer.
+    if (record->items_offset < items->offset || record->size > items->count ||
+        (record->items_offset - items->offset) % sizeof(int32_t) != 0 ||
+        (record->items_offset - items->offset) / sizeof(int32_t) > items->count - record->size)
+        return NULL;
+    *size = (size_t) record->size;
+    return (const int32_t *) (snap->base + record->items_offset);
+}
+
+const student_t *snapshot_students(const snapshot_t *snap, size_t *count)
+{
+    const snapshot_section_t *students = snapshot_section(snap, SECTION_STUDENTS);
+
+    if (!students) {
+        *count = 0;
+        return NULL;
+    }
+    *count = (size_t) students->count;
+    return (const student_t *) (snap->base + students->offset);
+}
+
+/**
+ * Text round trip in the list_print format, the baseline the snapshot is compared against.
+ */
+static int text_write(const char *path, const list_t *list)
+{
+    FILE *f = fopen(path, "w");
+
+    if (!f)
+        return -1;
+    fprintf(f, "[");
+    for (size_t i = 0; i < list->size; i++)
+        fprintf(f, "%d ", list->items[i]);
+    fprintf(f, "]\n");
+    return fclose(f);
+}
+
+static int text_read(const char *path, list_t *list, size_t capacity)
+{
+    FILE *f = fopen(path, "r");
+    int item;
+
+    if (!f)
+        return -1;
+    list->size = 0;
+    if (fgetc(f) != '[') {
+        fclose(f);
+        return -1;
+    }
+    while (list->size < capacity && fscanf(f, "%d", &item) == 1)
+        list->items[list->size++] = item;
+    fclose(f);
+    return 0;
+}
+
+static double ms_since(uint64_t begin)
+{
+    return (double) (bench_now_ns() - begin) / 1e6;
+}
+
+int main(int argc, char **argv)
+{
+    size_t count = argc > 1 ? strtoul(argv[1], NULL, 10) : 100000000;
+    const char *path = argc > 2 ? argv[2] : "list.snap";
+    char text_path[PATH_MAX];
+
+    if (count == 0) {
+        fprintf(stderr, "Usage: %s [number-of-items] [path]\n", argv[0]);
+        exit(1);
+    }
+    snprintf(text_path, sizeof(text_path), "%s.txt", path);
+
+    list_t list = {count, (int *) malloc(count * sizeof(int))};
+    student_t students[4];
+    if (!list.items)
+        exit_sys("%s - malloc", argv[0]);
+    for (size_t i = 0; i < count; i++)
+        list.items[i] = (int) (i * 2654435761u);
+    memset(students, 0, sizeof(students));
+    for (unsigned int i = 0; i < 4; i++) {
+        snprintf(students[i].person.first_name, sizeof(students[i].person.first_name), "student%u", i);
+        students[i].person.birth_year = 2000 + i;
+        students[i].passed_credits = 30 * i;
+    }
+
+    list_t *lists[] = {&list};
+    uint64_t begin = bench_now_ns();
+    if (snapshot_write(path, lists, 1, students, 4) == -1)
+        exit_sys("%s - snapshot_write %s", argv[0], path);
+    printf("binary write:  %10.2f ms\n", ms_since(begin));
+
+    snapshot_t snap;
+    begin = bench_now_ns();
+    if (snapshot_open(&snap, path) == -1)
+        exit_sys("%s - snapshot_open %s", argv[0], path);
+    size_t size = 0;
+    const int32_t *items = snapshot_list_items(&snap, 0, &size);
+    printf("binary load:   %10.3f ms (%zu items, no parsing)\n", ms_since(begin), size);
+
+    begin = bench_now_ns();
+    long long sum = 0;
+    for (size_t i = 0; i < size; i++)
+        sum += items[i];
+    printf("binary scan:   %10.2f ms (sum %lld)\n", ms_since(begin), sum);
+
+    begin = bench_now_ns();
+    int intact = snapshot_verify(&snap) == 0;
+    printf("binary verify: %10.2f ms (%s)\n", ms_since(begin), intact ? "ok" : "corrupt");
+    size_t student_count;
+    const student_t *loaded = snapshot_students(&snap, &student_count);
+    printf("students: %zu, last: %s\n", student_count, student_count ? loaded[student_count - 1].person.first_name : "-");
+    snapshot_close(&snap);
+
+    begin = bench_now_ns();
+    if (text_write(text_path, &list) == -1)
+        exit_sys("%s - text write %s", argv[0], text_path);
+    printf("text write:    %10.2f ms\n", ms_since(begin));
+    begin = bench_now_ns();
+    if (text_read(text_path, &list, count) == -1)
+        exit_sys("%s - text read %s", argv[0], text_path);
+    printf("text load:     %10.2f ms (%zu items parsed)\n", ms_since(begin), list.size);
+
+    unlink(text_path);
+    unlink(path);
+    free(list.items);
+    return 0;
+}
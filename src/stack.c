@@ -8,9 +8,21 @@
  *
  * Every stack variable has a scope
  *
+ * The scratch arena of scratch.c is the safe alternative to returning a local's address, at nearly the cost of a
+ * stack allocation. The stack probe of stack_probe.c measures how much of its stack a thread really uses.
+ *
  */
 
+#include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
+
+#include "bench.h"
+#include "scratch.h"
+#include "stack_probe.h"
+
+#define TEMPORARIES 10000000
+#define THREAD_STACK (256 * 1024)
 /** There is a problem here. Function returns a pointer's address which is just in
  * function scope. Whenever main function tries to deference it, it is going to be
  * undefined behaviour. So we don't know what would happen.
@@ -32,8 +44,85 @@ int * get_integer() {
     int var = 10;
     return &var;
 }
+
+/** Same as get_integer, but the integer lives in the thread's scratch arena, valid until the caller releases it. */
+int * get_integer_scratch() {
+    int* var = (int*)scratch_alloc(sizeof(int));
+    if (!var) {
+        perror("scratch_alloc");
+        exit(1);
+    }
+    *var = 10;
+    return var;
+}
+
+void compare_temporaries() {
+    uint64_t begin = bench_now_ns();
+    for (int i = 0; i < TEMPORARIES; i++) {
+        scratch_mark_t mark = scratch_mark();
+        volatile char* temp = (volatile char*)scratch_alloc(64);
+        temp[0] = (char)i;
+        scratch_release(mark);
+    }
+    uint64_t scratch_ns = bench_now_ns() - begin;
+    begin = bench_now_ns();
+    for (int i = 0; i < TEMPORARIES; i++) {
+        volatile char* temp = (volatile char*)malloc(64);
+        temp[0] = (char)i;
+        free((void*)temp);
+    }
+    uint64_t malloc_ns = bench_now_ns() - begin;
+    printf("64-byte temporary: scratch %.1f ns, malloc/free %.1f ns\n", (double)scratch_ns / TEMPORARIES,
+           (double)malloc_ns / TEMPORARIES);
+}
+
+/** Burns about 256 bytes of stack per level. */
+int recurse(int depth) {
+    volatile char frame[256];
+    frame[0] = (char)depth;
+    return depth == 0 ? frame[0] : recurse(depth - 1) + frame[0];
+}
+
+void* measure_thread(void* arg) {
+    int depth = *(int*)arg;
+    stack_paint(0);
+    recurse(depth);
+    printf("recursion depth %4d: %6zu of %zu stack bytes used\n", depth, stack_high_water(), stack_size());
+    return NULL;
+}
+
+/*
+ * Threads get a 256 KiB stack instead of the 8 MiB default and report their high-water mark, which is what the stack
+ * size could be cut down to, plus a margin.
+ */
+void measure_stacks() {
+    int depths[] = {0, 16, 128, 512};
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, THREAD_STACK);
+    for (size_t i = 0; i < sizeof(depths) / sizeof(depths[0]); i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, &attr, measure_thread, &depths[i]) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+        pthread_join(thread, NULL);
+    }
+    pthread_attr_destroy(&attr);
+}
+
 int main(int argc, char** argv) {
-    int* ptr = get_integer();
+    scratch_mark_t mark = scratch_mark();
+    int* ptr = get_integer_scratch();
+    printf("%d\n", *ptr);
+    scratch_release(mark); // ptr is dangling from here on, like the one of get_integer below
+    compare_temporaries();
+    measure_stacks();
+
+    fflush(stdout);
+
+    // Undefined behaviour: with gcc, get_integer returns NULL and this crashes.
+    ptr = get_integer();
     printf("%d\n", *ptr);
     *ptr = 5;
     printf("%d\n", *ptr);
@@ -0,0 +1,95 @@
+/** \file stack_probe.c
+ *
+ * @brief Stack high-water mark by painting
+ *
+ * A thread paints the unused part of its stack with a known pattern, runs, and then looks for the lowest address
+ * where the pattern was overwritten. Everything above it has been used at some point, so the distance to the top of
+ * the stack is the most the thread ever needed. With that number, stacks can be sized down from the 8 MiB default
+ * with pthread_attr_setstacksize, and more threads fit into the same memory.
+ *
+ * The bounds come from pthread_getattr_np. The top of a thread's stack also holds its TLS and thread descriptor, which
+ * therefore count as used, as they do against the stack size. The guard page at the bottom is never painted.
+ *
+ * Painting touches every page it writes, so for the main thread, whose stack may be allowed to grow to the rlimit,
+ * pass a max_depth. A signal handler running on the stack counts as usage; so does anything that wrote the pattern
+ * itself, which is unlikely for a 64-bit constant.
+ */
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "stack_probe.h"
+
+#define STACK_PATTERN UINT64_C(0x5717c4a11d5717c4)
+/** Room left below the frame of stack_paint for its own locals and the red zone. */
+#define PAINT_MARGIN 1024
+
+static _Thread_local const uint64_t *painted_low;
+static _Thread_local const char *painted_top;
+
+static int stack_bounds(char **low, char **high)
+{
+    pthread_attr_t attr;
+    void *addr;
+    size_t size;
+
+    if (pthread_getattr_np(pthread_self(), &attr) != 0)
+        return -1;
+    pthread_attr_getstack(&attr, &addr, &size);
+    pthread_attr_destroy(&attr);
+    *low = (char *) addr;
+    *high = (char *) addr + size;
+    return 0;
+}
+
+/**
+ * @return size of the calling thread's stack, 0 if unknown
+ */
+size_t stack_size(void)
+{
+    char *low, *high;
+
+    return stack_bounds(&low, &high) == 0 ? (size_t) (high - low) : 0;
+}
+
+/**
+ * Paints the calling thread's stack below the caller's frame.
+ * @param max_depth bytes to paint at most, 0 for everything down to the guard page
+ * @return bytes painted
+ */
+__attribute__((noinline)) size_t stack_paint(size_t max_depth)
+{
+    char *low, *high;
+
+    if (stack_bounds(&low, &high) == -1)
+        return 0;
+    long page = sysconf(_SC_PAGESIZE);
+    // No calls from here on: everything below this point is about to be overwritten.
+    char *top = (char *) ((uintptr_t) ((char *) __builtin_frame_address(0) - PAINT_MARGIN) & ~(uintptr_t) 7);
+    char *bottom = low + page;
+    if (max_depth && max_depth < (size_t) (top - bottom))
+        bottom = (char *) ((uintptr_t) (top - max_depth) & ~(uintptr_t) 7);
+    for (volatile uint64_t *word = (volatile uint64_t *) bottom; (char *) word < top; word++)
+        *word = STACK_PATTERN;
+    painted_low = (const uint64_t *) bottom;
+    painted_top = high;
+    return (size_t) (top - bottom);
+}
+
+/**
+ * @return most bytes of its stack the calling thread has used since stack_paint, 0 if it never painted. If the whole
+ * painted depth is used, the thread may have gone deeper.
+ */
+size_t stack_high_water(void)
+{
+    const volatile uint64_t *word = painted_low;
+
+    if (!word)
+        return 0;
+    while ((const char *) word < painted_top && *word == STACK_PATTERN)
+        word++;
+    return (size_t) (painted_top - (const char *) word);
+}
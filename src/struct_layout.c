@@ -0,0 +1,304 @@
+/** \file struct_layout.c
+ *
+ * @brief Structure layout analyzer
+ *
+ * structs.c explains padding with sample_t by hand. This program does the same for every structure of the project
+ * automatically: the structures are described with the X-macros of reflect.h, which give the offset, size and
+ * alignment of every field, and the analyzer prints
+ *
+ * - the holes the compiler inserted between fields and at the end (tail padding),
+ * - which fields straddle a 64-byte cache line when the structure is stored in an array, and in how many of the
+ *   array slots that happens (the pattern repeats every `64 / gcd(size, 64)` elements),
+ * - a field order with minimal padding and the size it would have.
+ *
+ * When all alignments are powers of two, sorting the fields by decreasing alignment leaves no hole between fields,
+ * because every field starts at an offset that is a multiple of the previous (larger or equal) alignment. Only the
+ * tail padding needed to round the size up to the structure alignment remains, which is the minimum possible.
+ *
+ * At the end a benchmark reads an array of record_t in its original and in its proposed order.
+ *
+ * \code{.sh}
+ * ./struct_layout [number-of-elements]
+ * \endcode
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+#include "reflect.h"
+
+#define CACHE_LINE 64u
+
+typedef enum {
+    ON,
+    OFF
+} state_t;
+
+struct gun_t;
+
+/* Structures of structs.c */
+#define COLOR_FIELDS(F, S)                                                                                             \
+    F(S, int, red, )                                                                                                   \
+    F(S, int, green, )                                                                                                 \
+    F(S, int, blue, )
+REFLECT_STRUCT(color_t, COLOR_FIELDS)
+
+#define SAMPLE_FIELDS(F, S)                                                                                            \
+    F(S, char, first, )                                                                                                \
+    F(S, char, second, )                                                                                               \
+    F(S, char, third, )                                                                                                \
+    F(S, short, fourth, )
+REFLECT_STRUCT(sample_t, SAMPLE_FIELDS)
+REFLECT_PACKED_STRUCT(sample1_t, SAMPLE_FIELDS)
+
+/* Structures of c_style_oop.c */
+#define CAR_FIELDS(F, S)                                                                                               \
+    F(S, char, name, [32])                                                                                             \
+    F(S, double, speed, )                                                                                              \
+    F(S, double, fuel, )
+REFLECT_STRUCT(car_t, CAR_FIELDS)
+
+#define LIST_FIELDS(F, S)                                                                                              \
+    F(S, size_t, size, )                                                                                               \
+    F(S, int *, items, )
+REFLECT_STRUCT(list_t, LIST_FIELDS)
+
+#define ENGINE_FIELDS(F, S)                                                                                            \
+    F(S, state_t, state, )                                                                                             \
+    F(S, double, temperature, )
+REFLECT_STRUCT(engine_t, ENGINE_FIELDS)
+
+#define CAR1_FIELDS(F, S) F(S, engine_t *, engine, )
+REFLECT_STRUCT(car1_t, CAR1_FIELDS)
+
+#define PLAYER_FIELDS(F, S)                                                                                            \
+    F(S, char *, name, )                                                                                               \
+    F(S, struct gun_t *, gun, )
+REFLECT_STRUCT(player_t, PLAYER_FIELDS)
+
+#define PERSON_FIELDS(F, S)                                                                                            \
+    F(S, char, first_name, [32])                                                                                       \
+    F(S, char, last_name, [32])                                                                                        \
+    F(S, unsigned int, birth_year, )
+REFLECT_STRUCT(person_t, PERSON_FIELDS)
+
+#define STUDENT_FIELDS(F, S)                                                                                           \
+    F(S, person_t, person, )                                                                                           \
+    F(S, char, student_number, [16])                                                                                   \
+    F(S, unsigned int, passed_credits, )
+REFLECT_STRUCT(student_t, STUDENT_FIELDS)
+
+/* Structure of heap2.c */
+#define QUEUE_FIELDS(F, S)                                                                                             \
+    F(S, int, front, )                                                                                                 \
+    F(S, int, rear, )                                                                                                  \
+    F(S, double *, arr, )
+REFLECT_STRUCT(queue_t, QUEUE_FIELDS)
+
+/**
+ * A record in the order fields are usually written: grouped by meaning, not by size. Every char is followed by a
+ * wider field, so the compiler pads after each of them.
+ */
+#define RECORD_FIELDS(F, S)                                                                                            \
+    F(S, char, active, )                                                                                               \
+    F(S, double, balance, )                                                                                            \
+    F(S, char, kind, )                                                                                                 \
+    F(S, int, id, )                                                                                                    \
+    F(S, char, flag, )                                                                                                 \
+    F(S, short, region, )                                                                                              \
+    F(S, char, level, )                                                                                                \
+    F(S, double, limit, )
+REFLECT_STRUCT(record_t, RECORD_FIELDS)
+
+/** The same fields in the order proposed by the analyzer for record_t. */
+#define RECORD_SORTED_FIELDS(F, S)                                                                                     \
+    F(S, double, balance, )                                                                                            \
+    F(S, double, limit, )                                                                                              \
+    F(S, int, id, )                                                                                                    \
+    F(S, short, region, )                                                                                              \
+    F(S, char, active, )                                                                                               \
+    F(S, char, kind, )                                                                                                 \
+    F(S, char, flag, )                                                                                                 \
+    F(S, char, level, )
+REFLECT_STRUCT(record_sorted_t, RECORD_SORTED_FIELDS)
+
+static const struct_info_t *all_structs[] = {
+        &color_t_info, &sample_t_info, &sample1_t_info, &car_t_info, &list_t_info,
+        &engine_t_info, &car1_t_info, &player_t_info, &person_t_info, &student_t_info,
+        &queue_t_info, &record_t_info, &record_sorted_t_info,
+};
+
+static size_t gcd(size_t a, size_t b)
+{
+    while (b) {
+        size_t t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+/**
+ * Counts the array slots (out of one period) in which the byte range [offset, offset + size) of an element crosses a
+ * cache line boundary. Arrays returned by malloc are at least 16-byte aligned; the count assumes a line-aligned array.
+ * A range longer than a cache line crosses a boundary in every slot.
+ */
+static size_t straddles(size_t elem_size, size_t offset, size_t size, size_t period)
+{
+    size_t count = 0;
+
+    for (size_t i = 0; i < period; i++) {
+        size_t start = (i * elem_size + offset) % CACHE_LINE;
+        if (start + size > CACHE_LINE)
+            count++;
+    }
+    return count;
+}
+
+static int by_alignment(const void *a, const void *b)
+{
+    const field_info_t *x = (const field_info_t *) a;
+    const field_info_t *y = (const field_info_t *) b;
+
+    if (x->align != y->align)
+        return x->align < y->align ? 1 : -1;
+    if (x->size != y->size)
+        return x->size < y->size ? 1 : -1;
+    // Keep the declaration order among equals, qsort is not stable.
+    return x->offset < y->offset ? -1 : 1;
+}
+
+/**
+ * Lays out the fields again in decreasing alignment order.
+ * @param info
+ * @param order receives the fields in the proposed order
+ * @return the size of the structure with that order
+ */
+static size_t propose_order(const struct_info_t *info, field_info_t *order)
+{
+    size_t offset = 0;
+
+    memcpy(order, info->fields, info->field_count * sizeof(field_info_t));
+    qsort(order, info->field_count, sizeof(field_info_t), by_alignment);
+    for (size_t i = 0; i < info->field_count; i++) {
+        offset = (offset + order[i].align - 1) / order[i].align * order[i].align;
+        order[i].offset = offset;
+        offset += order[i].size;
+    }
+    return (offset + info->align - 1) / info->align * info->align;
+}
+
+static void report(const struct_info_t *info)
+{
+    size_t period = CACHE_LINE / gcd(info->size, CACHE_LINE);
+    size_t end = 0;
+    size_t holes = 0;
+
+    printf("struct %s: size %zu, align %zu, %zu fields\n", info->name, info->size, info->align, info->field_count);
+    printf("  %6s %5s  %-20s %s\n", "offset", "size", "type", "field");
+    for (size_t i = 0; i < info->field_count; i++) {
+        const field_info_t *f = &info->fields[i];
+        if (f->offset > end) {
+            printf("  %6zu %5zu  /* hole */\n", end, f->offset - end);
+            holes += f->offset - end;
+        }
+        printf("  %6zu %5zu  %-20s %s", f->offset, f->size, f->type, f->name);
+        size_t crossing = straddles(info->size, f->offset, f->size, period);
+        if (crossing)
+            printf("   <- straddles a cache line in %zu of %zu slots", crossing, period);
+        printf("\n");
+        end = f->offset + f->size;
+    }
+    if (info->size > end)
+        printf("  %6zu %5zu  /* tail padding */\n", end, info->size - end);
+    printf("  padding: %zu bytes in holes, %zu bytes at the tail, %zu bytes of data\n", holes, info->size - end,
+           end - holes);
+    printf("  an array element straddles a cache line in %zu of %zu slots\n",
+           straddles(info->size, 0, info->size, period), period);
+
+    field_info_t *order = (field_info_t *) malloc(info->field_count * sizeof(field_info_t));
+    if (!order)
+        return;
+    size_t size = propose_order(info, order);
+    if (size < info->size) {
+        printf("  proposed order (%zu bytes, saves %zu):", size, info->size - size);
+        for (size_t i = 0; i < info->field_count; i++)
+            printf(" %s", order[i].name);
+        printf("\n");
+    } else {
+        printf("  already minimal\n");
+    }
+    printf("\n");
+    free(order);
+}
+
+/**
+ * Generates the same reading loop for both record layouts, so only the layout differs.
+ */
+#define DEFINE_RECORD_SUM(T)                                                                                           \
+    static double T##_sum(const T *records, size_t count)                                                              \
+    {                                                                                                                  \
+        double sum = 0;                                                                                                \
+        for (size_t i = 0; i < count; i++)                                                                             \
+            if (records[i].active)                                                                                     \
+                sum += records[i].balance + records[i].limit + records[i].id + records[i].region + records[i].kind;    \
+        return sum;                                                                                                    \
+    }                                                                                                                  \
+    static void T##_fill(T *records, size_t count)                                                                     \
+    {                                                                                                                  \
+        for (size_t i = 0; i < count; i++) {                                                                           \
+            records[i].active = (char) (i & 1);                                                                        \
+            records[i].balance = (double) i;                                                                           \
+            records[i].kind = (char) (i % 7);                                                                          \
+            records[i].id = (int) i;                                                                                   \
+            records[i].flag = 0;                                                                                       \
+            records[i].region = (short) (i % 100);                                                                     \
+            records[i].level = 1;                                                                                      \
+            records[i].limit = 1.0;                                                                                    \
+        }                                                                                                              \
+    }
+DEFINE_RECORD_SUM(record_t)
+DEFINE_RECORD_SUM(record_sorted_t)
+
+#define MEASURE_RECORD(T, count)                                                                                       \
+    do {                                                                                                               \
+        T *records = (T *) malloc((count) * sizeof(T));                                                                \
+        if (!records) {                                                                                                \
+            fprintf(stderr, "FATAL: Out of memory!\n");                                                                \
+            exit(1);                                                                                                   \
+        }                                                                                                              \
+        T##_fill(records, count);                                                                                      \
+        uint64_t begin = bench_now_ns();                                                                               \
+        double sum = 0;                                                                                                \
+        for (int r = 0; r < 5; r++)                                                                                    \
+            sum += T##_sum(records, count);                                                                            \
+        double ns = (double) (bench_now_ns() - begin) / 5;                                                             \
+        printf("%-16s %3zu bytes/element %8.2f ms/pass %6.2f ns/element %6.2f GB/s (sum %.0f)\n", #T, sizeof(T),      \
+               ns / 1e6, ns / (double) (count), (double) ((count) * sizeof(T)) / ns, sum);                             \
+        free(records);                                                                                                 \
+    } while (0)
+
+int main(int argc, char **argv)
+{
+    size_t count = argc > 1 ? strtoul(argv[1], NULL, 10) : 10000000;
+
+    if (count == 0) {
+        fprintf(stderr, "Usage: %s [number-of-elements]\n", argv[0]);
+        exit(1);
+    }
+    for (size_t i = 0; i < sizeof(all_structs) / sizeof(all_structs[0]); i++)
+        report(all_structs[i]);
+
+    field_info_t order[sizeof(record_t_fields) / sizeof(field_info_t)];
+    if (propose_order(&record_t_info, order) != sizeof(record_sorted_t)) {
+        fprintf(stderr, "FATAL: record_sorted_t does not match the proposed order!\n");
+        exit(1);
+    }
+
+    printf("Reading %zu records in both layouts\n", count);
+    MEASURE_RECORD(record_t, count);
+    MEASURE_RECORD(record_sorted_t, count);
+    return 0;
+}
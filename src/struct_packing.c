@@ -0,0 +1,235 @@
+/** \file struct_packing.c
+ *
+ * @brief Aligned, packed and bitfield-compressed structures under load
+ *
+ * structs.c shows that `__attribute__((__packed__))` removes the padding of sample_t. Whether that is a win depends on
+ * the access pattern: a packed array is smaller, so more elements fit in every cache line, but its fields are
+ * unaligned and some of them straddle two cache lines, which the CPU has to stitch together. Bitfields compress even
+ * more, at the price of shift and mask instructions on every access.
+ *
+ * This program stores the same wire message in three layouts:
+ *
+ * | Layout     | Fields                                                      | Bytes |
+ * | ---------- | ----------------------------------------------------------- | ----- |
+ * | `aligned`  | `uint8_t type; uint32_t id; uint16_t port; uint64_t stamp;` | 24    |
+ * | `packed`   | the same fields with `__packed__`                           | 15    |
+ * | `bitfield` | `stamp:44, port:16, type:4` in one word, then `uint32_t id` | 16    |
+ *
+ * and runs sequential and random reads and writes over arrays of them, plus atomic increments of `stamp`.
+ *
+ * An atomic operation on a field that straddles a cache line is a split lock: the CPU locks the whole memory bus.
+ * Recent kernels detect split locks and slow the offending thread down on purpose (or kill it with
+ * `split_lock_detect=fatal`), so the packed atomic run is only done when `--split-locks` is given. The bitfield layout
+ * cannot take the address of a bitfield at all and uses a compare-and-swap loop on the containing word.
+ *
+ * \code{.sh}
+ * ./struct_packing [number-of-elements] [--split-locks]
+ * \endcode
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+
+#define STAMP_MASK ((UINT64_C(1) << 44) - 1)
+
+typedef struct {
+    uint8_t type;
+    uint32_t id;
+    uint16_t port;
+    uint64_t stamp;
+} aligned_t;
+
+typedef struct __attribute__((__packed__)) {
+    uint8_t type;
+    uint32_t id;
+    uint16_t port;
+    uint64_t stamp;
+} packed_t;
+
+typedef struct {
+    uint64_t stamp : 44;
+    uint64_t port : 16;
+    uint64_t type : 4;
+    uint32_t id;
+} bitfield_t;
+
+/**
+ * Atomic `stamp += 1` for each layout. The first two are a single `lock xadd`, the bitfield one has to rebuild the
+ * whole 64-bit word and retry if another thread changed it in between.
+ */
+static inline void aligned_t_atomic_bump(aligned_t *e)
+{
+    __atomic_fetch_add(&e->stamp, 1, __ATOMIC_RELAXED);
+}
+
+static inline void packed_t_atomic_bump(packed_t *e)
+{
+    // Unaligned on purpose, this is what the packed layout forces on atomics.
+    uint64_t *stamp = (uint64_t *) (void *) ((char *) e + offsetof(packed_t, stamp));
+    __atomic_fetch_add(stamp, 1, __ATOMIC_RELAXED);
+}
+
+static inline void bitfield_t_atomic_bump(bitfield_t *e)
+{
+    uint64_t *word = (uint64_t *) (void *) e;
+    uint64_t old = __atomic_load_n(word, __ATOMIC_RELAXED);
+    uint64_t desired;
+
+    do {
+        desired = (old & ~STAMP_MASK) | ((old + 1) & STAMP_MASK);
+    } while (!__atomic_compare_exchange_n(word, &old, desired, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/**
+ * The kernels are generated from one definition, so the three layouts run exactly the same source code and only the
+ * layout differs.
+ */
+#define DEFINE_KERNELS(T)                                                                                              \
+    static uint64_t T##_read_seq(const T *a, size_t n)                                                                 \
+    {                                                                                                                  \
+        uint64_t sum = 0;                                                                                              \
+        for (size_t i = 0; i < n; i++)                                                                                 \
+            sum += a[i].type + a[i].id + a[i].port + a[i].stamp;                                                       \
+        return sum;                                                                                                    \
+    }                                                                                                                  \
+    static uint64_t T##_read_rand(const T *a, const uint32_t *order, size_t n)                                         \
+    {                                                                                                                  \
+        uint64_t sum = 0;                                                                                              \
+        for (size_t i = 0; i < n; i++)                                                                                 \
+            sum += a[order[i]].type + a[order[i]].id + a[order[i]].port + a[order[i]].stamp;                           \
+        return sum;                                                                                                    \
+    }                                                                                                                  \
+    static void T##_write_seq(T *a, size_t n)                                                                          \
+    {                                                                                                                  \
+        for (size_t i = 0; i < n; i++) {                                                                               \
+            a[i].type = (uint8_t) (i & 0xf);                                                                           \
+            a[i].id = (uint32_t) i;                                                                                    \
+            a[i].port = (uint16_t) (i & 0xffff);                                                                       \
+            a[i].stamp = i & STAMP_MASK;                                                                               \
+        }                                                                                                              \
+    }                                                                                                                  \
+    static void T##_write_rand(T *a, const uint32_t *order, size_t n)                                                  \
+    {                                                                                                                  \
+        for (size_t i = 0; i < n; i++) {                                                                               \
+            T *e = &a[order[i]];                                                                                       \
+            e->type = (uint8_t) (i & 0xf);                                                                             \
+            e->id = (uint32_t) i;                                                                                      \
+            e->port = (uint16_t) (i & 0xffff);                                                                         \
+            e->stamp = i & STAMP_MASK;                                                                                 \
+        }                                                                                                              \
+    }                                                                                                                  \
+    static void T##_atomic_seq(T *a, size_t n)                                                                         \
+    {                                                                                                                  \
+        for (size_t i = 0; i < n; i++)                                                                                 \
+            T##_atomic_bump(&a[i]);                                                                                    \
+    }
+DEFINE_KERNELS(aligned_t)
+DEFINE_KERNELS(packed_t)
+DEFINE_KERNELS(bitfield_t)
+
+static volatile uint64_t sink;
+
+static void print_result(const char *layout, const char *op, size_t elem_size, size_t n, uint64_t ns)
+{
+    printf("%-10s %-12s %3zu bytes/element %9.2f ms %8.2f Melem/s %7.2f GB/s\n", layout, op, elem_size,
+           (double) ns / 1e6, (double) n * 1e3 / (double) ns, (double) (n * elem_size) / (double) ns);
+}
+
+/**
+ * Runs every kernel of layout T once and prints one line per kernel.
+ */
+#define MEASURE_LAYOUT(T, n, order, split_locks)                                                                       \
+    do {                                                                                                               \
+        T *a = (T *) aligned_alloc(64, ((n) * sizeof(T) + 63) / 64 * 64);                                              \
+        if (!a) {                                                                                                      \
+            fprintf(stderr, "FATAL: Out of memory!\n");                                                                \
+            exit(1);                                                                                                   \
+        }                                                                                                              \
+        memset(a, 0, (n) * sizeof(T));                                                                                 \
+        uint64_t begin = bench_now_ns();                                                                               \
+        T##_write_seq(a, n);                                                                                           \
+        print_result(#T, "write-seq", sizeof(T), n, bench_now_ns() - begin);                                           \
+        begin = bench_now_ns();                                                                                        \
+        sink = T##_read_seq(a, n);                                                                                     \
+        print_result(#T, "read-seq", sizeof(T), n, bench_now_ns() - begin);                                            \
+        begin = bench_now_ns();                                                                                        \
+        T##_write_rand(a, order, n);                                                                                   \
+        print_result(#T, "write-rand", sizeof(T), n, bench_now_ns() - begin);                                          \
+        begin = bench_now_ns();                                                                                        \
+        sink = T##_read_rand(a, order, n);                                                                             \
+        print_result(#T, "read-rand", sizeof(T), n, bench_now_ns() - begin);                                           \
+        if (split_locks) {                                                                                             \
+            begin = bench_now_ns();                                                                                    \
+            T##_atomic_seq(a, n);                                                                                      \
+            print_result(#T, "atomic-seq", sizeof(T), n, bench_now_ns() - begin);                                      \
+        } else {                                                                                                       \
+            printf("%-10s %-12s skipped, pass --split-locks\n", #T, "atomic-seq");                                      \
+        }                                                                                                              \
+        free(a);                                                                                                       \
+    } while (0)
+
+/**
+ * Counts the elements of a line-aligned array whose `stamp` field crosses a cache line boundary.
+ */
+static size_t count_straddling(size_t elem_size, size_t offset, size_t field_size, size_t n)
+{
+    size_t count = 0;
+
+    for (size_t i = 0; i < n; i++)
+        if ((i * elem_size + offset) % 64 + field_size > 64)
+            count++;
+    return count;
+}
+
+int main(int argc, char **argv)
+{
+    size_t n = 10000000;
+    int split_locks = 0, counts = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--split-locks") == 0) {
+            split_locks = 1;
+        } else {
+            n = strtoul(argv[i], NULL, 10);
+            counts++;
+        }
+    }
+    if (counts > 1 || n == 0 || n > UINT32_MAX) {
+        fprintf(stderr, "Usage: %s [number-of-elements] [--split-locks]\n", argv[0]);
+        exit(1);
+    }
+
+    // Random visiting order: a Fisher-Yates shuffle of 0..n-1 with a fixed seed.
+    uint32_t *order = (uint32_t *) malloc(n * sizeof(uint32_t));
+    if (!order) {
+        fprintf(stderr, "FATAL: Out of memory!\n");
+        exit(1);
+    }
+    for (size_t i = 0; i < n; i++)
+        order[i] = (uint32_t) i;
+    uint64_t state = 88172645463325252u;
+    for (size_t i = n - 1; i > 0; i--) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        size_t j = (size_t) (state % (i + 1));
+        uint32_t tmp = order[i];
+        order[i] = order[j];
+        order[j] = tmp;
+    }
+
+    printf("%zu elements; stamp straddles a cache line in %zu packed elements, %zu aligned\n", n,
+           count_straddling(sizeof(packed_t), offsetof(packed_t, stamp), sizeof(uint64_t), n),
+           count_straddling(sizeof(aligned_t), offsetof(aligned_t, stamp), sizeof(uint64_t), n));
+    MEASURE_LAYOUT(aligned_t, n, order, 1);
+    MEASURE_LAYOUT(packed_t, n, order, split_locks);
+    MEASURE_LAYOUT(bitfield_t, n, order, 1);
+
+    free(order);
+    return 0;
+}
@@ -0,0 +1,321 @@
+/** \file swiss_map.c
+ *
+ * @brief Flat int-to-int hash map with SSE2 group probing, in the style of Swiss tables
+ *
+ * The slots are one flat array of {key, value} pairs, probed by open addressing. Next to it lives an array of control
+ * bytes, one per slot: 0x80 for empty, 0xFE for deleted, or, for a full slot, the low 7 bits of the key's hash (H2).
+ * The remaining bits (H1) pick where probing starts.
+ *
+ * Probing goes 16 slots at a time. One SSE2 compare of 16 control bytes against H2 and a movemask give a bit per slot
+ * whose hash fragment matches; only those slots' keys are compared, which for a miss is almost never. A second compare
+ * against "empty" tells whether the probe can stop. So a lookup usually costs one control-byte load and one slot load,
+ * where a chained map follows a pointer per bucket entry, each a possible cache miss.
+ *
+ * Groups are aligned, and the probe sequence visits groups in triangular steps, which covers all of them since their
+ * number is a power of two. Erasing marks the slot deleted so that probes keep going past it, unless its group still
+ * has an empty slot: no probe ever went past such a group, so the slot can become empty again. The table grows when
+ * full and deleted slots reach 7/8; if most of them are deleted it is rebuilt at the same size instead.
+ *
+ * Used as a set, the values are simply ignored.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "swiss_map.h"
+
+#define GROUP_WIDTH 16
+#define CTRL_EMPTY ((int8_t) -128)
+#define CTRL_DELETED ((int8_t) -2)
+
+typedef struct {
+    int key;
+    int value;
+} swiss_slot_t;
+
+struct swiss_map_t {
+    int8_t *ctrl;
+    swiss_slot_t *slots;
+    size_t capacity;
+    size_t size;
+    size_t deleted;
+};
+
+#ifdef __SSE2__
+static unsigned group_match(const int8_t *group, int8_t byte)
+{
+    __m128i ctrl = _mm_load_si128((const __m128i *) group);
+    return (unsigned) _mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8(byte)));
+}
+
+/** Empty and deleted are the only control bytes with the high bit set. */
+static unsigned group_free(const int8_t *group)
+{
+    return (unsigned) _mm_movemask_epi8(_mm_load_si128((const __m128i *) group));
+}
+#else
+static unsigned group_match(const int8_t *group, int8_t byte)
+{
+    unsigned mask = 0;
+
+    for (int i = 0; i < GROUP_WIDTH; i++)
+        mask |= (unsigned) (group[i] == byte) << i;
+    return mask;
+}
+
+static unsigned group_free(const int8_t *group)
+{
+    unsigned mask = 0;
+
+    for (int i = 0; i < GROUP_WIDTH; i++)
+        mask |= (unsigned) (group[i] < 0) << i;
+    return mask;
+}
+#endif
+
+static unsigned group_full(const int8_t *group)
+{
+    return ~group_free(group) & 0xffffu;
+}
+
+static uint64_t hash_key(int key)
+{
+    uint64_t hash = (uint64_t) (uint32_t) key * 0x9e3779b97f4a7c15u;
+    return hash ^ (hash >> 32);
+}
+
+static int8_t hash_h2(uint64_t hash)
+{
+    return (int8_t) (hash & 0x7f);
+}
+
+static size_t max_load(size_t capacity)
+{
+    return capacity - capacity / 8;
+}
+
+static int table_alloc(swiss_map_t *map, size_t capacity)
+{
+    size_t bytes = capacity + capacity * sizeof(swiss_slot_t);
+    int8_t *memory = (int8_t *) aligned_alloc(64, (bytes + 63) / 64 * 64);
+
+    if (!memory) {
+        errno = ENOMEM;
+        return -1;
+    }
+    memset(memory, CTRL_EMPTY, capacity);
+    map->ctrl = memory;
+    map->slots = (swiss_slot_t *) (memory + capacity);
+    map->capacity = capacity;
+    map->size = 0;
+    map->deleted = 0;
+    return 0;
+}
+
+/**
+ * @return slot index of the key, or capacity if absent
+ */
+static size_t find_slot(const swiss_map_t *map, int key, uint64_t hash)
+{
+    size_t group_mask = map->capacity / GROUP_WIDTH - 1;
+    size_t group = (size_t) (hash >> 7) & group_mask;
+    int8_t h2 = hash_h2(hash);
+
+    for (size_t step = 1; step <= group_mask + 1; step++) {
+        const int8_t *ctrl = map->ctrl + group * GROUP_WIDTH;
+        for (unsigned match = group_match(ctrl, h2); match; match &= match - 1) {
+            size_t index = group * GROUP_WIDTH + (size_t) __builtin_ctz(match);
+            if (map->slots[index].key == key)
+                return index;
+        }
+        if (group_match(ctrl, CTRL_EMPTY))
+            break;
+        group = (group + step) & group_mask;
+    }
+    return map->capacity;
+}
+
+/**
+ * @return index of the first empty or deleted slot on the key's probe sequence
+ */
+static size_t find_free(const swiss_map_t *map, uint64_t hash)
+{
+    size_t group_mask = map->capacity / GROUP_WIDTH - 1;
+    size_t group = (size_t) (hash >> 7) & group_mask;
+
+    for (size_t step = 1;; step++) {
+        unsigned free_slots = group_free(map->ctrl + group * GROUP_WIDTH);
+        if (free_slots)
+            return group * GROUP_WIDTH + (size_t) __builtin_ctz(free_slots);
+        group = (group + step) & group_mask;
+    }
+}
+
+static int rehash(swiss_map_t *map, size_t capacity)
+{
+    swiss_map_t old = *map;
+
+    if (table_alloc(map, capacity) == -1) {
+        *map = old;
+        return -1;
+    }
+    for (size_t group = 0; group < old.capacity; group += GROUP_WIDTH) {
+        for (unsigned full = group_full(old.ctrl + group); full; full &= full - 1) {
+            const swiss_slot_t *slot = &old.slots[group + (size_t) __builtin_ctz(full)];
+            uint64_t hash = hash_key(slot->key);
+            size_t index = find_free(map, hash);
+            map->ctrl[index] = hash_h2(hash);
+            map->slots[index] = *slot;
+        }
+    }
+    map->size = old.size;
+    free(old.ctrl);
+    return 0;
+}
+
+static size_t capacity_for(size_t count)
+{
+    size_t capacity = GROUP_WIDTH;
+
+    while (max_load(capacity) < count)
+        capacity *= 2;
+    return capacity;
+}
+
+/**
+ * @param capacity number of keys that fit without growing
+ * @return the map, or NULL with errno set
+ */
+swiss_map_t *swiss_new(size_t capacity)
+{
+    swiss_map_t *map = (swiss_map_t *) malloc(sizeof(swiss_map_t));
+
+    if (!map)
+        return NULL;
+    if (table_alloc(map, capacity_for(capacity)) == -1) {
+        free(map);
+        return NULL;
+    }
+    return map;
+}
+
+void swiss_free(swiss_map_t *map)
+{
+    free(map->ctrl);
+    free(map);
+}
+
+/**
+ * Grows the table so that count keys fit without another rehash.
+ * @return 0, or -1 with errno set
+ */
+int swiss_reserve(swiss_map_t *map, size_t count)
+{
+    size_t capacity = capacity_for(count);
+    return capacity > map->capacity ? rehash(map, capacity) : 0;
+}
+
+size_t swiss_size(const swiss_map_t *map)
+{
+    return map->size;
+}
+
+/**
+ * @return number of slots
+ */
+size_t swiss_capacity(const swiss_map_t *map)
+{
+    return map->capacity;
+}
+
+/**
+ * Inserts the key, or replaces its value.
+ * @return 1 if inserted, 0 if replaced, -1 with errno set if the table could not grow
+ */
+int swiss_insert(swiss_map_t *map, int key, int value)
+{
+    uint64_t hash = hash_key(key);
+    size_t index = find_slot(map, key, hash);
+
+    if (index != map->capacity) {
+        map->slots[index].value = value;
+        return 0;
+    }
+    if (map->size + map->deleted + 1 > max_load(map->capacity)) {
+        // Mostly tombstones: rebuilding at the same size drops them.
+        size_t capacity = map->size + 1 > max_load(map->capacity) / 2 ? map->capacity * 2 : map->capacity;
+        if (rehash(map, capacity) == -1)
+            return -1;
+    }
+    index = find_free(map, hash);
+    if (map->ctrl[index] == CTRL_DELETED)
+        map->deleted--;
+    map->ctrl[index] = hash_h2(hash);
+    map->slots[index].key = key;
+    map->slots[index].value = value;
+    map->size++;
+    return 1;
+}
+
+/**
+ * @param value receives the value if found, may be NULL for a membership test
+ * @return 1 if the key is present, 0 otherwise
+ */
+int swiss_find(const swiss_map_t *map, int key, int *value)
+{
+    size_t index = find_slot(map, key, hash_key(key));
+
+    if (index == map->capacity)
+        return 0;
+    if (value)
+        *value = map->slots[index].value;
+    return 1;
+}
+
+/**
+ * @return 1 if the key was removed, 0 if it was absent
+ */
+int swiss_erase(swiss_map_t *map, int key)
+{
+    size_t index = find_slot(map, key, hash_key(key));
+
+    if (index == map->capacity)
+        return 0;
+    if (group_match(map->ctrl + index / GROUP_WIDTH * GROUP_WIDTH, CTRL_EMPTY)) {
+        map->ctrl[index] = CTRL_EMPTY;
+    } else {
+        map->ctrl[index] = CTRL_DELETED;
+        map->deleted++;
+    }
+    map->size--;
+    return 1;
+}
+
+/**
+ * Iterates over the entries in slot order. Start with *cursor = 0. Erasing the entry just returned is allowed,
+ * inserting during the iteration is not.
+ * @return 1 and the next entry, or 0 at the end
+ */
+int swiss_next(const swiss_map_t *map, size_t *cursor, int *key, int *value)
+{
+    while (*cursor < map->capacity) {
+        size_t group = *cursor / GROUP_WIDTH * GROUP_WIDTH;
+        unsigned full = group_full(map->ctrl + group) & (0xffffu << (*cursor - group));
+        if (full) {
+            size_t index = group + (size_t) __builtin_ctz(full);
+            *key = map->slots[index].key;
+            if (value)
+                *value = map->slots[index].value;
+            *cursor = index + 1;
+            return 1;
+        }
+        *cursor = group + GROUP_WIDTH;
+    }
+    return 0;
+}